@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "backend.h"
+
+
+static const struct {
+        const char *name;
+        backend_t* (*create)(const char *options);
+} backends[] = {
+        {"iptables", backend_iptables_create},
+        {"sim", backend_sim_create},
+};
+
+
+backend_t* backend_create(const char *spec)
+{
+        char name[64];
+        const char *options = strchr(spec, ':');
+        size_t length = options != NULL ? options - spec : strlen(spec);
+
+        snprintf(name, sizeof(name), "%.*s", (int) length, spec);
+        options = options != NULL ? options + 1 : "";
+
+        for (int i=0; i<sizeof(backends)/sizeof(backends[0]); ++i) {
+                if (strcmp(backends[i].name, name) == 0) {
+                        log_info("Using backend '%s' with options '%s'", name, options);
+                        return backends[i].create(options);
+                }
+        }
+
+        log_error("Unknown backend: '%s'", name);
+        return NULL;
+}
+
+void backend_destroy(backend_t *backend)
+{
+        if (backend != NULL)
+                backend->destroy(backend);
+}
+
+int backend_options(const char *options, int (*set)(void *data, const char *key, const char *value), void *data)
+{
+        char *buffer, *pair, *value, *save;
+        int rc = 0;
+
+        buffer = strdup(options);
+        if (buffer == NULL)
+                return -1;
+
+        for (pair = strtok_r(buffer, ",", &save); pair != NULL && rc == 0; pair = strtok_r(NULL, ",", &save)) {
+                if ((value = strchr(pair, '=')) == NULL) {
+                        log_error("Invalid backend option: '%s'", pair);
+                        rc = -1;
+                        break;
+                }
+                *value++ = '\0';
+                if ((rc = set(data, pair, value)) < 0)
+                        log_error("Invalid backend option: '%s=%s'", pair, value);
+        }
+
+        free(buffer);
+        return rc;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "netpack.h"
+#include "template.h"
+
+
+enum backend_op {BACKEND_APPEND, BACKEND_REMOVE};
+
+typedef struct backend_rule {
+        enum backend_op op;
+        char ip[REQUEST_IP_SIZE];
+        unsigned int ttl;       // Seconds until the rule expires (0: never), the backends ignore it
+        int template;           // Index in the templates of the backend
+} backend_rule_t;
+
+// The backends fill the code and the reason of the response only on failure,
+// they have to be safe to call from every worker at the same time
+typedef struct backend {
+        const char *name;
+        void *data;
+        int atomic;             // A failed apply_batch() applied none of the rules
+        templates_t *templates; // The rules the backend can apply, the default one first
+        int (*apply)(struct backend *self, const backend_rule_t *rule, struct response *response);
+        int (*apply_batch)(struct backend *self, const backend_rule_t *rules, struct response *responses, int count);
+        // Start applying the rule without waiting for it (optional): done() gets the
+        // result of apply() once the response is filled, possibly on another thread
+        int (*submit)(struct backend *self, const backend_rule_t *rule, struct response *response,
+                        void (*done)(void *arg, int rc), void *arg);
+        int (*snapshot)(struct backend *self, int fd);
+        // Call rule() for every rule of the default template, once per duplicate
+        int (*list)(struct backend *self, void (*rule)(void *arg, const char *ip), void *arg);
+        void (*destroy)(struct backend *self);
+} backend_t;
+
+
+// "<name>[:<key>=<value>,...]" eg: "iptables" or "sim:latency=2,dist=exp,fail=0.01"
+backend_t* backend_create(const char *spec);
+void backend_destroy(backend_t *backend);
+
+int backend_options(const char *options, int (*set)(void *data, const char *key, const char *value), void *data);
+
+backend_t* backend_iptables_create(const char *options);
+backend_t* backend_sim_create(const char *options);
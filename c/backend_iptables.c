@@ -0,0 +1,302 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "exec.h"
+#include "backend.h"
+
+
+#define IPTABLES_NAME_SIZE 64
+#define IPTABLES_OUTPUT_SIZE 1024
+
+typedef struct iptables {
+        char command[IPTABLES_NAME_SIZE];
+        char restore[IPTABLES_NAME_SIZE];
+        char chain[IPTABLES_NAME_SIZE];
+        char target[IPTABLES_NAME_SIZE];
+        char templates[256];
+} iptables_t;
+
+typedef struct iptables_command {
+        char op[3];
+        char ip[REQUEST_IP_SIZE];
+        char *argv[TEMPLATE_ARGS + 3];
+} iptables_command_t;
+
+// A submitted rule until its command completes
+typedef struct iptables_call {
+        const char *command;
+        struct response *response;
+        void (*done)(void *arg, int rc);
+        void *arg;
+} iptables_call_t;
+
+
+static int _set(void *data, const char *key, const char *value)
+{
+        iptables_t *self = (iptables_t*) data;
+
+        if (strcmp(key, "command") == 0)
+                snprintf(self->command, sizeof(self->command), "%s", value);
+        else if (strcmp(key, "restore") == 0)
+                snprintf(self->restore, sizeof(self->restore), "%s", value);
+        else if (strcmp(key, "chain") == 0)
+                snprintf(self->chain, sizeof(self->chain), "%s", value);
+        else if (strcmp(key, "target") == 0)
+                snprintf(self->target, sizeof(self->target), "%s", value);
+        else if (strcmp(key, "templates") == 0)
+                snprintf(self->templates, sizeof(self->templates), "%s", value);
+        else
+                return -1;
+        return 0;
+}
+
+// The reason of a failed command is its stderr
+static void _result(const char *command, int code, const char *error, struct response *response)
+{
+        response->code = code;
+        if (code == 0)
+                return;
+
+        if (code == 127 && error[0] == '\0')
+                snprintf(response->reason, sizeof(response->reason), "Failed to execute %s", command);
+        else
+                snprintf(response->reason, sizeof(response->reason), "%s", error);
+}
+
+// Run the command with the input on its stdin and its stdout on the output
+// fd (inherited if -1), the stderr is returned as the reason of the failures
+static int _execute(char *const argv[], const char *input, int output, struct response *response)
+{
+        char error[IPTABLES_OUTPUT_SIZE];
+        int code;
+
+        if (exec_run(argv, input, output, &code, error, sizeof(error)) < 0)
+                return -1;
+        _result(argv[0], code, error, response);
+        return 0;
+}
+
+static void _executed(void *arg, int code, const char *error)
+{
+        iptables_call_t *call = (iptables_call_t*) arg;
+
+        _result(call->command, code, error, call->response);
+        call->done(call->arg, 0);
+        free(call);
+}
+
+// The argv of "<command> -A|-D <options of the template>" is kept in the rule command
+static char** _command(backend_t *backend, const backend_rule_t *rule, iptables_command_t *command)
+{
+        iptables_t *self = (iptables_t*) backend->data;
+        const template_t *template = backend->templates->list[rule->template];
+
+        snprintf(command->op, sizeof(command->op), "%s", rule->op == BACKEND_REMOVE ? "-D" : "-A");
+        snprintf(command->ip, sizeof(command->ip), "%s", rule->ip);
+
+        // Log from the parent, the child has no logging threads after fork()
+        log_info("Execute cmd: '%s %s %s%s%s'", self->command, command->op, template->prefix, command->ip, template->suffix);
+        return template_argv(template, self->command, command->op, command->ip, command->argv);
+}
+
+static int _apply(backend_t *backend, const backend_rule_t *rule, struct response *response)
+{
+        iptables_command_t command;
+
+        return _execute(_command(backend, rule, &command), NULL, -1, response);
+}
+
+// The same command as _apply(), the reaper completes it
+static int _submit(backend_t *backend, const backend_rule_t *rule, struct response *response,
+                void (*done)(void *arg, int rc), void *arg)
+{
+        iptables_t *self = (iptables_t*) backend->data;
+        iptables_command_t command;
+        iptables_call_t *call;
+
+        if ((call = (iptables_call_t*) malloc (sizeof(*call))) == NULL) {
+                log_error("Failed to malloc() iptables call");
+                return -1;
+        }
+        call->command = self->command;
+        call->response = response;
+        call->done = done;
+        call->arg = arg;
+
+        if (exec_start(_command(backend, rule, &command), NULL, -1, _executed, call) < 0) {
+                free(call);
+                return -1;
+        }
+        return 0;
+}
+
+// One iptables-restore run applies every rule or none of them
+static int _apply_batch(backend_t *backend, const backend_rule_t *rules, struct response *responses, int count)
+{
+        iptables_t *self = (iptables_t*) backend->data;
+        char noflush[] = "--noflush";
+        char *argv[] = {self->restore, noflush, NULL};
+        size_t size = 64, length;
+        char *input;
+        int rc;
+
+        if (count == 0)
+                return 0;
+
+        // Every rule fills in the skeleton of its own template
+        for (int i=0; i<count; ++i)
+                size += backend->templates->list[rules[i].template]->length + REQUEST_IP_SIZE + 8;
+        if ((input = (char*) malloc (size)) == NULL) {
+                log_error("Failed to malloc() iptables-restore input");
+                return -1;
+        }
+
+        length = snprintf(input, size, "*filter\n");
+        for (int i=0; i<count; ++i)
+                length += template_line(backend->templates->list[rules[i].template],
+                                rules[i].op == BACKEND_REMOVE ? "-D" : "-A", rules[i].ip, input + length, size - length);
+        snprintf(input + length, size - length, "COMMIT\n");
+
+        log_info("Execute cmd: '%s --noflush' with %d rule(s)", self->restore, count);
+        rc = _execute(argv, input, -1, &responses[0]);
+        for (int i=1; i<count; ++i)
+                responses[i] = responses[0];
+
+        free(input);
+        return rc;
+}
+
+static int _snapshot(backend_t *backend, int fd)
+{
+        iptables_t *self = (iptables_t*) backend->data;
+        struct response response = {0};
+        char list[] = "-S";
+        char *argv[] = {self->command, list, self->chain, NULL};
+
+        if (_execute(argv, NULL, fd, &response) < 0)
+                return -1;
+        if (response.code != 0) {
+                log_error("Failed to list the rules: %s", response.reason);
+                return -1;
+        }
+        return 0;
+}
+
+// Only the "-A <chain> -s <ip>/32 -j <target>" rules are ours, the others are left alone
+static int _list(backend_t *backend, void (*rule)(void *arg, const char *ip), void *arg)
+{
+        iptables_t *self = (iptables_t*) backend->data;
+        char line[256], chain[IPTABLES_NAME_SIZE], ip[REQUEST_IP_SIZE], target[IPTABLES_NAME_SIZE];
+        FILE *rules;
+        int end;
+
+        if ((rules = tmpfile()) == NULL) {
+                log_error("Failed to create temporary file: %s", strerror(errno));
+                return -1;
+        }
+        if (_snapshot(backend, fileno(rules)) < 0) {
+                fclose(rules);
+                return -1;
+        }
+
+        rewind(rules);
+        while (fgets(line, sizeof(line), rules) != NULL) {
+                end = 0;
+                if (sscanf(line, "-A %63s -s %39[0-9.]/32 -j %63s%n", chain, ip, target, &end) == 3 &&
+                                (line[end] == '\n' || line[end] == '\0') &&
+                                strcmp(chain, self->chain) == 0 && strcmp(target, self->target) == 0)
+                        rule(arg, ip);
+        }
+        fclose(rules);
+        return 0;
+}
+
+// iptables-restore --test checks every template once, with an address of the documentation range
+static int _check(backend_t *backend)
+{
+        iptables_t *self = (iptables_t*) backend->data;
+        templates_t *templates = backend->templates;
+        struct response response = {0};
+        char test[] = "--test";
+        char noflush[] = "--noflush";
+        char *argv[] = {self->restore, test, noflush, NULL};
+        size_t size = 64, length;
+        char *input;
+        int rc;
+
+        for (int i=0; i<templates->count; ++i)
+                size += templates->list[i]->length + 32;
+        if ((input = (char*) malloc (size)) == NULL) {
+                log_error("Failed to malloc() iptables-restore input");
+                return -1;
+        }
+
+        length = snprintf(input, size, "*filter\n");
+        for (int i=0; i<templates->count; ++i)
+                length += template_line(templates->list[i], "-A", "192.0.2.1", input + length, size - length);
+        snprintf(input + length, size - length, "COMMIT\n");
+
+        log_info("Checking %d template(s) with '%s --test'", templates->count, self->restore);
+        rc = _execute(argv, input, -1, &response);
+        if (rc == 0 && response.code != 0) {
+                log_error("Invalid templates: %s", response.reason);
+                rc = -1;
+        }
+        free(input);
+        return rc;
+}
+
+static void _destroy(backend_t *backend)
+{
+        templates_destroy(backend->templates);
+        free(backend->data);
+        free(backend);
+}
+
+
+backend_t* backend_iptables_create(const char *options)
+{
+        backend_t *backend;
+        iptables_t *self;
+
+        backend = (backend_t*) calloc (1, sizeof(*backend));
+        self = (iptables_t*) calloc (1, sizeof(*self));
+        if (backend == NULL || self == NULL) {
+                log_error("Failed to calloc() iptables backend");
+                free(backend);
+                free(self);
+                return NULL;
+        }
+
+        snprintf(self->command, sizeof(self->command), "iptables");
+        snprintf(self->restore, sizeof(self->restore), "iptables-restore");
+        snprintf(self->chain, sizeof(self->chain), "FORWARD");
+        snprintf(self->target, sizeof(self->target), "ACCEPT");
+        if (backend_options(options, _set, self) < 0) {
+                free(backend);
+                free(self);
+                return NULL;
+        }
+
+        backend->name = "iptables";
+        backend->data = self;
+        backend->templates = templates_load(self->templates, self->chain, self->target);
+        if (backend->templates == NULL || (self->templates[0] && _check(backend) < 0)) {
+                templates_destroy(backend->templates);
+                free(backend);
+                free(self);
+                return NULL;
+        }
+        backend->apply = _apply;
+        backend->apply_batch = _apply_batch;
+        backend->submit = _submit;
+        backend->atomic = 1;
+        backend->snapshot = _snapshot;
+        backend->list = _list;
+        backend->destroy = _destroy;
+        return backend;
+}
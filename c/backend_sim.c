@@ -0,0 +1,366 @@
+#include <math.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "backend.h"
+#include "exec.h"
+
+
+#define SIM_BUCKETS 4096
+
+enum sim_dist {SIM_CONST, SIM_UNIFORM, SIM_EXP};
+
+typedef struct sim_rule {
+        char ip[REQUEST_IP_SIZE];
+        int template;
+        int count;              // iptables keeps the duplicates too
+        struct sim_rule *next;
+} sim_rule_t;
+
+// In-memory rules with injected latency and failures instead of iptables
+typedef struct sim {
+        double latency;         // Mean latency of one call in milliseconds
+        enum sim_dist dist;
+        double fail;            // Probability of a failed call
+        int calls;              // Concurrent calls like the xtables lock (0: unlimited)
+        int async;              // Submit the single rules: the latency is a sleep child of the reaper
+        int running;
+        char templates[256];    // Accepted like iptables does, the rules are told apart by them
+        pthread_cond_t turn;
+        pthread_mutex_t lock;
+        sim_rule_t *buckets[SIM_BUCKETS];
+} sim_t;
+
+// A submitted rule until its sleep completes
+typedef struct sim_call {
+        backend_t *backend;
+        backend_rule_t rule;
+        struct response *response;
+        void (*done)(void *arg, int rc);
+        void *arg;
+} sim_call_t;
+
+static __thread uint64_t seed = 0;
+
+
+static double _random()
+{
+        if (seed == 0)
+                seed = (uint64_t) time(NULL) ^ (uint64_t) (uintptr_t) &seed;
+
+        // xorshift64*
+        seed ^= seed >> 12;
+        seed ^= seed << 25;
+        seed ^= seed >> 27;
+        return ((seed * 2685821657736338717ull) >> 11) / 9007199254740992.0;
+}
+
+static int _set(void *data, const char *key, const char *value)
+{
+        sim_t *self = (sim_t*) data;
+
+        if (strcmp(key, "latency") == 0) {
+                self->latency = atof(value);
+        } else if (strcmp(key, "fail") == 0) {
+                self->fail = atof(value);
+        } else if (strcmp(key, "lock") == 0) {
+                self->calls = atoi(value);
+        } else if (strcmp(key, "async") == 0) {
+                self->async = atoi(value);
+        } else if (strcmp(key, "templates") == 0) {
+                snprintf(self->templates, sizeof(self->templates), "%s", value);
+        } else if (strcmp(key, "dist") == 0) {
+                if (strcmp(value, "const") == 0)
+                        self->dist = SIM_CONST;
+                else if (strcmp(value, "uniform") == 0)
+                        self->dist = SIM_UNIFORM;
+                else if (strcmp(value, "exp") == 0)
+                        self->dist = SIM_EXP;
+                else
+                        return -1;
+        } else {
+                return -1;
+        }
+        return 0;
+}
+
+static double _latency(sim_t *self)
+{
+        switch (self->dist) {
+        case SIM_UNIFORM:
+                return self->latency * 2 * _random();
+        case SIM_EXP:
+                return self->latency * -log(1 - _random());
+        default:
+                return self->latency;
+        }
+}
+
+static void _delay(sim_t *self)
+{
+        struct timespec delay;
+        double ms;
+
+        if (self->latency <= 0)
+                return;
+
+        // The calls over the limit wait for their turn, so the latency grows with the concurrency
+        if (self->calls > 0) {
+                pthread_mutex_lock(&self->lock);
+                while (self->running >= self->calls)
+                        pthread_cond_wait(&self->turn, &self->lock);
+                self->running++;
+                pthread_mutex_unlock(&self->lock);
+        }
+
+        ms = _latency(self);
+        delay.tv_sec = ms / 1000;
+        delay.tv_nsec = (ms - delay.tv_sec * 1000) * 1000000;
+        nanosleep(&delay, NULL);
+
+        if (self->calls > 0) {
+                pthread_mutex_lock(&self->lock);
+                self->running--;
+                pthread_cond_signal(&self->turn);
+                pthread_mutex_unlock(&self->lock);
+        }
+}
+
+static unsigned long _hash(const char *ip)
+{
+        unsigned long hash = 5381;
+
+        while (*ip)
+                hash = hash * 33 + (unsigned char) *ip++;
+        return hash % SIM_BUCKETS;
+}
+
+// The lock has to be held by the caller
+static void _change(sim_t *self, const backend_rule_t *rule, struct response *response)
+{
+        sim_rule_t **link = &self->buckets[_hash(rule->ip)];
+        sim_rule_t *entry;
+
+        while (*link != NULL && (strcmp((*link)->ip, rule->ip) != 0 || (*link)->template != rule->template))
+                link = &(*link)->next;
+        entry = *link;
+
+        if (rule->op == BACKEND_APPEND) {
+                if (entry == NULL) {
+                        if ((entry = (sim_rule_t*) calloc (1, sizeof(*entry))) == NULL) {
+                                response->code = 1;
+                                snprintf(response->reason, sizeof(response->reason), "Out of memory");
+                                return;
+                        }
+                        snprintf(entry->ip, sizeof(entry->ip), "%s", rule->ip);
+                        entry->template = rule->template;
+                        *link = entry;
+                }
+                entry->count++;
+                response->code = 0;
+
+        } else if (entry == NULL) {
+                response->code = 1;
+                snprintf(response->reason, sizeof(response->reason),
+                                "iptables: Bad rule (does a matching rule exist in that chain?).");
+
+        } else {
+                if (--entry->count == 0) {
+                        *link = entry->next;
+                        free(entry);
+                }
+                response->code = 0;
+        }
+}
+
+static int _fail(sim_t *self, struct response *response)
+{
+        if (self->fail <= 0 || _random() >= self->fail)
+                return 0;
+
+        response->code = 1;
+        // Several lines like the stderr of iptables
+        snprintf(response->reason, sizeof(response->reason), "Simulated failure\nTry `iptables -h' for more information.");
+        return 1;
+}
+
+static int _apply(backend_t *backend, const backend_rule_t *rule, struct response *response)
+{
+        sim_t *self = (sim_t*) backend->data;
+
+        _delay(self);
+        if (_fail(self, response))
+                return 0;
+
+        pthread_mutex_lock(&self->lock);
+        _change(self, rule, response);
+        pthread_mutex_unlock(&self->lock);
+        return 0;
+}
+
+static void _slept(void *arg, int code, const char *error)
+{
+        sim_call_t *call = (sim_call_t*) arg;
+        sim_t *self = (sim_t*) call->backend->data;
+
+        if (code != 0) {
+                call->response->code = 1;
+                snprintf(call->response->reason, sizeof(call->response->reason), "Failed to sleep: %s", error);
+        } else if (!_fail(self, call->response)) {
+                pthread_mutex_lock(&self->lock);
+                _change(self, &call->rule, call->response);
+                pthread_mutex_unlock(&self->lock);
+        }
+        call->done(call->arg, 0);
+        free(call);
+}
+
+// The same as _apply() with the latency in a child like the iptables commands,
+// so the reaper completes it. The lock option does not hold the submitted calls.
+static int _submit(backend_t *backend, const backend_rule_t *rule, struct response *response,
+                void (*done)(void *arg, int rc), void *arg)
+{
+        sim_t *self = (sim_t*) backend->data;
+        char command[] = "sleep", seconds[32];
+        char *argv[] = {command, seconds, NULL};
+        sim_call_t *call;
+
+        if ((call = (sim_call_t*) malloc (sizeof(*call))) == NULL) {
+                log_error("Failed to malloc() sim call");
+                return -1;
+        }
+        call->backend = backend;
+        call->rule = *rule;
+        call->response = response;
+        call->done = done;
+        call->arg = arg;
+
+        snprintf(seconds, sizeof(seconds), "%.6f", self->latency > 0 ? _latency(self) / 1000 : 0);
+        if (exec_start(argv, NULL, -1, _slept, call) < 0) {
+                free(call);
+                return -1;
+        }
+        return 0;
+}
+
+// A batch costs one call like iptables-restore, and fails as a whole
+static int _apply_batch(backend_t *backend, const backend_rule_t *rules, struct response *responses, int count)
+{
+        sim_t *self = (sim_t*) backend->data;
+
+        _delay(self);
+        if (count > 0 && _fail(self, &responses[0])) {
+                for (int i=1; i<count; ++i)
+                        responses[i] = responses[0];
+                return 0;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        for (int i=0; i<count; ++i)
+                _change(self, &rules[i], &responses[i]);
+        pthread_mutex_unlock(&self->lock);
+        return 0;
+}
+
+// Same format as iptables -S
+static int _snapshot(backend_t *backend, int fd)
+{
+        sim_t *self = (sim_t*) backend->data;
+        FILE *out;
+
+        if ((fd = dup(fd)) < 0 || (out = fdopen(fd, "w")) == NULL) {
+                log_error("Failed to open snapshot output");
+                if (fd >= 0)
+                        close(fd);
+                return -1;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        fprintf(out, "-P FORWARD ACCEPT\n");
+        for (int i=0; i<SIM_BUCKETS; ++i)
+                for (sim_rule_t *entry = self->buckets[i]; entry != NULL; entry = entry->next)
+                        for (int j=0; j<entry->count; ++j)
+                                fprintf(out, "-A %s%s/32%s\n", backend->templates->list[entry->template]->prefix,
+                                                entry->ip, backend->templates->list[entry->template]->suffix);
+        pthread_mutex_unlock(&self->lock);
+
+        return fclose(out) == 0 ? 0 : -1;
+}
+
+static int _list(backend_t *backend, void (*rule)(void *arg, const char *ip), void *arg)
+{
+        sim_t *self = (sim_t*) backend->data;
+
+        pthread_mutex_lock(&self->lock);
+        for (int i=0; i<SIM_BUCKETS; ++i)
+                for (sim_rule_t *entry = self->buckets[i]; entry != NULL; entry = entry->next)
+                        for (int j=0; j<entry->count && entry->template == TEMPLATE_DEFAULT; ++j)
+                                rule(arg, entry->ip);
+        pthread_mutex_unlock(&self->lock);
+        return 0;
+}
+
+static void _destroy(backend_t *backend)
+{
+        sim_t *self = (sim_t*) backend->data;
+        sim_rule_t *entry;
+
+        for (int i=0; i<SIM_BUCKETS; ++i) {
+                while ((entry = self->buckets[i]) != NULL) {
+                        self->buckets[i] = entry->next;
+                        free(entry);
+                }
+        }
+        pthread_cond_destroy(&self->turn);
+        pthread_mutex_destroy(&self->lock);
+        templates_destroy(backend->templates);
+        free(self);
+        free(backend);
+}
+
+
+backend_t* backend_sim_create(const char *options)
+{
+        backend_t *backend;
+        sim_t *self;
+
+        backend = (backend_t*) calloc (1, sizeof(*backend));
+        self = (sim_t*) calloc (1, sizeof(*self));
+        if (backend == NULL || self == NULL) {
+                log_error("Failed to calloc() simulated backend");
+                free(backend);
+                free(self);
+                return NULL;
+        }
+
+        self->dist = SIM_CONST;
+        if (backend_options(options, _set, self) < 0 || self->latency < 0 || self->fail < 0 || self->fail > 1 ||
+                        self->calls < 0) {
+                free(backend);
+                free(self);
+                return NULL;
+        }
+        if ((backend->templates = templates_load(self->templates, "FORWARD", "ACCEPT")) == NULL) {
+                free(backend);
+                free(self);
+                return NULL;
+        }
+        pthread_mutex_init(&self->lock, NULL);
+        pthread_cond_init(&self->turn, NULL);
+
+        backend->name = "sim";
+        backend->data = self;
+        backend->apply = _apply;
+        backend->apply_batch = _apply_batch;
+        backend->submit = self->async ? _submit : NULL;
+        backend->snapshot = _snapshot;
+        backend->list = _list;
+        backend->destroy = _destroy;
+        return backend;
+}
@@ -0,0 +1,260 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "logging.h"
+#include "fwmgr.h"
+#include "stats.h"
+#include "bench.h"
+
+
+typedef struct bench_worker {
+        int id;
+        pthread_t thread;
+        const bench_config_t *config;
+        uint64_t seed;
+        stats_histogram_t latency;
+        unsigned long ok;
+        unsigned long failed;           // Non-zero response code
+        unsigned long busy;
+        unsigned long errors;           // Connection and protocol errors
+} bench_worker_t;
+
+static struct {
+        fwmgr_t *fw;
+        unsigned long issued;
+        uint64_t start;
+        uint64_t deadline;
+} state;
+
+
+// xorshift64*
+static uint64_t _random(uint64_t *seed)
+{
+        *seed ^= *seed >> 12;
+        *seed ^= *seed << 25;
+        *seed ^= *seed >> 27;
+        return *seed * 2685821657736338717ull;
+}
+
+static const char* _method(bench_worker_t *self)
+{
+        const bench_config_t *config = self->config;
+        int total = 0, pick;
+
+        for (int i=0; i<config->methods; ++i)
+                total += config->method[i].weight;
+
+        pick = _random(&self->seed) % total;
+        for (int i=0; i<config->methods; ++i) {
+                if (pick < config->method[i].weight)
+                        return config->method[i].name;
+                pick -= config->method[i].weight;
+        }
+        return config->method[0].name;
+}
+
+static void _address(bench_worker_t *self, char *ip, size_t size)
+{
+        struct in_addr addr;
+
+        addr.s_addr = htonl(self->config->network | (_random(&self->seed) & ~self->config->mask));
+        inet_ntop(AF_INET, &addr, ip, size);
+}
+
+// Claim the next request
+static bool _claim(const bench_config_t *config)
+{
+        if (config->requests > 0)
+                return __atomic_fetch_add(&state.issued, 1, __ATOMIC_RELAXED) < config->requests;
+        return stats_now() < state.deadline;
+}
+
+static void _sleep_until(uint64_t ns)
+{
+        struct timespec until = {ns / 1000000000, ns % 1000000000};
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) != 0)
+                ;
+}
+
+static void* _work(void *arg)
+{
+        bench_worker_t *self = (bench_worker_t*) arg;
+        const bench_config_t *config = self->config;
+        fwmgr_result_t result;
+        char ip[FWMGR_IP_SIZE];
+        uint64_t interval = 0, next, start;
+
+        // Open loop: every connection sends on its own schedule and the latency
+        // is measured from the scheduled time, so a slow server can not hide
+        // its queueing by slowing down the load generator
+        if (config->rate > 0)
+                interval = config->connections * 1e9 / config->rate;
+        next = state.start + interval * self->id / config->connections;
+
+        while (_claim(config)) {
+                if (interval > 0) {
+                        _sleep_until(next);
+                        start = next;
+                        next += interval;
+                } else {
+                        start = stats_now();
+                }
+
+                _address(self, ip, sizeof(ip));
+                if (fwmgr_request(state.fw, _method(self), ip, &result) < 0) {
+                        self->errors++;
+                        continue;
+                }
+                stats_histogram_record(&self->latency, stats_now() - start);
+
+                if (result.code == FWMGR_OK)
+                        self->ok++;
+                else if (result.code == FWMGR_BUSY)
+                        self->busy++;
+                else
+                        self->failed++;
+        }
+        return NULL;
+}
+
+
+// Comma separated methods with optional weights: "append=3,remove=1"
+int bench_methods(bench_config_t *config, const char *mix)
+{
+        char *buffer, *item, *weight, *save;
+
+        buffer = strdup(mix);
+        config->methods = 0;
+        for (item = strtok_r(buffer, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save)) {
+                if (config->methods == BENCH_METHODS) {
+                        log_error("Too many methods: '%s'", mix);
+                        free(buffer);
+                        return -1;
+                }
+
+                if ((weight = strchr(item, '=')) != NULL)
+                        *weight++ = '\0';
+                snprintf(config->method[config->methods].name, sizeof(config->method[0].name), "%s", item);
+                config->method[config->methods].weight = weight != NULL ? atoi(weight) : 1;
+                if (config->method[config->methods].weight <= 0) {
+                        log_error("Invalid method weight: '%s'", mix);
+                        free(buffer);
+                        return -1;
+                }
+                config->methods++;
+        }
+        free(buffer);
+
+        if (config->methods == 0) {
+                log_error("No methods in '%s'", mix);
+                return -1;
+        }
+        return 0;
+}
+
+// The target addresses are drawn from the network: "10.0.0.0/16"
+int bench_network(bench_config_t *config, const char *network)
+{
+        char buffer[32];
+        struct in_addr addr;
+        char *bits;
+        int prefix = 32;
+
+        snprintf(buffer, sizeof(buffer), "%s", network);
+        if ((bits = strchr(buffer, '/')) != NULL) {
+                *bits++ = '\0';
+                prefix = atoi(bits);
+        }
+
+        if (inet_pton(AF_INET, buffer, &addr) != 1 || prefix < 0 || prefix > 32) {
+                log_error("Invalid network: '%s'", network);
+                return -1;
+        }
+
+        config->mask = prefix == 0 ? 0 : 0xffffffffu << (32 - prefix);
+        config->network = ntohl(addr.s_addr) & config->mask;
+        return 0;
+}
+
+int bench_run(const bench_config_t *config)
+{
+        bench_worker_t *workers;
+        stats_histogram_t *latency;
+        fwmgr_config_t settings;
+        unsigned long ok = 0, failed = 0, busy = 0, errors = 0;
+        double elapsed;
+        int started = 0;
+
+        workers = (bench_worker_t*) calloc (config->connections, sizeof(*workers));
+        latency = (stats_histogram_t*) calloc (1, sizeof(*latency));
+        if (workers == NULL || latency == NULL) {
+                log_error("Failed to calloc() benchmark workers");
+                free(workers);
+                free(latency);
+                return -1;
+        }
+
+        // Every thread gets its own connection, the busy responses are counted instead of retried
+        fwmgr_defaults(&settings);
+        settings.host = config->host;
+        settings.port = config->port;
+        settings.path = config->path;
+        settings.connections = config->connections;
+        settings.workers = 0;
+        settings.retries = 0;
+        settings.keepalive = config->keepalive;
+        if ((state.fw = fwmgr_create(&settings)) == NULL) {
+                free(workers);
+                free(latency);
+                return -1;
+        }
+
+        state.issued = 0;
+        state.start = stats_now();
+        state.deadline = config->requests > 0 ? 0 : state.start + config->duration * 1e9;
+
+        for (; started<config->connections; ++started) {
+                workers[started].id = started;
+                workers[started].config = config;
+                workers[started].seed = state.start ^ (0x9e3779b97f4a7c15ull * (started + 1));
+                if (pthread_create(&workers[started].thread, NULL, _work, &workers[started]) != 0) {
+                        log_error("Failed to create benchmark thread %d", started);
+                        break;
+                }
+        }
+
+        for (int i=0; i<started; ++i) {
+                pthread_join(workers[i].thread, NULL);
+                stats_histogram_merge(latency, &workers[i].latency);
+                ok += workers[i].ok;
+                failed += workers[i].failed;
+                busy += workers[i].busy;
+                errors += workers[i].errors;
+        }
+        elapsed = (stats_now() - state.start) / 1e9;
+
+        printf("Connections: %d (%s, %s)\n", config->connections,
+                        config->rate > 0 ? "open loop" : "closed loop",
+                        config->keepalive ? "keep-alive" : "connection per request");
+        printf("Requests:    %lu (ok=%lu failed=%lu busy=%lu errors=%lu)\n",
+                        ok + failed + busy + errors, ok, failed, busy, errors);
+        printf("Duration:    %.3f s\n", elapsed);
+        printf("Throughput:  %.1f req/s\n", latency->count / elapsed);
+        printf("Latency:     p50=%.3f p90=%.3f p99=%.3f p999=%.3f max=%.3f ms\n",
+                        stats_histogram_percentile(latency, 50) / 1e6,
+                        stats_histogram_percentile(latency, 90) / 1e6,
+                        stats_histogram_percentile(latency, 99) / 1e6,
+                        stats_histogram_percentile(latency, 99.9) / 1e6,
+                        latency->max / 1e6);
+
+        fwmgr_destroy(state.fw);
+        free(workers);
+        free(latency);
+        return errors > 0 ? 1 : 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+
+#define BENCH_METHODS 8
+
+typedef struct bench_method {
+        char name[32];
+        int weight;
+} bench_method_t;
+
+typedef struct bench_config {
+        const char *host;
+        unsigned short port;
+        const char *path;               // Unix domain socket instead of host:port
+        int connections;
+        unsigned long requests;         // 0: run for the duration
+        double duration;                // Seconds
+        double rate;                    // Requests per second of every connection together, 0: closed loop
+        int keepalive;
+        int methods;
+        bench_method_t method[BENCH_METHODS];
+        uint32_t network;               // Target addresses in host byte order
+        uint32_t mask;
+} bench_config_t;
+
+
+int bench_methods(bench_config_t *config, const char *mix);
+int bench_network(bench_config_t *config, const char *network);
+int bench_run(const bench_config_t *config);
@@ -1,19 +1,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-#include <sys/socket.h>
-#include <sys/types.h>
-#include <netinet/in.h>
-#include <netdb.h>
-#include <stdio.h>
 #include <unistd.h>
-#include <errno.h>
-#include <arpa/inet.h>
-
+#include <fcntl.h>
 
 #include "logging.h"
 #include "netpack.h"
+#include "fwmgr.h"
+#include "bench.h"
 
 #define LOG_LEVEL LOG_INFO
 #define LOG_PREFIX 0
@@ -27,101 +21,173 @@
 #endif
 
 
-int setup(const char *ip, unsigned short port)
+static void usage(const char *name)
 {
-    int sock;
-    struct sockaddr_in addr;
-
-    log_debug("Connect to %s:%d", ip, port);
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        log_error("Failed to create socket: %s", strerror(errno));
-        return -1;
-    }
-
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = inet_addr(ip);
-
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        log_error("Failed to connect to the server: %s", strerror(errno));
-        return -1;
-    }
-
-    log_debug("Connected to %s:%d", ip, port);
-    return sock;
+    log_error("Usage: %s [-u <socket> | -p <port>] [-R <rule>] <method> <ip> [<ttl>]", name);
+    log_error("       %s [-u <socket> | -p <port>] bulk <file | ->", name);
+    log_error("       %s [-u <socket> | -p <port>] sync <file | ->", name);
+    log_error("       %s [-u <socket> | -p <port>] -c <connections> [-n <requests> | -t <seconds>] [-r <rate>] "
+            "[-m <method=weight,...>] [-a <network>] [-k]", name);
 }
 
-int communicate(int sock, char *buffer, size_t size)
+// Failed lines and progress of the bulk and sync modes
+static void progress(void *arg, const fwmgr_result_t *result)
 {
-    log_debug("Send buffer '%s'", buffer);
-    if (send(sock, buffer, strlen(buffer), 0) < 0) {
-        log_error("Failed to send request: %s", strerror(errno));
-        return -1;
-    }
-    log_debug("Buffer has been sent");
+    if (result->line > 0)
+        log_warning("Line %lu: %s", result->line, result->reason);
+    else
+        log_info("%s", result->reason);
+}
 
-    memset(buffer, 0, size); 
+static int stream(fwmgr_t *fw, const char *method, const char *file)
+{
+    fwmgr_result_t result;
+    int input = 0, rc;
 
-    log_debug("Receive buffer");
-    if (recv(sock, buffer, size-1, 0) < 0) {
-        log_error("Failed to receive response: %s", strerror(errno));
+    if (strcmp(file, "-") != 0 && (input = open(file, O_RDONLY)) < 0) {
+        log_error("Failed to open '%s'", file);
         return -1;
     }
-    log_debug("Buffer has been received: '%s'", buffer);
 
-    return 0;
-}
+    if (strcmp(method, "sync") == 0)
+        rc = fwmgr_sync(fw, input, progress, NULL, &result);
+    else
+        rc = fwmgr_bulk(fw, input, progress, NULL, &result);
+    if (input != 0)
+        close(input);
+    if (rc < 0)
+        return -1;
 
-int teardown(int sock)
-{
-    log_debug("Tearing down connection");
-    close(sock);
-    log_debug("Connection has torn down");
+    log_info("%s", result.reason);
     return 0;
 }
 
 int main(int argc, char **argv)
 {
-    int sock;
-    char buffer[1024];
-    struct request request;
-    struct response response;
+    int rc;
+    int opt;
+    int bench = 0;
+    int ttl = 0;
+    char *name = argv[0];
+    char *path = NULL;
+    char *rule = NULL;
+    fwmgr_t *fw;
+    fwmgr_config_t settings;
+    fwmgr_result_t result;
+    bench_config_t config = {
+        .host = HOST,
+        .port = PORT,
+        .connections = 1,
+        .duration = 10,
+        .methods = 1,
+        .method = {{"append", 1}},
+        .network = 0x0a000000,  // 10.0.0.0/8
+        .mask = 0xff000000,
+    };
 
     // Solid logging
     log_set(LOG_LEVEL, log_std_prefix);
 
-    if (argc < 3) {
-        log_error("Usage: %s <method> <ip>", argv[0]);
-        return 1;
+    while ((opt = getopt(argc, argv, "u:p:c:n:t:r:m:a:kR:")) != -1) {
+        switch (opt) {
+        case 'u':
+            path = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            bench = 1;
+            break;
+        case 'n':
+            config.requests = strtoul(optarg, NULL, 10);
+            bench = 1;
+            break;
+        case 't':
+            config.duration = atof(optarg);
+            bench = 1;
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'm':
+            if (bench_methods(&config, optarg) < 0)
+                return 1;
+            break;
+        case 'a':
+            if (bench_network(&config, optarg) < 0)
+                return 1;
+            break;
+        case 'k':
+            config.keepalive = 1;
+            break;
+        case 'R':
+            rule = optarg;
+            break;
+        default:
+            usage(name);
+            return 1;
+        }
+    }
+    // argv[0] becomes the last option (or the program name without options)
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // Load generator mode
+    if (bench) {
+        if (config.connections < 1 || (config.requests == 0 && config.duration <= 0)) {
+            usage(name);
+            return 1;
+        }
+        config.path = path;
+        return bench_run(&config);
     }
-    log_debug("argv[0]=%s; argv[1]=%s; argv[2]=%s", argv[0], argv[1], argv[2]);
-
-    memset(buffer, 0, sizeof(buffer));
-    memset(&request, 0, sizeof(struct request));
-    memset(&response, 0, sizeof(struct response));
 
-    // Create request
-    strncpy(request.method, argv[1], sizeof(request.method)-1);
-    strncpy(request.ip, argv[2], sizeof(request.ip)-1);
-    if (compose_request(buffer, request, sizeof(buffer)) < 0) {
-        log_error("Failed to compose reques");
+    if (argc < 3 || (argc > 3 && strcmp(argv[1], "append") != 0)) {
+        usage(name);
         return 1;
     }
-
-    // Communicate with the server
-    if ((sock = setup(HOST, PORT)) < 0)
+    log_debug("argv[1]=%s; argv[2]=%s", argv[1], argv[2]);
+    if (argc > 3 && parse_ttl(argv[3], &ttl) != 0) {
+        log_error("Invalid ttl: '%s'", argv[3]);
         return 1;
-    if (communicate(sock, buffer, sizeof(buffer)) < 0)
+    }
+
+    // One connection, no retries: the busy responses are shown to the user
+    fwmgr_defaults(&settings);
+    settings.host = HOST;
+    settings.port = config.port;
+    settings.path = path;
+    settings.connections = 1;
+    settings.workers = 0;
+    settings.retries = 0;
+    settings.keepalive = 0;
+
+    if ((fw = fwmgr_create(&settings)) == NULL)
         return 1;
 
-    teardown(sock);
+    // Stream a file of "<method> <ip> [<ttl>] [<rule>]" lines or the wanted "<ip>" lines over one connection
+    if (strcmp(argv[1], "bulk") == 0 || strcmp(argv[1], "sync") == 0) {
+        rc = stream(fw, argv[1], argv[2]);
+        fwmgr_destroy(fw);
+        return rc < 0 ? 1 : 0;
+    }
 
-    // Parse response
-    if (parse_response(buffer, &response) < 0) {
-        log_error("Failed to parse response");
+    // The optional ttl makes the appended rule temporary, the named rules use a template of the server
+    if (rule != NULL)
+        rc = fwmgr_apply(fw, argv[1], argv[2], rule, ttl, &result);
+    else if (argc > 3)
+        rc = fwmgr_append(fw, argv[2], ttl, &result);
+    else
+        rc = fwmgr_request(fw, argv[1], argv[2], &result);
+    fwmgr_destroy(fw);
+    if (rc < 0)
         return 1;
-    }
 
-    log_info(response.reason);
+    if (result.code == FWMGR_BUSY && result.retry > 0)
+        log_info("%s, retry after %d ms", result.reason, result.retry);
+    else
+        log_info("%s", result.reason);
     return 0;
 }
@@ -0,0 +1,182 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "logging.h"
+#include "config.h"
+
+
+enum config_type {CONFIG_STRING, CONFIG_INT};
+
+typedef struct config_key {
+        const char *name;
+        enum config_type type;
+        size_t offset;
+        size_t size;
+        long min;
+        long max;
+        bool reload;
+} config_key_t;
+
+#define _STRING(name) {#name, CONFIG_STRING, offsetof(config_t, name), sizeof(((config_t*)0)->name), 0, 0, false}
+#define _INT(name, type, min, max, reload) {#name, CONFIG_INT, offsetof(config_t, name), sizeof(type), min, max, reload}
+
+static const config_key_t _keys[] = {
+        _STRING(host),
+        _INT(port, unsigned short, 1, 65535, false),
+        _STRING(socket),
+        _STRING(backend),
+        _INT(threads, int, 1, 1024, true),
+        _INT(queue_size, int, 0, 1048576, true),
+        _INT(stats_port, unsigned short, 0, 65535, false),
+        _STRING(expiry_file),
+        _STRING(lead),
+        _STRING(follow),
+        _INT(processes, int, 0, 64, false),
+        _INT(backlog, int, 1, 65535, false),
+        _INT(overload, int, 0, 1, false),
+        _INT(read_timeout, int, 1, 3600000, false),
+        _INT(exec_timeout, int, 1, 3600000, false),
+        _INT(write_timeout, int, 1, 3600000, false),
+        _INT(rate_limit, int, 0, 1000000, false),
+        _INT(rate_burst, int, 1, 1000000, false),
+        _STRING(rate_allow),
+        _INT(limit, int, 1, 1024, false),
+        _INT(limit_min, int, 1, 1024, false),
+        _INT(limit_max, int, 1, 1024, false),
+        _STRING(trace_file),
+};
+
+#define _KEYS (sizeof(_keys) / sizeof(_keys[0]))
+
+
+static const config_key_t* _find(const char *name)
+{
+        for (int i=0; i<_KEYS; ++i)
+                if (strcmp(_keys[i].name, name) == 0)
+                        return &_keys[i];
+        return NULL;
+}
+
+static long _get(const config_t *config, const config_key_t *key)
+{
+        const char *field = (const char*) config + key->offset;
+
+        return key->size == sizeof(int) ? *(const int*) field : *(const unsigned short*) field;
+}
+
+static bool _equal(const config_t *a, const config_t *b, const config_key_t *key)
+{
+        if (key->type == CONFIG_STRING)
+                return strcmp((const char*) a + key->offset, (const char*) b + key->offset) == 0;
+        return _get(a, key) == _get(b, key);
+}
+
+static char* _trim(char *text)
+{
+        char *end;
+
+        while (isspace((unsigned char) *text))
+                text++;
+        end = text + strlen(text);
+        while (end > text && isspace((unsigned char) end[-1]))
+                *--end = '\0';
+        return text;
+}
+
+
+int config_set(config_t *config, const char *name, const char *value)
+{
+        const config_key_t *key;
+        char *field, *end;
+        long number;
+
+        if ((key = _find(name)) == NULL) {
+                log_error("Unknown configuration key: '%s'", name);
+                return -1;
+        }
+
+        field = (char*) config + key->offset;
+        if (key->type == CONFIG_STRING) {
+                if (strlen(value) >= key->size) {
+                        log_error("Too long value of %s: '%s'", name, value);
+                        return -1;
+                }
+                strcpy(field, value);
+                return 0;
+        }
+
+        errno = 0;
+        number = strtol(value, &end, 10);
+        if (errno != 0 || end == value || *end != '\0' || number < key->min || number > key->max) {
+                log_error("Invalid value of %s: '%s' (%ld..%ld)", name, value, key->min, key->max);
+                return -1;
+        }
+
+        if (key->size == sizeof(int))
+                *(int*) field = number;
+        else
+                *(unsigned short*) field = number;
+        return 0;
+}
+
+int config_load(config_t *config, const char *path)
+{
+        char line[512], *text, *value;
+        int number = 0;
+        int rc = 0;
+        FILE *file;
+
+        if ((file = fopen(path, "r")) == NULL) {
+                log_error("Failed to open %s: %s", path, strerror(errno));
+                return -1;
+        }
+
+        // "<key> = <value>" lines, the empty ones and the ones starting with '#' are skipped
+        while (fgets(line, sizeof(line), file) != NULL) {
+                number++;
+                text = _trim(line);
+                if (*text == '\0' || *text == '#')
+                        continue;
+
+                if ((value = strchr(text, '=')) == NULL) {
+                        log_error("%s:%d: Missing '=': '%s'", path, number, text);
+                        rc = -1;
+                        continue;
+                }
+                *value++ = '\0';
+                if (config_set(config, _trim(text), _trim(value)) < 0) {
+                        log_error("%s:%d: Invalid line", path, number);
+                        rc = -1;
+                }
+        }
+
+        fclose(file);
+        return rc;
+}
+
+int config_compare(const config_t *current, const config_t *next)
+{
+        int changed = 0;
+
+        for (int i=0; i<_KEYS; ++i) {
+                if (_keys[i].reload || _equal(current, next, &_keys[i]))
+                        continue;
+                log_warning("Changed %s needs a restart, keeping the current value", _keys[i].name);
+                changed++;
+        }
+        return changed;
+}
+
+void config_log(const config_t *config)
+{
+        for (int i=0; i<_KEYS; ++i) {
+                if (_keys[i].type == CONFIG_STRING)
+                        log_debug("Config: %s = %s", _keys[i].name, (const char*) config + _keys[i].offset);
+                else
+                        log_debug("Config: %s = %ld", _keys[i].name, _get(config, &_keys[i]));
+        }
+}
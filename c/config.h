@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdbool.h>
+
+
+// Server configuration: the defaults of the build, overridden by the
+// "<key> = <value>" lines of the config file, then by the command line.
+// Only threads and queue_size can be changed by a reload (SIGHUP), the
+// other keys need a restart.
+typedef struct config {
+        char host[64];
+        unsigned short port;
+        char socket[108];               // Unix domain socket ("": none)
+        char backend[256];
+        int threads;                    // Workers of each acceptor
+        int queue_size;                 // Concurrent sessions of each acceptor (0: no limit)
+        unsigned short stats_port;      // 0: no statistics endpoint
+        char expiry_file[256];
+        char lead[80];                  // "[<host>:]<port>" of the followers ("": no)
+        char follow[80];                // "<host>:<port>" of the leader ("": no)
+        int processes;                  // Worker processes of the prefork mode (0: a single process)
+        int backlog;                    // Accept queue of each listening socket
+        int overload;                   // 0: wait for a free session, 1: reject the connections over queue_size
+        int read_timeout;               // Deadlines of the connection phases in milliseconds
+        int exec_timeout;
+        int write_timeout;
+        int rate_limit;                 // Requests per second of one source address (0: no limit)
+        int rate_burst;
+        char rate_allow[256];           // Addresses and networks which are never limited
+        int limit;                      // Concurrent backend calls: initial, minimum and maximum
+        int limit_min;
+        int limit_max;
+        char trace_file[256];
+} config_t;
+
+
+// Returns -1 on unknown keys and invalid values
+int config_set(config_t *config, const char *key, const char *value);
+// Returns -1 if the file can not be read or one of its lines is invalid
+int config_load(config_t *config, const char *path);
+// Warn about the changed keys which can not be reloaded, returns their number
+int config_compare(const config_t *current, const config_t *next);
+void config_log(const config_t *config);
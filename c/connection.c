@@ -8,63 +8,696 @@
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <ctype.h>
+#include <pthread.h>
 
 #include "runner.h"
 #include "logging.h"
 #include "netpack.h"
 #include "connection.h"
+#include "wheel.h"
+#include "stats.h"
+#include "ruleset.h"
+
+// Resolution of the connection deadlines in milliseconds
+#define WATCHDOG_TICK 10
+
+// Receive buffer of the streamed requests, the longer lines are rejected
+#define STREAM_BUFFER_SIZE 65536
+// Buffers allocated at once and kept by each thread for reuse
+#define STREAM_BUFFER_CHUNK 4
+#define STREAM_BUFFER_CACHE 2
+#define BULK_METHOD "bulk"
+#define SYNC_METHOD "sync"
+
+
+static struct {
+    wheel_t *wheel;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    volatile bool running;
+    struct timespec start;
+    unsigned long deadlines[CON_PHASES];
+    unsigned long timeouts[CON_PHASES];
+} watchdog = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Rules of one bulk transaction
+static int bulk_batch = 1;
+// Submit the single requests instead of waiting for them
+static bool async = false;
+static slab_t *buffers;
+
+// serve() left the response to the completion of the request
+#define DEFERRED 2
+
+// Lines streamed by the client after a bulk or sync request
+typedef struct stream {
+    session_t *session;
+    // Handle one line, the text can be modified
+    int (*line)(struct stream *self, char *text, unsigned long number);
+    // Called whenever the client pauses (optional)
+    int (*idle)(struct stream *self);
+    unsigned long lines;
+    unsigned long failed;
+} stream_t;
+
+typedef struct bulk {
+    stream_t stream;
+    backend_rule_t *rules;
+    struct response *responses;
+    unsigned long *lines;
+    int count;
+    unsigned long applied;
+} bulk_t;
+
+typedef struct sync {
+    stream_t stream;
+    ruleset_t *desired;
+} sync_t;
 
 static void teardown(session_t *session);
+static void hangup(session_t *session);
+static void executed(void *arg, int rc);
 
 
-void con_handler(void *arg)
+static unsigned long elapsed()
 {
-    session_t *session = (session_t*) arg;
-    struct timeval timeout = {5, 0};
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - watchdog.start.tv_sec) * 1000 + (now.tv_nsec - watchdog.start.tv_nsec) / 1000000;
+}
+
+// Shut down the sockets of the expired sessions, so the workers blocked on
+// them return immediately. It runs under the lock, so teardown() can not
+// close (and the kernel can not reuse) a socket in the meantime.
+static void* watch(void *arg)
+{
+    struct timespec tick = {0, WATCHDOG_TICK * 1000000};
+    wheel_timer_t *expired;
+    session_t *session;
+    int count;
+
+    log_debug("Connection watchdog was started");
+    while (watchdog.running) {
+        nanosleep(&tick, NULL);
+
+        pthread_mutex_lock(&watchdog.lock);
+        expired = wheel_advance(watchdog.wheel, elapsed());
+        for (count=0; expired != NULL; expired = expired->next, ++count) {
+            session = (session_t*) expired->arg;
+            session->expired = true;
+            watchdog.timeouts[session->phase]++;
+            shutdown(session->socket, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&watchdog.lock);
+
+        if (count > 0)
+            log_debug("Expired %d session(s)", count);
+    }
+    log_debug("Connection watchdog was stopped");
+    return NULL;
+}
+
+// The stage took the time since the previous stamp
+static void stamp(session_t *session, enum trace_stamp stamp, enum stats_stage stage)
+{
+    trace_record_t *trace = &session->trace;
+
+    trace->stamps[stamp] = stats_now();
+    stats_record(stage, trace->stamps[stamp] - trace->stamps[stamp-1]);
+}
+
+static void deadline(session_t *session, enum con_phase phase)
+{
+    if (watchdog.wheel == NULL)
+        return;
+
+    pthread_mutex_lock(&watchdog.lock);
+    session->phase = phase;
+    wheel_add(watchdog.wheel, &session->deadline, watchdog.deadlines[phase]);
+    pthread_mutex_unlock(&watchdog.lock);
+}
+
+int con_setup(unsigned long read, unsigned long exec, unsigned long write, int batch, bool submit)
+{
+    log_debug("Connection deadlines: read=%lums exec=%lums write=%lums", read, exec, write);
+
+    if (batch < 1) {
+        log_error("Invalid bulk batch size: %d", batch);
+        return -1;
+    }
+    bulk_batch = batch;
+    async = submit;
+
+    watchdog.deadlines[CON_READ] = read;
+    watchdog.deadlines[CON_EXEC] = exec;
+    watchdog.deadlines[CON_WRITE] = write;
+    clock_gettime(CLOCK_MONOTONIC, &watchdog.start);
+
+    buffers = slab_create(STREAM_BUFFER_SIZE, STREAM_BUFFER_CHUNK, STREAM_BUFFER_CACHE);
+    if (buffers == NULL)
+        return -1;
+
+    watchdog.wheel = wheel_create(WATCHDOG_TICK);
+    if (watchdog.wheel == NULL) {
+        slab_destroy(buffers);
+        buffers = NULL;
+        return -1;
+    }
+
+    watchdog.running = true;
+    if (pthread_create(&watchdog.thread, NULL, watch, NULL) != 0) {
+        log_error("Failed to create connection watchdog thread");
+        wheel_destroy(watchdog.wheel);
+        watchdog.wheel = NULL;
+        slab_destroy(buffers);
+        buffers = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void con_teardown()
+{
+    if (watchdog.wheel == NULL)
+        return;
+
+    watchdog.running = false;
+    pthread_join(watchdog.thread, NULL);
+    wheel_destroy(watchdog.wheel);
+    watchdog.wheel = NULL;
+    slab_destroy(buffers);
+    buffers = NULL;
+}
 
+void con_shrink()
+{
+    if (buffers != NULL)
+        slab_shrink(buffers);
+}
+
+void con_buffers(slab_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (buffers != NULL)
+        slab_stats(buffers, stats);
+}
+
+void con_timeouts(unsigned long counts[CON_PHASES])
+{
+    pthread_mutex_lock(&watchdog.lock);
+    for (int i=0; i<CON_PHASES; ++i)
+        counts[i] = watchdog.timeouts[i];
+    pthread_mutex_unlock(&watchdog.lock);
+}
+
+// The responses of a stream are lines, the stderr of a command can have several
+static void flatten(char *reason)
+{
+    for (; *reason != '\0'; ++reason)
+        if (*reason == '\n' || *reason == '\r')
+            *reason = ' ';
+}
+
+// Send an intermediate response of a stream, one per line
+static int reply(session_t *session, struct response *response)
+{
+    char buffer[sizeof(response->reason) + 64];
+    int bytes;
+
+    flatten(response->reason);
+    bytes = compose_response(buffer, *response, sizeof(buffer) - 1);
+    if (bytes < 0 || bytes >= sizeof(buffer) - 1)
+        bytes = strlen(buffer);
+    buffer[bytes++] = '\n';
+
+    deadline(session, CON_WRITE);
+    if (send(session->socket, buffer, bytes, MSG_NOSIGNAL) < 0) {
+        log_error("Failed to send stream response: %s", session->expired ? "write timeout" : strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int invalid(stream_t *stream, struct response *response, unsigned long number)
+{
+    stream->failed++;
+    response->line = number;
+    return reply(stream->session, response);
+}
+
+// Receive the lines streamed after the request until the client shuts down its
+// side of the connection, returns -1 if the stream was interrupted
+static int receive(stream_t *stream, const char *rest)
+{
+    session_t *session = stream->session;
+    char *buffer, *start, *end;
+    size_t used;
+    bool skip = false;
+    ssize_t bytes;
+    int rc = 0;
+
+    if ((buffer = (char*) slab_alloc(buffers)) == NULL) {
+        log_error("Failed to allocate stream buffer");
+        return -1;
+    }
+
+    // The beginning of the stream may have arrived with the request
+    used = strlen(rest);
+    memcpy(buffer, rest, used);
+
+    while (rc == 0) {
+        // Process the complete lines
+        start = buffer;
+        while (rc == 0 && (end = memchr(start, '\n', used - (start - buffer))) != NULL) {
+            *end = '\0';
+            stream->lines++;
+            if (!skip)
+                rc = stream->line(stream, start, stream->lines);
+            skip = false;
+            start = end + 1;
+        }
+        used -= start - buffer;
+        memmove(buffer, start, used);
+
+        if (rc == 0 && used == STREAM_BUFFER_SIZE - 1) {
+            struct response failure = {.code = 1};
+
+            snprintf(failure.reason, sizeof(failure.reason), "Too long line");
+            rc = invalid(stream, &failure, stream->lines + 1);
+            used = 0;
+            skip = true;
+        }
+        if (rc < 0)
+            break;
+
+        // Let the handler work while the client has nothing more to say for now
+        bytes = -1;
+        errno = EAGAIN;
+        if (stream->idle != NULL)
+            bytes = recv(session->socket, buffer + used, STREAM_BUFFER_SIZE - 1 - used, MSG_DONTWAIT);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (stream->idle != NULL && (rc = stream->idle(stream)) < 0)
+                break;
+            deadline(session, CON_READ);
+            bytes = recv(session->socket, buffer + used, STREAM_BUFFER_SIZE - 1 - used, 0);
+        }
+
+        if (bytes == 0) {
+            // The last line does not need a newline
+            if (used > 0 && !skip) {
+                buffer[used] = '\0';
+                rc = stream->line(stream, buffer, ++stream->lines);
+            }
+            break;
+        }
+        if (bytes < 0) {
+            log_warning("Stream from %s:%d was interrupted: %s", session->ip, session->port,
+                    session->expired ? "read timeout" : strerror(errno));
+            rc = -1;
+        }
+        used += bytes;
+    }
+
+    slab_free(buffers, buffer);
+    return rc;
+}
+
+// Apply the collected rules in one transaction, then report the failed lines and the progress
+static int commit(bulk_t *bulk)
+{
+    session_t *session = bulk->stream.session;
+    struct response response;
+
+    deadline(session, CON_EXEC);
+    if (runner_batch(bulk->rules, bulk->responses, bulk->count) < 0) {
+        for (int i=0; i<bulk->count; ++i) {
+            bulk->responses[i].code = 1;
+            snprintf(bulk->responses[i].reason, sizeof(bulk->responses[i].reason), "Internal error (See server logs)");
+        }
+    }
+
+    for (int i=0; i<bulk->count; ++i) {
+        if (bulk->responses[i].code == 0) {
+            bulk->applied++;
+            continue;
+        }
+        if (invalid(&bulk->stream, &bulk->responses[i], bulk->lines[i]) < 0)
+            return -1;
+    }
+    bulk->count = 0;
+
+    memset(&response, 0, sizeof(response));
+    response.progress = bulk->stream.lines;
+    snprintf(response.reason, sizeof(response.reason), "%lu line(s) processed", response.progress);
+    return reply(session, &response);
+}
+
+// Validate one "<method> <ip> [<ttl>] [<rule>]" line and add it to the transaction
+static int bulk_line(stream_t *stream, char *text, unsigned long number)
+{
+    bulk_t *bulk = (bulk_t*) stream;
     struct request request;
     struct response response;
-    char buffer[sizeof(response.reason)];
+    char *method, *ip, *option, *save;
 
-    memset(buffer, 0, sizeof(buffer));
-    memset(&request, 0, sizeof(struct request));
-    memset(&response, 0, sizeof(struct response));
+    method = strtok_r(text, " \t\r", &save);
+    if (method == NULL || method[0] == '#')
+        return 0;
+    ip = strtok_r(NULL, " \t\r", &save);
 
-    log_debug("Connection from %s:%d", session->ip, session->port);
+    memset(&request, 0, sizeof(request));
+    memset(&response, 0, sizeof(response));
+    snprintf(request.method, sizeof(request.method), "%s", method);
+    snprintf(request.ip, sizeof(request.ip), "%s", ip != NULL ? ip : "");
 
-    // Receive request
-    setsockopt(session->socket, SOL_SOCKET, SO_RCVTIMEO, (struct timeval*) &timeout, sizeof(timeout));
-    if (recv(session->socket, buffer, sizeof(buffer)-1, 0) < 0) {
-        log_error("Failed to receive request: %s", strerror(errno));
-        teardown(session);
-        return;
+    // The ttl is the numeric option, the other one names the rule
+    while ((option = strtok_r(NULL, " \t\r", &save)) != NULL) {
+        if (isdigit((unsigned char) option[0]) || option[0] == '-') {
+            if (parse_ttl(option, &request.ttl) != 0)
+                request.ttl = -1;
+        }
+        else
+            snprintf(request.rule, sizeof(request.rule), "%s", option);
     }
 
-    // Process request
-    log_debug("Request: '%s'", buffer);
-    parse_request(buffer, &request);
+    if (runner_rule(request, &bulk->rules[bulk->count], &response) != 0)
+        return invalid(stream, &response, number);
 
-    // Execute subprocess
-    if (runner_process(request, &response) < 0) {
+    bulk->lines[bulk->count++] = number;
+    return bulk->count == bulk_batch ? commit(bulk) : 0;
+}
+
+static int bulk_idle(stream_t *stream)
+{
+    bulk_t *bulk = (bulk_t*) stream;
+
+    return bulk->count > 0 ? commit(bulk) : 0;
+}
+
+// Bulk mode: the client streams "<method> <ip> [<ttl>] [<rule>]" lines after the request until
+// it shuts down its side of the connection. The rules are applied in
+// transactions of bulk_batch rules or whenever the client pauses, the failed
+// lines and the progress are sent back after every transaction.
+// The final response is sent by the caller.
+static void bulk(session_t *session, const char *rest, struct response *response)
+{
+    bulk_t bulk = {.stream = {session, bulk_line, bulk_idle}};
+    int rc;
+
+    bulk.rules = (backend_rule_t*) calloc (bulk_batch, sizeof(*bulk.rules));
+    bulk.responses = (struct response*) calloc (bulk_batch, sizeof(*bulk.responses));
+    bulk.lines = (unsigned long*) calloc (bulk_batch, sizeof(*bulk.lines));
+    if (bulk.rules == NULL || bulk.responses == NULL || bulk.lines == NULL) {
+        log_error("Failed to allocate bulk buffers");
+        response->code = 1;
+        snprintf(response->reason, sizeof(response->reason), "Internal error (See server logs)");
+        goto cleanup;
+    }
+
+    rc = receive(&bulk.stream, rest);
+
+    // The rules which have already been received are applied even when the stream was interrupted
+    if (bulk.count > 0 && commit(&bulk) < 0)
+        rc = -1;
+
+    response->code = bulk.stream.failed > 0 || rc < 0 ? 1 : 0;
+    snprintf(response->reason, sizeof(response->reason), "%lu rule(s) applied, %lu failed",
+            bulk.applied, bulk.stream.failed);
+    log_info("Bulk from %s:%d: %lu line(s), %s", session->ip, session->port, bulk.stream.lines, response->reason);
+
+cleanup:
+    free(bulk.rules);
+    free(bulk.responses);
+    free(bulk.lines);
+}
+
+// Add one "<ip>" line to the desired set
+static int sync_line(stream_t *stream, char *text, unsigned long number)
+{
+    sync_t *sync = (sync_t*) stream;
+    struct request request = {.method = "append"};
+    struct response response;
+    backend_rule_t rule;
+    char *ip, *save;
+    uint32_t addr;
+
+    ip = strtok_r(text, " \t\r", &save);
+    if (ip == NULL || ip[0] == '#')
+        return 0;
+
+    memset(&response, 0, sizeof(response));
+    snprintf(request.ip, sizeof(request.ip), "%s", ip);
+    if (runner_rule(request, &rule, &response) != 0 || ruleset_parse(rule.ip, &addr) < 0)
+        return invalid(stream, &response, number);
+
+    // One rule per wanted address, the duplicated lines do not add more
+    if (ruleset_count(sync->desired, addr) == 0 && ruleset_add(sync->desired, addr, 1) < 0) {
         response.code = 1;
         snprintf(response.reason, sizeof(response.reason), "Internal error (See server logs)");
+        return invalid(stream, &response, number);
+    }
+    return 0;
+}
+
+// Sync mode: the client streams the complete set of the wanted addresses, one
+// per line. Only the difference from the managed rules is applied, nothing is
+// applied if the stream was interrupted or had invalid lines.
+static void synchronize(session_t *session, const char *rest, struct response *response)
+{
+    sync_t sync = {.stream = {session, sync_line, NULL}};
+    runner_sync_t result;
+
+    response->code = 1;
+    if ((sync.desired = ruleset_create(0)) == NULL) {
+        snprintf(response->reason, sizeof(response->reason), "Internal error (See server logs)");
+        return;
+    }
+
+    if (receive(&sync.stream, rest) < 0) {
+        snprintf(response->reason, sizeof(response->reason), "Sync aborted: the stream was interrupted");
+    } else if (sync.stream.failed > 0) {
+        snprintf(response->reason, sizeof(response->reason), "Sync aborted: %lu invalid line(s)", sync.stream.failed);
+    } else {
+        deadline(session, CON_EXEC);
+        if (runner_sync(sync.desired, &result, response) < 0) {
+            response->code = 1;
+            snprintf(response->reason, sizeof(response->reason), "Internal error (See server logs)");
+        }
+    }
+    log_info("Sync from %s:%d: %lu line(s), %s", session->ip, session->port, sync.stream.lines, response->reason);
+
+    ruleset_destroy(sync.desired);
+}
+
+// Send the response of the executed request, returns 1 when the client keeps the connection open
+static int respond(session_t *session, int keepalive)
+{
+    trace_record_t *trace = &session->trace;
+    struct response *response = &session->response;
+    char buffer[sizeof(response->reason)];
+    ssize_t bytes;
+
+    stamp(session, TRACE_EXECUTED, STATS_EXEC);
+    stats_code(response->code);
+    trace->code = response->code;
+
+    // The client has already been released
+    if (session->expired) {
+        log_warning("Exec timeout on connection from %s:%d", session->ip, session->port);
+        trace->result = "exec timeout";
+        return 0;
     }
 
     // Create response
+    response->keepalive = keepalive;
+    flatten(response->reason);
     memset(buffer, 0, sizeof(buffer));
-    compose_response(buffer, response, sizeof(buffer));
+    compose_response(buffer, *response, sizeof(buffer));
     log_debug("Response: '%s'", buffer);
 
     // Send response
-    if (send(session->socket, buffer, strlen(buffer), 0) < 0) {
-        log_error("Failed to send response: %s", strerror(errno));
+    deadline(session, CON_WRITE);
+    bytes = send(session->socket, buffer, strlen(buffer), MSG_NOSIGNAL);
+    stamp(session, TRACE_SENT, STATS_SEND);
+    if (bytes < 0) {
+        if (session->expired) {
+            log_warning("Write timeout on connection from %s:%d", session->ip, session->port);
+            trace->result = "write timeout";
+        } else {
+            log_error("Failed to send response: %s", strerror(errno));
+            trace->result = "send error";
+        }
+        return 0;
     }
 
+    trace->result = "sent";
+    return keepalive ? 1 : 0;
+}
+
+// Serve one request, returns 1 when the client keeps the connection open for
+// the next one, DEFERRED when the completion of the request responds
+static int serve(session_t *session)
+{
+    trace_record_t *trace = &session->trace;
+    struct response *response = &session->response;
+    struct request request;
+    char buffer[sizeof(response->reason)];
+    ssize_t bytes;
+    char *rest;
+    int rc;
+
+    memset(buffer, 0, sizeof(buffer));
+    memset(&request, 0, sizeof(struct request));
+    memset(response, 0, sizeof(struct response));
+
+    // Receive request
+    deadline(session, CON_READ);
+    bytes = recv(session->socket, buffer, sizeof(buffer)-1, 0);
+    stamp(session, TRACE_RECEIVED, STATS_RECV);
+    if (bytes <= 0) {
+        if (session->expired) {
+            log_warning("Read timeout on connection from %s:%d", session->ip, session->port);
+            trace->result = "read timeout";
+        } else if (bytes < 0) {
+            log_error("Failed to receive request: %s", strerror(errno));
+            trace->result = "recv error";
+        } else {
+            log_debug("Connection was closed by %s:%d", session->ip, session->port);
+            trace->result = "closed";
+        }
+        return 0;
+    }
+
+    // Process request, a bulk stream may follow it after a newline
+    if ((rest = strchr(buffer, '\n')) != NULL)
+        *rest++ = '\0';
+    log_debug("Request: '%s'", buffer);
+    parse_request(buffer, &request);
+    snprintf(trace->method, sizeof(trace->method), "%.*s", (int) sizeof(trace->method) - 1, request.method);
+    stamp(session, TRACE_PARSED, STATS_PARSE);
+
+    // Execute subprocess
+    deadline(session, CON_EXEC);
+    if (strcmp(request.method, BULK_METHOD) == 0) {
+        bulk(session, rest != NULL ? rest : "", response);
+        request.keepalive = 0;
+    } else if (strcmp(request.method, SYNC_METHOD) == 0) {
+        synchronize(session, rest != NULL ? rest : "", response);
+        request.keepalive = 0;
+    } else if (async) {
+        // Held before the submit, the completion can come before it returns
+        session->keepalive = request.keepalive;
+        tp_hold(session->job);
+        if ((rc = runner_submit(request, response, executed, session)) == RUNNER_DEFERRED)
+            return DEFERRED;
+        tp_release(session->tp, session->job, false);
+        if (rc < 0) {
+            response->code = 1;
+            snprintf(response->reason, sizeof(response->reason), "Internal error (See server logs)");
+        }
+    } else if (runner_process(request, response) < 0) {
+        response->code = 1;
+        snprintf(response->reason, sizeof(response->reason), "Internal error (See server logs)");
+    }
+    return respond(session, request.keepalive);
+}
+
+// Record the request which has been finished at the given time
+static void finish(session_t *session, uint64_t now)
+{
+    trace_record_t *trace = &session->trace;
+
+    trace->stamps[TRACE_CLOSED] = now;
+    stats_record(STATS_TOTAL, now - trace->stamps[TRACE_ACCEPTED]);
+    stats_count(STATS_BUSY_NS, now - trace->stamps[TRACE_STARTED]);
+    trace_commit(trace);
+}
+
+// Every request of a keep-alive connection is traced on its own,
+// the next one starts when the previous response was sent
+static void next(session_t *session)
+{
+    trace_record_t *trace = &session->trace;
+    uint64_t now = stats_now();
+
+    finish(session, now);
+
+    trace->id = trace_id();
+    memset(trace->stamps, 0, sizeof(trace->stamps));
+    trace->stamps[TRACE_ACCEPTED] = now;
+    trace->stamps[TRACE_STARTED] = now;
+    trace->method[0] = '\0';
+    trace->code = -1;
+    trace->result = NULL;
+    session->served++;
+}
+
+// The completion of a submitted request, the worker of the session is doing something else.
+// It runs on the reaper, so a worker of the session sends the response.
+static void executed(void *arg, int rc)
+{
+    session_t *session = (session_t*) arg;
+    struct response *response = &session->response;
+
+    if (rc < 0) {
+        response->code = 1;
+        snprintf(response->reason, sizeof(response->reason), "Internal error (See server logs)");
+    }
+
+    session->completed = true;
+    tp_release(session->tp, session->job, true);
+}
+
+void con_handler(void *arg)
+{
+    session_t *session = (session_t*) arg;
+    trace_record_t *trace = &session->trace;
+    int rc;
+
+    if (session->completed) {
+        // Back from executed(): respond, then the next request of the connection
+        session->completed = false;
+        if (respond(session, session->keepalive) == 0) {
+            hangup(session);
+            return;
+        }
+        next(session);
+    } else {
+        log_debug("Request %lu: connection from %s:%d", trace->id, session->ip, session->port);
+        stamp(session, TRACE_STARTED, STATS_QUEUE);
+
+        session->expired = false;
+        session->served = 0;
+        wheel_init_timer(&session->deadline, session);
+    }
+
+    while ((rc = serve(session)) == 1)
+        next(session);
+    if (rc != DEFERRED)
+        hangup(session);
+}
+
+static void hangup(session_t *session)
+{
     teardown(session);
+
+    // A keep-alive client closing the connection between the requests is not a request
+    if (session->served == 0 || session->trace.stamps[TRACE_PARSED] != 0)
+        finish(session, stats_now());
 }
 
 static void teardown(session_t *session)
 {
     log_debug("Close connection to %s:%d", session->ip, session->port);
+
+    // Cancel the deadline before the socket can be reused
+    if (watchdog.wheel != NULL) {
+        pthread_mutex_lock(&watchdog.lock);
+        wheel_del(watchdog.wheel, &session->deadline);
+        pthread_mutex_unlock(&watchdog.lock);
+    }
     close(session->socket);
 }
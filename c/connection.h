@@ -1,16 +1,49 @@
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+#include "wheel.h"
+#include "trace.h"
+#include "netpack.h"
+#include "threadpool.h"
+#include "slab.h"
+
+
+enum con_phase {CON_READ, CON_EXEC, CON_WRITE, CON_PHASES};
 
 typedef struct session {
     int socket;
     char ip[40];
     unsigned short port;
+    pid_t pid;
+    uid_t uid;
+    enum con_phase phase;
+    volatile bool expired;
+    wheel_timer_t deadline;
+    trace_record_t trace;
+
+    // The job of the session is held while a submitted request is executing
+    tp_t *tp;
+    tp_job_t *job;
+    struct response response;
+    int keepalive;
+    int served;
+    bool completed;             // The response of the submitted request is to be sent
 } session_t;
 
 
+// The bulk requests are applied in transactions of batch rules, with async the
+// single requests release their worker while their command is running
+int con_setup(unsigned long read, unsigned long exec, unsigned long write, int batch, bool async);
+void con_teardown();
+void con_timeouts(unsigned long counts[CON_PHASES]);
+// The receive buffers of the streams come from a slab as well
+void con_shrink();
+void con_buffers(slab_stats_t *stats);
+
 void con_handler(void *arg);
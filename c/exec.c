@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "logging.h"
+#include "stats.h"
+#include "exec.h"
+
+
+// The epoll events point to one of the watches of a child
+typedef struct exec_watch {
+        struct exec_child *child;
+        int fd;
+} exec_watch_t;
+
+typedef struct exec_child {
+        pid_t pid;
+        exec_watch_t exit;              // pidfd, readable when the child exited
+        exec_watch_t error;             // Read end of its stderr
+        exec_watch_t input;             // Write end of its stdin (-1: closed)
+        char *data;
+        size_t length;
+        size_t written;
+        bool exited;
+        bool completed;
+        int code;
+        size_t size;
+        char buffer[EXEC_OUTPUT_SIZE];
+        exec_done_t done;
+        void *arg;
+        struct exec_child *next;        // Completed by the same wakeup of the reaper
+} exec_child_t;
+
+// The completion of exec_run()
+typedef struct exec_wait {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        bool done;
+        int code;
+        char *error;
+        size_t size;
+} exec_wait_t;
+
+// The lock is held by the reaper while it handles the events and by
+// exec_start() while it registers a child, so a child is watched either
+// completely or not at all
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t idle;
+        pthread_t thread;
+        bool running;
+        int epoll;
+        int wakeup;                     // eventfd which stops the reaper
+        int children;
+} exec = {.lock = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER, .epoll = -1, .wakeup = -1};
+
+
+static int _watch(exec_watch_t *watch, uint32_t events)
+{
+        struct epoll_event event = {.events = events, .data.ptr = watch};
+
+        if (epoll_ctl(exec.epoll, EPOLL_CTL_ADD, watch->fd, &event) < 0) {
+                log_error("Failed to watch fd %d: %s", watch->fd, strerror(errno));
+                return -1;
+        }
+        return 0;
+}
+
+static void _unwatch(exec_watch_t *watch)
+{
+        if (watch->fd < 0)
+                return;
+        epoll_ctl(exec.epoll, EPOLL_CTL_DEL, watch->fd, NULL);
+        close(watch->fd);
+        watch->fd = -1;
+}
+
+// Called without the lock, the completion may start new children
+static void _complete(exec_child_t *child)
+{
+        char *error = child->buffer;
+
+        // Strip new lines
+        child->buffer[child->size] = '\0';
+        for (int i=child->size-1; i>=0 && error[i] == '\n'; --i)
+                error[i] = '\0';
+
+        child->done(child->arg, child->code, error);
+        free(child->data);
+        free(child);
+
+        pthread_mutex_lock(&exec.lock);
+        if (--exec.children == 0)
+                pthread_cond_broadcast(&exec.idle);
+        pthread_mutex_unlock(&exec.lock);
+}
+
+// Write as much of the input as the pipe takes, the child may exit without reading it
+static void _feed(exec_child_t *child)
+{
+        ssize_t bytes;
+
+        while (child->written < child->length) {
+                bytes = write(child->input.fd, child->data + child->written, child->length - child->written);
+                if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                        return;
+                if (bytes < 0) {
+                        if (errno != EPIPE)
+                                log_error("Failed to write to stdin of subprocess: %s", strerror(errno));
+                        break;
+                }
+                child->written += bytes;
+        }
+        _unwatch(&child->input);
+}
+
+// Keep the beginning of the stderr, read the rest until the end of file
+static void _drain(exec_child_t *child)
+{
+        char discard[256];
+        ssize_t bytes;
+
+        do {
+                if (child->size < sizeof(child->buffer) - 1)
+                        bytes = read(child->error.fd, child->buffer + child->size, sizeof(child->buffer) - 1 - child->size);
+                else
+                        bytes = read(child->error.fd, discard, sizeof(discard));
+                if (bytes > 0 && child->size < sizeof(child->buffer) - 1)
+                        child->size += bytes;
+        } while (bytes > 0);
+
+        if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                _unwatch(&child->error);
+}
+
+static void _reap(exec_child_t *child)
+{
+        siginfo_t info;
+
+        memset(&info, 0, sizeof(info));
+        if (waitid(P_PIDFD, child->exit.fd, &info, WEXITED | WNOHANG) < 0) {
+                log_error("Failed to reap process %d: %s", child->pid, strerror(errno));
+                child->code = -1;
+        } else if (info.si_pid == 0) {
+                return;         // Not yet
+        } else {
+                child->code = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+        }
+        child->exited = true;
+        _unwatch(&child->exit);
+}
+
+static void* _reaper(void *arg)
+{
+        struct epoll_event events[EXEC_EVENTS];
+        exec_watch_t *watch;
+        exec_child_t *child, *completed;
+        sigset_t signals;
+        bool stop = false;
+        int count;
+
+        // A child which exits without reading its input must not kill the server
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+        log_debug("Reaper thread was started");
+        while (!stop) {
+                count = epoll_wait(exec.epoll, events, EXEC_EVENTS, -1);
+                if (count < 0 && errno == EINTR)
+                        continue;
+                if (count < 0) {
+                        log_error("Failed to wait for the children: %s", strerror(errno));
+                        break;
+                }
+
+                completed = NULL;
+                pthread_mutex_lock(&exec.lock);
+                for (int i=0; i<count; ++i) {
+                        if ((watch = (exec_watch_t*) events[i].data.ptr) == NULL) {
+                                stop = true;
+                                continue;
+                        }
+
+                        // An earlier event of the batch could have closed it
+                        child = watch->child;
+                        if (watch->fd < 0)
+                                continue;
+                        if (watch == &child->input)
+                                _feed(child);
+                        else if (watch == &child->error)
+                                _drain(child);
+                        else
+                                _reap(child);
+
+                        // Done when it exited and every writer of its stderr is gone
+                        if (child->exited && child->error.fd < 0 && !child->completed) {
+                                _unwatch(&child->input);
+                                child->completed = true;
+                                child->next = completed;
+                                completed = child;
+                        }
+                }
+                pthread_mutex_unlock(&exec.lock);
+
+                while ((child = completed) != NULL) {
+                        completed = child->next;
+                        _complete(child);
+                }
+        }
+
+        log_debug("Reaper thread was stopped");
+        return NULL;
+}
+
+static void _finished(void *arg, int code, const char *error)
+{
+        exec_wait_t *wait = (exec_wait_t*) arg;
+
+        pthread_mutex_lock(&wait->lock);
+        wait->code = code;
+        if (wait->error != NULL)
+                snprintf(wait->error, wait->size, "%s", error);
+        wait->done = true;
+        pthread_cond_signal(&wait->cond);
+        pthread_mutex_unlock(&wait->lock);
+}
+
+
+int exec_setup()
+{
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+
+        exec.epoll = epoll_create1(EPOLL_CLOEXEC);
+        exec.wakeup = eventfd(0, EFD_CLOEXEC);
+        if (exec.epoll < 0 || exec.wakeup < 0 || epoll_ctl(exec.epoll, EPOLL_CTL_ADD, exec.wakeup, &event) < 0) {
+                log_error("Failed to setup the reaper: %s", strerror(errno));
+                exec_teardown();
+                return -1;
+        }
+
+        exec.running = true;
+        if (pthread_create(&exec.thread, NULL, _reaper, NULL) != 0) {
+                log_error("Failed to create reaper thread");
+                exec.running = false;
+                exec_teardown();
+                return -1;
+        }
+        return 0;
+}
+
+void exec_teardown()
+{
+        if (exec.running) {
+                exec_idle();
+                if (eventfd_write(exec.wakeup, 1) < 0)
+                        log_error("Failed to wake up the reaper: %s", strerror(errno));
+                pthread_join(exec.thread, NULL);
+                exec.running = false;
+        }
+        if (exec.wakeup >= 0)
+                close(exec.wakeup);
+        if (exec.epoll >= 0)
+                close(exec.epoll);
+        exec.wakeup = -1;
+        exec.epoll = -1;
+}
+
+int exec_start(char *const argv[], const char *input, int output, exec_done_t done, void *arg)
+{
+        int err[2], in[2] = {-1, -1};
+        exec_child_t *child;
+        uint64_t stamp;
+        int pidfd;
+        pid_t pid;
+
+        if (!exec.running) {
+                log_error("Failed to execute %s: the reaper is not running", argv[0]);
+                return -1;
+        }
+
+        if ((child = (exec_child_t*) calloc (1, sizeof(*child))) == NULL) {
+                log_error("Failed to calloc() child");
+                return -1;
+        }
+        if (input != NULL && (child->data = strdup(input)) == NULL) {
+                log_error("Failed to copy the input of %s", argv[0]);
+                free(child);
+                return -1;
+        }
+
+        // Close-on-exec, so the other children can not hold these pipes open
+        if (pipe2(err, O_CLOEXEC) < 0) {
+                log_error("Failed to open pipe: %s", strerror(errno));
+                goto fail;
+        }
+        if (input != NULL && pipe2(in, O_CLOEXEC) < 0) {
+                log_error("Failed to open pipe: %s", strerror(errno));
+                close(err[0]);
+                close(err[1]);
+                goto fail;
+        }
+
+        stamp = stats_now();
+        pid = fork();
+        if (pid < 0) {
+                log_error("Failed to fork: %s", strerror(errno));
+                stats_count(STATS_SPAWN_FAILED, 1);
+                close(err[0]);
+                close(err[1]);
+                if (input != NULL) {
+                        close(in[0]);
+                        close(in[1]);
+                }
+                goto fail;
+
+        } else if (pid == 0) {
+                // Child process, only async-signal-safe calls until exec
+                if (input != NULL)
+                        dup2(in[0], STDIN_FILENO);
+                if (output >= 0)
+                        dup2(output, STDOUT_FILENO);
+                dup2(err[1], STDERR_FILENO);
+                execvp(argv[0], argv);
+                _exit(127);
+        }
+
+        // Parent process
+        stats_record(STATS_FORK, stats_now() - stamp);
+        stats_count(STATS_SPAWNED, 1);
+        close(err[1]);
+        if (input != NULL)
+                close(in[0]);
+
+        if ((pidfd = syscall(SYS_pidfd_open, pid, 0)) < 0) {
+                // Nothing can watch it, wait for it here
+                log_error("Failed to open pidfd of process %d: %s", pid, strerror(errno));
+                close(err[0]);
+                if (input != NULL)
+                        close(in[1]);
+                waitpid(pid, NULL, 0);
+                goto fail;
+        }
+
+        child->pid = pid;
+        child->done = done;
+        child->arg = arg;
+        child->length = input != NULL ? strlen(input) : 0;
+        child->exit = (exec_watch_t) {child, pidfd};
+        child->error = (exec_watch_t) {child, err[0]};
+        child->input = (exec_watch_t) {child, in[1]};
+        fcntl(err[0], F_SETFL, O_NONBLOCK);
+        if (input != NULL)
+                fcntl(in[1], F_SETFL, O_NONBLOCK);
+
+        // The reaper owns the child after the unlock, it can complete before we return
+        pthread_mutex_lock(&exec.lock);
+        if (_watch(&child->exit, EPOLLIN) < 0 || _watch(&child->error, EPOLLIN) < 0 ||
+                        (input != NULL && _watch(&child->input, EPOLLOUT) < 0)) {
+                _unwatch(&child->exit);
+                _unwatch(&child->error);
+                _unwatch(&child->input);
+                pthread_mutex_unlock(&exec.lock);
+                kill(pid, SIGKILL);
+                waitpid(pid, NULL, 0);
+                goto fail;
+        }
+        exec.children++;
+        pthread_mutex_unlock(&exec.lock);
+        return 0;
+
+fail:
+        free(child->data);
+        free(child);
+        return -1;
+}
+
+int exec_run(char *const argv[], const char *input, int output, int *code, char *error, size_t size)
+{
+        exec_wait_t wait = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER,
+                .error = error,
+                .size = size,
+        };
+        int rc = 0;
+
+        if (exec_start(argv, input, output, _finished, &wait) < 0) {
+                rc = -1;
+        } else {
+                pthread_mutex_lock(&wait.lock);
+                while (!wait.done)
+                        pthread_cond_wait(&wait.cond, &wait.lock);
+                pthread_mutex_unlock(&wait.lock);
+                *code = wait.code;
+        }
+
+        pthread_cond_destroy(&wait.cond);
+        pthread_mutex_destroy(&wait.lock);
+        return rc;
+}
+
+void exec_idle()
+{
+        pthread_mutex_lock(&exec.lock);
+        while (exec.children > 0)
+                pthread_cond_wait(&exec.idle, &exec.lock);
+        pthread_mutex_unlock(&exec.lock);
+}
+
+int exec_running()
+{
+        return __atomic_load_n(&exec.children, __ATOMIC_RELAXED);
+}
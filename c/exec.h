@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+
+
+// Asynchronous execution of the commands: the children are started by the
+// callers, their pidfd and pipes are watched by one reaper thread (epoll)
+// which feeds their stdin, collects their stderr, reaps them and calls the
+// completion back. The callers never block on a child, so a few threads can
+// keep many commands running.
+#define EXEC_OUTPUT_SIZE 1024
+#define EXEC_EVENTS 64
+
+// Runs on the reaper thread: code is the exit code of the command (127 if it
+// could not be executed), error is its stderr without the trailing newlines
+typedef void (*exec_done_t)(void *arg, int code, const char *error);
+
+
+int exec_setup();
+// Wait for the running commands, then stop the reaper
+void exec_teardown();
+
+// Start the command with the input (copied, NULL: inherited) on its stdin
+// and its stdout on the output fd (-1: inherited). Returns -1 if it could
+// not be started, otherwise done() is called exactly once, possibly before
+// exec_start() returns.
+int exec_start(char *const argv[], const char *input, int output, exec_done_t done, void *arg);
+// Start the command and wait for its completion
+int exec_run(char *const argv[], const char *input, int output, int *code, char *error, size_t size);
+
+// Wait until no command is running
+void exec_idle();
+int exec_running();
@@ -0,0 +1,446 @@
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "logging.h"
+#include "hash.h"
+#include "wheel.h"
+#include "ruleset.h"
+#include "runner.h"
+#include "expiry.h"
+
+
+#define EXPIRY_TICK 1000                // Milliseconds
+#define EXPIRY_BUCKETS 1024             // Initial size of the index
+
+typedef struct expiry_entry {
+        wheel_timer_t timer;
+        uint32_t ip;
+        uint32_t count;                 // Temporary rules of the address
+        time_t deadline;                // Wall clock time for the state file
+        struct expiry_entry *next;      // Chain of the index
+} expiry_entry_t;
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t wakeup;          // Stops the thread without waiting for the tick
+        pthread_t thread;
+        bool running;
+        struct timespec start;
+        wheel_t *wheel;
+        const char *path;               // NULL: the expiries are not saved
+        bool dirty;
+
+        // Index of the entries by address
+        expiry_entry_t **buckets;
+        size_t size;
+        size_t entries;
+
+        unsigned long expired;
+} expiry = {.lock = PTHREAD_MUTEX_INITIALIZER, .wakeup = PTHREAD_COND_INITIALIZER};
+
+
+static unsigned long _elapsed()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (now.tv_sec - expiry.start.tv_sec) * 1000 + (now.tv_nsec - expiry.start.tv_nsec) / 1000000;
+}
+
+static inline size_t _bucket(uint32_t ip, size_t size)
+{
+        return hash32(ip) & (size - 1);
+}
+
+static expiry_entry_t** _link(uint32_t ip)
+{
+        expiry_entry_t **link = &expiry.buckets[_bucket(ip, expiry.size)];
+
+        while (*link != NULL && (*link)->ip != ip)
+                link = &(*link)->next;
+        return link;
+}
+
+static void _grow()
+{
+        expiry_entry_t **buckets, *entry;
+        size_t size = expiry.size * 2, bucket;
+
+        if ((buckets = (expiry_entry_t**) calloc (size, sizeof(*buckets))) == NULL)
+                return;         // The chains just get longer
+
+        for (size_t i=0; i<expiry.size; ++i) {
+                while ((entry = expiry.buckets[i]) != NULL) {
+                        expiry.buckets[i] = entry->next;
+                        bucket = _bucket(entry->ip, size);
+                        entry->next = buckets[bucket];
+                        buckets[bucket] = entry;
+                }
+        }
+        free(expiry.buckets);
+        expiry.buckets = buckets;
+        expiry.size = size;
+}
+
+// The wheel time runs ahead of _elapsed() by up to a tick after an advance,
+// the delay is counted from the wheel time. The deadlines beyond the range
+// of the wheel are armed again when their timer fires.
+static void _arm(expiry_entry_t *entry, time_t now)
+{
+        long seconds = entry->deadline - now < EXPIRY_MAX_TTL ? (long) (entry->deadline - now) : EXPIRY_MAX_TTL;
+        long delay = seconds * 1000 + (long) _elapsed() - (long) (expiry.wheel->now * EXPIRY_TICK);
+
+        wheel_add(expiry.wheel, &entry->timer, delay > 0 ? (unsigned long) delay : 0);
+}
+
+// The lock has to be held by the caller
+static int _grant(uint32_t ip, uint32_t count, time_t deadline)
+{
+        expiry_entry_t **link = _link(ip), *entry = *link;
+
+        if (entry == NULL) {
+                if ((entry = (expiry_entry_t*) calloc (1, sizeof(*entry))) == NULL) {
+                        log_error("Failed to calloc() expiry");
+                        return -1;
+                }
+                wheel_init_timer(&entry->timer, entry);
+                entry->ip = ip;
+                *link = entry;
+                if (++expiry.entries > expiry.size)
+                        _grow();
+        }
+        entry->count += count;
+
+        if (deadline > entry->deadline) {
+                entry->deadline = deadline;
+                _arm(entry, time(NULL));
+        }
+        expiry.dirty = true;
+        return 0;
+}
+
+static void _delete(expiry_entry_t **link)
+{
+        expiry_entry_t *entry = *link;
+
+        *link = entry->next;
+        wheel_del(expiry.wheel, &entry->timer);
+        expiry.entries--;
+        free(entry);
+        expiry.dirty = true;
+}
+
+// The missing directory of the file is created for the server only
+static int _directory(const char *path)
+{
+        char directory[4096], *slash;
+
+        snprintf(directory, sizeof(directory), "%s", path);
+        if ((slash = strrchr(directory, '/')) == NULL || slash == directory)
+                return 0;
+        *slash = '\0';
+        if (mkdir(directory, 0700) == 0) {
+                log_info("Created %s", directory);
+                return 0;
+        }
+        if (errno == EEXIST)
+                return 0;
+        log_warning("Failed to create %s: %s", directory, strerror(errno));
+        return -1;
+}
+
+// Written into a new file of the server in the same directory, then renamed
+// over the previous one, so the path of an existing file is never opened for
+// writing (eg. a link put there by somebody else)
+static int _save(const char *path)
+{
+        char tmp[4096], ip[16];
+        expiry_entry_t *entry;
+        FILE *out;
+        int fd;
+
+        if (path == NULL)
+                return 0;
+
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+        if ((fd = mkstemp(tmp)) < 0) {
+                log_error("Failed to create %s: %s", tmp, strerror(errno));
+                return -1;
+        }
+        if ((out = fdopen(fd, "w")) == NULL) {
+                log_error("Failed to open %s: %s", tmp, strerror(errno));
+                close(fd);
+                unlink(tmp);
+                return -1;
+        }
+
+        fprintf(out, "# ip rules deadline\n");
+        for (size_t i=0; i<expiry.size; ++i) {
+                for (entry = expiry.buckets[i]; entry != NULL; entry = entry->next) {
+                        ruleset_format(entry->ip, ip, sizeof(ip));
+                        fprintf(out, "%s %u %ld\n", ip, entry->count, (long) entry->deadline);
+                }
+        }
+
+        if (fclose(out) != 0 || rename(tmp, path) < 0) {
+                log_error("Failed to write %s: %s", path, strerror(errno));
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+static int _load(const char *path)
+{
+        char line[128], ip[16];
+        unsigned int count;
+        uint32_t addr;
+        long deadline;
+        int loaded = 0;
+        struct stat st;
+        FILE *in;
+        int fd;
+
+        if (path == NULL)
+                return 0;
+
+        if ((fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+                if (errno == ENOENT)
+                        return 0;
+                log_error("Failed to open %s: %s", path, strerror(errno));
+                return -1;
+        }
+
+        // The entries remove rules, they are trusted only from a file which nobody else could have written
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+                log_error("Refusing to load %s: not a regular file of uid %d writable only by its owner", path, (int) geteuid());
+                close(fd);
+                return -1;
+        }
+        if ((in = fdopen(fd, "r")) == NULL) {
+                log_error("Failed to open %s: %s", path, strerror(errno));
+                close(fd);
+                return -1;
+        }
+
+        while (fgets(line, sizeof(line), in) != NULL) {
+                if (line[0] == '#')
+                        continue;
+                if (sscanf(line, "%15s %u %ld", ip, &count, &deadline) != 3 || count == 0 ||
+                                ruleset_parse(ip, &addr) < 0) {
+                        log_warning("Invalid line in %s: '%s'", path, line);
+                        continue;
+                }
+                // The missed ones expire on the first tick
+                if (_grant(addr, count, deadline) == 0)
+                        loaded++;
+        }
+        fclose(in);
+
+        log_info("Loaded %d expiry(s) from %s", loaded, path);
+        return 0;
+}
+
+// Collect the remove rules of the expired addresses, the lock has to be held by the caller
+static size_t _collect(backend_rule_t **rules, size_t *size)
+{
+        wheel_timer_t *timer, *next;
+        expiry_entry_t *entry;
+        backend_rule_t *grown;
+        size_t count = 0;
+        time_t now = time(NULL);
+
+        for (timer = wheel_advance(expiry.wheel, _elapsed()); timer != NULL; timer = next) {
+                next = timer->next;
+                entry = (expiry_entry_t*) timer->arg;
+
+                // Fired at the end of the wheel range or within a second of the deadline
+                if (entry->deadline > now) {
+                        _arm(entry, now);
+                        continue;
+                }
+
+                if (count + entry->count > *size) {
+                        *size = (count + entry->count) * 2;
+                        if ((grown = (backend_rule_t*) realloc (*rules, *size * sizeof(**rules))) == NULL) {
+                                // Try again on the next tick
+                                log_error("Failed to realloc() expired rules");
+                                wheel_add(expiry.wheel, &entry->timer, EXPIRY_TICK);
+                                continue;
+                        }
+                        *rules = grown;
+                }
+
+                for (uint32_t i=0; i<entry->count; ++i) {
+                        memset(&(*rules)[count], 0, sizeof(**rules));
+                        (*rules)[count].op = BACKEND_REMOVE;
+                        ruleset_format(entry->ip, (*rules)[count].ip, sizeof((*rules)[count].ip));
+                        count++;
+                }
+
+                _delete(_link(entry->ip));
+        }
+        return count;
+}
+
+static void* _expire(void *arg)
+{
+        struct timespec next = expiry.start;
+        backend_rule_t *rules = NULL;
+        size_t size = 0, count;
+        int removed;
+
+        log_debug("Expiry thread was started");
+        pthread_mutex_lock(&expiry.lock);
+        while (expiry.running) {
+                // Ticks on the second boundaries of the start, the drift does not add up
+                next.tv_sec += EXPIRY_TICK / 1000;
+                while (expiry.running && pthread_cond_timedwait(&expiry.wakeup, &expiry.lock, &next) != ETIMEDOUT);
+                if (!expiry.running)
+                        break;
+
+                // The backend is called without the lock, so the grants do not wait for it
+                if ((count = _collect(&rules, &size)) > 0) {
+                        pthread_mutex_unlock(&expiry.lock);
+                        removed = runner_expire(rules, count);
+                        __atomic_add_fetch(&expiry.expired, count, __ATOMIC_RELAXED);
+                        log_info("Expired %zu rule(s), %d removed", count, removed);
+                        pthread_mutex_lock(&expiry.lock);
+                }
+
+                if (expiry.dirty && _save(expiry.path) == 0)
+                        expiry.dirty = false;
+        }
+        pthread_mutex_unlock(&expiry.lock);
+
+        free(rules);
+        log_debug("Expiry thread was stopped");
+        return NULL;
+}
+
+int expiry_setup(const char *path)
+{
+        pthread_condattr_t attr;
+
+        // The ticks are absolute times of the monotonic clock
+        pthread_cond_destroy(&expiry.wakeup);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&expiry.wakeup, &attr);
+        pthread_condattr_destroy(&attr);
+
+        // Without a directory for the file the expiries are kept in memory only
+        expiry.path = path != NULL && path[0] != '\0' ? path : NULL;
+        if (expiry.path != NULL && _directory(expiry.path) < 0) {
+                log_warning("The expiries are not saved");
+                expiry.path = NULL;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &expiry.start);
+
+        expiry.wheel = wheel_create(EXPIRY_TICK);
+        expiry.buckets = (expiry_entry_t**) calloc (EXPIRY_BUCKETS, sizeof(*expiry.buckets));
+        if (expiry.wheel == NULL || expiry.buckets == NULL) {
+                log_error("Failed to allocate expiries");
+                expiry_teardown();
+                return -1;
+        }
+        expiry.size = EXPIRY_BUCKETS;
+
+        if (_load(expiry.path) < 0) {
+                expiry_teardown();
+                return -1;
+        }
+        expiry.dirty = false;
+
+        expiry.running = true;
+        if (pthread_create(&expiry.thread, NULL, _expire, NULL) != 0) {
+                log_error("Failed to create expiry thread");
+                expiry.running = false;
+                expiry_teardown();
+                return -1;
+        }
+        return 0;
+}
+
+void expiry_teardown()
+{
+        expiry_entry_t *entry;
+
+        pthread_mutex_lock(&expiry.lock);
+        if (expiry.running) {
+                expiry.running = false;
+                pthread_cond_signal(&expiry.wakeup);
+                pthread_mutex_unlock(&expiry.lock);
+                pthread_join(expiry.thread, NULL);
+        } else {
+                pthread_mutex_unlock(&expiry.lock);
+        }
+
+        // The pending expiries are kept for the next run
+        if (expiry.dirty)
+                _save(expiry.path);
+
+        if (expiry.buckets != NULL) {
+                for (size_t i=0; i<expiry.size; ++i) {
+                        while ((entry = expiry.buckets[i]) != NULL) {
+                                expiry.buckets[i] = entry->next;
+                                free(entry);
+                        }
+                }
+                free(expiry.buckets);
+                expiry.buckets = NULL;
+        }
+        if (expiry.wheel != NULL) {
+                wheel_destroy(expiry.wheel);
+                expiry.wheel = NULL;
+        }
+        expiry.size = 0;
+        expiry.entries = 0;
+}
+
+int expiry_grant(uint32_t ip, unsigned int ttl)
+{
+        int rc = -1;
+
+        pthread_mutex_lock(&expiry.lock);
+        if (expiry.wheel != NULL)
+                rc = _grant(ip, 1, time(NULL) + ttl);
+        pthread_mutex_unlock(&expiry.lock);
+        return rc;
+}
+
+void expiry_revoke(uint32_t ip)
+{
+        expiry_entry_t **link;
+
+        pthread_mutex_lock(&expiry.lock);
+        if (expiry.wheel != NULL && *(link = _link(ip)) != NULL) {
+                if (--(*link)->count == 0)
+                        _delete(link);
+                expiry.dirty = true;
+        }
+        pthread_mutex_unlock(&expiry.lock);
+}
+
+unsigned long expiry_pending()
+{
+        unsigned long pending;
+
+        pthread_mutex_lock(&expiry.lock);
+        pending = expiry.entries;
+        pthread_mutex_unlock(&expiry.lock);
+        return pending;
+}
+
+unsigned long expiry_expired()
+{
+        return __atomic_load_n(&expiry.expired, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdint.h>
+
+#define EXPIRY_MAX_TTL 31536000         // One year, well within the range of the wheel
+
+// Temporary rules: every append with a TTL is removed when its address
+// expires. The expiries are kept in a timing wheel of one second ticks and
+// the expired rules are removed in one backend transaction per tick. The
+// pending expiries are saved into the state file and loaded on startup.
+int expiry_setup(const char *path);
+void expiry_teardown();
+
+// Granting an address again extends its expiry, at expiry every temporary
+// rule of the address is removed. A revoke takes back one of them.
+int expiry_grant(uint32_t ip, unsigned int ttl);
+void expiry_revoke(uint32_t ip);
+
+unsigned long expiry_pending();
+unsigned long expiry_expired();
@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "hash.h"
+#include "flight.h"
+
+
+static inline flight_stripe_t* _stripe(flight_t *flight, uint32_t key)
+{
+        return &flight->stripes[hash32(key) >> 28];
+}
+
+static inline flight_key_t** _link(flight_stripe_t *stripe, uint32_t key)
+{
+        flight_key_t **link = &stripe->buckets[hash32(key) % FLIGHT_BUCKETS];
+
+        while (*link != NULL && (*link)->key != key)
+                link = &(*link)->chain;
+        return link;
+}
+
+// The lock of the stripe has to be held by the caller
+static void _put(flight_call_t *call)
+{
+        if (--call->refs > 0)
+                return;
+        pthread_cond_destroy(&call->cond);
+        free(call);
+}
+
+
+flight_t* flight_create()
+{
+        flight_t *flight;
+
+        flight = (flight_t*) calloc (1, sizeof(*flight));
+        if (flight == NULL) {
+                log_error("Failed to calloc() in-flight table");
+                return NULL;
+        }
+
+        for (int i=0; i<FLIGHT_STRIPES; ++i)
+                pthread_mutex_init(&flight->stripes[i].lock, NULL);
+        return flight;
+}
+
+// Every call has to be finished before
+void flight_destroy(flight_t *flight)
+{
+        if (flight == NULL)
+                return;
+
+        for (int i=0; i<FLIGHT_STRIPES; ++i)
+                pthread_mutex_destroy(&flight->stripes[i].lock);
+        free(flight);
+}
+
+int flight_do(flight_t *flight, uint32_t key, uint64_t kind,
+                int (*call)(void *arg, struct response *response), void *arg, struct response *response)
+{
+        flight_stripe_t *stripe = _stripe(flight, key);
+        flight_key_t **link, *entry;
+        flight_call_t *current;
+        int rc;
+
+        pthread_mutex_lock(&stripe->lock);
+        link = _link(stripe, key);
+        if ((entry = *link) == NULL) {
+                if ((entry = (flight_key_t*) calloc (1, sizeof(*entry))) == NULL) {
+                        pthread_mutex_unlock(&stripe->lock);
+                        log_error("Failed to calloc() in-flight key");
+                        return call(arg, response);
+                }
+                entry->key = key;
+                *link = entry;
+        }
+
+        // Join the last call if it is the same, an earlier one would jump over the different ones after it
+        if ((current = entry->tail) != NULL && current->kind == kind) {
+                current->refs++;
+                __atomic_add_fetch(&flight->coalesced, 1, __ATOMIC_RELAXED);
+                while (!current->done)
+                        pthread_cond_wait(&current->cond, &stripe->lock);
+
+                rc = current->rc;
+                response->code = current->code;
+                memcpy(response->reason, current->reason, sizeof(response->reason));
+                _put(current);
+                pthread_mutex_unlock(&stripe->lock);
+                return rc;
+        }
+
+        if ((current = (flight_call_t*) calloc (1, sizeof(*current))) == NULL) {
+                if (entry->head == NULL) {
+                        *link = entry->chain;
+                        free(entry);
+                }
+                pthread_mutex_unlock(&stripe->lock);
+                log_error("Failed to calloc() in-flight call");
+                return -1;
+        }
+        current->kind = kind;
+        current->refs = 1;
+        pthread_cond_init(&current->cond, NULL);
+        if (entry->tail != NULL)
+                entry->tail->next = current;
+        else
+                entry->head = current;
+        entry->tail = current;
+
+        if (entry->head != current) {
+                __atomic_add_fetch(&flight->serialized, 1, __ATOMIC_RELAXED);
+                while (entry->head != current)
+                        pthread_cond_wait(&current->cond, &stripe->lock);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+
+        rc = call(arg, response);
+        flight_end(flight, key, current, rc, response);
+        return rc;
+}
+
+flight_call_t* flight_begin(flight_t *flight, uint32_t key, uint64_t kind)
+{
+        flight_stripe_t *stripe = _stripe(flight, key);
+        flight_key_t **link, *entry;
+        flight_call_t *current;
+
+        pthread_mutex_lock(&stripe->lock);
+        link = _link(stripe, key);
+        if (*link != NULL) {
+                pthread_mutex_unlock(&stripe->lock);
+                return NULL;
+        }
+
+        entry = (flight_key_t*) calloc (1, sizeof(*entry));
+        current = (flight_call_t*) calloc (1, sizeof(*current));
+        if (entry == NULL || current == NULL) {
+                pthread_mutex_unlock(&stripe->lock);
+                log_error("Failed to calloc() in-flight call");
+                free(entry);
+                free(current);
+                return NULL;
+        }
+        current->kind = kind;
+        current->refs = 1;
+        pthread_cond_init(&current->cond, NULL);
+        entry->key = key;
+        entry->head = current;
+        entry->tail = current;
+        *link = entry;
+        pthread_mutex_unlock(&stripe->lock);
+        return current;
+}
+
+void flight_end(flight_t *flight, uint32_t key, flight_call_t *current, int rc, const struct response *response)
+{
+        flight_stripe_t *stripe = _stripe(flight, key);
+        flight_key_t **link, *entry;
+
+        pthread_mutex_lock(&stripe->lock);
+        link = _link(stripe, key);
+        entry = *link;
+
+        current->rc = rc;
+        current->code = response->code;
+        memcpy(current->reason, response->reason, sizeof(current->reason));
+        current->done = 1;
+        pthread_cond_broadcast(&current->cond);
+
+        // Let the next call of the key run, the key goes away with its last call
+        if ((entry->head = current->next) != NULL) {
+                pthread_cond_broadcast(&entry->head->cond);
+        } else {
+                entry->tail = NULL;
+                *link = entry->chain;
+                free(entry);
+        }
+        _put(current);
+        pthread_mutex_unlock(&stripe->lock);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "netpack.h"
+
+
+#define FLIGHT_STRIPES 16
+#define FLIGHT_BUCKETS 256              // Per stripe
+
+// One execution and the requests waiting for its result
+typedef struct flight_call {
+        uint64_t kind;
+        int refs;                       // The owner and the joined requests
+        int done;
+        int rc;
+        int code;
+        char reason[RESPONSE_REASON_SIZE];
+        pthread_cond_t cond;
+        struct flight_call *next;
+} flight_call_t;
+
+// The calls of one key in arrival order, only the first one is executing
+typedef struct flight_key {
+        uint32_t key;
+        flight_call_t *head;
+        flight_call_t *tail;
+        struct flight_key *chain;
+} flight_key_t;
+
+typedef struct flight_stripe {
+        pthread_mutex_t lock;
+        flight_key_t *buckets[FLIGHT_BUCKETS];
+} flight_stripe_t;
+
+typedef struct flight {
+        flight_stripe_t stripes[FLIGHT_STRIPES];
+        unsigned long coalesced;        // Requests which got the result of an identical one
+        unsigned long serialized;       // Requests which waited for a different one of the same key
+} flight_t;
+
+
+flight_t* flight_create();
+void flight_destroy(flight_t *flight);
+
+// Run call() for the key, or share the result (rc, code and reason) of the
+// identical kind of call which is the last one queued for the key. The
+// different kinds of calls of a key run one after the other in arrival order.
+int flight_do(flight_t *flight, uint32_t key, uint64_t kind,
+                int (*call)(void *arg, struct response *response), void *arg, struct response *response);
+
+// The asynchronous callers: begin the call only if nothing is in flight for
+// the key (NULL: use flight_do()), the other requests of the key wait for
+// flight_end() of the call, which may come from another thread
+flight_call_t* flight_begin(flight_t *flight, uint32_t key, uint64_t kind);
+void flight_end(flight_t *flight, uint32_t key, flight_call_t *call, int rc, const struct response *response);
@@ -0,0 +1,586 @@
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "logging.h"
+#include "netpack.h"
+#include "threadpool.h"
+#include "fwmgr.h"
+
+
+#define FWMGR_BUFFER_SIZE (RESPONSE_REASON_SIZE + 64)
+#define FWMGR_RETRY_DEFAULT 100         // Milliseconds, when the server did not tell
+#define FWMGR_RETRY_MAX 5000
+#define FWMGR_BULK_SIZE 65536
+
+struct fwmgr {
+        fwmgr_config_t config;
+        char host[64];
+        char path[108];
+
+        // Connection pool
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        int *idle;
+        int idles;
+        int open;
+
+        tp_t *tp;
+};
+
+struct fwmgr_future {
+        fwmgr_t *fw;
+        fwmgr_item_t item;
+        fwmgr_callback_t callback;
+        void *arg;
+
+        pthread_mutex_t lock;
+        pthread_cond_t ready;
+        int refs;               // The caller and the worker
+        bool done;
+        int rc;
+        fwmgr_result_t result;
+};
+
+
+static int _connect(fwmgr_t *fw)
+{
+        struct sockaddr_in inet;
+        struct sockaddr_un local;
+        struct timeval timeout;
+        int sock;
+
+        if ((sock = socket(fw->path[0] ? AF_UNIX : AF_INET, SOCK_STREAM, 0)) < 0) {
+                log_error("Failed to create socket: %s", strerror(errno));
+                return -1;
+        }
+
+        if (fw->config.timeout > 0) {
+                timeout.tv_sec = fw->config.timeout / 1000;
+                timeout.tv_usec = (fw->config.timeout % 1000) * 1000;
+                setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+
+        if (fw->path[0]) {
+                memset(&local, 0, sizeof(local));
+                local.sun_family = AF_UNIX;
+                snprintf(local.sun_path, sizeof(local.sun_path), "%s", fw->path);
+                if (connect(sock, (struct sockaddr*)&local, sizeof(local)) == 0)
+                        return sock;
+        } else {
+                memset(&inet, 0, sizeof(inet));
+                inet.sin_family = AF_INET;
+                inet.sin_port = htons(fw->config.port);
+                inet.sin_addr.s_addr = inet_addr(fw->host);
+                if (connect(sock, (struct sockaddr*)&inet, sizeof(inet)) == 0)
+                        return sock;
+        }
+
+        log_error("Failed to connect to the server: %s", strerror(errno));
+        close(sock);
+        return -1;
+}
+
+// Take an idle connection or open a new one while the pool is not full.
+// Reused tells whether the connection has already served a request.
+static int _acquire(fwmgr_t *fw, bool *reused)
+{
+        int sock;
+
+        pthread_mutex_lock(&fw->lock);
+        while (fw->idles == 0 && fw->open >= fw->config.connections)
+                pthread_cond_wait(&fw->ready, &fw->lock);
+
+        if (fw->idles > 0) {
+                sock = fw->idle[--fw->idles];
+                pthread_mutex_unlock(&fw->lock);
+                *reused = true;
+                return sock;
+        }
+        fw->open++;
+        pthread_mutex_unlock(&fw->lock);
+
+        *reused = false;
+        if ((sock = _connect(fw)) < 0) {
+                pthread_mutex_lock(&fw->lock);
+                fw->open--;
+                pthread_cond_signal(&fw->ready);
+                pthread_mutex_unlock(&fw->lock);
+        }
+        return sock;
+}
+
+static void _release(fwmgr_t *fw, int sock, bool reuse)
+{
+        pthread_mutex_lock(&fw->lock);
+        if (reuse) {
+                fw->idle[fw->idles++] = sock;
+        } else {
+                close(sock);
+                fw->open--;
+        }
+        pthread_cond_signal(&fw->ready);
+        pthread_mutex_unlock(&fw->lock);
+}
+
+// Stale tells whether the request surely did not run: the send failed or the
+// connection was closed without a response, not timed out
+static int _communicate(int sock, char *buffer, size_t size, bool *stale)
+{
+        ssize_t bytes;
+
+        *stale = true;
+        if (send(sock, buffer, strlen(buffer), MSG_NOSIGNAL) < 0)
+                return -1;
+
+        memset(buffer, 0, size);
+        if ((bytes = recv(sock, buffer, size-1, 0)) <= 0) {
+                errno = bytes == 0 ? ECONNRESET : errno;
+                *stale = errno == ECONNRESET;
+                return -1;
+        }
+        return 0;
+}
+
+static void _sleep(int ms)
+{
+        struct timespec delay = {ms / 1000, (ms % 1000) * 1000000L};
+
+        nanosleep(&delay, NULL);
+}
+
+static int _exchange(fwmgr_t *fw, const char *method, const char *ip, const char *rule, int ttl, fwmgr_result_t *result)
+{
+        char buffer[FWMGR_BUFFER_SIZE];
+        struct request request;
+        struct response response;
+        int retries = 0, resent = 0;
+        bool reused, stale;
+        int sock;
+
+        memset(&request, 0, sizeof(request));
+        snprintf(request.method, sizeof(request.method), "%s", method);
+        snprintf(request.ip, sizeof(request.ip), "%s", ip);
+        request.keepalive = fw->config.keepalive;
+        request.ttl = ttl;
+        if (rule != NULL)
+                snprintf(request.rule, sizeof(request.rule), "%s", rule);
+
+        while (1) {
+                if ((sock = _acquire(fw, &reused)) < 0)
+                        return -1;
+
+                compose_request(buffer, request, sizeof(buffer));
+                if (_communicate(sock, buffer, sizeof(buffer), &stale) < 0) {
+                        _release(fw, sock, false);
+                        // The server may have closed an idle connection in the meantime,
+                        // a request which may have run is not sent again (append is not idempotent)
+                        if (reused && stale && resent++ <= fw->config.connections)
+                                continue;
+                        log_error("Failed to communicate with the server: %s", strerror(errno));
+                        return -1;
+                }
+
+                memset(&response, 0, sizeof(response));
+                if (parse_response(buffer, &response) < 0) {
+                        _release(fw, sock, false);
+                        log_error("Failed to parse response: '%s'", buffer);
+                        return -1;
+                }
+                _release(fw, sock, fw->config.keepalive && response.keepalive);
+
+                if (response.code == RESPONSE_BUSY && retries++ < fw->config.retries) {
+                        log_debug("Server is busy, retry after %d ms", response.retry);
+                        _sleep(response.retry > 0 ? (response.retry < FWMGR_RETRY_MAX ? response.retry : FWMGR_RETRY_MAX)
+                                        : FWMGR_RETRY_DEFAULT);
+                        continue;
+                }
+
+                result->code = response.code;
+                result->retry = response.retry;
+                snprintf(result->reason, sizeof(result->reason), "%s", response.reason);
+                return 0;
+        }
+}
+
+static void _put(fwmgr_future_t *future)
+{
+        if (__atomic_sub_fetch(&future->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+
+        pthread_cond_destroy(&future->ready);
+        pthread_mutex_destroy(&future->lock);
+        free(future);
+}
+
+static void _run(void *arg)
+{
+        fwmgr_future_t *future = (fwmgr_future_t*) arg;
+        fwmgr_result_t result;
+        int rc;
+
+        memset(&result, 0, sizeof(result));
+        rc = _exchange(future->fw, future->item.method, future->item.ip, NULL, 0, &result);
+        if (rc < 0) {
+                result.code = -1;
+                snprintf(result.reason, sizeof(result.reason), "Failed to communicate with the server");
+        }
+
+        if (future->callback != NULL)
+                future->callback(future->arg, &result);
+
+        pthread_mutex_lock(&future->lock);
+        future->rc = rc;
+        future->result = result;
+        future->done = true;
+        pthread_cond_broadcast(&future->ready);
+        pthread_mutex_unlock(&future->lock);
+        _put(future);
+}
+
+
+void fwmgr_defaults(fwmgr_config_t *config)
+{
+        memset(config, 0, sizeof(*config));
+        config->host = "127.0.0.1";
+        config->port = 5555;
+        config->connections = 4;
+        config->workers = 4;
+        config->queue = 64;
+        config->retries = 3;
+        config->keepalive = 1;
+}
+
+fwmgr_t* fwmgr_create(const fwmgr_config_t *config)
+{
+        fwmgr_t *fw;
+
+        if (config->connections < 1 || config->workers < 0 || (config->workers > 0 && config->queue < 1)) {
+                log_error("Invalid client configuration");
+                return NULL;
+        }
+
+        fw = (fwmgr_t*) calloc (1, sizeof(*fw));
+        if (fw == NULL) {
+                log_error("Failed to calloc() client");
+                return NULL;
+        }
+
+        fw->config = *config;
+        snprintf(fw->host, sizeof(fw->host), "%s", config->host != NULL ? config->host : "127.0.0.1");
+        if (config->path != NULL) {
+                if (strlen(config->path) >= sizeof(fw->path)) {
+                        log_error("Too long socket path: '%s'", config->path);
+                        free(fw);
+                        return NULL;
+                }
+                snprintf(fw->path, sizeof(fw->path), "%s", config->path);
+        }
+
+        fw->idle = (int*) calloc (config->connections, sizeof(*fw->idle));
+        if (fw->idle == NULL) {
+                log_error("Failed to calloc() connection pool");
+                free(fw);
+                return NULL;
+        }
+        pthread_mutex_init(&fw->lock, NULL);
+        pthread_cond_init(&fw->ready, NULL);
+
+        if (config->workers > 0) {
+                fw->tp = tp_create(config->workers, config->queue);
+                if (fw->tp == NULL || tp_start(fw->tp) < 0) {
+                        log_error("Failed to start client threadpool");
+                        if (fw->tp != NULL)
+                                tp_destroy(fw->tp);
+                        pthread_cond_destroy(&fw->ready);
+                        pthread_mutex_destroy(&fw->lock);
+                        free(fw->idle);
+                        free(fw);
+                        return NULL;
+                }
+        }
+        return fw;
+}
+
+void fwmgr_destroy(fwmgr_t *fw)
+{
+        if (fw->tp != NULL) {
+                tp_stop(fw->tp);
+                tp_destroy(fw->tp);
+        }
+
+        for (int i=0; i<fw->idles; ++i)
+                close(fw->idle[i]);
+        pthread_cond_destroy(&fw->ready);
+        pthread_mutex_destroy(&fw->lock);
+        free(fw->idle);
+        free(fw);
+}
+
+int fwmgr_request(fwmgr_t *fw, const char *method, const char *ip, fwmgr_result_t *result)
+{
+        memset(result, 0, sizeof(*result));
+        return _exchange(fw, method, ip, NULL, 0, result);
+}
+
+int fwmgr_append(fwmgr_t *fw, const char *ip, int ttl, fwmgr_result_t *result)
+{
+        memset(result, 0, sizeof(*result));
+        return _exchange(fw, "append", ip, NULL, ttl, result);
+}
+
+int fwmgr_apply(fwmgr_t *fw, const char *method, const char *ip, const char *rule, int ttl, fwmgr_result_t *result)
+{
+        memset(result, 0, sizeof(*result));
+        return _exchange(fw, method, ip, rule, ttl, result);
+}
+
+fwmgr_future_t* fwmgr_submit(fwmgr_t *fw, const char *method, const char *ip,
+                fwmgr_callback_t callback, void *arg)
+{
+        fwmgr_future_t *future;
+        tp_job_t *job;
+
+        if (fw->tp == NULL) {
+                log_error("Asynchronous requests need workers");
+                return NULL;
+        }
+
+        future = (fwmgr_future_t*) calloc (1, sizeof(*future));
+        if (future == NULL) {
+                log_error("Failed to calloc() future");
+                return NULL;
+        }
+        future->fw = fw;
+        snprintf(future->item.method, sizeof(future->item.method), "%s", method);
+        snprintf(future->item.ip, sizeof(future->item.ip), "%s", ip);
+        future->callback = callback;
+        future->arg = arg;
+        future->refs = 2;
+        pthread_mutex_init(&future->lock, NULL);
+        pthread_cond_init(&future->ready, NULL);
+
+        // Blocks while every job is in flight
+        if ((job = tp_wait(fw->tp)) == NULL) {
+                log_error("Client threadpool is closed");
+                goto failed;
+        }
+        job->function = _run;
+        job->arg = future;
+        if (tp_put(fw->tp, job) < 0) {
+                log_error("Client job queue overflow");
+                tp_unget(fw->tp, job);
+                goto failed;
+        }
+        return future;
+
+failed:
+        pthread_cond_destroy(&future->ready);
+        pthread_mutex_destroy(&future->lock);
+        free(future);
+        return NULL;
+}
+
+int fwmgr_wait(fwmgr_future_t *future, fwmgr_result_t *result)
+{
+        int rc;
+
+        pthread_mutex_lock(&future->lock);
+        while (!future->done)
+                pthread_cond_wait(&future->ready, &future->lock);
+        rc = future->rc;
+        if (result != NULL)
+                *result = future->result;
+        pthread_mutex_unlock(&future->lock);
+
+        _put(future);
+        return rc;
+}
+
+void fwmgr_release(fwmgr_future_t *future)
+{
+        _put(future);
+}
+
+int fwmgr_batch(fwmgr_t *fw, const fwmgr_item_t *items, fwmgr_result_t *results, int count)
+{
+        fwmgr_future_t **futures;
+        int failed = 0;
+
+        // Without workers the items are sent one by one
+        if (fw->tp == NULL) {
+                for (int i=0; i<count; ++i) {
+                        if (fwmgr_request(fw, items[i].method, items[i].ip, &results[i]) < 0) {
+                                results[i].code = -1;
+                                failed++;
+                        }
+                }
+                return failed;
+        }
+
+        futures = (fwmgr_future_t**) calloc (count, sizeof(*futures));
+        if (futures == NULL) {
+                log_error("Failed to calloc() futures");
+                return count;
+        }
+
+        for (int i=0; i<count; ++i)
+                futures[i] = fwmgr_submit(fw, items[i].method, items[i].ip, NULL, NULL);
+
+        for (int i=0; i<count; ++i) {
+                memset(&results[i], 0, sizeof(results[i]));
+                if (futures[i] == NULL || fwmgr_wait(futures[i], &results[i]) < 0) {
+                        results[i].code = -1;
+                        failed++;
+                }
+        }
+
+        free(futures);
+        return failed;
+}
+
+// Handle the complete response lines of the bulk mode, the one without line
+// and progress is the summary
+static void _bulk_responses(char *buffer, size_t *used, fwmgr_callback_t callback, void *arg, fwmgr_result_t *result)
+{
+        struct response response;
+        char *start = buffer, *end;
+        fwmgr_result_t current;
+
+        while ((end = memchr(start, '\n', *used - (start - buffer))) != NULL) {
+                *end = '\0';
+                memset(&response, 0, sizeof(response));
+                if (*start != '\0' && parse_response(start, &response) == 0) {
+                        memset(&current, 0, sizeof(current));
+                        current.code = response.code;
+                        current.retry = response.retry;
+                        current.line = response.line;
+                        current.progress = response.progress;
+                        snprintf(current.reason, sizeof(current.reason), "%s", response.reason);
+
+                        if (current.line == 0 && current.progress == 0)
+                                *result = current;
+                        else if (callback != NULL)
+                                callback(arg, &current);
+                }
+                start = end + 1;
+        }
+        *used -= start - buffer;
+        memmove(buffer, start, *used);
+}
+
+// Send the request and the lines of the input after it, then the summary is received
+static int _stream(fwmgr_t *fw, const char *header, int input, fwmgr_callback_t callback, void *arg,
+                fwmgr_result_t *result)
+{
+        char *out, *in;
+        size_t sent = 0, pending = 0, received = 0;
+        bool eof = false;
+        struct pollfd fds[2];
+        ssize_t bytes;
+        int sock, rc = -1;
+
+        memset(result, 0, sizeof(*result));
+        result->code = -1;
+
+        out = (char*) malloc (FWMGR_BULK_SIZE);
+        in = (char*) malloc (FWMGR_BULK_SIZE);
+        if (out == NULL || in == NULL) {
+                log_error("Failed to malloc() bulk buffers");
+                goto cleanup;
+        }
+
+        // The connection can not be reused after the stream
+        if ((sock = _connect(fw)) < 0)
+                goto cleanup;
+        pending = snprintf(out, FWMGR_BULK_SIZE, "%s\n", header);
+
+        // Send the input and receive the responses at the same time, otherwise
+        // both sides could block on a full socket buffer
+        while (1) {
+                fds[0].fd = sock;
+                fds[0].events = POLLIN | (pending > sent ? POLLOUT : 0);
+                fds[1].fd = !eof && pending == sent ? input : -1;
+                fds[1].events = POLLIN;
+
+                if (poll(fds, 2, -1) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        log_error("Failed to poll bulk connection: %s", strerror(errno));
+                        break;
+                }
+
+                if (fds[1].revents) {
+                        bytes = read(input, out, FWMGR_BULK_SIZE);
+                        if (bytes < 0 && errno != EINTR) {
+                                log_error("Failed to read bulk input: %s", strerror(errno));
+                                break;
+                        }
+                        if (bytes == 0) {
+                                eof = true;
+                                shutdown(sock, SHUT_WR);
+                        }
+                        sent = 0;
+                        pending = bytes > 0 ? bytes : 0;
+                }
+
+                if (fds[0].revents & POLLOUT) {
+                        if ((bytes = send(sock, out + sent, pending - sent, MSG_NOSIGNAL)) < 0) {
+                                log_error("Failed to send bulk input: %s", strerror(errno));
+                                break;
+                        }
+                        sent += bytes;
+                }
+
+                if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                        bytes = recv(sock, in + received, FWMGR_BULK_SIZE - 1 - received, 0);
+                        if (bytes < 0) {
+                                log_error("Failed to receive bulk response: %s", strerror(errno));
+                                break;
+                        }
+                        if (bytes == 0) {
+                                // The summary may not end with a newline
+                                in[received++] = '\n';
+                                _bulk_responses(in, &received, callback, arg, result);
+                                rc = result->code < 0 ? -1 : 0;
+                                if (rc < 0)
+                                        log_error("Bulk connection was closed without summary");
+                                break;
+                        }
+                        received += bytes;
+                        _bulk_responses(in, &received, callback, arg, result);
+                        if (received == FWMGR_BULK_SIZE - 1) {
+                                log_error("Too long bulk response");
+                                break;
+                        }
+                }
+        }
+        close(sock);
+
+cleanup:
+        free(out);
+        free(in);
+        return rc;
+}
+
+int fwmgr_bulk(fwmgr_t *fw, int input, fwmgr_callback_t callback, void *arg, fwmgr_result_t *result)
+{
+        return _stream(fw, "method=bulk", input, callback, arg, result);
+}
+
+int fwmgr_sync(fwmgr_t *fw, int input, fwmgr_callback_t callback, void *arg, fwmgr_result_t *result)
+{
+        return _stream(fw, "method=sync", input, callback, arg, result);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+// Client library of the firewall manager server:
+//      libfwmgr.a / libfwmgr.so
+//
+// Every function is thread-safe. The connections are kept in a pool and
+// reused while the server keeps them alive, the busy responses are
+// retried after the time the server asked for.
+
+#define FWMGR_API __attribute__((visibility("default")))
+
+#define FWMGR_METHOD_SIZE 32
+#define FWMGR_IP_SIZE 40
+#define FWMGR_REASON_SIZE 1024
+
+// Response codes besides the exit code of the executed command
+#define FWMGR_OK 0
+#define FWMGR_ERROR 1
+#define FWMGR_BUSY 75
+
+typedef struct fwmgr fwmgr_t;
+typedef struct fwmgr_future fwmgr_future_t;
+
+typedef struct fwmgr_config {
+        const char *host;
+        unsigned short port;
+        const char *path;       // Unix domain socket of the server instead of host:port
+        int connections;        // Size of the connection pool
+        int workers;            // Threads of the asynchronous requests (0: synchronous only)
+        int queue;              // Asynchronous requests in flight before fwmgr_submit() blocks
+        int retries;            // Retries of the busy responses
+        int timeout;            // Send / receive timeout in milliseconds (0: none)
+        int keepalive;          // Reuse the connections
+} fwmgr_config_t;
+
+typedef struct fwmgr_item {
+        char method[FWMGR_METHOD_SIZE];
+        char ip[FWMGR_IP_SIZE];
+} fwmgr_item_t;
+
+typedef struct fwmgr_result {
+        int code;
+        int retry;              // Milliseconds the server asked to wait (busy responses)
+        unsigned long line;     // Bulk mode: the failed line of the input
+        unsigned long progress; // Bulk mode: the lines processed so far
+        char reason[FWMGR_REASON_SIZE];
+} fwmgr_result_t;
+
+typedef void (*fwmgr_callback_t)(void *arg, const fwmgr_result_t *result);
+
+
+// Default configuration: 127.0.0.1:5555, 4 connections, 4 workers, 3 retries
+FWMGR_API void fwmgr_defaults(fwmgr_config_t *config);
+
+FWMGR_API fwmgr_t* fwmgr_create(const fwmgr_config_t *config);
+// Every future has to be finished before
+FWMGR_API void fwmgr_destroy(fwmgr_t *fw);
+
+// Returns 0 with the result of the server or -1 on connection / protocol errors
+FWMGR_API int fwmgr_request(fwmgr_t *fw, const char *method, const char *ip, fwmgr_result_t *result);
+// Append a temporary rule, the server removes it after ttl seconds (0: never)
+FWMGR_API int fwmgr_append(fwmgr_t *fw, const char *ip, int ttl, fwmgr_result_t *result);
+// The same with a rule template of the server (NULL or "": the default rule),
+// only the default rule can have a ttl
+FWMGR_API int fwmgr_apply(fwmgr_t *fw, const char *method, const char *ip, const char *rule, int ttl, fwmgr_result_t *result);
+
+// The callback (optional) runs on a worker thread when the request is done.
+// The future has to be passed to fwmgr_wait() or fwmgr_release() once.
+FWMGR_API fwmgr_future_t* fwmgr_submit(fwmgr_t *fw, const char *method, const char *ip,
+                fwmgr_callback_t callback, void *arg);
+FWMGR_API int fwmgr_wait(fwmgr_future_t *future, fwmgr_result_t *result);
+FWMGR_API void fwmgr_release(fwmgr_future_t *future);
+
+// Send the items through the pool in parallel, returns the number of the
+// items which could not be sent (their results have code -1)
+FWMGR_API int fwmgr_batch(fwmgr_t *fw, const fwmgr_item_t *items, fwmgr_result_t *results, int count);
+
+// Stream the "<method> <ip> [<ttl>] [<rule>]" lines of the input over one connection, the server
+// applies them in large transactions. The callback (optional) gets the failed
+// lines and the progress while the input is sent. Returns 0 with the summary in
+// the result or -1 on connection / protocol errors.
+FWMGR_API int fwmgr_bulk(fwmgr_t *fw, int input, fwmgr_callback_t callback, void *arg, fwmgr_result_t *result);
+
+// Make the rules of the server exactly the "<ip>" lines of the input, only the
+// difference is applied. The callback (optional) gets the invalid lines, the
+// summary tells the number of the added, removed and unchanged rules.
+FWMGR_API int fwmgr_sync(fwmgr_t *fw, int input, fwmgr_callback_t callback, void *arg, fwmgr_result_t *result);
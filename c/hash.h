@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+
+// Finalizer of MurmurHash3: every bit of the key changes about half of the bits
+// of the hash, so both its high and its low bits can pick a slot, even for
+// addresses which differ only in their first or their last octet
+static inline uint32_t hash32(uint32_t key)
+{
+        key ^= key >> 16;
+        key *= 0x85ebca6bu;
+        key ^= key >> 13;
+        key *= 0xc2b2ae35u;
+        key ^= key >> 16;
+        return key;
+}
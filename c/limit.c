@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "logging.h"
+#include "limit.h"
+
+
+limit_t* limit_create(int initial, int min, int max)
+{
+        limit_t *limit;
+
+        if (min < 1 || max < min || initial < min || initial > max) {
+                log_error("Invalid concurrency limit: initial=%d min=%d max=%d", initial, min, max);
+                return NULL;
+        }
+
+        limit = (limit_t*) calloc (1, sizeof(*limit));
+        if (limit == NULL) {
+                log_error("Failed to calloc() concurrency limit");
+                return NULL;
+        }
+
+        pthread_mutex_init(&limit->lock, NULL);
+        pthread_cond_init(&limit->cond, NULL);
+        limit->min = min;
+        limit->max = max;
+        limit->limit = initial;
+        return limit;
+}
+
+void limit_destroy(limit_t *limit)
+{
+        if (limit == NULL)
+                return;
+
+        pthread_cond_destroy(&limit->cond);
+        pthread_mutex_destroy(&limit->lock);
+        free(limit);
+}
+
+// The lock has to be held by the caller
+static void _enqueue(limit_t *limit, limit_waiter_t *waiter)
+{
+        waiter->next = NULL;
+        if (limit->tail != NULL)
+                limit->tail->next = waiter;
+        else
+                limit->head = waiter;
+        limit->tail = waiter;
+        limit->waiting++;
+}
+
+// A free slot is taken only if nobody is queued for it, so the waiters of
+// both kinds get the slots in arrival order
+void limit_acquire(limit_t *limit)
+{
+        limit_waiter_t waiter = {.start = NULL, .arg = NULL};
+
+        pthread_mutex_lock(&limit->lock);
+        if (limit->head == NULL && limit->inflight < (int) limit->limit) {
+                limit->inflight++;
+                pthread_mutex_unlock(&limit->lock);
+                return;
+        }
+
+        // Without start() the release marks the waiter with the slot taken
+        _enqueue(limit, &waiter);
+        while (waiter.arg == NULL)
+                pthread_cond_wait(&limit->cond, &limit->lock);
+        pthread_mutex_unlock(&limit->lock);
+}
+
+int limit_submit(limit_t *limit, limit_waiter_t *waiter)
+{
+        pthread_mutex_lock(&limit->lock);
+        if (limit->head == NULL && limit->inflight < (int) limit->limit) {
+                limit->inflight++;
+                pthread_mutex_unlock(&limit->lock);
+                return 1;
+        }
+
+        _enqueue(limit, waiter);
+        pthread_mutex_unlock(&limit->lock);
+        return 0;
+}
+
+void limit_release(limit_t *limit, uint64_t ns)
+{
+        limit_waiter_t *ready = NULL, **last = &ready, *waiter;
+        double latency = (double) ns;
+        bool woken = false;
+        int before;
+
+        pthread_mutex_lock(&limit->lock);
+        before = (int) limit->limit;
+        limit->inflight--;
+        if (ns == 0)
+                goto done;
+
+        if (limit->baseline == 0 || latency < limit->baseline)
+                limit->baseline = latency;
+        else
+                limit->baseline += (latency - limit->baseline) * LIMIT_DRIFT;
+        limit->smoothed = limit->smoothed == 0 ? latency : limit->smoothed + (latency - limit->smoothed) * LIMIT_SMOOTHING;
+
+        if (latency > limit->baseline * LIMIT_TOLERANCE)
+                limit->congested = 1;
+
+        // Decide once per window of limit calls, so a single slow call does not collapse it
+        if (++limit->window >= (unsigned long) limit->limit) {
+                if (limit->congested) {
+                        limit->limit *= LIMIT_BACKOFF;
+                        if (limit->limit < limit->min)
+                                limit->limit = limit->min;
+                } else if (limit->waiting > 0 || limit->inflight + 1 >= (int) limit->limit) {
+                        // Only a limit which is really used is raised
+                        limit->limit += 1;
+                        if (limit->limit > limit->max)
+                                limit->limit = limit->max;
+                }
+                limit->window = 0;
+                limit->congested = 0;
+        }
+
+        if ((int) limit->limit > before) {
+                limit->increased++;
+                log_debug("Concurrency limit raised to %d", (int) limit->limit);
+        } else if ((int) limit->limit < before) {
+                limit->decreased++;
+                log_debug("Concurrency limit lowered to %d", (int) limit->limit);
+        }
+
+done:
+        // The queued waiters take the free slots first, they are started outside of the lock
+        while (limit->head != NULL && limit->inflight < (int) limit->limit) {
+                waiter = limit->head;
+                if ((limit->head = waiter->next) == NULL)
+                        limit->tail = NULL;
+                waiter->next = NULL;
+                limit->inflight++;
+                limit->waiting--;
+                if (waiter->start == NULL) {
+                        waiter->arg = waiter;
+                        woken = true;
+                        continue;
+                }
+                *last = waiter;
+                last = &waiter->next;
+        }
+        if (woken)
+                pthread_cond_broadcast(&limit->cond);
+        pthread_mutex_unlock(&limit->lock);
+
+        while ((waiter = ready) != NULL) {
+                ready = waiter->next;
+                waiter->start(waiter->arg);
+        }
+}
+
+void limit_stats(limit_t *limit, limit_stats_t *stats)
+{
+        pthread_mutex_lock(&limit->lock);
+        stats->limit = (int) limit->limit;
+        stats->inflight = limit->inflight;
+        stats->waiting = limit->waiting;
+        stats->baseline = limit->baseline / 1e9;
+        stats->smoothed = limit->smoothed / 1e9;
+        stats->increased = limit->increased;
+        stats->decreased = limit->decreased;
+        pthread_mutex_unlock(&limit->lock);
+}
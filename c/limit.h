@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+
+// Adaptive concurrency limit (AIMD): the limit grows by one after a full
+// window of calls with latency close to the baseline, and shrinks by
+// LIMIT_BACKOFF once per window when the latency rises above LIMIT_TOLERANCE
+// times the baseline. The baseline is the lowest latency seen, drifting up
+// slowly so that a permanently slower backend does not pin the limit to the
+// minimum. The calls over the limit wait inside the server.
+#define LIMIT_TOLERANCE 2.0
+#define LIMIT_BACKOFF 0.8
+#define LIMIT_DRIFT 0.001
+#define LIMIT_SMOOTHING 0.1
+
+// A call waiting for a slot: start() gets it without blocking the thread of
+// the call, without start() the thread is blocked in limit_acquire()
+typedef struct limit_waiter {
+        void (*start)(void *arg);
+        void *arg;
+        struct limit_waiter *next;
+} limit_waiter_t;
+
+typedef struct limit {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        limit_waiter_t *head;           // The waiters in arrival order
+        limit_waiter_t *tail;
+        int min;
+        int max;
+        double limit;
+        int inflight;
+        int waiting;
+        unsigned long window;           // Calls since the limit changed
+        int congested;                  // A call of the window was over the tolerance
+        double baseline;                // Nanoseconds
+        double smoothed;                // Nanoseconds
+        unsigned long increased;
+        unsigned long decreased;
+} limit_t;
+
+typedef struct limit_stats {
+        int limit;
+        int inflight;
+        int waiting;
+        double baseline;                // Seconds
+        double smoothed;                // Seconds
+        unsigned long increased;
+        unsigned long decreased;
+} limit_stats_t;
+
+
+limit_t* limit_create(int initial, int min, int max);
+void limit_destroy(limit_t *limit);
+
+// Wait for a free slot, every acquire needs a release with the measured
+// latency (0: not a sample, eg. the batches which take longer by design).
+// The slots go to the blocked and the queued callers in arrival order.
+void limit_acquire(limit_t *limit);
+// Take a free slot (returns 1) or queue the waiter (returns 0), the release
+// which frees a slot for it calls its start() with the slot taken. The start()
+// runs on the releasing thread, it should hand the call over instead of
+// releasing in turn.
+int limit_submit(limit_t *limit, limit_waiter_t *waiter);
+void limit_release(limit_t *limit, uint64_t ns);
+
+void limit_stats(limit_t *limit, limit_stats_t *stats);
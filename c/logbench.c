@@ -0,0 +1,80 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+#define REQUESTS 200000
+
+
+// Same log calls that connection.c and netpack.c make for one request
+static void request(int id)
+{
+        const char *ip = "10.0.0.1";
+        const char *method = "append";
+
+        log_debug("Connection from %s:%d", "127.0.0.1", 40000 + id % 1000);
+        log_debug("Request: 'method=%s;ip=%s'", method, ip);
+        log_debug("Parsing request: 'method=%s;ip=%s'", method, ip);
+        log_debug("Parsed request: method='%s', ip='%s'", method, ip);
+        log_info("Execute cmd: iptables -A INPUT -s %s -j DROP", ip);
+        log_debug("Composing response code='%d', reason='%s'", 0, "OK");
+        log_debug("Composed request: 'code=%d;reason=%s'", 0, "OK");
+        log_debug("Response: 'code=%d;reason=%s'", 0, "OK");
+        log_debug("Close connection to %s:%d", "127.0.0.1", 40000 + id % 1000);
+        if (id % 1000 == 0)
+                log_warning("Read timeout on connection from %s:%d", "127.0.0.1", 40000);
+        if (id % 1000 == 500)
+                log_error("Failed to send response: %s", "write timeout");
+}
+
+static double now()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void measure(const char *mode, const char *name, enum log_level level)
+{
+        const char *names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+        double start;
+
+        // The lower levels run the same calls as LOG_MIN_LEVEL
+        if (level < LOG_MIN_LEVEL)
+                return;
+
+        log_set(level, log_std_prefix);
+        start = now();
+        for (int i=0; i<REQUESTS; ++i)
+                request(i);
+        fflush(stdout);
+
+        fprintf(stderr, "%-8s min=%-8s %-8s %10.1f ns/request\n",
+                        mode, names[LOG_MIN_LEVEL], name, (now() - start) / REQUESTS);
+}
+
+// The log lines go to stdout and the results to stderr:
+//      ./logbench > /dev/null
+int main(int argc, char *argv[])
+{
+        const char *names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+        enum log_level levels[] = {LOG_DEBUG, LOG_INFO, LOG_WARNING, LOG_ERROR};
+
+        for (int i=0; i<4; ++i)
+                measure("sync", names[i], levels[i]);
+
+        if (log_async_start() != 0) {
+                fprintf(stderr, "Failed to start asynchronous logging\n");
+                return 1;
+        }
+        for (int i=0; i<4; ++i) {
+                measure("async", names[i], levels[i]);
+                // Let the flusher drain the rings between the rounds
+                usleep(100000);
+        }
+        log_async_stop();
+        return 0;
+}
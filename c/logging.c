@@ -1,9 +1,13 @@
 #include <time.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <execinfo.h>
+#include <sys/uio.h>
 
 #define LOG_ENABLE
 
@@ -13,14 +17,50 @@
 #define LOG_PREFIX_SIZE 1024
 #define LOG_BACKTRACE_SIZE 1024
 
+// Asynchronous mode: records per thread, size of a rendered message,
+// records written by one writev() and the flush interval in milliseconds
+#define LOG_RING_SIZE 512
+#define LOG_MESSAGE_SIZE 256
+#define LOG_BATCH_SIZE 64
+#define LOG_FLUSH_INTERVAL 10
+
+
+typedef struct log_record {
+        enum log_level level;
+        const char *location;
+        char message[LOG_MESSAGE_SIZE];
+} log_record_t;
+
+// Single producer (the owner thread) / single consumer (the flusher) ring
+typedef struct log_ring {
+        unsigned long head;
+        unsigned long tail;
+        unsigned long dropped;
+        unsigned long reported;
+        struct log_ring *next;
+        log_record_t records[LOG_RING_SIZE];
+} log_ring_t;
+
 
 typedef struct {
         enum log_level level;
-        int (*prefix)(enum log_level level, const char *file, int line, char *fmt, size_t size);
+        int (*prefix)(enum log_level level, const char *location, char *fmt, size_t size);
 } config_t;
 
 static config_t config = {LOG_INFO, log_std_prefix};
 
+static struct {
+        volatile bool running;
+        pthread_t flusher;
+        log_ring_t *rings;
+} async;
+
+static __thread log_ring_t *ring = NULL;
+
+// The timestamp is formatted once per second and thread
+static __thread time_t cached_time = -1;
+static __thread char cached_timestamp[20];
+
 const char *log_level_names[] = {
         "DEBUG",
         "INFO",
@@ -37,55 +77,199 @@ const char *log_level_colors[] = {
         CFG_BLUE,
 };
 
-int log_no_prefix(enum log_level level, const char *file, int line, char *fmt, size_t size)
+int log_no_prefix(enum log_level level, const char *location, char *fmt, size_t size)
 {
+        if (size > 0)
+                fmt[0] = '\0';
         return 0;
 }
 
-int log_std_prefix(enum log_level level, const char *file, int line, char *fmt, size_t size)
+int log_std_prefix(enum log_level level, const char *location, char *fmt, size_t size)
 {
-        char timestamp[20];
-        char location[512];
-        time_t t = time(NULL); 
-
-        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
-        snprintf(location, 512, "%s:%d", file, line);
-        return snprintf(fmt, size, "%s | %7s | %-20s | ", 
-                        timestamp, log_level_names[level], location);
+        struct tm tm;
+        time_t t = time(NULL);
+
+        if (t != cached_time) {
+                strftime(cached_timestamp, sizeof(cached_timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+                cached_time = t;
+        }
+        return snprintf(fmt, size, "%s | %7s | %-20s | ",
+                        cached_timestamp, log_level_names[level], location);
 }
 
 void log_set(enum log_level level, int (*prefix)(
-        enum log_level level, const char *file, int line, char *fmt, size_t size))
+        enum log_level level, const char *location, char *fmt, size_t size))
 {
         config.level = level;
         config.prefix = prefix;
 }
 
-void log_write(enum log_level level, const char *file, int line, const char *fmt, ...)
+// The rings are registered once per thread and never freed, because the
+// threads can outlive the asynchronous mode
+static log_ring_t* _ring()
+{
+        if (ring != NULL)
+                return ring;
+
+        ring = (log_ring_t*) calloc (1, sizeof(*ring));
+        if (ring == NULL)
+                return NULL;
+
+        ring->next = __atomic_load_n(&async.rings, __ATOMIC_ACQUIRE);
+        while (!__atomic_compare_exchange_n(&async.rings, &ring->next, ring,
+                                false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                ;
+        return ring;
+}
+
+static void _write_async(enum log_level level, const char *location, const char *fmt, va_list args)
+{
+        log_ring_t *self = _ring();
+        log_record_t *record;
+        unsigned long head;
+
+        if (self == NULL)
+                return;
+
+        // Drop the record instead of blocking when the flusher is behind
+        head = self->head;
+        if (head - __atomic_load_n(&self->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+                __atomic_add_fetch(&self->dropped, 1, __ATOMIC_RELAXED);
+                return;
+        }
+
+        record = &self->records[head % LOG_RING_SIZE];
+        record->level = level;
+        record->location = location;
+        vsnprintf(record->message, sizeof(record->message), fmt, args);
+
+        __atomic_store_n(&self->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static size_t _render(char *buffer, size_t size, enum log_level level, const char *location, const char *message)
 {
-        va_list args;
         char prefix[LOG_PREFIX_SIZE];
-        char format[LOG_PREFIX_SIZE+10];
-        memset(prefix, 0, sizeof(prefix));
-        memset(format, 0, sizeof(format));
+        int bytes;
 
-        if (level >= config.level) {
-                config.prefix(level, file, line, prefix, LOG_PREFIX_SIZE);
+        prefix[0] = '\0';
+        config.prefix(level, location, prefix, LOG_PREFIX_SIZE);
 
 #ifndef NO_COLOR
-                snprintf(format, LOG_PREFIX_SIZE+10, "%s%s%s\n%s", 
-                        log_level_colors[level], prefix, fmt, CRESET);
+        bytes = snprintf(buffer, size, "%s%s%s\n%s", log_level_colors[level], prefix, message, CRESET);
 #else
-                snprintf(format, LOG_PREFIX_SIZE+10, "%s%s\n", prefix, fmt);
+        bytes = snprintf(buffer, size, "%s%s\n", prefix, message);
 #endif
+        return bytes < size ? bytes : size - 1;
+}
+
+// Format the records of every ring and write them out in batches
+static void _flush()
+{
+        static char lines[LOG_BATCH_SIZE][LOG_PREFIX_SIZE + LOG_MESSAGE_SIZE + 16];
+        struct iovec iov[LOG_BATCH_SIZE];
+        char message[LOG_MESSAGE_SIZE];
+        log_record_t *record;
+        log_ring_t *self;
+        unsigned long head, dropped;
+        int count = 0;
 
-                va_start(args, fmt);
-                vprintf(format, args);
+        for (self = __atomic_load_n(&async.rings, __ATOMIC_ACQUIRE); self != NULL; self = self->next) {
+                dropped = __atomic_load_n(&self->dropped, __ATOMIC_RELAXED);
+                if (dropped != self->reported) {
+                        snprintf(message, sizeof(message), "%lu log records were dropped", dropped - self->reported);
+                        iov[count].iov_base = lines[count];
+                        iov[count].iov_len = _render(lines[count], sizeof(lines[count]), LOG_WARNING, LOG_LOCATION, message);
+                        self->reported = dropped;
+                        if (++count == LOG_BATCH_SIZE) {
+                                writev(STDOUT_FILENO, iov, count);
+                                count = 0;
+                        }
+                }
+
+                head = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE);
+                while (self->tail != head) {
+                        record = &self->records[self->tail % LOG_RING_SIZE];
+                        iov[count].iov_base = lines[count];
+                        iov[count].iov_len = _render(lines[count], sizeof(lines[count]),
+                                        record->level, record->location, record->message);
+                        __atomic_store_n(&self->tail, self->tail + 1, __ATOMIC_RELEASE);
+
+                        if (++count == LOG_BATCH_SIZE) {
+                                writev(STDOUT_FILENO, iov, count);
+                                count = 0;
+                        }
+                }
+        }
+
+        if (count > 0)
+                writev(STDOUT_FILENO, iov, count);
+}
+
+static void* _flusher(void *arg)
+{
+        struct timespec interval = {0, LOG_FLUSH_INTERVAL * 1000000};
+
+        while (async.running) {
+                nanosleep(&interval, NULL);
+                _flush();
+        }
+        _flush();
+        return NULL;
+}
+
+int log_async_start()
+{
+        fflush(stdout);
+        async.running = true;
+        if (pthread_create(&async.flusher, NULL, _flusher, NULL) != 0) {
+                async.running = false;
+                return -1;
+        }
+        return 0;
+}
+
+void log_async_stop()
+{
+        if (!async.running)
+                return;
+
+        async.running = false;
+        pthread_join(async.flusher, NULL);
+}
+
+void log_write(enum log_level level, const char *location, const char *fmt, ...)
+{
+        va_list args;
+        char prefix[LOG_PREFIX_SIZE];
+
+        if (level < config.level)
+                return;
+
+        va_start(args, fmt);
+        if (async.running) {
+                _write_async(level, location, fmt, args);
                 va_end(args);
+                return;
         }
+
+        config.prefix(level, location, prefix, LOG_PREFIX_SIZE);
+
+        flockfile(stdout);
+#ifndef NO_COLOR
+        fputs(log_level_colors[level], stdout);
+#endif
+        fputs(prefix, stdout);
+        vprintf(fmt, args);
+#ifndef NO_COLOR
+        fputs("\n" CRESET, stdout);
+#else
+        fputc('\n', stdout);
+#endif
+        funlockfile(stdout);
+        va_end(args);
 }
 
-void _log_trace(const char *file, int line)
+void _log_trace(const char *location)
 {
         int sframes;
         void *bt[LOG_BACKTRACE_SIZE];
@@ -95,6 +279,7 @@ void _log_trace(const char *file, int line)
         lines = backtrace_symbols(bt, sframes);
 
         for (int i=0; i<sframes; ++i) {
-                log_write(LOG_TRACE, file, line, "%s", lines[i]);
+                log_write(LOG_TRACE, location, "%s", lines[i]);
         }
+        free(lines);
 }
@@ -1,33 +1,73 @@
 #pragma once
 
+#include <stdio.h>
 #include <stddef.h>
 
+// Numeric levels for the preprocessor (see LOG_MIN_LEVEL)
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_TRACE 4
+
 enum log_level {
-        LOG_DEBUG, 
-        LOG_INFO, 
-        LOG_WARNING, 
-        LOG_ERROR, 
-        LOG_TRACE
+        LOG_DEBUG = LOG_LEVEL_DEBUG,
+        LOG_INFO = LOG_LEVEL_INFO,
+        LOG_WARNING = LOG_LEVEL_WARNING,
+        LOG_ERROR = LOG_LEVEL_ERROR,
+        LOG_TRACE = LOG_LEVEL_TRACE
 };
 
-int log_no_prefix(enum log_level level, const char *file, int line, char *fmt, size_t size);
-int log_std_prefix(enum log_level level, const char *file, int line, char *fmt, size_t size);
+int log_no_prefix(enum log_level level, const char *location, char *fmt, size_t size);
+int log_std_prefix(enum log_level level, const char *location, char *fmt, size_t size);
+
+void log_set(enum log_level level, int (*prefix)(enum log_level level, const char *location, char *fmt, size_t size));
+void log_write(enum log_level level, const char *location, const char *fmt, ...);
+
+int log_async_start();
+void log_async_stop();
+
+void _log_trace(const char *location);
+
+// The calls below LOG_MIN_LEVEL are compiled out
+#ifndef LOG_MIN_LEVEL
+#       define LOG_MIN_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+// "file:line" is built by the compiler as a static string
+#define _LOG_STR(x) #x
+#define _LOG_XSTR(x) _LOG_STR(x)
+#define LOG_LOCATION __FILE__ ":" _LOG_XSTR(__LINE__)
+
+// Generates no code, but keeps the arguments type-checked and used
+#define _LOG_NOTHING(...) ((void) sizeof(printf(__VA_ARGS__)))
+
+#if defined LOG_ENABLE && LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#       define log_debug(...)   log_write(LOG_DEBUG  , LOG_LOCATION, __VA_ARGS__)
+#else
+#       define log_debug(...) _LOG_NOTHING(__VA_ARGS__)
+#endif
 
-void log_set(enum log_level level, int (*prefix)(enum log_level level, const char *file, int line, char *fmt, size_t size));
-void log_write(enum log_level level, const char *file, int line, const char *fmt, ...);
+#if defined LOG_ENABLE && LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#       define log_info(...)    log_write(LOG_INFO   , LOG_LOCATION, __VA_ARGS__)
+#else
+#       define log_info(...) _LOG_NOTHING(__VA_ARGS__)
+#endif
 
-void _log_trace(const char *file, int line);
+#if defined LOG_ENABLE && LOG_MIN_LEVEL <= LOG_LEVEL_WARNING
+#       define log_warning(...) log_write(LOG_WARNING, LOG_LOCATION, __VA_ARGS__)
+#else
+#       define log_warning(...) _LOG_NOTHING(__VA_ARGS__)
+#endif
+
+#if defined LOG_ENABLE && LOG_MIN_LEVEL <= LOG_LEVEL_ERROR
+#       define log_error(...)   log_write(LOG_ERROR  , LOG_LOCATION, __VA_ARGS__)
+#else
+#       define log_error(...) _LOG_NOTHING(__VA_ARGS__)
+#endif
 
-#if defined LOG_ENABLE
-#       define log_debug(...)   log_write(LOG_DEBUG  , __FILE__, __LINE__, __VA_ARGS__)
-#       define log_info(...)    log_write(LOG_INFO   , __FILE__, __LINE__, __VA_ARGS__)
-#       define log_warning(...) log_write(LOG_WARNING, __FILE__, __LINE__, __VA_ARGS__)
-#       define log_error(...)   log_write(LOG_ERROR  , __FILE__, __LINE__, __VA_ARGS__)
-#       define log_trace()      _log_trace(__FILE__, __LINE__)
+#if defined LOG_ENABLE && LOG_MIN_LEVEL <= LOG_LEVEL_TRACE
+#       define log_trace()      _log_trace(LOG_LOCATION)
 #else
-#       define log_debug(...)
-#       define log_info(...)
-#       define log_warning(...)
-#       define log_error(...)
-#       define log_trace()
+#       define log_trace() ((void) 0)
 #endif
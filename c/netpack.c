@@ -1,6 +1,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
 
 #include "netpack.h"
 #include "logging.h"
@@ -12,6 +14,20 @@
 #define num2chr(num) (char)(num) | 0x30
 
 
+int parse_ttl(const char *text, int *ttl)
+{
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(text, &end, 10);
+    if (errno != 0 || end == text || *end != '\0' || value < 0 || value > INT_MAX)
+        return -1;
+
+    *ttl = (int) value;
+    return 0;
+}
+
 int parse_request(const char *text, struct request *request)
 {
     char *buffer, *pair, *key, *val;
@@ -35,6 +51,16 @@ int parse_request(const char *text, struct request *request)
             snprintf(request->method, sizeof(request->method), "%s", val);
         } else if (strcmp(key, "ip") == 0) {
             snprintf(request->ip, sizeof(request->ip), "%s", val);
+        } else if (strcmp(key, "keepalive") == 0) {
+            request->keepalive = atoi(val);
+        } else if (strcmp(key, "ttl") == 0) {
+            // Left to the validation of the request to reject
+            if (parse_ttl(val, &request->ttl) != 0) {
+                log_warning("Invalid ttl: '%s'", val);
+                request->ttl = -1;
+            }
+        } else if (strcmp(key, "rule") == 0) {
+            snprintf(request->rule, sizeof(request->rule), "%s", val);
         }
 
         pair = strtok_r(NULL, DELIM_PAIR, &save_pair);
@@ -68,6 +94,14 @@ int parse_response(const char *text, struct response *response)
             response->code = atoi(val);
         } else if (strcmp(key, "reason") == 0) {
             snprintf(response->reason, sizeof(response->reason), "%s", val);
+        } else if (strcmp(key, "retry") == 0) {
+            response->retry = atoi(val);
+        } else if (strcmp(key, "keepalive") == 0) {
+            response->keepalive = atoi(val);
+        } else if (strcmp(key, "line") == 0) {
+            response->line = strtoul(val, NULL, 10);
+        } else if (strcmp(key, "progress") == 0) {
+            response->progress = strtoul(val, NULL, 10);
         }
 
         pair = strtok_r(NULL, DELIM_PAIR, &save_pair);
@@ -88,6 +122,14 @@ int compose_request(char *text, struct request request, size_t size)
                     "ip" DELIM_KEYVAL "%s",
                     request.method, request.ip);
 
+    // The server keeps the connection open for the next request
+    if (request.keepalive && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes, DELIM_PAIR "keepalive" DELIM_KEYVAL "1");
+    if (request.ttl && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes, DELIM_PAIR "ttl" DELIM_KEYVAL "%d", request.ttl);
+    if (request.rule[0] && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes, DELIM_PAIR "rule" DELIM_KEYVAL "%s", request.rule);
+
     log_debug("Composed request: '%s'", text);
     return bytes;
 }
@@ -102,6 +144,20 @@ int compose_response(char *text, struct response response, size_t size)
                     "reason" DELIM_KEYVAL "%s",
                     response.code, response.reason);
 
+    // Only busy responses tell the client when to come back
+    if (response.retry > 0 && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes,
+                        DELIM_PAIR "retry" DELIM_KEYVAL "%d", response.retry);
+
+    if (response.keepalive && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes, DELIM_PAIR "keepalive" DELIM_KEYVAL "1");
+
+    // Intermediate responses of the bulk mode
+    if (response.line > 0 && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes, DELIM_PAIR "line" DELIM_KEYVAL "%lu", response.line);
+    if (response.progress > 0 && bytes >= 0 && bytes < size)
+        bytes += snprintf(text + bytes, size - bytes, DELIM_PAIR "progress" DELIM_KEYVAL "%lu", response.progress);
+
     log_debug("Composed request: '%s'", text);
     return bytes;
 }
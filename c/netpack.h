@@ -4,18 +4,33 @@ typedef unsigned char uint8_t;
 
 #define REQUEST_METHOD_SIZE 256
 #define REQUEST_IP_SIZE 40
+#define REQUEST_RULE_SIZE 32
 #define RESPONSE_REASON_SIZE 1024
 
+// Response codes (besides the exit code of the executed command)
+#define RESPONSE_OK 0
+#define RESPONSE_ERROR 1
+#define RESPONSE_BUSY 75
+
 struct request {
     char method[256];
     char ip[40];
+    int keepalive;
+    int ttl;                    // Seconds until an appended rule expires (0: never)
+    char rule[32];              // Template of the rule on the server ("": the default one)
 };
 
 struct response {
     int code;
+    int retry;
+    int keepalive;
+    unsigned long line;         // Bulk mode: the failed line
+    unsigned long progress;     // Bulk mode: the lines processed so far
     char reason[1024];
 };
 
+// A whole non-negative number of seconds, returns -1 otherwise
+int parse_ttl(const char *text, int *ttl);
 int parse_request(const char *text, struct request *request);
 int parse_response(const char *text, struct response *response);
 int compose_request(char *text, struct request request, size_t size);
@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "logging.h"
+#include "prefork.h"
+
+
+#define _ALIGN 64                       // The workers do not share cache lines
+
+typedef struct prefork_worker {
+        pid_t pid;                      // 0: not running
+        uint64_t started;               // Monotonic milliseconds
+        uint64_t due;                   // Of the next fork
+        int backoff;                    // Milliseconds before the next fork after an exit
+        unsigned long restarts;
+        prefork_counters_t counters[PREFORK_ACCEPTORS];
+} __attribute__((aligned(_ALIGN))) prefork_worker_t;
+
+// Only the supervisor changes the slots, the workers only their counters
+struct prefork {
+        size_t size;                    // Of the mapping
+        int count;
+        bool stopping;
+        char *shared;
+        prefork_worker_t workers[];
+};
+
+
+static uint64_t _now()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int _find(prefork_t *prefork, pid_t pid)
+{
+        for (int i=0; i<prefork->count; ++i)
+                if (prefork->workers[i].pid == pid)
+                        return i;
+        return -1;
+}
+
+static void _exited(prefork_t *prefork, int i, int status)
+{
+        prefork_worker_t *worker = &prefork->workers[i];
+        uint64_t now = _now();
+        char reason[64];
+
+        if (WIFSIGNALED(status))
+                snprintf(reason, sizeof(reason), "killed by signal %d", WTERMSIG(status));
+        else
+                snprintf(reason, sizeof(reason), "exited with %d", WEXITSTATUS(status));
+        worker->pid = 0;
+
+        if (prefork->stopping) {
+                log_info("Worker %d: Stopped (%s)", i, reason);
+                return;
+        }
+
+        // A worker which could not run for a while is forked slower and slower
+        if (now - worker->started >= PREFORK_STABLE * 1000)
+                worker->backoff = PREFORK_BACKOFF;
+        worker->due = now + worker->backoff;
+        log_warning("Worker %d: %s, restarting in %d ms", i, reason, worker->backoff);
+        worker->backoff = worker->backoff * 2 > PREFORK_BACKOFF_MAX ? PREFORK_BACKOFF_MAX : worker->backoff * 2;
+        worker->restarts++;
+}
+
+
+prefork_t* prefork_create(int count, size_t shared)
+{
+        prefork_t *prefork;
+        size_t head, size;
+
+        if (count < 1) {
+                log_error("Invalid number of workers: %d", count);
+                return NULL;
+        }
+
+        head = (sizeof(*prefork) + count * sizeof(prefork->workers[0]) + _ALIGN - 1) / _ALIGN * _ALIGN;
+        size = head + shared;
+        prefork = (prefork_t*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (prefork == MAP_FAILED) {
+                log_error("Failed to mmap() %zu bytes of shared memory: %s", size, strerror(errno));
+                return NULL;
+        }
+
+        prefork->size = size;
+        prefork->count = count;
+        prefork->shared = (char*) prefork + head;
+        for (int i=0; i<count; ++i)
+                prefork->workers[i].backoff = PREFORK_BACKOFF;
+        return prefork;
+}
+
+void prefork_destroy(prefork_t *prefork)
+{
+        if (prefork == NULL)
+                return;
+        munmap(prefork, prefork->size);
+}
+
+void* prefork_shared(prefork_t *prefork)
+{
+        return prefork->shared;
+}
+
+prefork_counters_t* prefork_counters(prefork_t *prefork, int worker)
+{
+        return prefork->workers[worker].counters;
+}
+
+int prefork_spawn(prefork_t *prefork, int (*serve)(int worker, void *arg), void *arg)
+{
+        prefork_worker_t *worker;
+        uint64_t now = _now();
+        int timeout = -1;
+        pid_t pid;
+
+        for (int i=0; i<prefork->count && !prefork->stopping; ++i) {
+                worker = &prefork->workers[i];
+                if (worker->pid != 0)
+                        continue;
+                if (worker->due > now) {
+                        if (timeout < 0 || worker->due - now < timeout)
+                                timeout = worker->due - now;
+                        continue;
+                }
+
+                // The buffered output would be written by both processes
+                fflush(NULL);
+                if ((pid = fork()) < 0) {
+                        log_error("Worker %d: Failed to fork(): %s", i, strerror(errno));
+                        worker->due = now + worker->backoff;
+                        if (timeout < 0 || worker->backoff < timeout)
+                                timeout = worker->backoff;
+                        continue;
+                }
+                if (pid == 0) {
+                        // The workers do not outlive a killed supervisor
+                        prctl(PR_SET_PDEATHSIG, SIGINT);
+                        exit(serve(i, arg));
+                }
+
+                worker->pid = pid;
+                worker->started = now;
+                log_info("Worker %d: Started with pid %d", i, pid);
+        }
+        return timeout;
+}
+
+int prefork_reap(prefork_t *prefork, void (*dead)(int worker))
+{
+        int status, i, reaped = 0;
+        pid_t pid;
+
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if ((i = _find(prefork, pid)) < 0)
+                        continue;
+                dead(i);
+                _exited(prefork, i, status);
+                reaped++;
+        }
+        return reaped;
+}
+
+void prefork_signal(prefork_t *prefork, int sig)
+{
+        for (int i=0; i<prefork->count; ++i)
+                if (prefork->workers[i].pid != 0 && kill(prefork->workers[i].pid, sig) < 0)
+                        log_warning("Worker %d: Failed to send signal %d: %s", i, sig, strerror(errno));
+}
+
+void prefork_stop(prefork_t *prefork, int sig)
+{
+        prefork->stopping = true;
+        prefork_signal(prefork, sig);
+}
+
+int prefork_running(prefork_t *prefork)
+{
+        int running = 0;
+
+        for (int i=0; i<prefork->count; ++i)
+                if (prefork->workers[i].pid != 0)
+                        running++;
+        return running;
+}
+
+void prefork_write(prefork_t *prefork, FILE *out, const char *prefix, int acceptors)
+{
+        static const char *outcomes[] = {"accepted", "dropped", "rejected", "busy", "limited"};
+        prefork_counters_t *counters;
+        unsigned long values[5];
+
+        fprintf(out, "# HELP %s_worker_up Worker processes which are running.\n", prefix);
+        fprintf(out, "# TYPE %s_worker_up gauge\n", prefix);
+        for (int i=0; i<prefork->count; ++i)
+                fprintf(out, "%s_worker_up{worker=\"%d\"} %d\n", prefix, i, prefork->workers[i].pid != 0);
+        fprintf(out, "# HELP %s_worker_restarts_total Worker processes forked again after an exit.\n", prefix);
+        fprintf(out, "# TYPE %s_worker_restarts_total counter\n", prefix);
+        for (int i=0; i<prefork->count; ++i)
+                fprintf(out, "%s_worker_restarts_total{worker=\"%d\"} %lu\n", prefix, i, prefork->workers[i].restarts);
+
+        // Kept over the restarts, so they only grow
+        fprintf(out, "# HELP %s_connections_total Connections of the acceptors by outcome.\n", prefix);
+        fprintf(out, "# TYPE %s_connections_total counter\n", prefix);
+        for (int i=0; i<prefork->count; ++i) {
+                for (int a=0; a<acceptors && a<PREFORK_ACCEPTORS; ++a) {
+                        counters = &prefork->workers[i].counters[a];
+                        values[0] = __atomic_load_n(&counters->accepted, __ATOMIC_RELAXED);
+                        values[1] = __atomic_load_n(&counters->dropped, __ATOMIC_RELAXED);
+                        values[2] = __atomic_load_n(&counters->rejected, __ATOMIC_RELAXED);
+                        values[3] = __atomic_load_n(&counters->busy, __ATOMIC_RELAXED);
+                        values[4] = __atomic_load_n(&counters->limited, __ATOMIC_RELAXED);
+                        for (int o=0; o<5; ++o)
+                                fprintf(out, "%s_connections_total{worker=\"%d\",acceptor=\"%d\",outcome=\"%s\"} %lu\n",
+                                                prefix, i, a, outcomes[o], values[o]);
+                }
+        }
+}
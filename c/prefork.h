@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+// Supervisor of forked worker processes: the slots of the workers and the
+// memory of the caller are in one shared anonymous mapping created before
+// the first fork, so the workers see the same state at the same addresses
+// and the supervisor can read their counters. A worker which exits while the
+// supervisor is not stopping is forked again after a backoff which doubles
+// with every exit in a row, up to PREFORK_BACKOFF_MAX.
+#define PREFORK_ACCEPTORS 8             // Counters of the acceptors per worker
+#define PREFORK_BACKOFF 100             // First restart delay in milliseconds
+#define PREFORK_BACKOFF_MAX 10000
+#define PREFORK_STABLE 10               // Seconds of a worker after which its backoff starts over
+
+// Connections of an acceptor, written by the worker and read by the supervisor
+typedef struct prefork_counters {
+        unsigned long accepted;
+        unsigned long dropped;
+        unsigned long rejected;
+        unsigned long busy;
+        unsigned long limited;
+} prefork_counters_t;
+
+typedef struct prefork prefork_t;
+
+
+// The workers get shared bytes of zeroed memory together
+prefork_t* prefork_create(int count, size_t shared);
+void prefork_destroy(prefork_t *prefork);
+void* prefork_shared(prefork_t *prefork);
+// PREFORK_ACCEPTORS counters of the worker
+prefork_counters_t* prefork_counters(prefork_t *prefork, int worker);
+
+// Fork the workers which are due, the child exits with the return value of
+// serve(). Returns the milliseconds until the next one is due, -1 if none.
+int prefork_spawn(prefork_t *prefork, int (*serve)(int worker, void *arg), void *arg);
+// Collect the exited workers without blocking, dead() is called for each of
+// them before it can be forked again. Returns the number of the collected ones.
+int prefork_reap(prefork_t *prefork, void (*dead)(int worker));
+void prefork_signal(prefork_t *prefork, int sig);
+// No more forks, the workers get sig
+void prefork_stop(prefork_t *prefork, int sig);
+int prefork_running(prefork_t *prefork);
+
+// The state of the workers and the counters of their first acceptors in Prometheus format
+void prefork_write(prefork_t *prefork, FILE *out, const char *prefix, int acceptors);
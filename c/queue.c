@@ -38,14 +38,44 @@ queue_t* queue_create(int size)
         q->size = size;
         q->head = 0;
         q->tail = 0;
+        q->closed = false;
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->ready, NULL);
 
         return q;
 }
 
+// Move the nodes to a new ring of size, keeping their order, the lock is held
+static int _relocate(queue_t *q, int size)
+{
+        void **nodes;
+        int count;
+
+        count = _isfull(q) ? q->size : (q->tail - q->head + q->size) % q->size;
+        if (count > size || (nodes = (void**) calloc (size, sizeof(void*))) == NULL)
+                return -1;
+
+        for (int i=0; i<count; ++i)
+                nodes[i] = q->nodes[(q->head + i) % q->size];
+        free(q->nodes);
+        q->nodes = nodes;
+        q->size = size;
+        q->head = 0;
+        q->tail = count % size;
+        return 0;
+}
+
+void queue_grow(queue_t *q)
+{
+        pthread_mutex_lock(&q->lock);
+        q->growing = true;
+        pthread_mutex_unlock(&q->lock);
+}
+
 int queue_put(queue_t *q, void *data)
 {
         pthread_mutex_lock(&q->lock);
-        if (_isfull(q)) {
+        if (_isfull(q) && (!q->growing || _relocate(q, q->size * 2) < 0)) {
                 pthread_mutex_unlock(&q->lock);
                 return -1;
         }
@@ -53,6 +83,7 @@ int queue_put(queue_t *q, void *data)
         q->nodes[q->tail] = data;
         q->tail  = _next(q, q->tail);
 
+        pthread_cond_signal(&q->ready);
         pthread_mutex_unlock(&q->lock);
         return 0;
 }
@@ -75,8 +106,52 @@ void* queue_get(queue_t *q)
         return data;
 }
 
+void* queue_wait(queue_t *q)
+{
+        void *data;
+
+        pthread_mutex_lock(&q->lock);
+        while (_isempty(q)) {
+                if (q->closed) {
+                        pthread_mutex_unlock(&q->lock);
+                        return NULL;
+                }
+                pthread_cond_wait(&q->ready, &q->lock);
+        }
+
+        data = q->nodes[q->head];
+        q->nodes[q->head] = NULL;
+        q->head = _next(q, q->head);
+
+        pthread_mutex_unlock(&q->lock);
+        return data;
+}
+
+int queue_count(queue_t *q)
+{
+        int count;
+
+        pthread_mutex_lock(&q->lock);
+        if (_isfull(q))
+                count = q->size;
+        else
+                count = (q->tail - q->head + q->size) % q->size;
+        pthread_mutex_unlock(&q->lock);
+        return count;
+}
+
+void queue_close(queue_t *q)
+{
+        pthread_mutex_lock(&q->lock);
+        q->closed = true;
+        pthread_cond_broadcast(&q->ready);
+        pthread_mutex_unlock(&q->lock);
+}
+
 void queue_destroy(queue_t *q)
 {
+        pthread_cond_destroy(&q->ready);
+        pthread_mutex_destroy(&q->lock);
         free(q->nodes);
         free(q);
 }
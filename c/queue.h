@@ -8,11 +8,19 @@ typedef struct {
     int size;
     int head;
     int tail;
+    bool closed;
+    bool growing;           // queue_put() doubles a full queue instead of failing
     void **nodes;
     pthread_mutex_t lock;
+    pthread_cond_t ready;
 } queue_t;
 
 queue_t* queue_create(int size);
+// Let the queue grow, the callers hold as many nodes as they put
+void queue_grow(queue_t *q);
 int queue_put(queue_t *q, void *data);
 void* queue_get(queue_t *q);
+void* queue_wait(queue_t *q);
+int queue_count(queue_t *q);
+void queue_close(queue_t *q);
 void queue_destroy(queue_t *q);
@@ -0,0 +1,192 @@
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "logging.h"
+#include "hash.h"
+#include "ratelimit.h"
+
+
+static unsigned long _now()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// The addresses come in network byte order, the high bits of the hash pick the
+// stripe and the low ones the bucket
+static inline uint32_t _hash(uint32_t addr)
+{
+        return hash32(ntohl(addr));
+}
+
+static inline void _lru_del(rl_entry_t *entry)
+{
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+}
+
+static inline void _lru_push(rl_stripe_t *stripe, rl_entry_t *entry)
+{
+        entry->prev = &stripe->lru;
+        entry->next = stripe->lru.next;
+        stripe->lru.next->prev = entry;
+        stripe->lru.next = entry;
+}
+
+static void _chain_del(rl_entry_t **bucket, rl_entry_t *entry)
+{
+        for (; *bucket != NULL; bucket = &(*bucket)->chain) {
+                if (*bucket == entry) {
+                        *bucket = entry->chain;
+                        return;
+                }
+        }
+}
+
+static int _parse_allow(rl_t *rl, const char *allow)
+{
+        char *buffer, *net, *bits, *save;
+        struct in_addr addr;
+        int prefix;
+
+        if (allow == NULL || *allow == '\0')
+                return 0;
+
+        buffer = strdup(allow);
+        for (net = strtok_r(buffer, ",", &save); net != NULL; net = strtok_r(NULL, ",", &save)) {
+                prefix = 32;
+                if ((bits = strchr(net, '/')) != NULL) {
+                        *bits++ = '\0';
+                        prefix = atoi(bits);
+                }
+
+                if (inet_pton(AF_INET, net, &addr) != 1 || prefix < 0 || prefix > 32) {
+                        log_error("Invalid network in rate limit allowlist: '%s'", net);
+                        free(buffer);
+                        return -1;
+                }
+
+                rl->allow = realloc(rl->allow, (rl->allowed + 1) * sizeof(*rl->allow));
+                rl->allow[rl->allowed].mask = prefix ? htonl(~0u << (32 - prefix)) : 0;
+                rl->allow[rl->allowed].addr = addr.s_addr & rl->allow[rl->allowed].mask;
+                rl->allowed++;
+        }
+
+        free(buffer);
+        return 0;
+}
+
+rl_t* rl_create(double rate, double burst, int size, const char *allow)
+{
+        rl_t *rl;
+        rl_stripe_t *stripe;
+
+        log_debug("Creating rate limiter with %.1f/s rate, %.0f burst and %d entries", rate, burst, size);
+
+        rl = (rl_t*) calloc (1, sizeof(*rl));
+        if (rl == NULL) {
+                log_error("Failed to calloc() memory for rate limiter");
+                return NULL;
+        }
+
+        rl->rate = rate;
+        rl->burst = burst < 1 ? 1 : burst;
+        if (_parse_allow(rl, allow) < 0) {
+                rl_destroy(rl);
+                return NULL;
+        }
+
+        for (int i=0; i<RL_STRIPES; ++i) {
+                stripe = &rl->stripes[i];
+                stripe->size = size / RL_STRIPES > 0 ? size / RL_STRIPES : 1;
+                stripe->lru.prev = stripe->lru.next = &stripe->lru;
+                pthread_mutex_init(&stripe->lock, NULL);
+
+                stripe->entries = (rl_entry_t*) calloc (stripe->size, sizeof(*stripe->entries));
+                stripe->buckets = (rl_entry_t**) calloc (stripe->size, sizeof(*stripe->buckets));
+                if (stripe->entries == NULL || stripe->buckets == NULL) {
+                        log_error("Failed to calloc() memory for rate limiter table");
+                        rl_destroy(rl);
+                        return NULL;
+                }
+        }
+
+        return rl;
+}
+
+void rl_destroy(rl_t *rl)
+{
+        for (int i=0; i<RL_STRIPES; ++i) {
+                pthread_mutex_destroy(&rl->stripes[i].lock);
+                free(rl->stripes[i].entries);
+                free(rl->stripes[i].buckets);
+        }
+        free(rl->allow);
+        free(rl);
+}
+
+// Take a token for the address. Returns 0 if the request is allowed,
+// otherwise the milliseconds until the next token is available.
+long rl_take(rl_t *rl, uint32_t addr)
+{
+        uint32_t hash = _hash(addr);
+        rl_stripe_t *stripe = &rl->stripes[hash >> (32 - RL_STRIPE_BITS)];
+        rl_entry_t **bucket, *entry;
+        unsigned long now;
+        long wait = 0;
+
+        for (int i=0; i<rl->allowed; ++i)
+                if ((addr & rl->allow[i].mask) == rl->allow[i].addr)
+                        return 0;
+
+        now = _now();
+        pthread_mutex_lock(&stripe->lock);
+
+        bucket = &stripe->buckets[hash % stripe->size];
+        for (entry = *bucket; entry != NULL; entry = entry->chain)
+                if (entry->addr == addr)
+                        break;
+
+        if (entry != NULL) {
+                _lru_del(entry);
+                entry->tokens += (now - entry->stamp) * rl->rate / 1000;
+                if (entry->tokens > rl->burst)
+                        entry->tokens = rl->burst;
+        } else {
+                // Reuse the least recently seen source when the table is full
+                if (stripe->used < stripe->size) {
+                        entry = &stripe->entries[stripe->used++];
+                } else {
+                        entry = stripe->lru.prev;
+                        _lru_del(entry);
+                        _chain_del(&stripe->buckets[_hash(entry->addr) % stripe->size], entry);
+                }
+                entry->addr = addr;
+                entry->tokens = rl->burst;
+                entry->chain = *bucket;
+                *bucket = entry;
+        }
+        entry->stamp = now;
+        _lru_push(stripe, entry);
+
+        if (entry->tokens >= 1)
+                entry->tokens -= 1;
+        else
+                wait = (long)((1 - entry->tokens) * 1000 / rl->rate) + 1;
+
+        pthread_mutex_unlock(&stripe->lock);
+
+        if (wait > 0)
+                __atomic_add_fetch(&rl->limited, 1, __ATOMIC_RELAXED);
+        return wait;
+}
+
+unsigned long rl_limited(rl_t *rl)
+{
+        return __atomic_load_n(&rl->limited, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+
+
+#define RL_STRIPE_BITS 4
+#define RL_STRIPES (1 << RL_STRIPE_BITS)
+
+typedef struct rl_entry {
+        uint32_t addr;
+        double tokens;
+        unsigned long stamp;
+        struct rl_entry *chain;
+        struct rl_entry *prev;
+        struct rl_entry *next;
+} rl_entry_t;
+
+typedef struct rl_stripe {
+        pthread_mutex_t lock;
+        int size;
+        int used;
+        rl_entry_t *entries;
+        rl_entry_t **buckets;
+        rl_entry_t lru;
+} rl_stripe_t;
+
+typedef struct rl_net {
+        uint32_t addr;
+        uint32_t mask;
+} rl_net_t;
+
+typedef struct rl {
+        double rate;
+        double burst;
+        int allowed;
+        rl_net_t *allow;
+        rl_stripe_t stripes[RL_STRIPES];
+        unsigned long limited;
+} rl_t;
+
+
+rl_t* rl_create(double rate, double burst, int size, const char *allow);
+void rl_destroy(rl_t *rl);
+
+long rl_take(rl_t *rl, uint32_t addr);
+unsigned long rl_limited(rl_t *rl);
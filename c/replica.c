@@ -0,0 +1,792 @@
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "logging.h"
+#include "ruleset.h"
+#include "runner.h"
+#include "replica.h"
+
+
+#define REPLICA_BUFFER 65536
+#define REPLICA_LINE 64                 // Longest line of a batch or a snapshot
+#define REPLICA_TIMEOUT 5               // Seconds of silence before a connection is dropped
+#define REPLICA_HEARTBEAT 1             // Seconds between the heartbeats of an idle leader
+
+typedef struct replica_change {
+        uint32_t ip;
+        uint32_t op;
+} replica_change_t;
+
+typedef struct replica_reader {
+        int sock;
+        int idle;                       // Seconds without data
+        size_t start;
+        size_t end;
+        char buffer[REPLICA_BUFFER];
+} replica_reader_t;
+
+// A follower connected to this leader
+typedef struct replica_peer {
+        int sock;
+        char name[64];
+        pthread_t thread;
+        volatile bool done;
+        unsigned long long sent;
+        unsigned long long acked;
+        struct replica_peer *next;
+} replica_peer_t;
+
+static struct {
+        pthread_mutex_t lock;
+        pthread_cond_t changed;         // Wakes the peers on new changes and on teardown
+        bool running;
+
+        // Leader: the last size changes, sequence number n is at n % size
+        replica_change_t *log;
+        size_t size;
+        int batch;
+        unsigned long long head;
+        unsigned long long epoch;       // Identifies the log of this run
+        int listener;
+        pthread_t accepter;
+        replica_peer_t *peers;
+
+        // Follower
+        char host[256];
+        char port[8];
+        int sock;
+        pthread_t follower;
+        bool following;
+        bool connected;
+        unsigned long long leader;      // Epoch of the leader the rules came from
+        unsigned long long applied;
+        unsigned long long known;       // Last sequence number the leader told
+} replica = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .listener = -1,
+        .sock = -1,
+};
+
+
+// Value of "<key>=<number>" at the start of the line or after a ';'
+static bool _field(const char *line, const char *key, unsigned long long *value)
+{
+        size_t length = strlen(key);
+        const char *pair = line;
+
+        while (pair != NULL) {
+                if (strncmp(pair, key, length) == 0 && pair[length] == '=') {
+                        *value = strtoull(pair + length + 1, NULL, 10);
+                        return true;
+                }
+                if ((pair = strchr(pair, ';')) != NULL)
+                        pair++;
+        }
+        return false;
+}
+
+static int _send(int sock, const char *data, size_t size)
+{
+        ssize_t sent;
+
+        while (size > 0) {
+                if ((sent = send(sock, data, size, MSG_NOSIGNAL)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                data += sent;
+                size -= sent;
+        }
+        return 0;
+}
+
+static int _printf(int sock, const char *format, unsigned long long value)
+{
+        char line[REPLICA_LINE];
+
+        return _send(sock, line, snprintf(line, sizeof(line), format, value));
+}
+
+// Returns 1 with the next line, 0 when none came in time and -1 when the connection is gone
+static int _readline(replica_reader_t *reader, char **line, bool wait)
+{
+        char *newline;
+        ssize_t n;
+
+        while (1) {
+                newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+                if (newline != NULL) {
+                        *newline = '\0';
+                        *line = reader->buffer + reader->start;
+                        reader->start = newline - reader->buffer + 1;
+                        reader->idle = 0;
+                        return 1;
+                }
+
+                memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+                reader->end -= reader->start;
+                reader->start = 0;
+                if (reader->end == sizeof(reader->buffer)) {
+                        log_error("Too long replication line");
+                        return -1;
+                }
+
+                // The sockets have a receive timeout of a second
+                n = recv(reader->sock, reader->buffer + reader->end, sizeof(reader->buffer) - reader->end,
+                                wait ? 0 : MSG_DONTWAIT);
+                if (n == 0)
+                        return -1;
+                if (n < 0) {
+                        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                                return -1;
+                        if (wait && ++reader->idle >= REPLICA_TIMEOUT) {
+                                log_warning("Replication connection is silent for %d s", reader->idle);
+                                return -1;
+                        }
+                        return 0;
+                }
+                reader->end += n;
+        }
+}
+
+// Wait for the next line as long as the replication runs
+static int _next(replica_reader_t *reader, char **line)
+{
+        int rc;
+
+        while ((rc = _readline(reader, line, true)) == 0)
+                if (!__atomic_load_n(&replica.running, __ATOMIC_RELAXED))
+                        return -1;
+        return rc;
+}
+
+static void _timeouts(int sock)
+{
+        struct timeval timeout = {1, 0};
+        struct timeval send = {REPLICA_TIMEOUT, 0};
+
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &send, sizeof(send));
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+}
+
+static const char* _op(uint32_t op)
+{
+        return op == BACKEND_APPEND ? "append" : "remove";
+}
+
+
+// ================================================================================
+// Leader
+// ================================================================================
+
+// Send the managed rules as "<ip> <count>" lines, the peer continues from their sequence number
+static int _snapshot(replica_peer_t *peer, char *buffer)
+{
+        ruleset_t *rules;
+        ruleset_entry_t *entry;
+        unsigned long long seq;
+        size_t cursor, length;
+        char ip[16];
+        int rc = -1;
+
+        if ((rules = ruleset_create(0)) == NULL)
+                return -1;
+        if (runner_snapshot(rules, &seq) < 0)
+                goto cleanup;
+
+        length = snprintf(buffer, REPLICA_BUFFER, "snapshot=%llu;epoch=%llu;count=%zu\n", seq, replica.epoch, rules->size);
+        for (cursor = 0; (entry = ruleset_next(rules, &cursor)) != NULL; ) {
+                if (length + REPLICA_LINE > REPLICA_BUFFER) {
+                        if (_send(peer->sock, buffer, length) < 0)
+                                goto cleanup;
+                        length = 0;
+                }
+                ruleset_format(entry->ip, ip, sizeof(ip));
+                length += snprintf(buffer + length, REPLICA_BUFFER - length, "%s %u\n", ip, entry->count);
+        }
+        if (_send(peer->sock, buffer, length) < 0)
+                goto cleanup;
+
+        log_info("Sent snapshot of %zu address(es) at sequence %llu to %s", rules->size, seq, peer->name);
+        peer->sent = seq;
+        rc = 0;
+
+cleanup:
+        ruleset_destroy(rules);
+        return rc;
+}
+
+static int _batch(replica_peer_t *peer, const replica_change_t *changes, size_t count, char *buffer)
+{
+        size_t length;
+        char ip[16];
+
+        length = snprintf(buffer, REPLICA_BUFFER, "batch=%llu;count=%zu\n", peer->sent + 1, count);
+        for (size_t i=0; i<count; ++i) {
+                if (length + REPLICA_LINE > REPLICA_BUFFER) {
+                        if (_send(peer->sock, buffer, length) < 0)
+                                return -1;
+                        length = 0;
+                }
+                ruleset_format(changes[i].ip, ip, sizeof(ip));
+                length += snprintf(buffer + length, REPLICA_BUFFER - length, "%s %s\n", _op(changes[i].op), ip);
+        }
+        if (_send(peer->sock, buffer, length) < 0)
+                return -1;
+
+        peer->sent += count;
+        return 0;
+}
+
+// Read the "ack=<seq>" lines which are already there
+static int _acks(replica_peer_t *peer, replica_reader_t *reader)
+{
+        unsigned long long acked;
+        char *line;
+        int rc;
+
+        while ((rc = _readline(reader, &line, false)) > 0)
+                if (_field(line, "ack", &acked))
+                        __atomic_store_n(&peer->acked, acked, __ATOMIC_RELAXED);
+        return rc;
+}
+
+static void* _serve(void *arg)
+{
+        replica_peer_t *peer = (replica_peer_t*) arg;
+        replica_reader_t *reader;
+        replica_change_t *changes;
+        unsigned long long seq = 0, epoch = 0, head;
+        struct timespec deadline;
+        char *buffer, *line;
+        bool snapshot;
+        size_t count;
+
+        reader = (replica_reader_t*) calloc (1, sizeof(*reader));
+        changes = (replica_change_t*) calloc (replica.batch, sizeof(*changes));
+        buffer = (char*) malloc (REPLICA_BUFFER);
+        if (reader == NULL || changes == NULL || buffer == NULL) {
+                log_error("Failed to allocate replication buffers");
+                goto done;
+        }
+        reader->sock = peer->sock;
+
+        // "method=follow;epoch=<epoch>;seq=<last applied>"
+        if (_next(reader, &line) <= 0 || !_field(line, "seq", &seq)) {
+                log_warning("Invalid replication request from %s", peer->name);
+                goto done;
+        }
+        _field(line, "epoch", &epoch);
+
+        // Continue from the log only if it still has every change after seq
+        pthread_mutex_lock(&replica.lock);
+        snapshot = epoch != replica.epoch || seq > replica.head || replica.head - seq > replica.size;
+        pthread_mutex_unlock(&replica.lock);
+        peer->sent = peer->acked = seq;
+        log_info("Follower %s connected at sequence %llu%s", peer->name, seq, snapshot ? ", sending snapshot" : "");
+
+        while (__atomic_load_n(&replica.running, __ATOMIC_RELAXED)) {
+                if (snapshot && _snapshot(peer, buffer) < 0)
+                        break;
+                snapshot = false;
+
+                pthread_mutex_lock(&replica.lock);
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += REPLICA_HEARTBEAT;
+                while (replica.running && replica.head == peer->sent &&
+                                pthread_cond_timedwait(&replica.changed, &replica.lock, &deadline) != ETIMEDOUT);
+
+                head = replica.head;
+                count = 0;
+                if (head - peer->sent > replica.size) {
+                        // The follower fell behind the log
+                        snapshot = true;
+                } else {
+                        count = head - peer->sent < (unsigned long long) replica.batch ? head - peer->sent : replica.batch;
+                        for (size_t i=0; i<count; ++i)
+                                changes[i] = replica.log[(peer->sent + 1 + i) % replica.size];
+                }
+                pthread_mutex_unlock(&replica.lock);
+
+                if (snapshot)
+                        continue;
+                if (count > 0 && _batch(peer, changes, count, buffer) < 0)
+                        break;
+                if (count == 0 && _printf(peer->sock, "head=%llu\n", head) < 0)
+                        break;
+                if (_acks(peer, reader) < 0)
+                        break;
+        }
+        log_info("Follower %s disconnected at sequence %llu", peer->name, __atomic_load_n(&peer->acked, __ATOMIC_RELAXED));
+
+done:
+        free(reader);
+        free(changes);
+        free(buffer);
+        __atomic_store_n(&peer->done, true, __ATOMIC_RELEASE);
+        return NULL;
+}
+
+// Join the peers which are gone (all of them on teardown). They are joined
+// without the lock, a peer can be waiting for it.
+static void _reap(bool all)
+{
+        replica_peer_t **link = &replica.peers, *peer, *gone = NULL;
+
+        pthread_mutex_lock(&replica.lock);
+        while ((peer = *link) != NULL) {
+                if (!all && !__atomic_load_n(&peer->done, __ATOMIC_ACQUIRE)) {
+                        link = &peer->next;
+                        continue;
+                }
+                *link = peer->next;
+                peer->next = gone;
+                gone = peer;
+        }
+        pthread_mutex_unlock(&replica.lock);
+
+        while ((peer = gone) != NULL) {
+                gone = peer->next;
+                shutdown(peer->sock, SHUT_RDWR);
+                pthread_join(peer->thread, NULL);
+                close(peer->sock);
+                free(peer);
+        }
+}
+
+// The deadlines of the waits are of the monotonic clock, a server can both
+// lead and follow
+static pthread_once_t _clocked = PTHREAD_ONCE_INIT;
+
+static void _clock()
+{
+        pthread_condattr_t attr;
+
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&replica.changed, &attr);
+        pthread_condattr_destroy(&attr);
+}
+
+static void* _accept(void *arg)
+{
+        struct sockaddr_in addr;
+        socklen_t length;
+        replica_peer_t *peer;
+        int sock;
+
+        while (__atomic_load_n(&replica.running, __ATOMIC_RELAXED)) {
+                length = sizeof(addr);
+                if ((sock = accept(replica.listener, (struct sockaddr*) &addr, &length)) < 0) {
+                        if (errno == EINTR || errno == ECONNABORTED)
+                                continue;
+                        if (__atomic_load_n(&replica.running, __ATOMIC_RELAXED))
+                                log_error("Failed to accept follower: %s", strerror(errno));
+                        break;
+                }
+
+                if ((peer = (replica_peer_t*) calloc (1, sizeof(*peer))) == NULL) {
+                        log_error("Failed to calloc() follower");
+                        close(sock);
+                        continue;
+                }
+                _timeouts(sock);
+                peer->sock = sock;
+                snprintf(peer->name, sizeof(peer->name), "%s:%u", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+                _reap(false);
+                pthread_mutex_lock(&replica.lock);
+                if (pthread_create(&peer->thread, NULL, _serve, peer) != 0) {
+                        log_error("Failed to create follower thread");
+                        close(sock);
+                        free(peer);
+                } else {
+                        peer->next = replica.peers;
+                        replica.peers = peer;
+                }
+                pthread_mutex_unlock(&replica.lock);
+        }
+        return NULL;
+}
+
+int replica_lead(const char *host, unsigned short port, size_t size, int batch)
+{
+        struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+        struct timespec now;
+
+        pthread_once(&_clocked, _clock);
+        if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+                log_error("Invalid replication address: '%s'", host);
+                return -1;
+        }
+
+        if ((replica.log = (replica_change_t*) calloc (size, sizeof(*replica.log))) == NULL) {
+                log_error("Failed to calloc() replication log");
+                return -1;
+        }
+        replica.size = size;
+        replica.batch = batch;
+
+        // A new log for every run: the followers of the previous one get a snapshot
+        clock_gettime(CLOCK_REALTIME, &now);
+        replica.epoch = ((unsigned long long) now.tv_sec * 1000000000ULL + now.tv_nsec) ^ ((unsigned long long) getpid() << 32);
+
+        if ((replica.listener = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+                        setsockopt(replica.listener, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0 ||
+                        bind(replica.listener, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+                        listen(replica.listener, 16) < 0) {
+                log_error("Failed to listen on replication port %u: %s", port, strerror(errno));
+                return -1;
+        }
+
+        replica.running = true;
+        if (pthread_create(&replica.accepter, NULL, _accept, NULL) != 0) {
+                log_error("Failed to create replication thread");
+                replica.running = false;
+                return -1;
+        }
+        log_info("Leading followers on %s:%u, log of %zu change(s)", host, port, size);
+        return 0;
+}
+
+
+// ================================================================================
+// Follower
+// ================================================================================
+
+static int _connect()
+{
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM};
+        struct addrinfo *result;
+        int sock = -1;
+
+        if (getaddrinfo(replica.host, replica.port, &hints, &result) != 0) {
+                log_error("Failed to resolve leader %s", replica.host);
+                return -1;
+        }
+        if ((sock = socket(AF_INET, SOCK_STREAM, 0)) >= 0 && connect(sock, result->ai_addr, result->ai_addrlen) < 0) {
+                close(sock);
+                sock = -1;
+        }
+        freeaddrinfo(result);
+        return sock;
+}
+
+// Read the "<ip> <count>" lines of a snapshot and sync to them
+static int _resync(replica_reader_t *reader, const char *header)
+{
+        unsigned long long seq, epoch = 0, count = 0;
+        runner_sync_t result;
+        struct response response;
+        ruleset_t *desired;
+        char ip[16], *line;
+        unsigned int times;
+        uint32_t addr;
+        int rc = -1;
+
+        _field(header, "snapshot", &seq);
+        _field(header, "epoch", &epoch);
+        _field(header, "count", &count);
+        if ((desired = ruleset_create(0)) == NULL)
+                return -1;
+
+        for (unsigned long long i=0; i<count; ++i) {
+                if (_next(reader, &line) <= 0)
+                        goto cleanup;
+                if (sscanf(line, "%15s %u", ip, &times) != 2 || ruleset_parse(ip, &addr) < 0 ||
+                                ruleset_add(desired, addr, times) < 0) {
+                        log_error("Invalid snapshot line: '%s'", line);
+                        goto cleanup;
+                }
+        }
+
+        memset(&response, 0, sizeof(response));
+        if (runner_sync(desired, &result, &response) < 0 || response.code != 0) {
+                log_error("Failed to sync to the snapshot of the leader: %s", response.reason);
+                goto cleanup;
+        }
+        log_info("Synced to the snapshot of the leader at sequence %llu: %s", seq, response.reason);
+
+        pthread_mutex_lock(&replica.lock);
+        replica.leader = epoch;
+        replica.applied = seq;
+        if (replica.known < seq)
+                replica.known = seq;
+        pthread_mutex_unlock(&replica.lock);
+        rc = 0;
+
+cleanup:
+        ruleset_destroy(desired);
+        return rc;
+}
+
+// Read the "<method> <ip>" lines of a batch and apply them in one transaction
+static int _apply(replica_reader_t *reader, const char *header, backend_rule_t **rules, struct response **responses, size_t *size)
+{
+        unsigned long long first = 0, count = 0;
+        char method[16], ip[16], *line;
+        void *grown;
+        int failed = 0;
+
+        _field(header, "batch", &first);
+        _field(header, "count", &count);
+        if (first != replica.applied + 1) {
+                log_error("Replication gap: expected %llu, got %llu", replica.applied + 1, first);
+                return -1;
+        }
+
+        if (count > *size) {
+                if ((grown = realloc (*rules, count * sizeof(**rules))) == NULL)
+                        return -1;
+                *rules = (backend_rule_t*) grown;
+                if ((grown = realloc (*responses, count * sizeof(**responses))) == NULL)
+                        return -1;
+                *responses = (struct response*) grown;
+                *size = count;
+        }
+
+        for (unsigned long long i=0; i<count; ++i) {
+                if (_next(reader, &line) <= 0)
+                        return -1;
+                memset(&(*rules)[i], 0, sizeof(**rules));
+                if (sscanf(line, "%15s %15s", method, ip) != 2) {
+                        log_error("Invalid batch line: '%s'", line);
+                        return -1;
+                }
+                (*rules)[i].op = strcmp(method, "append") == 0 ? BACKEND_APPEND : BACKEND_REMOVE;
+                snprintf((*rules)[i].ip, sizeof((*rules)[i].ip), "%s", ip);
+        }
+
+        if (runner_batch(*rules, *responses, count) < 0)
+                return -1;
+        for (unsigned long long i=0; i<count; ++i) {
+                if ((*responses)[i].code != 0) {
+                        log_error("Failed to replicate %s %s: %s", _op((*rules)[i].op), (*rules)[i].ip, (*responses)[i].reason);
+                        failed++;
+                }
+        }
+
+        pthread_mutex_lock(&replica.lock);
+        replica.applied = first + count - 1;
+        if (replica.known < replica.applied)
+                replica.known = replica.applied;
+        // The rules diverged, a snapshot puts them right on the next connection
+        if (failed > 0)
+                replica.leader = 0;
+        pthread_mutex_unlock(&replica.lock);
+        return failed > 0 ? -1 : 0;
+}
+
+static void _stream(int sock)
+{
+        replica_reader_t *reader;
+        backend_rule_t *rules = NULL;
+        struct response *responses = NULL;
+        unsigned long long head;
+        size_t size = 0;
+        char hello[128], *line;
+        int rc;
+
+        if ((reader = (replica_reader_t*) calloc (1, sizeof(*reader))) == NULL)
+                return;
+        reader->sock = sock;
+
+        snprintf(hello, sizeof(hello), "method=follow;epoch=%llu;seq=%llu\n", replica.leader, replica.applied);
+        rc = _send(sock, hello, strlen(hello));
+        pthread_mutex_lock(&replica.lock);
+        replica.connected = rc == 0;
+        pthread_mutex_unlock(&replica.lock);
+
+        while (rc >= 0 && _next(reader, &line) > 0) {
+                if (strncmp(line, "snapshot=", 9) == 0) {
+                        rc = _resync(reader, line);
+                } else if (strncmp(line, "batch=", 6) == 0) {
+                        rc = _apply(reader, line, &rules, &responses, &size);
+                } else if (_field(line, "head", &head)) {
+                        pthread_mutex_lock(&replica.lock);
+                        if (replica.known < head)
+                                replica.known = head;
+                        pthread_mutex_unlock(&replica.lock);
+                } else {
+                        log_warning("Unknown replication line: '%s'", line);
+                }
+                if (rc == 0)
+                        rc = _printf(sock, "ack=%llu\n", replica.applied);
+        }
+
+        pthread_mutex_lock(&replica.lock);
+        replica.connected = false;
+        pthread_mutex_unlock(&replica.lock);
+        free(reader);
+        free(rules);
+        free(responses);
+}
+
+static void* _follow(void *arg)
+{
+        struct timespec deadline;
+        int sock;
+
+        while (__atomic_load_n(&replica.running, __ATOMIC_RELAXED)) {
+                if ((sock = _connect()) >= 0) {
+                        _timeouts(sock);
+                        pthread_mutex_lock(&replica.lock);
+                        replica.sock = sock;
+                        pthread_mutex_unlock(&replica.lock);
+
+                        log_info("Following %s:%s from sequence %llu", replica.host, replica.port, replica.applied);
+                        _stream(sock);
+                        log_warning("Lost the leader %s:%s at sequence %llu", replica.host, replica.port, replica.applied);
+
+                        pthread_mutex_lock(&replica.lock);
+                        replica.sock = -1;
+                        pthread_mutex_unlock(&replica.lock);
+                        close(sock);
+                }
+
+                // Reconnect after a second, the teardown wakes it up
+                pthread_mutex_lock(&replica.lock);
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += 1;
+                while (replica.running && pthread_cond_timedwait(&replica.changed, &replica.lock, &deadline) != ETIMEDOUT);
+                pthread_mutex_unlock(&replica.lock);
+        }
+        return NULL;
+}
+
+int replica_follow(const char *leader)
+{
+        const char *colon = strrchr(leader, ':');
+
+        pthread_once(&_clocked, _clock);
+        if (colon == NULL || colon == leader || (size_t)(colon - leader) >= sizeof(replica.host) ||
+                        strlen(colon + 1) >= sizeof(replica.port) || atoi(colon + 1) <= 0) {
+                log_error("Invalid leader '%s', expected <host>:<port>", leader);
+                return -1;
+        }
+        snprintf(replica.host, sizeof(replica.host), "%.*s", (int)(colon - leader), leader);
+        snprintf(replica.port, sizeof(replica.port), "%s", colon + 1);
+
+        replica.running = true;
+        if (pthread_create(&replica.follower, NULL, _follow, NULL) != 0) {
+                log_error("Failed to create follower thread");
+                return -1;
+        }
+        replica.following = true;
+        return 0;
+}
+
+
+void replica_teardown()
+{
+        pthread_mutex_lock(&replica.lock);
+        replica.running = false;
+        pthread_cond_broadcast(&replica.changed);
+        if (replica.sock >= 0)
+                shutdown(replica.sock, SHUT_RDWR);
+        pthread_mutex_unlock(&replica.lock);
+
+        if (replica.following) {
+                pthread_join(replica.follower, NULL);
+                replica.following = false;
+        }
+
+        if (replica.listener >= 0) {
+                shutdown(replica.listener, SHUT_RDWR);
+                pthread_join(replica.accepter, NULL);
+                close(replica.listener);
+                replica.listener = -1;
+
+                _reap(true);
+        }
+
+        free(replica.log);
+        replica.log = NULL;
+}
+
+void replica_publish(enum backend_op op, uint32_t ip)
+{
+        // Set up before the first change, only the leaders keep a log
+        if (replica.log == NULL)
+                return;
+
+        pthread_mutex_lock(&replica.lock);
+        replica.head++;
+        replica.log[replica.head % replica.size] = (replica_change_t) {ip, op};
+        pthread_cond_broadcast(&replica.changed);
+        pthread_mutex_unlock(&replica.lock);
+}
+
+unsigned long long replica_head()
+{
+        unsigned long long head;
+
+        pthread_mutex_lock(&replica.lock);
+        head = replica.head;
+        pthread_mutex_unlock(&replica.lock);
+        return head;
+}
+
+void replica_stats(replica_stats_t *stats)
+{
+        memset(stats, 0, sizeof(*stats));
+
+        pthread_mutex_lock(&replica.lock);
+        if (replica.following) {
+                stats->head = replica.known;
+                stats->applied = replica.applied;
+                stats->connected = replica.connected;
+        } else {
+                stats->head = replica.head;
+        }
+        for (replica_peer_t *peer = replica.peers; peer != NULL; peer = peer->next)
+                stats->followers += !peer->done;
+        pthread_mutex_unlock(&replica.lock);
+}
+
+void replica_write(FILE *out, const char *prefix)
+{
+        replica_stats_t stats;
+
+        replica_stats(&stats);
+
+        if (replica.log != NULL) {
+                fprintf(out, "# HELP %s_replica_sequence Last sequence number of the replication log.\n", prefix);
+                fprintf(out, "# TYPE %s_replica_sequence counter\n", prefix);
+                fprintf(out, "%s_replica_sequence %llu\n", prefix, replica_head());
+
+                fprintf(out, "# HELP %s_replica_follower_lag Changes the followers have not acknowledged yet.\n", prefix);
+                fprintf(out, "# TYPE %s_replica_follower_lag gauge\n", prefix);
+                pthread_mutex_lock(&replica.lock);
+                for (replica_peer_t *peer = replica.peers; peer != NULL; peer = peer->next)
+                        if (!peer->done)
+                                fprintf(out, "%s_replica_follower_lag{follower=\"%s\"} %llu\n", prefix, peer->name,
+                                                replica.head - __atomic_load_n(&peer->acked, __ATOMIC_RELAXED));
+                pthread_mutex_unlock(&replica.lock);
+        }
+
+        if (replica.following) {
+                fprintf(out, "# HELP %s_replica_connected Follower is connected to the leader.\n", prefix);
+                fprintf(out, "# TYPE %s_replica_connected gauge\n", prefix);
+                fprintf(out, "%s_replica_connected %d\n", prefix, stats.connected);
+                fprintf(out, "# HELP %s_replica_applied Last applied sequence number of the leader.\n", prefix);
+                fprintf(out, "# TYPE %s_replica_applied counter\n", prefix);
+                fprintf(out, "%s_replica_applied %llu\n", prefix, stats.applied);
+                fprintf(out, "# HELP %s_replica_lag Changes of the leader this follower has not applied yet.\n", prefix);
+                fprintf(out, "# TYPE %s_replica_lag gauge\n", prefix);
+                fprintf(out, "%s_replica_lag %llu\n", prefix, stats.head - stats.applied);
+        }
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "backend.h"
+
+
+// Leader / follower replication of the rule changes:
+//
+// The leader numbers every applied change (through any method, expiry and
+// sync included) and keeps the last ones in a ring log. The followers
+// connect to its replication port and ask for the changes after the last
+// one they applied, a follower which is too far behind, or talks to a
+// restarted leader, gets a snapshot of the managed rules instead and syncs
+// to it. The changes are streamed in batches and applied with one backend
+// transaction each, the followers acknowledge the applied sequence numbers.
+//
+// A follower is a leader of its own changes too, so the servers can be
+// chained.
+typedef struct replica_stats {
+        unsigned long long head;        // Last sequence number of the leader
+        unsigned long long applied;     // Follower: last applied sequence number
+        int connected;                  // Follower: connected to the leader
+        int followers;                  // Leader: connected followers
+} replica_stats_t;
+
+
+// Keep size changes in the log and send them in batches of batch changes
+int replica_lead(const char *host, unsigned short port, size_t size, int batch);
+// Follow the leader at "<host>:<port>"
+int replica_follow(const char *leader);
+void replica_teardown();
+
+// Called by the runner for every applied change, in the order of the managed set
+void replica_publish(enum backend_op op, uint32_t ip);
+unsigned long long replica_head();
+
+void replica_stats(replica_stats_t *stats);
+void replica_write(FILE *out, const char *prefix);
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "logging.h"
+#include "hash.h"
+#include "ruleset.h"
+
+
+#define RULESET_MIN_CAPACITY 64
+
+static inline size_t _slot(const ruleset_t *set, uint32_t ip)
+{
+        return hash32(ip) & (set->capacity - 1);
+}
+
+static int _resize(ruleset_t *set, size_t capacity)
+{
+        ruleset_entry_t *entries = set->entries;
+        size_t old = set->capacity, slot;
+
+        if (set->fixed) {
+                log_error("Ruleset is full (%zu addresses)", set->size);
+                return -1;
+        }
+
+        set->entries = (ruleset_entry_t*) calloc (capacity, sizeof(*set->entries));
+        if (set->entries == NULL) {
+                log_error("Failed to calloc() ruleset of %zu entries", capacity);
+                set->entries = entries;
+                return -1;
+        }
+        set->capacity = capacity;
+
+        for (size_t i=0; i<old; ++i) {
+                if (entries[i].count == 0)
+                        continue;
+                for (slot = _slot(set, entries[i].ip); set->entries[slot].count != 0; slot = (slot + 1) & (capacity - 1));
+                set->entries[slot] = entries[i];
+        }
+        free(entries);
+        return 0;
+}
+
+static ruleset_entry_t* _find(const ruleset_t *set, uint32_t ip)
+{
+        size_t slot;
+
+        for (slot = _slot(set, ip); set->entries[slot].count != 0; slot = (slot + 1) & (set->capacity - 1))
+                if (set->entries[slot].ip == ip)
+                        return &set->entries[slot];
+        return NULL;
+}
+
+// Backward shift deletion keeps the probe sequences intact without tombstones
+static void _delete(ruleset_t *set, size_t hole)
+{
+        size_t mask = set->capacity - 1, slot = hole, home;
+
+        while (1) {
+                slot = (slot + 1) & mask;
+                if (set->entries[slot].count == 0)
+                        break;
+
+                // Move the entry into the hole unless its home is between the hole and the slot
+                home = _slot(set, set->entries[slot].ip);
+                if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                        set->entries[hole] = set->entries[slot];
+                        hole = slot;
+                }
+        }
+        set->entries[hole].count = 0;
+        set->entries[hole].ip = 0;
+}
+
+
+ruleset_t* ruleset_create(size_t capacity)
+{
+        ruleset_t *set;
+        size_t size = RULESET_MIN_CAPACITY;
+
+        while (size < capacity)
+                size <<= 1;
+
+        set = (ruleset_t*) calloc (1, sizeof(*set));
+        if (set == NULL) {
+                log_error("Failed to calloc() ruleset");
+                return NULL;
+        }
+        if (_resize(set, size) < 0) {
+                free(set);
+                return NULL;
+        }
+        return set;
+}
+
+void ruleset_destroy(ruleset_t *set)
+{
+        if (set == NULL || set->fixed)
+                return;
+        free(set->entries);
+        free(set);
+}
+
+void ruleset_clear(ruleset_t *set)
+{
+        memset(set->entries, 0, set->capacity * sizeof(*set->entries));
+        set->size = 0;
+        set->rules = 0;
+}
+
+// Twice the slots of the addresses keep the load factor under 1/2
+static size_t _slots(size_t capacity)
+{
+        size_t size = RULESET_MIN_CAPACITY;
+
+        while (size < capacity * 2)
+                size <<= 1;
+        return size;
+}
+
+size_t ruleset_footprint(size_t capacity)
+{
+        return sizeof(ruleset_t) + _slots(capacity) * sizeof(ruleset_entry_t);
+}
+
+ruleset_t* ruleset_place(void *memory, size_t capacity)
+{
+        ruleset_t *set = (ruleset_t*) memory;
+
+        set->capacity = _slots(capacity);
+        set->size = 0;
+        set->rules = 0;
+        set->fixed = true;
+        set->entries = (ruleset_entry_t*) (set + 1);
+        return set;
+}
+
+void ruleset_recount(ruleset_t *set)
+{
+        set->size = 0;
+        set->rules = 0;
+        for (size_t i=0; i<set->capacity; ++i) {
+                if (set->entries[i].count == 0)
+                        continue;
+                set->size++;
+                set->rules += set->entries[i].count;
+        }
+}
+
+int ruleset_parse(const char *ip, uint32_t *addr)
+{
+        struct in_addr in;
+
+        if (inet_pton(AF_INET, ip, &in) != 1)
+                return -1;
+        *addr = ntohl(in.s_addr);
+        return 0;
+}
+
+void ruleset_format(uint32_t addr, char *ip, size_t size)
+{
+        struct in_addr in = {htonl(addr)};
+
+        inet_ntop(AF_INET, &in, ip, size);
+}
+
+int ruleset_add(ruleset_t *set, uint32_t ip, uint32_t count)
+{
+        ruleset_entry_t *entry;
+        size_t slot;
+
+        if (count == 0)
+                return 0;
+
+        if ((entry = _find(set, ip)) == NULL) {
+                // Keep the load factor under 1/2 for short probe sequences
+                if ((set->size + 1) * 2 > set->capacity && _resize(set, set->capacity * 2) < 0)
+                        return -1;
+                for (slot = _slot(set, ip); set->entries[slot].count != 0; slot = (slot + 1) & (set->capacity - 1));
+                entry = &set->entries[slot];
+                entry->ip = ip;
+                set->size++;
+        }
+        entry->count += count;
+        set->rules += count;
+        return 0;
+}
+
+uint32_t ruleset_remove(ruleset_t *set, uint32_t ip, uint32_t count)
+{
+        ruleset_entry_t *entry;
+
+        if ((entry = _find(set, ip)) == NULL)
+                return 0;
+
+        if (count >= entry->count) {
+                count = entry->count;
+                _delete(set, entry - set->entries);
+                set->size--;
+        } else {
+                entry->count -= count;
+        }
+        set->rules -= count;
+        return count;
+}
+
+uint32_t ruleset_count(const ruleset_t *set, uint32_t ip)
+{
+        ruleset_entry_t *entry = _find(set, ip);
+
+        return entry != NULL ? entry->count : 0;
+}
+
+ruleset_entry_t* ruleset_next(const ruleset_t *set, size_t *cursor)
+{
+        while (*cursor < set->capacity) {
+                if (set->entries[(*cursor)++].count != 0)
+                        return &set->entries[*cursor - 1];
+        }
+        return NULL;
+}
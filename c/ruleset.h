@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+
+// Set of the managed rules keyed by the IPv4 address in host byte order.
+// Open addressing with linear probing in a power of two table, the count
+// keeps the duplicated rules (iptables keeps them too).
+typedef struct ruleset_entry {
+        uint32_t ip;
+        uint32_t count;         // 0: empty slot
+} ruleset_entry_t;
+
+typedef struct ruleset {
+        size_t capacity;
+        size_t size;            // Distinct addresses
+        size_t rules;           // Rules together with the duplicates
+        bool fixed;             // Placed into the memory of the caller, it can not grow
+        ruleset_entry_t *entries;
+} ruleset_t;
+
+// The set does no locking, the callers have to serialize the access
+ruleset_t* ruleset_create(size_t capacity);
+void ruleset_destroy(ruleset_t *set);
+void ruleset_clear(ruleset_t *set);
+
+// A set of at most capacity addresses in the zeroed memory of the caller (eg.
+// shared by processes), the memory has to be ruleset_footprint() bytes
+size_t ruleset_footprint(size_t capacity);
+ruleset_t* ruleset_place(void *memory, size_t capacity);
+// Count the addresses and the rules again from the entries
+void ruleset_recount(ruleset_t *set);
+
+int ruleset_parse(const char *ip, uint32_t *addr);
+void ruleset_format(uint32_t addr, char *ip, size_t size);
+
+int ruleset_add(ruleset_t *set, uint32_t ip, uint32_t count);
+// Returns the number of the removed rules
+uint32_t ruleset_remove(ruleset_t *set, uint32_t ip, uint32_t count);
+uint32_t ruleset_count(const ruleset_t *set, uint32_t ip);
+
+// Iterate the entries, the cursor has to start from 0
+ruleset_entry_t* ruleset_next(const ruleset_t *set, size_t *cursor);
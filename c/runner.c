@@ -1,46 +1,415 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
 #include <regex.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
 
 #include "logging.h"
 #include "netpack.h"
+#include "backend.h"
+#include "ruleset.h"
+#include "expiry.h"
+#include "replica.h"
+#include "flight.h"
+#include "limit.h"
+#include "exec.h"
+#include "stats.h"
+#include "threadpool.h"
+#include "runner.h"
 
 
 #define NUM255 "([0-9]|[1-9][0-9]|1[0-9][0-9]|2[0-4][0-9]|25[0-5])"
 #define IPV4_PATTERN "^" NUM255 "." NUM255 "." NUM255 "." NUM255 "$"
 
-int runner_process(struct request request, struct response *response)
-{
-    int fd[2];
-    int status;
-    pid_t pid;
+// The rules applied through the server behind the apply gate: the changes
+// hold the gate shared and update the set under the lock of the set, a sync
+// holds it exclusively so nothing can change the rules in the meantime.
+// Unlike a rwlock the gate can be left by another thread, so a submitted rule
+// holds it until its completion. In prefork mode the state is in the memory
+// shared by the worker processes, its locks are robust so the others can go
+// on when a worker dies holding them.
+typedef struct runner_state {
+    pthread_mutex_t gate;
+    pthread_cond_t open;
+    int appliers;
+    int syncer;                     // Worker of the sync (-1: none)
+    pthread_mutex_t lock;
+    unsigned long seq;              // Odd while the set changes, the readers without the lock retry
+    bool loaded;                    // The rules of the backend were listed into the set
+    ruleset_t *managed;
+    int held[];                     // Shared holds of the gate by worker
+} runner_state_t;
+
+#define RUNNER_ALIGN 64                 // Of the set behind the state
+#define RUNNER_TRIES 1000               // Of the readers without the lock
+
+static struct {
+    backend_t *backend;
     regex_t regex;
-    char cmd[1024];
-    char buffer[1024];
-    char success[1024];
-    char append[] = "-A";
-    char remove[] = "-D";
-    char *argv[] = {"iptables", "<-A/-D>", "FORWARD", "-s", "<ip>", "-j", "ACCEPT", 0};
 
-    // Leave this here for thread-testing purposes
-    //log_debug("-------------------------------------- Sleeping in runner_process ------------------------------------------");
-    //usleep(100000);
+    runner_state_t *state;
+    bool shared;                    // The state is not freed with the runner
+    int worker;
+
+    // The single requests in flight by address
+    flight_t *flight;
+    // Concurrent backend calls
+    limit_t *limit;
+    // Starts the queued submissions, so a completion does not start the next one itself
+    tp_t *starter;
+} runner;
+
+// A rule from runner_submit() until its backend call completes
+typedef struct submission {
+    backend_rule_t rule;
+    struct response *response;
+    uint32_t addr;
+    flight_call_t *flight;
+    limit_waiter_t waiter;
+    uint64_t stamp;
+    void (*done)(void *arg, int rc);
+    void *arg;
+} submission_t;
+
+
+static int init(runner_state_t *state, bool shared)
+{
+    pthread_mutexattr_t mutex;
+    pthread_condattr_t cond;
+    int rc = 0;
+
+    pthread_mutexattr_init(&mutex);
+    pthread_condattr_init(&cond);
+    pthread_mutexattr_setrobust(&mutex, PTHREAD_MUTEX_ROBUST);
+    if (shared && (pthread_mutexattr_setpshared(&mutex, PTHREAD_PROCESS_SHARED) != 0 ||
+                pthread_condattr_setpshared(&cond, PTHREAD_PROCESS_SHARED) != 0)) {
+        log_error("Failed to share the runner locks between processes");
+        rc = -1;
+    }
+    if (rc == 0 && (pthread_mutex_init(&state->gate, &mutex) != 0 || pthread_mutex_init(&state->lock, &mutex) != 0 ||
+                pthread_cond_init(&state->open, &cond) != 0)) {
+        log_error("Failed to initialize the runner locks");
+        rc = -1;
+    }
+    pthread_condattr_destroy(&cond);
+    pthread_mutexattr_destroy(&mutex);
+    state->syncer = -1;
+    return rc;
+}
+
+// The set was left in the middle of a change by a dead worker: its counters
+// are rebuilt, the entries are as far as the change got
+static void repair(runner_state_t *state)
+{
+    if ((state->seq & 1) == 0)
+        return;
+    ruleset_recount(state->managed);
+    __atomic_store_n(&state->seq, state->seq + 1, __ATOMIC_RELEASE);
+    log_warning("Recovered the managed set from a dead worker: %zu rule(s) of %zu address(es), a sync makes it exact",
+            state->managed->rules, state->managed->size);
+}
+
+static void take(pthread_mutex_t *mutex)
+{
+    if (pthread_mutex_lock(mutex) == EOWNERDEAD) {
+        log_warning("Took over a lock of a dead worker");
+        pthread_mutex_consistent(mutex);
+        if (mutex == &runner.state->lock)
+            repair(runner.state);
+    }
+}
+
+static void lock()
+{
+    take(&runner.state->lock);
+}
+
+static void unlock()
+{
+    pthread_mutex_unlock(&runner.state->lock);
+}
+
+// Every change of the set is between these, under the lock or the exclusive gate
+static void begin()
+{
+    __atomic_store_n(&runner.state->seq, runner.state->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void end()
+{
+    __atomic_store_n(&runner.state->seq, runner.state->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void enter(bool exclusive)
+{
+    runner_state_t *state = runner.state;
+
+    take(&state->gate);
+    while (state->syncer >= 0 || (exclusive && state->appliers > 0)) {
+        if (pthread_cond_wait(&state->open, &state->gate) == EOWNERDEAD)
+            pthread_mutex_consistent(&state->gate);
+    }
+    if (exclusive) {
+        state->syncer = runner.worker;
+    } else {
+        state->appliers++;
+        state->held[runner.worker]++;
+    }
+    pthread_mutex_unlock(&state->gate);
+}
+
+static void leave(bool exclusive)
+{
+    runner_state_t *state = runner.state;
+
+    take(&state->gate);
+    if (exclusive) {
+        state->syncer = -1;
+    } else {
+        state->appliers--;
+        state->held[runner.worker]--;
+    }
+    if (exclusive || state->appliers == 0)
+        pthread_cond_broadcast(&state->open);
+    pthread_mutex_unlock(&state->gate);
+}
+
+
+// The only changes of the managed set, under its lock or the exclusive gate
+// Fails when the set is full (eg. the fixed-size set of the prefork mode)
+static int change(enum backend_op op, uint32_t addr)
+{
+    int rc = 0;
+
+    begin();
+    if (op == BACKEND_APPEND)
+        rc = ruleset_add(runner.state->managed, addr, 1);
+    else
+        ruleset_remove(runner.state->managed, addr, 1);
+    end();
+    return rc;
+}
+
+static void load(void *arg, const char *ip)
+{
+    uint32_t addr;
+
+    if (ruleset_parse(ip, &addr) == 0 && change(BACKEND_APPEND, addr) < 0)
+        log_error("Failed to manage the current rule of %s", ip);
+}
+
+// The backend calls go through the concurrency limit, the single rules give the latency samples
+static int call(const backend_rule_t *rules, struct response *responses, int count, int batch)
+{
+    uint64_t stamp, now;
+    int rc;
+
+    stamp = stats_now();
+    limit_acquire(runner.limit);
+    now = stats_now();
+    stats_record(STATS_LIMIT, now - stamp);
+
+    if (!batch)
+        rc = runner.backend->apply(runner.backend, rules, responses);
+    else
+        rc = runner.backend->apply_batch(runner.backend, rules, responses, count);
+
+    stamp = stats_now();
+    stats_record(STATS_BACKEND, stamp - now);
+    limit_release(runner.limit, batch ? 0 : stamp - now);
+    return rc;
+}
+
+// Track the successfully applied rules, only the ones of the default template are managed
+static void manage(const backend_rule_t *rule, struct response *response)
+{
+    uint32_t addr;
+
+    if (response->code != 0 || rule->template != TEMPLATE_DEFAULT || ruleset_parse(rule->ip, &addr) < 0)
+        return;
 
-    memset(cmd, 0, sizeof(cmd));
-    memset(buffer, 0, sizeof(buffer));
-    memset(success, 0, sizeof(success));
+    // The rule is in the firewall but not in the set, the request fails so it is not lost silently
+    if (change(rule->op, addr) < 0) {
+        log_error("Failed to manage the rule of %s", rule->ip);
+        response->code = 1;
+        snprintf(response->reason, sizeof(response->reason), "The rule of %s was applied but the managed set is full",
+                rule->ip);
+        return;
+    }
+    replica_publish(rule->op, addr);
+}
+
+// Schedule the expiry of the temporary rules, a removed rule takes back one of them
+static void track(const backend_rule_t *rule, const struct response *response)
+{
+    uint32_t addr;
+
+    if (response->code != 0 || rule->template != TEMPLATE_DEFAULT || ruleset_parse(rule->ip, &addr) < 0)
+        return;
+
+    if (rule->op == BACKEND_REMOVE)
+        expiry_revoke(addr);
+    else if (rule->ttl > 0 && expiry_grant(addr, rule->ttl) < 0)
+        log_error("Failed to schedule the expiry of %s", rule->ip);
+}
+
+static runner_state_t* local()
+{
+    runner_state_t *state;
+
+    if ((state = (runner_state_t*) calloc (1, sizeof(*state) + sizeof(state->held[0]))) == NULL) {
+        log_error("Failed to calloc() runner state");
+        return NULL;
+    }
+    if (init(state, false) < 0 || (state->managed = ruleset_create(0)) == NULL) {
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+// The shared state outlives the workers
+static void release()
+{
+    if (runner.shared || runner.state == NULL)
+        return;
+    ruleset_destroy(runner.state->managed);
+    pthread_cond_destroy(&runner.state->open);
+    pthread_mutex_destroy(&runner.state->lock);
+    pthread_mutex_destroy(&runner.state->gate);
+    free(runner.state);
+    runner.state = NULL;
+}
+
+
+// The jobs of the starter are allocated by queued()
+static void started(void *arg, tp_job_t *job)
+{
+    free(job);
+}
+
+int runner_setup(const char *backend, int limit, int min, int max)
+{
+    size_t addresses, rules;
+
+    // regexec() is thread-safe, the pattern is compiled only once
+    if (regcomp(&runner.regex, IPV4_PATTERN, REG_EXTENDED)) {
+        log_error("Failed to compile regex");
+        return -1;
+    }
+
+    // The backends start their commands through the reaper
+    if (exec_setup() < 0) {
+        regfree(&runner.regex);
+        return -1;
+    }
+
+    runner.backend = backend_create(backend);
+    if (runner.backend == NULL) {
+        log_error("Failed to create backend '%s'", backend);
+        exec_teardown();
+        regfree(&runner.regex);
+        return -1;
+    }
+
+    // Without runner_share() the state is of this process only
+    if (!runner.shared && (runner.state = local()) == NULL) {
+        backend_destroy(runner.backend);
+        runner.backend = NULL;
+        exec_teardown();
+        regfree(&runner.regex);
+        return -1;
+    }
+    runner.flight = flight_create();
+    runner.limit = limit_create(limit, min, max);
+    if ((runner.starter = tp_create(1, 0)) != NULL) {
+        tp_recycle(runner.starter, started, NULL);
+        if (tp_start(runner.starter) < 0) {
+            tp_destroy(runner.starter);
+            runner.starter = NULL;
+        }
+    }
+    if (runner.flight == NULL || runner.limit == NULL || runner.starter == NULL) {
+        if (runner.starter != NULL) {
+            tp_stop(runner.starter);
+            tp_destroy(runner.starter);
+        }
+        flight_destroy(runner.flight);
+        limit_destroy(runner.limit);
+        runner.flight = NULL;
+        runner.limit = NULL;
+        runner.starter = NULL;
+        release();
+        backend_destroy(runner.backend);
+        runner.backend = NULL;
+        exec_teardown();
+        regfree(&runner.regex);
+        return -1;
+    }
+
+    // The rules of the previous runs are managed too, the first worker lists them for all
+    lock();
+    if (!runner.state->loaded && runner.backend->list(runner.backend, load, NULL) < 0)
+        log_warning("Failed to list the current rules, starting with an empty managed set");
+    runner.state->loaded = true;
+    unlock();
+    runner_managed(&addresses, &rules);
+    log_info("Managing %zu rule(s) of %zu address(es)", rules, addresses);
+    return 0;
+}
+
+void runner_teardown()
+{
+    if (runner.backend == NULL)
+        return;
+
+    // The completions still use the runner, the starter is idle after runner_drain()
+    tp_stop(runner.starter);
+    tp_destroy(runner.starter);
+    runner.starter = NULL;
+    exec_teardown();
+    backend_destroy(runner.backend);
+    runner.backend = NULL;
+    release();
+    flight_destroy(runner.flight);
+    runner.flight = NULL;
+    limit_destroy(runner.limit);
+    runner.limit = NULL;
+    regfree(&runner.regex);
+}
+
+void runner_drain()
+{
+    limit_stats_t stats;
+
+    // The queued submissions start their commands after the running ones
+    exec_idle();
+    while (runner.limit != NULL) {
+        limit_stats(runner.limit, &stats);
+        if (stats.inflight == 0 && stats.waiting == 0)
+            break;
+        usleep(1000);
+        exec_idle();
+    }
+}
 
+backend_t* runner_backend()
+{
+    return runner.backend;
+}
+
+int runner_rule(struct request request, backend_rule_t *rule, struct response *response)
+{
     // Check method
     if (strcmp(request.method, "append") == 0) {
-        argv[1] = append;
-        snprintf(success, sizeof(success), "%s was successfully added", request.ip);
+        rule->op = BACKEND_APPEND;
     } else if (strcmp(request.method, "remove") == 0) {
-        argv[1] = remove;
-        snprintf(success, sizeof(success), "%s was successfully removed", request.ip);
+        rule->op = BACKEND_REMOVE;
     } else {
         response->code = 1;
         snprintf(response->reason, sizeof(response->reason), "Invalid method: '%s'", request.method);
@@ -48,78 +417,493 @@ int runner_process(struct request request, struct response *response)
     }
 
     // Check IP
-    if (regcomp(&regex, IPV4_PATTERN, REG_EXTENDED)) {
-        log_error("Failed to compile regex");
-        return -1;
-    }
-    if (regexec(&regex, request.ip, 0, NULL, 0) != 0) {
+    if (regexec(&runner.regex, request.ip, 0, NULL, 0) != 0) {
         log_error("Invalid ip address '%s'", request.ip);
         response->code = 1;
         snprintf(response->reason, sizeof(response->reason), "Invalid ip: '%s'", request.ip);
         return 1;
     }
 
-    argv[4] = request.ip;
+    // Check template, the named ones only fill in their compiled skeleton
+    if ((rule->template = templates_find(runner.backend->templates, request.rule)) < 0) {
+        response->code = 1;
+        snprintf(response->reason, sizeof(response->reason), "Invalid rule: '%s'", request.rule);
+        return 1;
+    }
 
-    // Concatenate command
-    int counter = 0;
-    int size = 0;
-    for (int i=0; argv[i] != NULL; ++i) {
-        size = strlen(argv[i]);
-        if ((counter + size) > sizeof(cmd))
-            break;
-        strcat(cmd, argv[i]);
-        strcat(cmd, " ");
-        counter += size + 1;
+    // Check TTL, the expiry handles only the managed rules
+    if (request.ttl < 0 || request.ttl > EXPIRY_MAX_TTL ||
+            (request.ttl > 0 && (rule->op != BACKEND_APPEND || rule->template != TEMPLATE_DEFAULT))) {
+        response->code = 1;
+        snprintf(response->reason, sizeof(response->reason), "Invalid ttl: %d", request.ttl);
+        return 1;
+    }
+
+    snprintf(rule->ip, sizeof(rule->ip), "%s", request.ip);
+    rule->ttl = request.ttl;
+    return 0;
+}
+
+void runner_result(const backend_rule_t *rule, struct response *response)
+{
+    if (response->code != 0)
+        return;
+
+    if (rule->template != TEMPLATE_DEFAULT)
+        snprintf(response->reason, sizeof(response->reason), "%s was successfully %s (%s)", rule->ip,
+                rule->op == BACKEND_APPEND ? "added" : "removed", runner.backend->templates->list[rule->template]->name);
+    else if (rule->op == BACKEND_APPEND && rule->ttl > 0)
+        snprintf(response->reason, sizeof(response->reason), "%s was successfully added, expires in %u s",
+                rule->ip, rule->ttl);
+    else if (rule->op == BACKEND_APPEND)
+        snprintf(response->reason, sizeof(response->reason), "%s was successfully added", rule->ip);
+    else
+        snprintf(response->reason, sizeof(response->reason), "%s was successfully removed", rule->ip);
+}
+
+static int apply(void *arg, struct response *response)
+{
+    backend_rule_t *rule = (backend_rule_t*) arg;
+
+    // Leave this here for thread-testing purposes
+    //log_debug("-------------------------------------- Sleeping in runner_process ------------------------------------------");
+    //usleep(100000);
+
+    response->code = 0;
+    enter(false);
+    if (call(rule, response, 1, 0) < 0) {
+        leave(false);
+        return -1;
+    }
+    lock();
+    manage(rule, response);
+    unlock();
+    track(rule, response);
+    leave(false);
+
+    runner_result(rule, response);
+    return 0;
+}
+
+// The requests which are identical for the flights: method, template and ttl
+static uint64_t kind(const backend_rule_t *rule)
+{
+    return (uint64_t) rule->template << 32 | (uint64_t) rule->ttl << 1 | rule->op;
+}
+
+static int process(backend_rule_t *rule, struct response *response)
+{
+    uint32_t addr;
+
+    if (ruleset_parse(rule->ip, &addr) < 0)
+        return apply(rule, response);
+
+    // The identical requests in flight share one execution, the others of
+    // the same address wait for their turn in arrival order
+    return flight_do(runner.flight, addr, kind(rule), apply, rule, response);
+}
+
+int runner_process(struct request request, struct response *response)
+{
+    backend_rule_t rule;
+    int rc;
+
+    if ((rc = runner_rule(request, &rule, response)) != 0)
+        return rc;
+    return process(&rule, response);
+}
+
+// Runs on the thread of the backend completion, the same steps as apply() after the call
+static void complete(void *arg, int rc)
+{
+    submission_t *submission = (submission_t*) arg;
+    uint64_t ns = stats_now() - submission->stamp;
+
+    stats_record(STATS_BACKEND, ns);
+    if (rc == 0) {
+        lock();
+        manage(&submission->rule, submission->response);
+        unlock();
+        track(&submission->rule, submission->response);
+    }
+    leave(false);
+
+    if (rc == 0)
+        runner_result(&submission->rule, submission->response);
+    flight_end(runner.flight, submission->addr, submission->flight, rc, submission->response);
+    submission->done(submission->arg, rc);
+
+    // The next waiter is handed to the starter
+    limit_release(runner.limit, ns);
+    free(submission);
+}
+
+// Called with a slot of the concurrency limit
+static void start(void *arg)
+{
+    submission_t *submission = (submission_t*) arg;
+    uint64_t now = stats_now();
+
+    stats_record(STATS_LIMIT, now - submission->stamp);
+    submission->stamp = now;
+    submission->response->code = 0;
+    if (runner.backend->submit(runner.backend, &submission->rule, submission->response, complete, submission) < 0)
+        complete(submission, -1);
+}
+
+// The slot of a queued submission is freed by the completion of another one,
+// the starter takes it over so the completion does not start it right there
+static void queued(void *arg)
+{
+    tp_job_t *job;
+
+    if ((job = (tp_job_t*) calloc (1, sizeof(*job))) != NULL) {
+        job->function = start;
+        job->arg = arg;
+        if (tp_put(runner.starter, job) == 0)
+            return;
+        free(job);
+    }
+    log_error("Failed to hand over submission, starting it on the completion");
+    start(arg);
+}
+
+int runner_submit(struct request request, struct response *response, void (*done)(void *arg, int rc), void *arg)
+{
+    submission_t *submission;
+    backend_rule_t rule;
+    flight_call_t *flight;
+    uint32_t addr;
+    int rc;
+
+    if ((rc = runner_rule(request, &rule, response)) != 0)
+        return rc;
+
+    // A request of an address which is in flight already waits for it (or shares its result) on this thread
+    if (runner.backend->submit == NULL || ruleset_parse(rule.ip, &addr) < 0 ||
+            (flight = flight_begin(runner.flight, addr, kind(&rule))) == NULL)
+        return process(&rule, response);
+
+    if ((submission = (submission_t*) calloc (1, sizeof(*submission))) == NULL) {
+        log_error("Failed to calloc() submission");
+        flight_end(runner.flight, addr, flight, -1, response);
+        return -1;
     }
-    cmd[counter-1] = 0;
+    submission->rule = rule;
+    submission->response = response;
+    submission->addr = addr;
+    submission->flight = flight;
+    submission->waiter.start = queued;
+    submission->waiter.arg = submission;
+    submission->done = done;
+    submission->arg = arg;
+
+    enter(false);
+    submission->stamp = stats_now();
+    if (limit_submit(runner.limit, &submission->waiter))
+        start(submission);
+    return RUNNER_DEFERRED;
+}
+
+void runner_limit(limit_stats_t *stats)
+{
+    limit_stats(runner.limit, stats);
+}
+
+void runner_flights(unsigned long *coalesced, unsigned long *serialized)
+{
+    *coalesced = __atomic_load_n(&runner.flight->coalesced, __ATOMIC_RELAXED);
+    *serialized = __atomic_load_n(&runner.flight->serialized, __ATOMIC_RELAXED);
+}
+
+static int ok(const struct response *responses, int count)
+{
+    for (int i=0; i<count; ++i)
+        if (responses[i].code != 0)
+            return 0;
+    return 1;
+}
+
+static int transaction(const backend_rule_t *rules, struct response *responses, int count)
+{
+    int half;
+
+    if (count == 0)
+        return 0;
 
-    if (pipe(fd) < 0) {
-        log_error("Failed to open pipe to fd1");
+    memset(responses, 0, count * sizeof(*responses));
+    if (call(rules, responses, count, 1) < 0)
         return -1;
+    if (!runner.backend->atomic || count == 1 || ok(responses, count))
+        return 0;
+
+    // The whole transaction failed because of some of the rules: split it
+    // until the failed rules are found, the order of the rules is kept
+    half = count / 2;
+    log_debug("Transaction of %d rule(s) failed, retry in halves", count);
+    if (transaction(rules, responses, half) < 0)
+        return -1;
+    return transaction(rules + half, responses + half, count - half);
+}
+
+int runner_batch(const backend_rule_t *rules, struct response *responses, int count)
+{
+    int rc;
+
+    enter(false);
+    rc = transaction(rules, responses, count);
+    if (rc == 0) {
+        lock();
+        for (int i=0; i<count; ++i)
+            manage(&rules[i], &responses[i]);
+        unlock();
+        for (int i=0; i<count; ++i)
+            track(&rules[i], &responses[i]);
     }
+    leave(false);
+    return rc;
+}
+
+int runner_expire(const backend_rule_t *rules, int count)
+{
+    backend_rule_t *expired;
+    struct response *responses;
+    uint32_t addr, left = 0;
+    int n = 0, removed = 0;
 
-    pid = fork();
-    if (pid < 0) {
-        log_error("Failed to fork");
+    expired = (backend_rule_t*) calloc (count, sizeof(*expired));
+    responses = (struct response*) calloc (count, sizeof(*responses));
+    if (expired == NULL || responses == NULL) {
+        log_error("Failed to calloc() expired rules");
+        free(expired);
+        free(responses);
         return -1;
+    }
+
+    enter(false);
 
-    } else if (pid == 0) {
-        // Child process
-        log_info("Execute cmd: '%s'", cmd);
-        dup2(fd[1], STDERR_FILENO);
-        close(fd[0]);
-        execvp(argv[0], argv);
+    // The rules of an address come one after the other, only the ones which
+    // are still there are removed (eg. a sync could have removed them already)
+    lock();
+    for (int i=0; i<count; ++i) {
+        if (ruleset_parse(rules[i].ip, &addr) < 0)
+            continue;
+        if (i == 0 || strcmp(rules[i].ip, rules[i-1].ip) != 0)
+            left = ruleset_count(runner.state->managed, addr);
+        if (left == 0)
+            continue;
+        left--;
+        expired[n++] = rules[i];
+    }
+    unlock();
 
+    if (transaction(expired, responses, n) == 0) {
+        lock();
+        for (int i=0; i<n; ++i) {
+            manage(&expired[i], &responses[i]);
+            if (responses[i].code != 0)
+                log_error("Failed to remove expired %s: %s", expired[i].ip, responses[i].reason);
+            else
+                removed++;
+        }
+        unlock();
     } else {
-        // Parent process
-        close(fd[1]);
+        removed = -1;
+    }
+
+    leave(false);
+    free(expired);
+    free(responses);
+    return removed;
+}
+
+static int delta(backend_rule_t **rules, size_t *size, size_t count, enum backend_op op, uint32_t addr, uint32_t times)
+{
+    backend_rule_t *grown;
 
-        if (read(fd[0], buffer, sizeof(buffer)-1) < 0) {
-            log_error("Failed to read from stderr of subprocess");
+    if (count + times > *size) {
+        *size = (count + times) * 2;
+        if ((grown = (backend_rule_t*) realloc (*rules, *size * sizeof(**rules))) == NULL) {
+            log_error("Failed to realloc() sync delta");
             return -1;
         }
+        *rules = grown;
+    }
+    for (uint32_t i=0; i<times; ++i) {
+        memset(&(*rules)[count + i], 0, sizeof(**rules));
+        (*rules)[count + i].op = op;
+        ruleset_format(addr, (*rules)[count + i].ip, sizeof((*rules)[count + i].ip));
+    }
+    return 0;
+}
 
-        // Strip new lines
-        for (int i=strlen(buffer)-1; i>=0 && buffer[i] == '\n'; --i)
-            buffer[i] = '\0';
+int runner_sync(const ruleset_t *desired, runner_sync_t *result, struct response *response)
+{
+    backend_rule_t *rules = NULL;
+    struct response *responses = NULL;
+    ruleset_entry_t *entry;
+    size_t size = 0, count = 0, cursor;
+    uint32_t current;
+    int rc = -1;
 
-        if (waitpid(pid, &status, WUNTRACED) < 0) {
-            log_error("Failed during waiting for process to finish");
-            return -1;
+    memset(result, 0, sizeof(*result));
+
+    // Nothing else can change the rules until the delta is applied, so the
+    // managed set can be read without its lock
+    enter(true);
+
+    // Every wanted address gets as many rules as its count in the desired set
+    for (cursor = 0; (entry = ruleset_next(desired, &cursor)) != NULL; ) {
+        current = ruleset_count(runner.state->managed, entry->ip);
+        if (current == entry->count) {
+            result->unchanged++;
+        } else if (current < entry->count) {
+            if (delta(&rules, &size, count, BACKEND_APPEND, entry->ip, entry->count - current) < 0)
+                goto cleanup;
+            count += entry->count - current;
+        } else if (current > entry->count) {
+            if (delta(&rules, &size, count, BACKEND_REMOVE, entry->ip, current - entry->count) < 0)
+                goto cleanup;
+            count += current - entry->count;
         }
+    }
+
+    // Every rule of the unwanted addresses is removed
+    for (cursor = 0; (entry = ruleset_next(runner.state->managed, &cursor)) != NULL; ) {
+        if (ruleset_count(desired, entry->ip) > 0)
+            continue;
+        if (delta(&rules, &size, count, BACKEND_REMOVE, entry->ip, entry->count) < 0)
+            goto cleanup;
+        count += entry->count;
+    }
 
-        if (WIFEXITED(status))
-            response->code = WEXITSTATUS(status);
-        else
-            response->code = status;
+    log_info("Sync to %zu address(es): %zu rule change(s)", desired->size, count);
+    if (count > 0) {
+        if ((responses = (struct response*) calloc (count, sizeof(*responses))) == NULL) {
+            log_error("Failed to calloc() sync responses");
+            goto cleanup;
+        }
+        // One transaction for the whole delta, split only when it fails
+        if (transaction(rules, responses, count) < 0)
+            goto cleanup;
+    }
 
-        if (response->code == 0) {
-            snprintf(response->reason, sizeof(response->reason), "%s", success);
+    for (size_t i=0; i<count; ++i) {
+        manage(&rules[i], &responses[i]);
+        track(&rules[i], &responses[i]);
+        if (responses[i].code != 0) {
+            log_error("Failed to sync %s: %s", rules[i].ip, responses[i].reason);
+            result->failed++;
+        } else if (rules[i].op == BACKEND_APPEND) {
+            result->added++;
         } else {
-            snprintf(response->reason, sizeof(response->reason), "%s", buffer);
+            result->removed++;
+        }
+    }
+
+    response->code = result->failed > 0 ? 1 : 0;
+    snprintf(response->reason, sizeof(response->reason), "%lu added, %lu removed, %lu unchanged, %lu failed",
+            result->added, result->removed, result->unchanged, result->failed);
+    rc = 0;
+
+cleanup:
+    leave(true);
+    free(rules);
+    free(responses);
+    return rc;
+}
+
+int runner_snapshot(ruleset_t *copy, unsigned long long *seq)
+{
+    ruleset_entry_t *entry;
+    size_t cursor;
+    int rc = 0;
+
+    // Every change is published under these locks, so the copy is exactly the rules at seq
+    enter(false);
+    lock();
+    for (cursor = 0; (entry = ruleset_next(runner.state->managed, &cursor)) != NULL; ) {
+        if (ruleset_add(copy, entry->ip, entry->count) < 0) {
+            rc = -1;
+            break;
         }
     }
-    
+    *seq = replica_head();
+    unlock();
+    leave(false);
+    return rc;
+}
+
+static size_t offset(int workers)
+{
+    size_t size = sizeof(runner_state_t) + workers * sizeof(((runner_state_t*) 0)->held[0]);
+
+    return (size + RUNNER_ALIGN - 1) / RUNNER_ALIGN * RUNNER_ALIGN;
+}
+
+size_t runner_shared_size(size_t rules, int workers)
+{
+    return offset(workers) + ruleset_footprint(rules);
+}
+
+int runner_share(void *memory, size_t rules, int workers)
+{
+    runner_state_t *state = (runner_state_t*) memory;
+
+    if (init(state, true) < 0)
+        return -1;
+    state->managed = ruleset_place((char*) memory + offset(workers), rules);
+    runner.state = state;
+    runner.shared = true;
     return 0;
 }
+
+void runner_attach(int worker)
+{
+    runner.worker = worker;
+}
+
+void runner_recover(int worker)
+{
+    runner_state_t *state = runner.state;
+
+    take(&state->gate);
+    if (state->held[worker] > 0) {
+        log_warning("Worker %d died during %d rule change(s)", worker, state->held[worker]);
+        state->appliers -= state->held[worker];
+        state->held[worker] = 0;
+    }
+    if (state->syncer == worker) {
+        log_warning("Worker %d died during a sync", worker);
+        state->syncer = -1;
+        repair(state);
+    }
+    pthread_cond_broadcast(&state->open);
+    pthread_mutex_unlock(&state->gate);
+
+    // Taking over the lock of the set repairs a change it died in
+    lock();
+    unlock();
+}
+
+void runner_managed(size_t *addresses, size_t *rules)
+{
+    runner_state_t *state = runner.state;
+    unsigned long seq;
+
+    // A gauge: after a while the values in the middle of a change are taken
+    // as they are (eg. of a dead worker until it is recovered)
+    for (int tries=0; tries<RUNNER_TRIES; ++tries) {
+        if ((seq = __atomic_load_n(&state->seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+            continue;
+        }
+        *addresses = __atomic_load_n(&state->managed->size, __ATOMIC_RELAXED);
+        *rules = __atomic_load_n(&state->managed->rules, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&state->seq, __ATOMIC_RELAXED) == seq)
+            return;
+    }
+    *addresses = __atomic_load_n(&state->managed->size, __ATOMIC_RELAXED);
+    *rules = __atomic_load_n(&state->managed->rules, __ATOMIC_RELAXED);
+}
@@ -1,6 +1,57 @@
 #pragma once
 
 #include "netpack.h"
+#include "backend.h"
+#include "ruleset.h"
+#include "limit.h"
 
+#define RUNNER_DEFERRED 2
 
+typedef struct runner_sync {
+    unsigned long added;
+    unsigned long removed;          // Together with the removed duplicates
+    unsigned long unchanged;
+    unsigned long failed;
+} runner_sync_t;
+
+
+// The concurrent backend calls start at limit and adapt between min and max
+int runner_setup(const char *backend, int limit, int min, int max);
+void runner_teardown();
+// Wait for the submitted rules to complete
+void runner_drain();
+backend_t* runner_backend();
+
+// Validate the request and convert it into a rule, returns 1 if it is invalid
+int runner_rule(struct request request, backend_rule_t *rule, struct response *response);
+// Fill the reason of a successfully applied rule
+void runner_result(const backend_rule_t *rule, struct response *response);
+
+// Identical requests in flight (method, ip, rule and ttl) are executed once, the
+// requests of an address are applied in arrival order
 int runner_process(struct request request, struct response *response);
+// The same without waiting for the backend if it can submit the rules: returns
+// RUNNER_DEFERRED and done() gets the result (rc of runner_process()) later,
+// possibly before runner_submit() returns, from the thread of the completion
+int runner_submit(struct request request, struct response *response, void (*done)(void *arg, int rc), void *arg);
+void runner_flights(unsigned long *coalesced, unsigned long *serialized);
+void runner_limit(limit_stats_t *stats);
+// Apply the rules in as few backend transactions as possible, every response tells the result of its own rule
+int runner_batch(const backend_rule_t *rules, struct response *responses, int count);
+// Remove the expired rules in one transaction, returns the number of the removed rules or -1
+int runner_expire(const backend_rule_t *rules, int count);
+// Make the managed rules exactly the desired set (count rules per address): only the delta is applied, in one transaction
+int runner_sync(const ruleset_t *desired, runner_sync_t *result, struct response *response);
+// Copy the managed rules together with the replication sequence number they are at
+int runner_snapshot(ruleset_t *copy, unsigned long long *seq);
+
+// Prefork mode: the supervisor puts the state of the managed rules (at most
+// rules addresses) into the memory shared with the workers before they are
+// forked, every worker attaches with its index before runner_setup()
+size_t runner_shared_size(size_t rules, int workers);
+int runner_share(void *memory, size_t rules, int workers);
+void runner_attach(int worker);
+// Give back the gate held by a dead worker and repair the changes it died in
+void runner_recover(int worker);
+// The size of the managed set without its lock
+void runner_managed(size_t *addresses, size_t *rules);
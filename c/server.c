@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -6,22 +8,57 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 
 #include "logging.h"
+#include "netpack.h"
 #include "server.h"
 #include "connection.h"
+#include "runner.h"
 #include "threadpool.h"
+#include "ratelimit.h"
+#include "stats.h"
+#include "trace.h"
+#include "expiry.h"
+#include "replica.h"
+#include "config.h"
+#include "exec.h"
+#include "slab.h"
+#include "prefork.h"
 
 
 #ifndef THREADS
 #       define THREADS 4
 #endif
 
+// Concurrent sessions of each acceptor (0: no limit), allocated on demand
 #ifndef QUEUE_SIZE
-#       define QUEUE_SIZE 256
+#       define QUEUE_SIZE 1024
+#endif
+
+// Sessions allocated at once and kept by each thread for reuse
+#ifndef SESSION_CHUNK
+#       define SESSION_CHUNK 64
+#endif
+
+#ifndef SESSION_CACHE
+#       define SESSION_CACHE 16
+#endif
+
+// Seconds between the releases of the memory left unused
+#ifndef SLAB_IDLE
+#       define SLAB_IDLE 10
 #endif
 
 #ifndef HOST
@@ -32,29 +69,376 @@
 #       define PORT 5555
 #endif
 
-#define QUEUE_WAIT 10000
+#ifndef ACCEPTORS
+#       define ACCEPTORS 1
+#endif
 
+#ifndef BACKLOG
+#       define BACKLOG 128
+#endif
 
-struct server {
-        tp_t *tp;
+// Milliseconds to wait after accept() ran out of descriptors or memory
+#ifndef ACCEPT_BACKOFF
+#       define ACCEPT_BACKOFF 10
+#endif
+
+// Worker processes of the prefork mode (0: a single process)
+#ifndef PROCESSES
+#       define PROCESSES 0
+#endif
+
+// Addresses of the managed set shared by the worker processes
+#ifndef SHARED_RULES
+#       define SHARED_RULES 262144
+#endif
+
+// Seconds for the worker processes to stop before they are killed
+#ifndef STOP_TIMEOUT
+#       define STOP_TIMEOUT 10
+#endif
+
+#if ACCEPTORS + 1 > PREFORK_ACCEPTORS
+#       error "The shared counters of the worker processes have room for PREFORK_ACCEPTORS - 1 acceptors"
+#endif
+
+#ifndef SOCKET_PATH
+#       define SOCKET_PATH NULL
+#endif
+
+// Backend which applies the rules, can be overridden with -b
+#ifndef BACKEND
+#       define BACKEND "iptables"
+#endif
+
+#ifndef SOCKET_UID
+#       define SOCKET_UID -1
+#endif
+
+// Connection deadlines per phase in milliseconds
+#ifndef READ_TIMEOUT
+#       define READ_TIMEOUT 5000
+#endif
+
+#ifndef EXEC_TIMEOUT
+#       define EXEC_TIMEOUT 10000
+#endif
+
+#ifndef WRITE_TIMEOUT
+#       define WRITE_TIMEOUT 5000
+#endif
+
+// Rules applied in one backend transaction in bulk mode
+#ifndef BULK_BATCH
+#       define BULK_BATCH 512
+#endif
+
+// Release the workers while the commands of the single requests are running
+#ifndef EXEC_ASYNC
+#       define EXEC_ASYNC 1
+#endif
+
+// Requests per second allowed from one source address (0 disables the limit)
+#ifndef RATE_LIMIT
+#       define RATE_LIMIT 0
+#endif
+
+#ifndef RATE_BURST
+#       define RATE_BURST 10
+#endif
+
+#ifndef RATE_TABLE
+#       define RATE_TABLE 4096
+#endif
+
+#ifndef RATE_ALLOW
+#       define RATE_ALLOW ""
+#endif
+
+// Write the logs from the workers through per-thread rings and a background flusher
+#ifndef LOG_ASYNC
+#       define LOG_ASYNC 0
+#endif
+
+#ifndef STATS_INTERVAL
+#       define STATS_INTERVAL 60
+#endif
+
+// Port of the Prometheus endpoint on the loopback interface (0 disables it)
+#ifndef STATS_PORT
+#       define STATS_PORT 9555
+#endif
+
+#define STATS_PREFIX "firewall"
+
+// Requests kept in the trace ring, dumped into TRACE_FILE on SIGUSR1
+#ifndef TRACE_SIZE
+#       define TRACE_SIZE 4096
+#endif
+
+#ifndef TRACE_FILE
+#       define TRACE_FILE "/var/lib/fwmgr/trace.txt"
+#endif
+
+// Pending expiries of the temporary rules, saved every second and on shutdown
+#ifndef EXPIRY_FILE
+#       define EXPIRY_FILE "/var/lib/fwmgr/expiry.txt"
+#endif
+
+// Concurrent backend calls: the limit starts at LIMIT and adapts between LIMIT_MIN and LIMIT_MAX
+#ifndef LIMIT
+#       define LIMIT 4
+#endif
+
+#ifndef LIMIT_MIN
+#       define LIMIT_MIN 1
+#endif
+
+#ifndef LIMIT_MAX
+#       define LIMIT_MAX 64
+#endif
+
+// Replication: changes kept for the followers to catch up from, and sent in one batch
+#ifndef REPLICA_LOG
+#       define REPLICA_LOG 1048576
+#endif
+
+#ifndef REPLICA_BATCH
+#       define REPLICA_BATCH 512
+#endif
+
+// Log the requests slower than this in milliseconds (0 disables it)
+#ifndef TRACE_SLOW_MS
+#       define TRACE_SLOW_MS 0
+#endif
+
+// Overload policies when every job of the threadpool is taken
+#define OVERLOAD_BLOCK 0        // Wait for a free job, keep the connections in the backlog
+#define OVERLOAD_REJECT 1       // Answer the connections immediately with a busy response
+
+#ifndef OVERLOAD
+#       define OVERLOAD OVERLOAD_BLOCK
+#endif
+
+#ifndef RETRY_AFTER
+#       define RETRY_AFTER 100
+#endif
+
+
+// Allocated from the slab of the acceptor for each connection, given back when
+// its job is finished
+typedef struct slot {
+        tp_job_t job;
+        session_t session;
+} slot_t;
+
+typedef struct acceptor {
+        int id;
+        int family;
+        pthread_t thread;
         int socket;
+        tp_t *tp;
+        slab_t *slots;
+        pthread_mutex_t lock;           // Guards the sessions below
+        pthread_cond_t freed;
+        int sessions;                   // Taken from the slab
+        int target;                     // Limit of the configuration (0: none)
+        prefork_counters_t local;
+        prefork_counters_t *counters;   // The local ones, or the shared ones of the worker process
+        unsigned long reported;
+        time_t reported_at;
+} acceptor_t;
+
+struct server {
+        volatile int running;
+        volatile sig_atomic_t dump;
+        volatile sig_atomic_t reload;
+        volatile sig_atomic_t stop;
+        sigset_t signals;
+        int size;
         struct sockaddr_in addr;
-        session_t *sessions;
+        struct sockaddr_un local;
+        acceptor_t *acceptors;
+        rl_t *limiter;
+        int exporter;
+        pthread_t exporter_thread;
+
+        // Prefork mode: the supervisor and the worker processes share it
+        prefork_t *prefork;
+        int worker;
+        int signals_fd;                 // Of the supervisor
+        char expiry[sizeof(((config_t*) 0)->expiry_file) + 16];
+        char trace[sizeof(((config_t*) 0)->trace_file) + 16];
+
+        config_t config;
+
+        // Command line options, applied over the config file at every reload
+        const char *path;
+        struct {
+                const char *key;
+                const char *value;
+        } options[32];
+        int optioned;
 };
 
 
 static struct server server;
 
-int setup(const char *ip, unsigned short port)
+// The defaults of the build, the config file, then the command line
+static int configure(config_t *config)
+{
+        const char *socket = SOCKET_PATH;
+
+        memset(config, 0, sizeof(*config));
+        snprintf(config->host, sizeof(config->host), "%s", HOST);
+        config->port = PORT;
+        if (socket != NULL)
+                snprintf(config->socket, sizeof(config->socket), "%s", socket);
+        snprintf(config->backend, sizeof(config->backend), "%s", BACKEND);
+        config->threads = THREADS;
+        config->queue_size = QUEUE_SIZE;
+        config->stats_port = STATS_PORT;
+        config->processes = PROCESSES;
+        snprintf(config->expiry_file, sizeof(config->expiry_file), "%s", EXPIRY_FILE);
+        config->backlog = BACKLOG;
+        config->overload = OVERLOAD;
+        config->read_timeout = READ_TIMEOUT;
+        config->exec_timeout = EXEC_TIMEOUT;
+        config->write_timeout = WRITE_TIMEOUT;
+        config->rate_limit = RATE_LIMIT;
+        config->rate_burst = RATE_BURST;
+        snprintf(config->rate_allow, sizeof(config->rate_allow), "%s", RATE_ALLOW);
+        config->limit = LIMIT;
+        config->limit_min = LIMIT_MIN;
+        config->limit_max = LIMIT_MAX;
+        snprintf(config->trace_file, sizeof(config->trace_file), "%s", TRACE_FILE);
+
+        if (server.path != NULL && config_load(config, server.path) < 0)
+                return -1;
+
+        for (int i=0; i<server.optioned; ++i)
+                if (config_set(config, server.options[i].key, server.options[i].value) < 0)
+                        return -1;
+        return 0;
+}
+
+static int listener(int family)
 {
         int sock;
+
+        if ((sock = socket(family, SOCK_STREAM, 0)) < 0) {
+                log_error("Failed to create socket: %s", strerror(errno));
+                return -1;
+        }
+
+        if (family == AF_UNIX) {
+                // Remove the socket file left behind by a previous run
+                unlink(server.local.sun_path);
+                if (bind(sock, (struct sockaddr*)&server.local, sizeof(server.local)) < 0) {
+                        log_error("Failed to bind socket: %s", strerror(errno));
+                        close(sock);
+                        return -1;
+                }
+                // Everybody can connect, the callers are authenticated with SO_PEERCRED
+                if (chmod(server.local.sun_path, 0666) < 0)
+                        log_warning("Failed to chmod() %s: %s", server.local.sun_path, strerror(errno));
+
+        } else {
+                if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
+                        log_error("Failed to set socket option (SO_REUSEADDR): %s", strerror(errno));
+                        close(sock);
+                        return -1;
+                }
+
+                // Let the kernel spread new connections across the acceptors and the processes
+                if ((ACCEPTORS > 1 || server.prefork != NULL) && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0) {
+                        log_error("Failed to set socket option (SO_REUSEPORT): %s", strerror(errno));
+                        close(sock);
+                        return -1;
+                }
+
+                if (bind(sock, (struct sockaddr*)&server.addr, sizeof(server.addr)) < 0) {
+                        log_error("Failed to bind socket: %s", strerror(errno));
+                        close(sock);
+                        return -1;
+                }
+        }
+
+        if (listen(sock, server.config.backlog) < 0) {
+                log_error("Failed to listen on socket: %s", strerror(errno));
+                close(sock);
+                return -1;
+        }
+
+        return sock;
+}
+
+static void recycle(void *arg, tp_job_t *job)
+{
+        acceptor_t *self = (acceptor_t*) arg;
+
+        slab_free(self->slots, (char*) job - offsetof(slot_t, job));
+        pthread_mutex_lock(&self->lock);
+        self->sessions--;
+        pthread_cond_signal(&self->freed);
+        pthread_mutex_unlock(&self->lock);
+}
+
+static int acceptor_setup(acceptor_t *acceptor, int id, int family)
+{
+        acceptor->id = id;
+        acceptor->target = server.config.queue_size;
+        acceptor->counters = server.prefork != NULL ? prefork_counters(server.prefork, server.worker) + id : &acceptor->local;
+        pthread_mutex_init(&acceptor->lock, NULL);
+        pthread_cond_init(&acceptor->freed, NULL);
+        acceptor->family = family;
+        acceptor->reported_at = time(NULL);
+        acceptor->socket = listener(family);
+        if (acceptor->socket < 0)
+                return -1;
+
+        // The sessions come from the slab, the pool only runs them
+        acceptor->slots = slab_create(sizeof(slot_t), SESSION_CHUNK, SESSION_CACHE);
+        if (acceptor->slots == NULL) {
+                log_error("Failed to create session slab");
+                return -1;
+        }
+
+        acceptor->tp = tp_create(server.config.threads, 0);
+        if (acceptor->tp == NULL) {
+                log_error("Failed to create threadpool");
+                return -1;
+        }
+        tp_recycle(acceptor->tp, recycle, acceptor);
+
+        return tp_start(acceptor->tp);
+}
+
+// The workers change right away, the sessions above a lowered limit finish first
+static int acceptor_resize(acceptor_t *acceptor, int threads, int size)
+{
+        int rc = 0;
+
+        if (tp_resize(acceptor->tp, threads) < 0) {
+                log_error("Acceptor %d: Failed to resize workers to %d", acceptor->id, threads);
+                rc = -1;
+        }
+
+        pthread_mutex_lock(&acceptor->lock);
+        acceptor->target = size;
+        pthread_cond_broadcast(&acceptor->freed);
+        pthread_mutex_unlock(&acceptor->lock);
+        return rc;
+}
+
+static int exporter_setup(unsigned short port)
+{
         struct sockaddr_in addr;
-        tp_job_t *job;
+        int sock;
 
-        log_info("Starting server on %s:%d", ip, port);
+        log_info("Starting statistics endpoint on 127.0.0.1:%d", port);
 
         addr.sin_family = AF_INET;
-        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
         addr.sin_port = htons(port);
 
         if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -64,115 +448,752 @@ int setup(const char *ip, unsigned short port)
 
         if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0) {
                 log_error("Failed to set socket option (SO_REUSEADDR): %s", strerror(errno));
+                close(sock);
                 return -1;
         }
 
-        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-                log_error("Failed to bind socket: %s", strerror(errno));
+        if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+                log_error("Failed to listen on statistics port: %s", strerror(errno));
+                close(sock);
                 return -1;
         }
+        return sock;
+}
 
-        if (listen(sock, 5) < 0) {
-                log_error("Failed to listen on socket: %s", strerror(errno));
+int setup(const config_t *config)
+{
+        const char *path = config->socket[0] ? config->socket : NULL;
+        char replica_host[64] = "";
+        unsigned short replica_port = 0;
+        const char *colon;
+
+        server.config = *config;
+        config_log(config);
+        log_info("Starting server on %s:%d with %d acceptor(s), %d workers and %d sessions each",
+                        config->host, config->port, ACCEPTORS, config->threads, config->queue_size);
+
+        server.addr.sin_family = AF_INET;
+        server.addr.sin_port = htons(config->port);
+        if (inet_pton(AF_INET, config->host, &server.addr.sin_addr) != 1) {
+                log_error("Invalid host: '%s'", config->host);
                 return -1;
         }
 
-        server.socket = sock;
-        server.addr = addr;
-        server.tp = tp_create(THREADS, QUEUE_SIZE);
+        // "[<host>:]<port>", eg. 0.0.0.0:5600 for followers on other hosts
+        if (config->lead[0]) {
+                if ((colon = strrchr(config->lead, ':')) != NULL)
+                        snprintf(replica_host, sizeof(replica_host), "%.*s", (int)(colon - config->lead), config->lead);
+                replica_port = atoi(colon != NULL ? colon + 1 : config->lead);
+        }
 
-        if (server.tp == NULL) {
-                log_error("Failed to create threadpool");
+        // The local listener is of the first worker process only, the files of the others are their own
+        snprintf(server.expiry, sizeof(server.expiry), "%s", config->expiry_file);
+        snprintf(server.trace, sizeof(server.trace), "%s", config->trace_file);
+        if (server.prefork != NULL) {
+                if (server.worker > 0)
+                        path = NULL;
+                if (config->expiry_file[0])
+                        snprintf(server.expiry, sizeof(server.expiry), "%s.%d", config->expiry_file, server.worker);
+                snprintf(server.trace, sizeof(server.trace), "%s.%d", config->trace_file, server.worker);
+        }
+
+        server.size = ACCEPTORS;
+        if (path != NULL) {
+                if (strlen(path) >= sizeof(server.local.sun_path)) {
+                        log_error("Too long socket path: '%s'", path);
+                        return -1;
+                }
+                log_info("Starting local listener on %s", path);
+                server.local.sun_family = AF_UNIX;
+                strcpy(server.local.sun_path, path);
+                server.size += 1;
+        }
+
+        if (trace_setup(TRACE_SIZE, TRACE_SLOW_MS) < 0) {
+                log_error("Failed to setup request trace");
                 return -1;
         }
 
-        // Init queue with connection objects
-        server.sessions = (session_t*) calloc (QUEUE_SIZE, sizeof(*server.sessions));
-        if (server.sessions == NULL) {
-                log_error("Failed to calloc() sessions");
+        if (runner_setup(config->backend, config->limit, config->limit_min, config->limit_max) < 0) {
+                log_error("Failed to setup runner");
                 return -1;
         }
 
-        for (int i=0; i<QUEUE_SIZE; ++i) {
-                job = (tp_job_t*) server.tp->jobs.finished->nodes[i];
-                job->function = con_handler;
-                job->arg = (void*) &server.sessions[i];
+        if (expiry_setup(server.expiry) < 0) {
+                log_error("Failed to setup rule expiry");
+                return -1;
         }
 
-        tp_start(server.tp);
+        if (replica_port > 0 && replica_lead(replica_host[0] ? replica_host : config->host, replica_port, REPLICA_LOG, REPLICA_BATCH) < 0) {
+                log_error("Failed to setup replication log");
+                return -1;
+        }
+
+        if (config->follow[0] && replica_follow(config->follow) < 0) {
+                log_error("Failed to setup replication from %s", config->follow);
+                return -1;
+        }
+
+        if (con_setup(config->read_timeout, config->exec_timeout, config->write_timeout, BULK_BATCH, EXEC_ASYNC) < 0) {
+                log_error("Failed to setup connection deadlines");
+                return -1;
+        }
+
+        if (config->rate_limit > 0) {
+                server.limiter = rl_create(config->rate_limit, config->rate_burst, RATE_TABLE, config->rate_allow);
+                if (server.limiter == NULL) {
+                        log_error("Failed to create rate limiter");
+                        return -1;
+                }
+        }
+
+        server.acceptors = (acceptor_t*) calloc (server.size, sizeof(*server.acceptors));
+        if (server.acceptors == NULL) {
+                log_error("Failed to calloc() acceptors");
+                return -1;
+        }
+
+        // The supervisor of the worker processes serves the statistics
+        server.exporter = -1;
+        if (server.prefork == NULL && config->stats_port > 0 && (server.exporter = exporter_setup(config->stats_port)) < 0) {
+                log_error("Failed to setup statistics endpoint");
+                return -1;
+        }
+
+        for (int i=0; i<server.size; ++i) {
+                server.acceptors[i].socket = -1;
+                if (acceptor_setup(&server.acceptors[i], i, i < ACCEPTORS ? AF_INET : AF_UNIX) < 0) {
+                        log_error("Failed to setup acceptor %d", i);
+                        return -1;
+                }
+        }
 
         log_info("Server has started");
         return 0;
 }
 
-int operate()
+// Only the workers and the capacity are resized, the connections of the
+// acceptors stay where they are
+static void reload()
+{
+        config_t config;
+
+        log_info("Reloading configuration");
+        if (configure(&config) < 0) {
+                log_error("Failed to reload configuration, keeping the current one");
+                return;
+        }
+        config_compare(&server.config, &config);
+
+        if (config.threads == server.config.threads && config.queue_size == server.config.queue_size) {
+                log_info("Configuration is unchanged");
+                return;
+        }
+
+        log_info("Resizing acceptors from %d workers and %d sessions to %d workers and %d sessions",
+                        server.config.threads, server.config.queue_size, config.threads, config.queue_size);
+        for (int i=0; i<server.size; ++i)
+                acceptor_resize(&server.acceptors[i], config.threads, config.queue_size);
+        server.config.threads = config.threads;
+        server.config.queue_size = config.queue_size;
+}
+
+static int dropped(int error)
+{
+        switch (error) {
+        case EINTR:
+        case EAGAIN:
+        case ECONNABORTED:
+        case EPROTO:
+        case EPERM:
+                return 1;
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+                // The pending connection stays in the backlog, retrying at once would spin
+                usleep(ACCEPT_BACKOFF * 1000);
+                return 1;
+        default:
+                return 0;
+        }
+}
+
+static void reject(int sock, int code, const char *reason, int retry, trace_record_t *trace)
+{
+        char buffer[RESPONSE_REASON_SIZE];
+        struct response response;
+
+        stats_code(code);
+        trace->code = code;
+        trace->result = reason;
+        response.code = code;
+        response.retry = retry;
+        snprintf(response.reason, sizeof(response.reason), "%s", reason);
+        compose_response(buffer, response, sizeof(buffer));
+        send(sock, buffer, strlen(buffer), MSG_NOSIGNAL);
+        close(sock);
+
+        trace->stamps[TRACE_CLOSED] = stats_now();
+        trace_commit(trace);
+}
+
+static int authenticate(session_t *session)
+{
+        struct ucred cred;
+        socklen_t size = sizeof(cred);
+
+        if (getsockopt(session->socket, SOL_SOCKET, SO_PEERCRED, &cred, &size) < 0) {
+                log_error("Failed to get peer credentials: %s", strerror(errno));
+                return -1;
+        }
+
+        session->pid = cred.pid;
+        session->uid = cred.uid;
+        snprintf(session->ip, sizeof(session->ip), "local");
+        session->port = 0;
+
+        if (cred.uid == 0 || cred.uid == geteuid() || cred.uid == (uid_t) SOCKET_UID)
+                return 0;
+
+        log_warning("Rejected local connection from pid=%d uid=%d", cred.pid, cred.uid);
+        return -1;
+}
+
+// Take a session, with OVERLOAD_BLOCK and wait for one below the limit
+static tp_job_t* acquire(acceptor_t *self, bool wait)
+{
+        slot_t *slot;
+
+        pthread_mutex_lock(&self->lock);
+        while (server.running && self->target > 0 && self->sessions >= self->target) {
+                if (server.config.overload == OVERLOAD_REJECT || !wait) {
+                        pthread_mutex_unlock(&self->lock);
+                        return NULL;
+                }
+                pthread_cond_wait(&self->freed, &self->lock);
+        }
+        if (!server.running) {
+                pthread_mutex_unlock(&self->lock);
+                return NULL;
+        }
+        self->sessions++;
+        pthread_mutex_unlock(&self->lock);
+
+        if ((slot = (slot_t*) slab_alloc(self->slots)) == NULL) {
+                log_error("Acceptor %d: Failed to allocate session", self->id);
+                pthread_mutex_lock(&self->lock);
+                self->sessions--;
+                pthread_mutex_unlock(&self->lock);
+                return NULL;
+        }
+        slot->job.function = con_handler;
+        slot->job.arg = (void*) &slot->session;
+        return &slot->job;
+}
+
+static void* operate(void *arg)
 {
+        acceptor_t *self = (acceptor_t*) arg;
         tp_job_t *job = NULL;
-        struct sockaddr_in addr;
+        struct sockaddr_storage addr;
+        struct sockaddr_in *inet = (struct sockaddr_in*) &addr;
         session_t *session = NULL;
-        socklen_t size = sizeof(addr);
+        trace_record_t trace;
+        socklen_t size;
+        long wait;
+        int sock;
 
-        log_info("Start listening");
-        while (1) {
+        log_info("Acceptor %d: Start listening", self->id);
+        while (server.running) {
                 // Find a session to overwrite
-                while ((job = tp_get(server.tp)) == NULL) {
-                        log_warning("No free job is available");
-                        usleep(QUEUE_WAIT);
+                if (job == NULL && (job = acquire(self, true)) == NULL && !server.running)
+                        goto stop_listening;
+
+                size = sizeof(addr);
+                while ((sock = accept(self->socket, (struct sockaddr*)&addr, &size)) < 0) {
+                        if (!server.running)
+                                goto stop_listening;
+                        if (!dropped(errno)) {
+                                log_error("Failed to accept connection: %s", strerror(errno));
+                                goto stop_listening;
+                        }
+                        log_warning("Acceptor %d: Dropped connection: %s", self->id, strerror(errno));
+                        __atomic_add_fetch(&self->counters->dropped, 1, __ATOMIC_RELAXED);
+                        size = sizeof(addr);
                 }
-                session = (session_t*) job->arg;
-                
+                __atomic_add_fetch(&self->counters->accepted, 1, __ATOMIC_RELAXED);
+
+                memset(&trace, 0, sizeof(trace));
+                trace.id = trace_id();
+                trace.stamps[TRACE_ACCEPTED] = stats_now();
+                trace.code = -1;
+                if (self->family == AF_UNIX) {
+                        snprintf(trace.ip, sizeof(trace.ip), "local");
+                } else {
+                        if (inet_ntop(AF_INET, &inet->sin_addr, trace.ip, sizeof(trace.ip)) == NULL) {
+                                log_warning("Acceptor %d: Dropped connection: Failed to parse ip address: %s",
+                                                self->id, strerror(errno));
+                                __atomic_add_fetch(&self->counters->dropped, 1, __ATOMIC_RELAXED);
+                                close(sock);
+                                continue;
+                        }
+                        trace.port = ntohs(inet->sin_port);
+                }
+
+                // Limit the sources before they can take a worker
+                if (server.limiter != NULL && self->family == AF_INET &&
+                                (wait = rl_take(server.limiter, inet->sin_addr.s_addr)) > 0) {
+                        __atomic_add_fetch(&self->counters->limited, 1, __ATOMIC_RELAXED);
+                        reject(sock, RESPONSE_BUSY, "Rate limit exceeded", wait, &trace);
+                        continue;
+                }
+
+                // Fail fast instead of holding the connection in the backlog, the
+                // sessions could have ended while accept() was waiting
+                if (job == NULL && (job = acquire(self, false)) == NULL) {
+                        __atomic_add_fetch(&self->counters->busy, 1, __ATOMIC_RELAXED);
+                        reject(sock, RESPONSE_BUSY, "Server busy", RETRY_AFTER, &trace);
+                        continue;
+                }
+
                 // Update the session
-                session->socket = accept(server.socket, (struct sockaddr*)&addr, &size);
-                if (session->socket < 0) {
-                        log_error("Failed to accept connection: %s", strerror(errno));
-                        return -1;
+                session = (session_t*) job->arg;
+                session->socket = sock;
+                session->tp = self->tp;
+                session->job = job;
+                session->completed = false;
+                snprintf(session->ip, sizeof(session->ip), "%s", trace.ip);
+                session->port = trace.port;
+
+                if (self->family == AF_UNIX && authenticate(session) < 0) {
+                        __atomic_add_fetch(&self->counters->rejected, 1, __ATOMIC_RELAXED);
+                        reject(session->socket, RESPONSE_ERROR, "Permission denied", 0, &trace);
+                        continue;
                 }
+                session->trace = trace;
 
-                if (inet_ntop(AF_INET, &addr.sin_addr, session->ip, sizeof(session->ip)) == NULL) {
-                        log_warning("Failed to parse ip address: %s", strerror(errno));
-                        return -1;
+                // Start the job with the session, the pending queue grows with the sessions
+                if (tp_put(self->tp, job) < 0) {
+                        log_error("Job queue overflow");
+                        reject(session->socket, RESPONSE_BUSY, "Server busy", RETRY_AFTER, &session->trace);
+                        continue;
+                }
+                job = NULL;
+        }
+
+stop_listening:
+        // The session taken for the next connection is given back
+        if (job != NULL)
+                recycle(self, job);
+        log_info("Acceptor %d: Stop listening", self->id);
+        server.running = 0;
+        return NULL;
+}
+
+// The sessions of the acceptors together, and the stream buffers
+static void memory(slab_stats_t *slots, slab_stats_t *buffers)
+{
+        slab_stats_t stats;
+
+        memset(slots, 0, sizeof(*slots));
+        for (int i=0; i<server.size; ++i) {
+                slab_stats(server.acceptors[i].slots, &stats);
+                slots->used += stats.used;
+                slots->capacity += stats.capacity;
+                slots->bytes += stats.bytes;
+                slots->grown += stats.grown;
+                slots->shrunk += stats.shrunk;
+        }
+        con_buffers(buffers);
+}
+
+static void report()
+{
+        acceptor_t *acceptor;
+        unsigned long accepted;
+        unsigned long timeouts[CON_PHASES];
+        time_t now = time(NULL);
+        time_t elapsed;
+        struct tcp_info info;
+        socklen_t size;
+        stats_thread_t *total;
+        slab_stats_t slots, buffers;
+        limit_stats_t limit;
+        char latency[512];
+
+        for (int i=0; i<server.size; ++i) {
+                acceptor = &server.acceptors[i];
+                accepted = __atomic_load_n(&acceptor->counters->accepted, __ATOMIC_RELAXED);
+                elapsed = now > acceptor->reported_at ? now - acceptor->reported_at : 1;
+
+                // For listening sockets the kernel reports the accept queue as unacked / sacked
+                size = sizeof(info);
+                memset(&info, 0, sizeof(info));
+                if (acceptor->family == AF_INET)
+                        getsockopt(acceptor->socket, IPPROTO_TCP, TCP_INFO, &info, &size);
+
+                log_info("Acceptor %d: accepted=%lu (%.1f/s) dropped=%lu rejected=%lu busy=%lu limited=%lu backlog=%u/%u", i,
+                                accepted, (double)(accepted - acceptor->reported) / elapsed,
+                                __atomic_load_n(&acceptor->counters->dropped, __ATOMIC_RELAXED),
+                                __atomic_load_n(&acceptor->counters->rejected, __ATOMIC_RELAXED),
+                                __atomic_load_n(&acceptor->counters->busy, __ATOMIC_RELAXED),
+                                __atomic_load_n(&acceptor->counters->limited, __ATOMIC_RELAXED),
+                                info.tcpi_unacked, info.tcpi_sacked);
+                acceptor->reported = accepted;
+                acceptor->reported_at = now;
+        }
+
+        con_timeouts(timeouts);
+        log_info("Timeouts: read=%lu exec=%lu write=%lu",
+                        timeouts[CON_READ], timeouts[CON_EXEC], timeouts[CON_WRITE]);
+
+        memory(&slots, &buffers);
+        log_info("Memory: sessions=%lu/%lu (%lu kB) buffers=%lu/%lu (%lu kB)",
+                        slots.used, slots.capacity, slots.bytes / 1024, buffers.used, buffers.capacity, buffers.bytes / 1024);
+
+        runner_limit(&limit);
+        log_info("Backend: limit=%d running=%d waiting=%d latency baseline=%.3f smoothed=%.3f ms",
+                        limit.limit, limit.inflight, limit.waiting, limit.baseline * 1e3, limit.smoothed * 1e3);
+
+        // Median and 99th percentile of the stages in milliseconds
+        if ((total = (stats_thread_t*) malloc (sizeof(*total))) == NULL)
+                return;
+        stats_collect(total);
+        for (int i=0, length=0; i<STATS_STAGES && length < sizeof(latency); ++i)
+                length += snprintf(latency + length, sizeof(latency) - length, " %s=%.3f/%.3f", stats_stage_names[i],
+                                stats_histogram_percentile(&total->stages[i], 50) / 1e6,
+                                stats_histogram_percentile(&total->stages[i], 99) / 1e6);
+        log_info("Latency p50/p99 (ms):%s", latency);
+        free(total);
+}
+
+// The managed set is read without its lock, it can be shared by the worker processes
+static void managed(FILE *out)
+{
+        size_t addresses, rules;
+
+        runner_managed(&addresses, &rules);
+        fprintf(out, "# HELP " STATS_PREFIX "_rules_managed Rules and distinct addresses of the managed set.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_rules_managed gauge\n");
+        fprintf(out, STATS_PREFIX "_rules_managed{kind=\"rules\"} %zu\n", rules);
+        fprintf(out, STATS_PREFIX "_rules_managed{kind=\"addresses\"} %zu\n", addresses);
+}
+
+static void metrics(FILE *out)
+{
+        acceptor_t *acceptor;
+        unsigned long timeouts[CON_PHASES];
+        unsigned long coalesced, serialized;
+        slab_stats_t slots, buffers;
+        limit_stats_t limit;
+        int sessions;
+        struct tcp_info info;
+        socklen_t size;
+
+        fprintf(out, "# HELP " STATS_PREFIX "_connections_total Connections of the acceptors by outcome.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_connections_total counter\n");
+        for (int i=0; i<server.size; ++i) {
+                acceptor = &server.acceptors[i];
+                fprintf(out, STATS_PREFIX "_connections_total{acceptor=\"%d\",outcome=\"accepted\"} %lu\n",
+                                i, __atomic_load_n(&acceptor->counters->accepted, __ATOMIC_RELAXED));
+                fprintf(out, STATS_PREFIX "_connections_total{acceptor=\"%d\",outcome=\"dropped\"} %lu\n",
+                                i, __atomic_load_n(&acceptor->counters->dropped, __ATOMIC_RELAXED));
+                fprintf(out, STATS_PREFIX "_connections_total{acceptor=\"%d\",outcome=\"rejected\"} %lu\n",
+                                i, __atomic_load_n(&acceptor->counters->rejected, __ATOMIC_RELAXED));
+                fprintf(out, STATS_PREFIX "_connections_total{acceptor=\"%d\",outcome=\"busy\"} %lu\n",
+                                i, __atomic_load_n(&acceptor->counters->busy, __ATOMIC_RELAXED));
+                fprintf(out, STATS_PREFIX "_connections_total{acceptor=\"%d\",outcome=\"limited\"} %lu\n",
+                                i, __atomic_load_n(&acceptor->counters->limited, __ATOMIC_RELAXED));
+        }
+
+        fprintf(out, "# HELP " STATS_PREFIX "_queue_depth Connections and jobs waiting in the queues.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_queue_depth gauge\n");
+        for (int i=0; i<server.size; ++i) {
+                acceptor = &server.acceptors[i];
+                size = sizeof(info);
+                memset(&info, 0, sizeof(info));
+                if (acceptor->family == AF_INET)
+                        getsockopt(acceptor->socket, IPPROTO_TCP, TCP_INFO, &info, &size);
+                fprintf(out, STATS_PREFIX "_queue_depth{acceptor=\"%d\",queue=\"backlog\"} %u\n", i, info.tcpi_unacked);
+                fprintf(out, STATS_PREFIX "_queue_depth{acceptor=\"%d\",queue=\"pending\"} %d\n", i, tp_pending(acceptor->tp));
+        }
+
+        fprintf(out, "# HELP " STATS_PREFIX "_workers Workers of the acceptors.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_workers gauge\n");
+        for (int i=0; i<server.size; ++i)
+                fprintf(out, STATS_PREFIX "_workers{acceptor=\"%d\"} %d\n", i, server.acceptors[i].tp->size);
+        fprintf(out, "# HELP " STATS_PREFIX "_sessions Sessions of the acceptors.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_sessions gauge\n");
+        for (int i=0; i<server.size; ++i) {
+                acceptor = &server.acceptors[i];
+                pthread_mutex_lock(&acceptor->lock);
+                sessions = acceptor->sessions;
+                pthread_mutex_unlock(&acceptor->lock);
+                fprintf(out, STATS_PREFIX "_sessions{acceptor=\"%d\"} %d\n", i, sessions);
+        }
+        fprintf(out, "# HELP " STATS_PREFIX "_workers_busy Workers which are handling a session.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_workers_busy gauge\n");
+        for (int i=0; i<server.size; ++i)
+                fprintf(out, STATS_PREFIX "_workers_busy{acceptor=\"%d\"} %d\n", i, tp_busy(server.acceptors[i].tp));
+
+        con_timeouts(timeouts);
+        fprintf(out, "# HELP " STATS_PREFIX "_timeouts_total Sessions which missed a deadline.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_timeouts_total counter\n");
+        fprintf(out, STATS_PREFIX "_timeouts_total{phase=\"read\"} %lu\n", timeouts[CON_READ]);
+        fprintf(out, STATS_PREFIX "_timeouts_total{phase=\"exec\"} %lu\n", timeouts[CON_EXEC]);
+        fprintf(out, STATS_PREFIX "_timeouts_total{phase=\"write\"} %lu\n", timeouts[CON_WRITE]);
+
+        memory(&slots, &buffers);
+        fprintf(out, "# HELP " STATS_PREFIX "_slab_bytes Memory of the slab allocators.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_slab_bytes gauge\n");
+        fprintf(out, STATS_PREFIX "_slab_bytes{slab=\"sessions\"} %lu\n", slots.bytes);
+        fprintf(out, STATS_PREFIX "_slab_bytes{slab=\"buffers\"} %lu\n", buffers.bytes);
+        fprintf(out, "# HELP " STATS_PREFIX "_slab_objects Objects of the slab allocators by state.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_slab_objects gauge\n");
+        fprintf(out, STATS_PREFIX "_slab_objects{slab=\"sessions\",state=\"used\"} %lu\n", slots.used);
+        fprintf(out, STATS_PREFIX "_slab_objects{slab=\"sessions\",state=\"free\"} %lu\n", slots.capacity - slots.used);
+        fprintf(out, STATS_PREFIX "_slab_objects{slab=\"buffers\",state=\"used\"} %lu\n", buffers.used);
+        fprintf(out, STATS_PREFIX "_slab_objects{slab=\"buffers\",state=\"free\"} %lu\n", buffers.capacity - buffers.used);
+        fprintf(out, "# HELP " STATS_PREFIX "_slab_chunks_total Chunks allocated and freed by the slab allocators.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_slab_chunks_total counter\n");
+        fprintf(out, STATS_PREFIX "_slab_chunks_total{slab=\"sessions\",change=\"grown\"} %lu\n", slots.grown);
+        fprintf(out, STATS_PREFIX "_slab_chunks_total{slab=\"sessions\",change=\"shrunk\"} %lu\n", slots.shrunk);
+        fprintf(out, STATS_PREFIX "_slab_chunks_total{slab=\"buffers\",change=\"grown\"} %lu\n", buffers.grown);
+        fprintf(out, STATS_PREFIX "_slab_chunks_total{slab=\"buffers\",change=\"shrunk\"} %lu\n", buffers.shrunk);
+
+        fprintf(out, "# HELP " STATS_PREFIX "_exec_running Commands started and not reaped yet.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_exec_running gauge\n");
+        fprintf(out, STATS_PREFIX "_exec_running %d\n", exec_running());
+
+        fprintf(out, "# HELP " STATS_PREFIX "_expiry_pending Addresses with temporary rules.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_expiry_pending gauge\n");
+        fprintf(out, STATS_PREFIX "_expiry_pending %lu\n", expiry_pending());
+        fprintf(out, "# HELP " STATS_PREFIX "_expired_total Temporary rules which expired.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_expired_total counter\n");
+        fprintf(out, STATS_PREFIX "_expired_total %lu\n", expiry_expired());
+
+        runner_limit(&limit);
+        fprintf(out, "# HELP " STATS_PREFIX "_backend_limit Adaptive limit of the concurrent backend calls.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_backend_limit gauge\n");
+        fprintf(out, STATS_PREFIX "_backend_limit %d\n", limit.limit);
+        fprintf(out, "# HELP " STATS_PREFIX "_backend_calls Backend calls by state.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_backend_calls gauge\n");
+        fprintf(out, STATS_PREFIX "_backend_calls{state=\"running\"} %d\n", limit.inflight);
+        fprintf(out, STATS_PREFIX "_backend_calls{state=\"waiting\"} %d\n", limit.waiting);
+        fprintf(out, "# HELP " STATS_PREFIX "_backend_latency_seconds Latency of a single rule as seen by the limit.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_backend_latency_seconds gauge\n");
+        fprintf(out, STATS_PREFIX "_backend_latency_seconds{stat=\"baseline\"} %.9f\n", limit.baseline);
+        fprintf(out, STATS_PREFIX "_backend_latency_seconds{stat=\"smoothed\"} %.9f\n", limit.smoothed);
+        fprintf(out, "# HELP " STATS_PREFIX "_backend_limit_changes_total Changes of the adaptive limit.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_backend_limit_changes_total counter\n");
+        fprintf(out, STATS_PREFIX "_backend_limit_changes_total{direction=\"up\"} %lu\n", limit.increased);
+        fprintf(out, STATS_PREFIX "_backend_limit_changes_total{direction=\"down\"} %lu\n", limit.decreased);
+
+        runner_flights(&coalesced, &serialized);
+        fprintf(out, "# HELP " STATS_PREFIX "_requests_coalesced_total Requests which shared the execution of an identical one.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_requests_coalesced_total counter\n");
+        fprintf(out, STATS_PREFIX "_requests_coalesced_total %lu\n", coalesced);
+        fprintf(out, "# HELP " STATS_PREFIX "_requests_serialized_total Requests which waited for another one of the same address.\n");
+        fprintf(out, "# TYPE " STATS_PREFIX "_requests_serialized_total counter\n");
+        fprintf(out, STATS_PREFIX "_requests_serialized_total %lu\n", serialized);
+
+        managed(out);
+        replica_write(out, STATS_PREFIX);
+        stats_write(out, STATS_PREFIX);
+}
+
+// Answer one request of the statistics endpoint, every path returns the metrics
+static void scrape(int sock, void (*write)(FILE *out))
+{
+        struct timeval timeout = {1, 0};
+        char request[1024];
+        char header[256];
+        char *body = NULL;
+        size_t size = 0;
+        FILE *out;
+
+        // A slow scraper can not hold the endpoint
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        recv(sock, request, sizeof(request), 0);
+
+        if ((out = open_memstream(&body, &size)) == NULL) {
+                log_error("Failed to open_memstream(): %s", strerror(errno));
+                close(sock);
+                return;
+        }
+        write(out);
+        fclose(out);
+
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                        "Content-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\n\r\n", size);
+        send(sock, header, strlen(header), MSG_NOSIGNAL);
+        send(sock, body, size, MSG_NOSIGNAL);
+        free(body);
+        close(sock);
+}
+
+// Minimal HTTP endpoint for Prometheus
+static void* export(void *arg)
+{
+        int sock;
+
+        while (server.running) {
+                if ((sock = accept(server.exporter, NULL, NULL)) < 0) {
+                        if (!server.running)
+                                break;
+                        if (dropped(errno))
+                                continue;
+                        log_error("Failed to accept statistics connection: %s", strerror(errno));
+                        break;
                 }
-                session->port = htons(addr.sin_port);
+                scrape(sock, metrics);
+        }
+        return NULL;
+}
 
-                // Start the job with the session
-                while(tp_put(server.tp, job) < 0) {
-                        log_warning("Job queue overflow");
-                        usleep(QUEUE_WAIT);
+// Give back the memory of the sessions and the buffers which stayed unused
+static void shrink()
+{
+        for (int i=0; i<server.size; ++i)
+                slab_shrink(server.acceptors[i].slots);
+        con_shrink();
+}
+
+int run()
+{
+        unsigned long ticks = 0;
+
+        server.running = 1;
+        for (int i=0; i<server.size; ++i) {
+                if (pthread_create(&server.acceptors[i].thread, NULL, operate, &server.acceptors[i]) != 0) {
+                        log_error("Failed to create acceptor thread %d", i);
+                        server.running = 0;
+                        break;
                 }
         }
-        log_info("Stop listening");
+
+        if (server.running && server.exporter >= 0 &&
+                        pthread_create(&server.exporter_thread, NULL, export, NULL) != 0) {
+                log_error("Failed to create statistics thread");
+                server.running = 0;
+        }
+
+        // Every thread is started, signals can be handled on the main thread
+        pthread_sigmask(SIG_UNBLOCK, &server.signals, NULL);
+
+        while (server.running && !server.stop) {
+                for (int left=STATS_INTERVAL; left > 0 && server.running && !server.stop; --left) {
+                        sleep(1);
+                        if (server.dump) {
+                                server.dump = 0;
+                                trace_dump(server.trace);
+                        }
+                        if (server.reload) {
+                                server.reload = 0;
+                                reload();
+                        }
+                        if (++ticks % SLAB_IDLE == 0)
+                                shrink();
+                }
+                if (server.running && !server.stop)
+                        report();
+        }
         return 0;
 }
 
 int teardown()
 {
+    acceptor_t *acceptor;
+
     log_info("Stopping server");
-    close(server.socket);
-    free(server.sessions);
-    tp_stop(server.tp);
-    tp_destroy(server.tp);
+    server.running = 0;
+    for (int i=0; i<server.size; ++i) {
+        acceptor = &server.acceptors[i];
+        if (acceptor->socket >= 0)
+            shutdown(acceptor->socket, SHUT_RDWR);
+        pthread_mutex_lock(&acceptor->lock);
+        pthread_cond_broadcast(&acceptor->freed);
+        pthread_mutex_unlock(&acceptor->lock);
+        if (acceptor->thread)
+            pthread_join(acceptor->thread, NULL);
+    }
+    if (server.exporter >= 0) {
+        shutdown(server.exporter, SHUT_RDWR);
+        if (server.exporter_thread)
+            pthread_join(server.exporter_thread, NULL);
+        close(server.exporter);
+        server.exporter = -1;
+    }
+    report();
+
+    // The submitted requests complete their sessions
+    runner_drain();
+    for (int i=0; i<server.size; ++i) {
+        acceptor = &server.acceptors[i];
+        if (acceptor->socket >= 0)
+            close(acceptor->socket);
+        if (acceptor->family == AF_UNIX)
+            unlink(server.local.sun_path);
+        if (acceptor->tp != NULL) {
+            tp_stop(acceptor->tp);
+            tp_destroy(acceptor->tp);
+        }
+        slab_destroy(acceptor->slots);
+        pthread_cond_destroy(&acceptor->freed);
+        pthread_mutex_destroy(&acceptor->lock);
+    }
+    con_teardown();
+    replica_teardown();
+    expiry_teardown();
+    runner_teardown();
+    trace_teardown();
+    if (server.limiter != NULL)
+        rl_destroy(server.limiter);
+    free(server.acceptors);
+    server.size = 0;
     log_info("Server is stopped");
+    log_async_stop();
     return 0;
 }
 
+// The server is torn down after run() returns, not in the signal handler
 void interrupt_handler(int sig)
 {
-    signal(sig, SIG_IGN);
-    teardown();
-    signal(SIGINT, SIG_DFL);
-    raise(sig);
+    server.stop = 1;
 }
 
+// The trace is dumped by the main loop, not in the signal handler
+void dump_handler(int sig)
+{
+    server.dump = 1;
+}
 
-int main(int argc, char **argv)
+// Reloaded by the main loop as well
+void reload_handler(int sig)
 {
-    if (argc > 1 && (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "--debug") == 0))
-        log_set(LOG_DEBUG, log_std_prefix);
-    else
-        log_set(LOG_INFO, log_std_prefix);
+    server.reload = 1;
+}
 
 
+// The server in this process, a single one or a worker of the supervisor
+static int serve(const config_t *config)
+{
+    if (LOG_ASYNC && log_async_start() < 0)
+        log_warning("Failed to start asynchronous logging");
+
     signal(SIGINT, interrupt_handler);
+    signal(SIGUSR1, dump_handler);
+    signal(SIGHUP, reload_handler);
+
+    // Threads inherit the mask, so only the main thread will handle signals
+    sigemptyset(&server.signals);
+    sigaddset(&server.signals, SIGINT);
+    sigaddset(&server.signals, SIGUSR1);
+    sigaddset(&server.signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &server.signals, NULL);
 
         log_debug("debug");
         log_info("debug");
@@ -180,11 +1201,206 @@ int main(int argc, char **argv)
         log_error("debug");
         log_trace();
 
-    if (setup(HOST, PORT) < 0)
+    if (setup(config) < 0)
         return 1;
 
-    operate();
+    run();
     teardown();
 
     return 0;
 }
+
+// A forked worker process: nothing of the supervisor loop is left to it
+static int worker(int index, void *arg)
+{
+    sigset_t none;
+
+    close(server.signals_fd);
+    if (server.exporter >= 0)
+        close(server.exporter);
+    server.exporter = -1;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
+    server.worker = index;
+    runner_attach(index);
+    return serve((const config_t*) arg);
+}
+
+static void supervision(FILE *out)
+{
+    prefork_write(server.prefork, out, STATS_PREFIX, ACCEPTORS + (server.config.socket[0] ? 1 : 0));
+    managed(out);
+}
+
+// Prefork mode: the worker processes bind their own listeners with
+// SO_REUSEPORT and share the managed rules, the supervisor restarts the ones
+// which die and serves the statistics of all of them
+static int supervise(const config_t *config)
+{
+    struct signalfd_siginfo info;
+    struct pollfd fds[2];
+    sigset_t signals, none;
+    time_t deadline = 0;
+    int timeout, sock;
+    int rc = 0;
+
+    // The followers would get the changes of only one of the workers
+    if (config->lead[0] || config->follow[0]) {
+        log_error("Replication needs the single process mode (processes = 0)");
+        return -1;
+    }
+
+    server.config = *config;
+    server.exporter = -1;
+    server.signals_fd = -1;
+    log_info("Starting supervisor of %d worker processes", config->processes);
+    server.prefork = prefork_create(config->processes, runner_shared_size(SHARED_RULES, config->processes));
+    if (server.prefork == NULL || runner_share(prefork_shared(server.prefork), SHARED_RULES, config->processes) < 0) {
+        log_error("Failed to setup shared memory");
+        prefork_destroy(server.prefork);
+        return -1;
+    }
+
+    if (config->stats_port > 0 && (server.exporter = exporter_setup(config->stats_port)) < 0) {
+        log_error("Failed to setup statistics endpoint");
+        prefork_destroy(server.prefork);
+        return -1;
+    }
+
+    // Every signal of the supervisor is read in its loop
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    if ((server.signals_fd = signalfd(-1, &signals, SFD_CLOEXEC)) < 0) {
+        log_error("Failed to create signalfd: %s", strerror(errno));
+        rc = -1;
+        goto cleanup;
+    }
+
+    fds[0].fd = server.signals_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = server.exporter;
+    fds[1].events = POLLIN;
+    for (;;) {
+        if (deadline == 0) {
+            timeout = prefork_spawn(server.prefork, worker, (void*) config);
+        } else {
+            if (prefork_running(server.prefork) == 0)
+                break;
+            if (time(NULL) >= deadline) {
+                log_warning("Killing the worker processes which did not stop in %d seconds", STOP_TIMEOUT);
+                prefork_signal(server.prefork, SIGKILL);
+            }
+            timeout = 1000;
+        }
+
+        if (poll(fds, server.exporter >= 0 ? 2 : 1, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            log_error("Failed to poll(): %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && read(server.signals_fd, &info, sizeof(info)) == sizeof(info)) {
+            switch (info.ssi_signo) {
+            case SIGCHLD:
+                prefork_reap(server.prefork, runner_recover);
+                break;
+            case SIGHUP:
+            case SIGUSR1:
+                prefork_signal(server.prefork, info.ssi_signo);
+                break;
+            default:
+                if (deadline == 0) {
+                    log_info("Stopping worker processes");
+                    prefork_stop(server.prefork, SIGINT);
+                    deadline = time(NULL) + STOP_TIMEOUT;
+                }
+                break;
+            }
+        }
+
+        if (server.exporter >= 0 && (fds[1].revents & POLLIN) && (sock = accept(server.exporter, NULL, NULL)) >= 0)
+            scrape(sock, supervision);
+    }
+
+cleanup:
+    if (server.signals_fd >= 0)
+        close(server.signals_fd);
+    if (server.exporter >= 0)
+        close(server.exporter);
+    prefork_destroy(server.prefork);
+    server.prefork = NULL;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    log_info("Supervisor is stopped");
+    return rc;
+}
+
+static void usage(const char *name)
+{
+    log_error("Usage: %s [-d] [-c <config file>] [-b <backend>[:<key>=<value>,...]] [-H <host>] [-p <port>] [-u <socket path>]", name);
+    log_error("       [-t <threads>] [-q <queue size>] [-s <stats port>] [-e <expiry file>]");
+    log_error("       [-l [<host>:]<replication port>] [-f <leader host>:<port>] [-P <processes>]");
+    log_error("Backends: iptables[:command=,restore=,chain=,target=,templates=] sim[:latency=<ms>,dist=const|uniform|exp,fail=<p>,lock=<calls>,async=1,templates=]");
+}
+
+int main(int argc, char **argv)
+{
+    struct option options[] = {
+        {"debug", no_argument, NULL, 'd'},
+        {"config", required_argument, NULL, 'c'},
+        {"backend", required_argument, NULL, 'b'},
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"socket", required_argument, NULL, 'u'},
+        {"threads", required_argument, NULL, 't'},
+        {"queue-size", required_argument, NULL, 'q'},
+        {"stats", required_argument, NULL, 's'},
+        {"expiry", required_argument, NULL, 'e'},
+        {"lead", required_argument, NULL, 'l'},
+        {"follow", required_argument, NULL, 'f'},
+        {"processes", required_argument, NULL, 'P'},
+        {NULL, 0, NULL, 0},
+    };
+    // The configuration keys of the options
+    const char *keys[128] = {
+        ['b'] = "backend", ['H'] = "host", ['p'] = "port", ['u'] = "socket", ['t'] = "threads",
+        ['q'] = "queue_size", ['s'] = "stats_port", ['e'] = "expiry_file", ['l'] = "lead", ['f'] = "follow",
+        ['P'] = "processes",
+    };
+    config_t config;
+    int opt;
+
+    log_set(LOG_INFO, log_std_prefix);
+    while ((opt = getopt_long(argc, argv, "dc:b:H:p:u:t:q:s:e:l:f:P:", options, NULL)) != -1) {
+        if (opt == 'd') {
+            log_set(LOG_DEBUG, log_std_prefix);
+        } else if (opt == 'c') {
+            server.path = optarg;
+        } else if (opt > 0 && opt < 128 && keys[opt] != NULL &&
+                server.optioned < sizeof(server.options) / sizeof(server.options[0])) {
+            server.options[server.optioned].key = keys[opt];
+            server.options[server.optioned].value = optarg;
+            server.optioned++;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (configure(&config) < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (config.processes > 0)
+        return supervise(&config) < 0 ? 1 : 0;
+    return serve(&config);
+}
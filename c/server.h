@@ -1,6 +1,8 @@
 #pragma once
 
 void interrupt_handler(int sig);
+void dump_handler(int sig);
+void reload_handler(int sig);
 
 int server_setup(const char *ip, unsigned short port);
 int server_listen();
@@ -0,0 +1,356 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "slab.h"
+
+
+// Every object is preceded by the pointer of its chunk, padded to keep the
+// objects aligned like malloc() does
+#define _ALIGN 16
+#define _HEADER _ALIGN
+
+typedef struct slab_chunk {
+        struct slab_chunk *prev;
+        struct slab_chunk *next;
+        void *free;                     // Free objects, linked through their first word
+        int used;                       // Objects out of the chunk, the cached ones too
+        bool idle;                      // Was empty at the previous slab_shrink()
+        char objects[] __attribute__((aligned(_ALIGN)));
+} slab_chunk_t;
+
+typedef struct slab_cache {
+        struct slab_cache *prev;
+        struct slab_cache *next;
+        struct slab *slab;
+        pthread_mutex_t lock;           // Taken by its thread, and by slab_shrink() to flush it
+        bool used;                      // Since the previous slab_shrink()
+        int count;
+        void *objects[];
+} slab_cache_t;
+
+struct slab {
+        size_t size;                    // Object together with its header
+        int chunk;
+        int cache;
+        pthread_key_t key;              // Cache of the calling thread
+
+        pthread_mutex_t lock;           // Guards the chunks and the counters below
+        slab_chunk_t *chunks;           // The ones with free objects first
+        unsigned long chunked;
+        unsigned long grown;
+        unsigned long shrunk;
+        unsigned long used;             // Atomic
+
+        pthread_mutex_t caching;        // Guards the list of the caches, taken before their locks
+        slab_cache_t *caches;
+};
+
+
+static void _unlink(slab_chunk_t **head, slab_chunk_t *chunk)
+{
+        if (chunk->prev != NULL)
+                chunk->prev->next = chunk->next;
+        else
+                *head = chunk->next;
+        if (chunk->next != NULL)
+                chunk->next->prev = chunk->prev;
+        chunk->prev = chunk->next = NULL;
+}
+
+static void _push(slab_chunk_t **head, slab_chunk_t *chunk)
+{
+        chunk->prev = NULL;
+        chunk->next = *head;
+        if (*head != NULL)
+                (*head)->prev = chunk;
+        *head = chunk;
+}
+
+static slab_chunk_t* _grow(slab_t *slab)
+{
+        slab_chunk_t *chunk;
+        char *object;
+
+        chunk = (slab_chunk_t*) calloc (1, sizeof(*chunk) + slab->chunk * slab->size);
+        if (chunk == NULL) {
+                log_error("Failed to calloc() slab chunk of %d objects", slab->chunk);
+                return NULL;
+        }
+
+        for (int i=slab->chunk - 1; i>=0; --i) {
+                object = chunk->objects + i * slab->size;
+                *(slab_chunk_t**) object = chunk;
+                *(void**) (object + _HEADER) = chunk->free;
+                chunk->free = object + _HEADER;
+        }
+        _push(&slab->chunks, chunk);
+        slab->chunked++;
+        slab->grown++;
+        return chunk;
+}
+
+// Take up to count objects out of the chunks, the lock of the slab is held
+static int _take(slab_t *slab, void **objects, int count)
+{
+        slab_chunk_t *chunk;
+        int taken = 0;
+
+        while (taken < count) {
+                chunk = slab->chunks;
+                if ((chunk == NULL || chunk->free == NULL) && (chunk = _grow(slab)) == NULL)
+                        break;
+
+                while (taken < count && chunk->free != NULL) {
+                        objects[taken++] = chunk->free;
+                        chunk->free = *(void**) chunk->free;
+                        chunk->used++;
+                }
+                chunk->idle = false;
+
+                // The full chunks go to the end, behind the ones which can still give
+                if (chunk->free == NULL && chunk->next != NULL) {
+                        _unlink(&slab->chunks, chunk);
+                        for (slab_chunk_t *last = slab->chunks; last != NULL; last = last->next) {
+                                if (last->next == NULL) {
+                                        last->next = chunk;
+                                        chunk->prev = last;
+                                        break;
+                                }
+                        }
+                }
+        }
+        return taken;
+}
+
+// Give the object back to its chunk, the lock of the slab is held
+static void _put(slab_t *slab, void *object)
+{
+        slab_chunk_t *chunk = *(slab_chunk_t**) ((char*) object - _HEADER);
+
+        if (chunk->free == NULL) {
+                _unlink(&slab->chunks, chunk);
+                _push(&slab->chunks, chunk);
+        }
+        *(void**) object = chunk->free;
+        chunk->free = object;
+        chunk->used--;
+}
+
+// Give the last count objects of the cache back, its lock is held
+static void _flush(slab_t *slab, slab_cache_t *cache, int count)
+{
+        pthread_mutex_lock(&slab->lock);
+        while (count-- > 0 && cache->count > 0)
+                _put(slab, cache->objects[--cache->count]);
+        pthread_mutex_unlock(&slab->lock);
+}
+
+// Destructor of the cache of an exiting thread
+static void _release(void *arg)
+{
+        slab_cache_t *cache = (slab_cache_t*) arg;
+        slab_t *slab = cache->slab;
+
+        pthread_mutex_lock(&slab->caching);
+        if (cache->prev != NULL)
+                cache->prev->next = cache->next;
+        else
+                slab->caches = cache->next;
+        if (cache->next != NULL)
+                cache->next->prev = cache->prev;
+        pthread_mutex_unlock(&slab->caching);
+
+        pthread_mutex_lock(&cache->lock);
+        _flush(slab, cache, cache->count);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+}
+
+static slab_cache_t* _cache(slab_t *slab)
+{
+        slab_cache_t *cache;
+
+        if (slab->cache == 0)
+                return NULL;
+        if ((cache = (slab_cache_t*) pthread_getspecific(slab->key)) != NULL)
+                return cache;
+
+        // Without a cache the thread goes to the chunks directly
+        cache = (slab_cache_t*) calloc (1, sizeof(*cache) + slab->cache * sizeof(cache->objects[0]));
+        if (cache == NULL)
+                return NULL;
+        cache->slab = slab;
+        pthread_mutex_init(&cache->lock, NULL);
+        if (pthread_setspecific(slab->key, cache) != 0) {
+                pthread_mutex_destroy(&cache->lock);
+                free(cache);
+                return NULL;
+        }
+
+        pthread_mutex_lock(&slab->caching);
+        cache->next = slab->caches;
+        if (slab->caches != NULL)
+                slab->caches->prev = cache;
+        slab->caches = cache;
+        pthread_mutex_unlock(&slab->caching);
+        return cache;
+}
+
+
+slab_t* slab_create(size_t size, int chunk, int cache)
+{
+        slab_t *slab;
+
+        if (chunk < 1 || cache < 0) {
+                log_error("Invalid slab chunk / cache: %d / %d", chunk, cache);
+                return NULL;
+        }
+
+        if ((slab = (slab_t*) calloc (1, sizeof(*slab))) == NULL) {
+                log_error("Failed to calloc() slab");
+                return NULL;
+        }
+
+        // Room for the free list link, rounded up to the alignment
+        if (size < sizeof(void*))
+                size = sizeof(void*);
+        slab->size = _HEADER + (size + _ALIGN - 1) / _ALIGN * _ALIGN;
+        slab->chunk = chunk;
+        slab->cache = cache;
+        if (pthread_key_create(&slab->key, _release) != 0) {
+                log_error("Failed to create slab cache key");
+                free(slab);
+                return NULL;
+        }
+        pthread_mutex_init(&slab->lock, NULL);
+        pthread_mutex_init(&slab->caching, NULL);
+        return slab;
+}
+
+void slab_destroy(slab_t *slab)
+{
+        slab_chunk_t *chunk;
+        slab_cache_t *cache;
+
+        if (slab == NULL)
+                return;
+
+        // The threads which are still running do not call _release() any more
+        pthread_key_delete(slab->key);
+        while ((cache = slab->caches) != NULL) {
+                slab->caches = cache->next;
+                pthread_mutex_destroy(&cache->lock);
+                free(cache);
+        }
+        while ((chunk = slab->chunks) != NULL) {
+                slab->chunks = chunk->next;
+                free(chunk);
+        }
+        pthread_mutex_destroy(&slab->caching);
+        pthread_mutex_destroy(&slab->lock);
+        free(slab);
+}
+
+void* slab_alloc(slab_t *slab)
+{
+        slab_cache_t *cache = _cache(slab);
+        void *object = NULL;
+
+        if (cache == NULL) {
+                pthread_mutex_lock(&slab->lock);
+                _take(slab, &object, 1);
+                pthread_mutex_unlock(&slab->lock);
+        } else {
+                // Refill half of the cache, so the next frees have room as well
+                pthread_mutex_lock(&cache->lock);
+                cache->used = true;
+                if (cache->count == 0) {
+                        pthread_mutex_lock(&slab->lock);
+                        cache->count = _take(slab, cache->objects, (slab->cache + 1) / 2);
+                        pthread_mutex_unlock(&slab->lock);
+                }
+                if (cache->count > 0)
+                        object = cache->objects[--cache->count];
+                pthread_mutex_unlock(&cache->lock);
+        }
+
+        if (object != NULL)
+                __atomic_add_fetch(&slab->used, 1, __ATOMIC_RELAXED);
+        return object;
+}
+
+void slab_free(slab_t *slab, void *object)
+{
+        slab_cache_t *cache;
+
+        if (object == NULL)
+                return;
+        __atomic_sub_fetch(&slab->used, 1, __ATOMIC_RELAXED);
+
+        if ((cache = _cache(slab)) == NULL) {
+                pthread_mutex_lock(&slab->lock);
+                _put(slab, object);
+                pthread_mutex_unlock(&slab->lock);
+                return;
+        }
+
+        pthread_mutex_lock(&cache->lock);
+        cache->used = true;
+        if (cache->count == slab->cache)
+                _flush(slab, cache, (slab->cache + 1) / 2);
+        cache->objects[cache->count++] = object;
+        pthread_mutex_unlock(&cache->lock);
+}
+
+int slab_shrink(slab_t *slab)
+{
+        slab_chunk_t *chunk, *next;
+        int freed = 0;
+
+        pthread_mutex_lock(&slab->caching);
+        for (slab_cache_t *cache = slab->caches; cache != NULL; cache = cache->next) {
+                pthread_mutex_lock(&cache->lock);
+                if (!cache->used)
+                        _flush(slab, cache, cache->count);
+                cache->used = false;
+                pthread_mutex_unlock(&cache->lock);
+        }
+        pthread_mutex_unlock(&slab->caching);
+
+        // A chunk has to be empty at two calls in a row, so a burst does not free and allocate it again
+        pthread_mutex_lock(&slab->lock);
+        for (chunk = slab->chunks; chunk != NULL; chunk = next) {
+                next = chunk->next;
+                if (chunk->used > 0) {
+                        chunk->idle = false;
+                } else if (!chunk->idle || slab->chunked == 1) {
+                        chunk->idle = true;
+                } else {
+                        _unlink(&slab->chunks, chunk);
+                        free(chunk);
+                        slab->chunked--;
+                        slab->shrunk++;
+                        freed++;
+                }
+        }
+        pthread_mutex_unlock(&slab->lock);
+
+        if (freed > 0)
+                log_debug("Slab of %zu byte objects freed %d chunk(s), %lu left", slab->size - _HEADER, freed, slab->chunked);
+        return freed;
+}
+
+void slab_stats(slab_t *slab, slab_stats_t *stats)
+{
+        pthread_mutex_lock(&slab->lock);
+        stats->capacity = slab->chunked * slab->chunk;
+        stats->bytes = slab->chunked * (sizeof(slab_chunk_t) + slab->chunk * slab->size);
+        stats->grown = slab->grown;
+        stats->shrunk = slab->shrunk;
+        pthread_mutex_unlock(&slab->lock);
+        stats->used = __atomic_load_n(&slab->used, __ATOMIC_RELAXED);
+}
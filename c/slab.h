@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <pthread.h>
+
+
+// Allocator of fixed size objects: they are carved out of chunks allocated on
+// demand and recycled through small per-thread caches, so the threads rarely
+// meet on the lock of the slab. slab_shrink() gives the chunks which stayed
+// empty since its previous call back to the system, the memory follows the
+// objects actually in use.
+typedef struct slab_stats {
+        unsigned long used;             // Objects held by the callers
+        unsigned long capacity;         // Objects of the chunks
+        unsigned long bytes;            // Memory of the chunks
+        unsigned long grown;            // Chunks allocated since the creation
+        unsigned long shrunk;           // Chunks freed since the creation
+} slab_stats_t;
+
+typedef struct slab slab_t;
+
+
+// chunk objects are allocated at once, cache objects are kept per thread (0: none)
+slab_t* slab_create(size_t size, int chunk, int cache);
+// The objects of the callers are freed as well
+void slab_destroy(slab_t *slab);
+
+// Returns NULL if no chunk can be allocated, the recycled objects are not cleared
+void* slab_alloc(slab_t *slab);
+void slab_free(slab_t *slab, void *object);
+
+// Flush the caches of the idle threads and free the idle chunks (one is kept),
+// returns the number of the freed chunks
+int slab_shrink(slab_t *slab);
+void slab_stats(slab_t *slab, slab_stats_t *stats);
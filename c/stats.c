@@ -0,0 +1,272 @@
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "logging.h"
+#include "stats.h"
+
+
+const char *stats_stage_names[] = {
+        "queue",
+        "recv",
+        "parse",
+        "exec",
+        "fork",
+        "limit",
+        "backend",
+        "send",
+        "total",
+};
+
+// Bucket bounds of the exported histograms in seconds
+static const double bounds[] = {
+        0.00001, 0.000025, 0.00005,
+        0.0001, 0.00025, 0.0005,
+        0.001, 0.0025, 0.005,
+        0.01, 0.025, 0.05,
+        0.1, 0.25, 0.5,
+        1, 2.5, 5, 10,
+};
+
+// The lock guards the list, the threads only take it to register and to retire
+static stats_thread_t *threads = NULL;
+static stats_thread_t retired;          // The blocks of the exited threads summed up
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t key;
+static pthread_once_t keyed = PTHREAD_ONCE_INIT;
+static __thread stats_thread_t *local = NULL;
+
+
+static inline int _bucket(uint64_t value)
+{
+        int bits;
+
+        if (value < STATS_SUB_BUCKETS)
+                return value;
+
+        bits = 63 - __builtin_clzll(value);
+        if (bits >= STATS_MAX_BITS)
+                return STATS_BUCKETS - 1;
+
+        return ((bits - STATS_SUB_BITS + 1) << STATS_SUB_BITS) |
+                ((value >> (bits - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+// First value above the bucket
+static uint64_t _upper(int bucket)
+{
+        int group = bucket >> STATS_SUB_BITS;
+        uint64_t sub = bucket & (STATS_SUB_BUCKETS - 1);
+
+        if (group == 0)
+                return sub + 1;
+        return (STATS_SUB_BUCKETS + sub + 1) << (group - 1);
+}
+
+// Only the owner thread writes, the relaxed stores keep the readers from
+// seeing torn values
+static inline void _add(uint64_t *counter, uint64_t value)
+{
+        __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t _load(const uint64_t *counter)
+{
+        return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void _merge(stats_thread_t *total, const stats_thread_t *block)
+{
+        for (int i=0; i<STATS_STAGES; ++i)
+                stats_histogram_merge(&total->stages[i], &block->stages[i]);
+        for (int i=0; i<STATS_COUNTERS; ++i)
+                total->counters[i] += _load(&block->counters[i]);
+        for (int i=0; i<STATS_CODES; ++i)
+                total->codes[i] += _load(&block->codes[i]);
+}
+
+// Destructor of the key: the exiting thread moves its counts into the
+// retired block and frees its own one
+static void _retire(void *arg)
+{
+        stats_thread_t *block = (stats_thread_t*) arg, **link;
+
+        pthread_mutex_lock(&lock);
+        for (link = &threads; *link != NULL && *link != block; link = &(*link)->next)
+                ;
+        if (*link != NULL)
+                *link = block->next;
+        _merge(&retired, block);
+        pthread_mutex_unlock(&lock);
+
+        local = NULL;
+        free(block);
+}
+
+static void _key()
+{
+        if (pthread_key_create(&key, _retire) != 0)
+                log_error("Failed to create the key of the statistics");
+}
+
+static stats_thread_t* _local()
+{
+        if (local != NULL)
+                return local;
+
+        pthread_once(&keyed, _key);
+        local = (stats_thread_t*) calloc (1, sizeof(*local));
+        if (local == NULL)
+                return NULL;
+        pthread_setspecific(key, local);
+
+        pthread_mutex_lock(&lock);
+        local->next = threads;
+        threads = local;
+        pthread_mutex_unlock(&lock);
+        return local;
+}
+
+
+uint64_t stats_now()
+{
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void stats_histogram_record(stats_histogram_t *h, uint64_t value)
+{
+        _add(&h->buckets[_bucket(value)], 1);
+        _add(&h->count, 1);
+        _add(&h->sum, value);
+        if (value > h->max)
+                __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+void stats_histogram_merge(stats_histogram_t *dst, const stats_histogram_t *src)
+{
+        uint64_t max = _load(&src->max);
+
+        for (int i=0; i<STATS_BUCKETS; ++i)
+                dst->buckets[i] += _load(&src->buckets[i]);
+        dst->count += _load(&src->count);
+        dst->sum += _load(&src->sum);
+        if (max > dst->max)
+                dst->max = max;
+}
+
+uint64_t stats_histogram_percentile(const stats_histogram_t *h, double percentile)
+{
+        uint64_t rank = (uint64_t) (h->count * percentile / 100.0);
+        uint64_t seen = 0;
+        uint64_t value;
+
+        if (h->count == 0)
+                return 0;
+        if (rank >= h->count)
+                return h->max;
+
+        for (int i=0; i<STATS_BUCKETS; ++i) {
+                seen += h->buckets[i];
+                if (seen > rank) {
+                        value = _upper(i) - 1;
+                        return value < h->max ? value : h->max;
+                }
+        }
+        return h->max;
+}
+
+void stats_record(enum stats_stage stage, uint64_t ns)
+{
+        stats_thread_t *self = _local();
+
+        if (self != NULL)
+                stats_histogram_record(&self->stages[stage], ns);
+}
+
+void stats_count(enum stats_counter counter, uint64_t value)
+{
+        stats_thread_t *self = _local();
+
+        if (self != NULL)
+                _add(&self->counters[counter], value);
+}
+
+void stats_code(int code)
+{
+        stats_thread_t *self = _local();
+
+        if (self != NULL)
+                _add(&self->codes[code >= 0 && code < STATS_CODES ? code : STATS_CODES - 1], 1);
+}
+
+void stats_collect(stats_thread_t *total)
+{
+        stats_thread_t *self;
+
+        memset(total, 0, sizeof(*total));
+        pthread_mutex_lock(&lock);
+        _merge(total, &retired);
+        for (self = threads; self != NULL; self = self->next)
+                _merge(total, self);
+        pthread_mutex_unlock(&lock);
+}
+
+// Prometheus text format
+void stats_write(FILE *out, const char *prefix)
+{
+        stats_thread_t *total;
+        stats_histogram_t *h;
+        uint64_t cumulative;
+        int bucket;
+
+        total = (stats_thread_t*) malloc (sizeof(*total));
+        if (total == NULL) {
+                log_error("Failed to malloc() statistics");
+                return;
+        }
+        stats_collect(total);
+
+        fprintf(out, "# HELP %s_stage_seconds Time spent in the stages of the requests.\n", prefix);
+        fprintf(out, "# TYPE %s_stage_seconds histogram\n", prefix);
+        for (int i=0; i<STATS_STAGES; ++i) {
+                h = &total->stages[i];
+                cumulative = 0;
+                bucket = 0;
+                for (int j=0; j<sizeof(bounds)/sizeof(bounds[0]); ++j) {
+                        // The buckets which end below the bound
+                        for (; bucket < STATS_BUCKETS && _upper(bucket) <= bounds[j] * 1e9; ++bucket)
+                                cumulative += h->buckets[bucket];
+                        fprintf(out, "%s_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                                        prefix, stats_stage_names[i], bounds[j], cumulative);
+                }
+                fprintf(out, "%s_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", prefix, stats_stage_names[i], h->count);
+                fprintf(out, "%s_stage_seconds_sum{stage=\"%s\"} %.9f\n", prefix, stats_stage_names[i], h->sum / 1e9);
+                fprintf(out, "%s_stage_seconds_count{stage=\"%s\"} %lu\n", prefix, stats_stage_names[i], h->count);
+        }
+
+        fprintf(out, "# HELP %s_spawned_total Commands started by the workers.\n", prefix);
+        fprintf(out, "# TYPE %s_spawned_total counter\n", prefix);
+        fprintf(out, "%s_spawned_total %lu\n", prefix, total->counters[STATS_SPAWNED]);
+        fprintf(out, "# HELP %s_spawn_failures_total Commands which could not be started.\n", prefix);
+        fprintf(out, "# TYPE %s_spawn_failures_total counter\n", prefix);
+        fprintf(out, "%s_spawn_failures_total %lu\n", prefix, total->counters[STATS_SPAWN_FAILED]);
+
+        // The busy ratio is rate(busy_seconds_total) / workers
+        fprintf(out, "# HELP %s_worker_busy_seconds_total Time spent by the workers on the sessions.\n", prefix);
+        fprintf(out, "# TYPE %s_worker_busy_seconds_total counter\n", prefix);
+        fprintf(out, "%s_worker_busy_seconds_total %.9f\n", prefix, total->counters[STATS_BUSY_NS] / 1e9);
+
+        fprintf(out, "# HELP %s_responses_total Responses by code.\n", prefix);
+        fprintf(out, "# TYPE %s_responses_total counter\n", prefix);
+        for (int i=0; i<STATS_CODES; ++i)
+                if (total->codes[i] > 0)
+                        fprintf(out, "%s_responses_total{code=\"%d\"} %lu\n", prefix, i, total->codes[i]);
+
+        free(total);
+}
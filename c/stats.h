@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+// Log-linear buckets: every power of two is split into 2^STATS_SUB_BITS
+// linear sub-buckets, so the relative error stays below 1/2^STATS_SUB_BITS
+#define STATS_SUB_BITS 4
+#define STATS_SUB_BUCKETS (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40       // ~18 minutes in nanoseconds
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS)
+
+#define STATS_CODES 256
+
+enum stats_stage {
+        STATS_QUEUE,            // From accept() until a worker picks up the session
+        STATS_RECV,
+        STATS_PARSE,
+        STATS_EXEC,             // runner_process(): fork, exec and wait for the command
+        STATS_FORK,
+        STATS_LIMIT,            // Waiting for a slot of the adaptive concurrency limit
+        STATS_BACKEND,          // One backend call (a rule or a batch)
+        STATS_SEND,
+        STATS_TOTAL,            // From accept() until the connection is closed
+        STATS_STAGES
+};
+
+extern const char *stats_stage_names[];
+
+enum stats_counter {
+        STATS_SPAWNED,
+        STATS_SPAWN_FAILED,
+        STATS_BUSY_NS,          // Time spent by the workers on the sessions
+        STATS_COUNTERS
+};
+
+typedef struct stats_histogram {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+// Every thread writes only its own block, the readers sum the blocks up
+typedef struct stats_thread {
+        stats_histogram_t stages[STATS_STAGES];
+        uint64_t counters[STATS_COUNTERS];
+        uint64_t codes[STATS_CODES];
+        struct stats_thread *next;
+} stats_thread_t;
+
+
+uint64_t stats_now();
+
+void stats_record(enum stats_stage stage, uint64_t ns);
+void stats_count(enum stats_counter counter, uint64_t value);
+void stats_code(int code);
+
+void stats_histogram_record(stats_histogram_t *h, uint64_t value);
+void stats_histogram_merge(stats_histogram_t *dst, const stats_histogram_t *src);
+uint64_t stats_histogram_percentile(const stats_histogram_t *h, double percentile);
+
+void stats_collect(stats_thread_t *total);
+void stats_write(FILE *out, const char *prefix);
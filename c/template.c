@@ -0,0 +1,240 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "template.h"
+
+
+#define _CHAIN_SIZE 29                  // Longest chain name of iptables, together with the '\0'
+
+static char* _trim(char *text)
+{
+        char *end;
+
+        while (isspace((unsigned char) *text))
+                text++;
+        end = text + strlen(text);
+        while (end > text && isspace((unsigned char) end[-1]))
+                *--end = '\0';
+        return text;
+}
+
+static int _name(const char *name, size_t size)
+{
+        if (*name == '\0' || strlen(name) >= size)
+                return -1;
+        for (; *name; ++name)
+                if (!isalnum((unsigned char) *name) && *name != '_' && *name != '-' && *name != '.')
+                        return -1;
+        return 0;
+}
+
+// No quoting and no comments: the words go into the restore lines as they are
+static int _word(const char *word)
+{
+        for (; *word; ++word)
+                if (!isgraph((unsigned char) *word) || strchr("\"'\\#", *word) != NULL)
+                        return -1;
+        return 0;
+}
+
+static int _compile(template_t *template, const char *name, const char *text)
+{
+        char *word, *save;
+        int ip = -1, jump = -1, words = 0;
+        size_t length = 0;
+
+        memset(template, 0, sizeof(*template));
+        if (_name(name, sizeof(template->name)) < 0) {
+                log_error("Invalid template name: '%s'", name);
+                return -1;
+        }
+        if (strlen(text) >= sizeof(template->text)) {
+                log_error("Template %s: Too long", name);
+                return -1;
+        }
+        snprintf(template->name, sizeof(template->name), "%s", name);
+        snprintf(template->text, sizeof(template->text), "%s", text);
+        snprintf(template->words, sizeof(template->words), "%s", text);
+
+        // <command> <op> are filled in by the rules
+        for (word = strtok_r(template->words, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+                if (words == TEMPLATE_ARGS) {
+                        log_error("Template %s: More than %d options", name, TEMPLATE_ARGS);
+                        return -1;
+                }
+                if (_word(word) < 0) {
+                        log_error("Template %s: Invalid option '%s'", name, word);
+                        return -1;
+                }
+                if (strcmp(word, TEMPLATE_IP) == 0) {
+                        if (ip >= 0) {
+                                log_error("Template %s: More than one " TEMPLATE_IP, name);
+                                return -1;
+                        }
+                        ip = words;
+                } else if (strchr(word, '{') != NULL) {
+                        log_error("Template %s: Unknown parameter '%s'", name, word);
+                        return -1;
+                }
+                if (strcmp(word, "-j") == 0 || strcmp(word, "--jump") == 0)
+                        jump = words;
+                template->argv[2 + words++] = word;
+        }
+
+        if (words == 0 || template->argv[2][0] == '-' || _name(template->argv[2], _CHAIN_SIZE) < 0) {
+                log_error("Template %s: Invalid chain '%s'", name, words > 0 ? template->argv[2] : "");
+                return -1;
+        }
+        if (ip < 1 || (strcmp(template->argv[1 + ip], "-s") != 0 && strcmp(template->argv[1 + ip], "--source") != 0 &&
+                        strcmp(template->argv[1 + ip], "-d") != 0 && strcmp(template->argv[1 + ip], "--destination") != 0)) {
+                log_error("Template %s: Missing -s " TEMPLATE_IP " or -d " TEMPLATE_IP, name);
+                return -1;
+        }
+        if (jump < 0 || jump + 1 == words || jump + 1 == ip) {
+                log_error("Template %s: Missing -j <target>", name);
+                return -1;
+        }
+
+        template->argc = 2 + words;
+        template->ip = 2 + ip;
+
+        // The halves of the restore line, both already separated from the address
+        for (int i=0; i<ip; ++i)
+                length += snprintf(template->prefix + length, sizeof(template->prefix) - length, "%s ", template->argv[2 + i]);
+        length = 0;
+        for (int i=ip + 1; i<words; ++i)
+                length += snprintf(template->suffix + length, sizeof(template->suffix) - length, " %s", template->argv[2 + i]);
+        template->length = strlen(template->prefix) + strlen(template->suffix);
+        return 0;
+}
+
+// The argv of a template points into its words, so every template stays where it was allocated
+static int _add(templates_t *templates, const char *name, const char *text)
+{
+        template_t **list, *template;
+
+        list = (template_t**) realloc (templates->list, (templates->count + 1) * sizeof(*list));
+        if (list == NULL) {
+                log_error("Failed to realloc() templates");
+                return -1;
+        }
+        templates->list = list;
+
+        if ((template = (template_t*) malloc (sizeof(*template))) == NULL) {
+                log_error("Failed to malloc() template");
+                return -1;
+        }
+        if (_compile(template, name, text) < 0) {
+                free(template);
+                return -1;
+        }
+        list[templates->count++] = template;
+        return 0;
+}
+
+static int _load(templates_t *templates, const char *path)
+{
+        char line[TEMPLATE_TEXT_SIZE + TEMPLATE_NAME_SIZE + 16], *text, *value;
+        int number = 0;
+        int rc = 0;
+        FILE *file;
+
+        if ((file = fopen(path, "r")) == NULL) {
+                log_error("Failed to open %s: %s", path, strerror(errno));
+                return -1;
+        }
+
+        // "<name> = <options>" lines, the empty ones and the ones starting with '#' are skipped
+        while (fgets(line, sizeof(line), file) != NULL) {
+                number++;
+                text = _trim(line);
+                if (*text == '\0' || *text == '#')
+                        continue;
+
+                if ((value = strchr(text, '=')) == NULL) {
+                        log_error("%s:%d: Missing '='", path, number);
+                        rc = -1;
+                        continue;
+                }
+                *value++ = '\0';
+                text = _trim(text);
+                if (templates_find(templates, text) >= 0 || strcmp(text, "default") == 0) {
+                        log_error("%s:%d: Template %s is defined already", path, number, text);
+                        rc = -1;
+                        continue;
+                }
+
+                if (_add(templates, text, _trim(value)) < 0) {
+                        log_error("%s:%d: Invalid template", path, number);
+                        rc = -1;
+                }
+        }
+
+        fclose(file);
+        return rc;
+}
+
+
+templates_t* templates_load(const char *path, const char *chain, const char *target)
+{
+        char text[TEMPLATE_TEXT_SIZE];
+        templates_t *templates;
+
+        if ((templates = (templates_t*) calloc (1, sizeof(*templates))) == NULL) {
+                log_error("Failed to calloc() templates");
+                return NULL;
+        }
+
+        snprintf(text, sizeof(text), "%s -s " TEMPLATE_IP " -j %s", chain, target);
+        if (_add(templates, "default", text) < 0) {
+                templates_destroy(templates);
+                return NULL;
+        }
+
+        if (path != NULL && path[0] != '\0' && _load(templates, path) < 0) {
+                templates_destroy(templates);
+                return NULL;
+        }
+
+        for (int i=0; i<templates->count; ++i)
+                log_debug("Template %s: %s", templates->list[i]->name, templates->list[i]->text);
+        return templates;
+}
+
+void templates_destroy(templates_t *templates)
+{
+        if (templates == NULL)
+                return;
+        for (int i=0; i<templates->count; ++i)
+                free(templates->list[i]);
+        free(templates->list);
+        free(templates);
+}
+
+int templates_find(const templates_t *templates, const char *name)
+{
+        if (name[0] == '\0')
+                return TEMPLATE_DEFAULT;
+        for (int i=0; i<templates->count; ++i)
+                if (strcmp(templates->list[i]->name, name) == 0)
+                        return i;
+        return -1;
+}
+
+char** template_argv(const template_t *template, char *command, char *op, char *ip, char *argv[TEMPLATE_ARGS + 3])
+{
+        memcpy(argv, template->argv, (template->argc + 1) * sizeof(argv[0]));
+        argv[0] = command;
+        argv[1] = op;
+        argv[template->ip] = ip;
+        return argv;
+}
+
+int template_line(const template_t *template, const char *op, const char *ip, char *line, size_t size)
+{
+        return snprintf(line, size, "%s %s%s%s\n", op, template->prefix, ip, template->suffix);
+}
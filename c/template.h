@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+
+// Named rule templates: "<name> = <chain> <options>" lines where exactly one
+// of the options is the {ip} of the requests, after -s or -d, and a -j
+// target is given, eg:
+//
+//      ssh = INPUT -p tcp --dport 22 -s {ip} -j DROP
+//
+// They are validated and compiled once when they are loaded: a rule only
+// puts its operation and its address into the argv skeleton, or between the
+// two halves of the iptables-restore line.
+#define TEMPLATE_DEFAULT 0              // Index of the default template
+#define TEMPLATE_NAME_SIZE 32
+#define TEMPLATE_ARGS 32                // Options of a template
+#define TEMPLATE_TEXT_SIZE 512
+#define TEMPLATE_IP "{ip}"
+
+typedef struct template {
+        char name[TEMPLATE_NAME_SIZE];
+        char text[TEMPLATE_TEXT_SIZE];  // The options as written
+        char words[TEMPLATE_TEXT_SIZE]; // The options split at the whitespace
+        int argc;
+        char *argv[TEMPLATE_ARGS + 3];  // <command> <op> <options>, NULL terminated
+        int ip;                         // Index of the address in argv
+        char prefix[TEMPLATE_TEXT_SIZE];// Restore line around the address: "<chain> ... -s "
+        char suffix[TEMPLATE_TEXT_SIZE];// " -j <target> ..."
+        size_t length;                  // Of the prefix and the suffix together
+} template_t;
+
+typedef struct templates {
+        int count;
+        template_t **list;              // The default one first
+} templates_t;
+
+
+// The default template "<chain> -s {ip} -j <target>", then the ones of the file (NULL: none)
+templates_t* templates_load(const char *path, const char *chain, const char *target);
+void templates_destroy(templates_t *templates);
+
+// Returns the index of the template, the empty name is the default one, -1 if unknown
+int templates_find(const templates_t *templates, const char *name);
+
+// The argv of "<command> <op> <options>" with the address filled in
+char** template_argv(const template_t *template, char *command, char *op, char *ip, char *argv[TEMPLATE_ARGS + 3]);
+// "<op> <options>\n" for iptables-restore, returns its length like snprintf()
+int template_line(const template_t *template, const char *op, const char *ip, char *line, size_t size);
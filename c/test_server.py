@@ -0,0 +1,215 @@
+"""
+End-to-end tests of the C server with the sim backend on a unix socket
+"""
+import os
+import re
+import time
+import socket
+import signal
+import tempfile
+import subprocess
+from concurrent.futures import ThreadPoolExecutor
+from typing import List, Optional
+from unittest import TestCase, main
+
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+
+# Seconds to wait for the server and for the responses
+TIMEOUT = 5
+
+
+def free_port() -> int:
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        return sock.getsockname()[1]
+
+
+def parse(line: bytes) -> dict:
+    """
+    Fields of a "key=value;..." response, the reason is the text until the next known key
+    """
+    fields = dict(re.findall(r'(code|retry|keepalive|line|progress)=(-?\d+)', line.decode()))
+    reason = re.search(r'reason=(.*?)(?:;(?:retry|keepalive|line|progress)=|$)', line.decode())
+    return {**{key: int(value) for key, value in fields.items()}, 'reason': reason.group(1) if reason else None}
+
+
+class Server:
+    """
+    A server process on a unix socket in its own directory
+    """
+
+    def __init__(self, workdir: str, backend: str = 'sim', binary: str = 'server', options: List[str] = ()):
+        self.workdir = workdir
+        self.path = os.path.join(workdir, 'fwmgr.sock')
+        self.log = os.path.join(workdir, f'{binary}.log')
+        self.command = [os.path.join(ROOT, binary), '-b', backend, '-u', self.path, '-p', str(free_port()),
+                        '-s', '0', '-e', os.path.join(workdir, 'expiry.txt')] + list(options)
+        self.process: Optional[subprocess.Popen] = None
+
+    def start(self) -> None:
+        with open(self.log, 'ab') as log:
+            self.process = subprocess.Popen(self.command, stdout=log, stderr=subprocess.STDOUT, cwd=self.workdir)
+
+        deadline = time.monotonic() + TIMEOUT
+        while time.monotonic() < deadline and self.process.poll() is None:
+            try:
+                self.connect().close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        self.stop()
+        raise RuntimeError(f"Server did not start, see {self.log}")
+
+    def stop(self) -> None:
+        if self.process is None or self.process.poll() is not None:
+            return
+        self.process.send_signal(signal.SIGINT)
+        try:
+            self.process.wait(TIMEOUT)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            self.process.wait()
+
+    def connect(self) -> socket.socket:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(TIMEOUT)
+        try:
+            sock.connect(self.path)
+        except OSError:
+            sock.close()
+            raise
+        return sock
+
+    def request(self, text: str) -> dict:
+        with self.connect() as sock:
+            sock.sendall(text.encode())
+            return parse(sock.recv(4096))
+
+    def stream(self, method: str, lines: List[str]) -> List[bytes]:
+        """
+        Returns with the response lines of a bulk or sync stream
+        """
+        with self.connect() as sock:
+            sock.sendall(f'method={method}\n'.encode() + ''.join(f'{line}\n' for line in lines).encode())
+            sock.shutdown(socket.SHUT_WR)
+            data = b''
+            while chunk := sock.recv(4096):
+                data += chunk
+        return data.splitlines()
+
+
+class ServerTestCase(TestCase):
+    BACKEND = 'sim'
+
+    def setUp(self):
+        tmpdir = tempfile.TemporaryDirectory()
+        self.addCleanup(tmpdir.cleanup)
+        self.workdir = tmpdir.name
+        self.prepare()
+        self.server = Server(self.workdir, self.BACKEND)
+        self.server.start()
+        self.addCleanup(self.server.stop)
+
+    def prepare(self) -> None:
+        """
+        Called in the working directory before the server is started
+        """
+
+
+class TestRequest(ServerTestCase):
+    def test_append(self):
+        response = self.server.request('method=append;ip=10.0.0.1')
+        self.assertEqual(response['code'], 0)
+        self.assertEqual(response['reason'], "10.0.0.1 was successfully added")
+
+    def test_invalid_ttl(self):
+        for ttl in ('abc', '12x', '99999999999'):
+            self.assertEqual(self.server.request(f'method=append;ip=10.0.0.1;ttl={ttl}')['code'], 1)
+
+    def test_sync(self):
+        # The duplicate of 10.0.0.1 is removed, so only 10.0.0.2 is unchanged
+        for ip in ('10.0.0.1', '10.0.0.1', '10.0.0.2'):
+            self.assertEqual(self.server.request(f'method=append;ip={ip}')['code'], 0)
+        lines = self.server.stream('sync', ['10.0.0.1', '10.0.0.2', '10.0.0.3'])
+        self.assertEqual(parse(lines[-1]), {'code': 0, 'reason': "1 added, 1 removed, 1 unchanged, 0 failed"})
+
+
+class TestFailingBulk(ServerTestCase):
+    BACKEND = 'sim:fail=1'
+
+    def test_multiline_reason(self):
+        lines = self.server.stream('bulk', ['append 10.0.0.1', 'append 10.0.0.2'])
+        responses = [parse(line) for line in lines]
+        failures = [response for response in responses if 'line' in response]
+        self.assertEqual([response['line'] for response in failures], [1, 2], lines)
+        self.assertEqual([response['code'] for response in failures], [1, 1])
+        self.assertEqual(failures[0]['reason'], "Simulated failure Try `iptables -h' for more information.")
+        self.assertEqual(responses[-1], {'code': 1, 'reason': "0 rule(s) applied, 2 failed"})
+
+
+class TestAsync(ServerTestCase):
+    # The single requests complete on the reaper of the sleep children (EXEC_ASYNC)
+    BACKEND = 'sim:async=1,latency=20'
+
+    def test_append_remove(self):
+        self.assertEqual(self.server.request('method=append;ip=10.0.0.1')['code'], 0)
+        self.assertEqual(self.server.request('method=remove;ip=10.0.0.1')['code'], 0)
+        response = self.server.request('method=remove;ip=10.0.0.1')
+        self.assertEqual(response['code'], 1)
+        self.assertEqual(response['reason'], "iptables: Bad rule (does a matching rule exist in that chain?).")
+
+    def test_keepalive(self):
+        with self.server.connect() as sock:
+            for i in range(1, 5):
+                sock.sendall(f'method=append;ip=10.0.0.{i};keepalive=1\n'.encode())
+                self.assertEqual(parse(sock.recv(4096))['code'], 0)
+
+    def test_queued(self):
+        # Over the concurrency limit the submissions wait in its queue for the completions
+        with ThreadPoolExecutor(16) as executor:
+            responses = list(executor.map(lambda i: self.server.request(f'method=append;ip=10.0.1.{i}'), range(1, 33)))
+        self.assertEqual([response['code'] for response in responses], [0] * 32)
+
+
+class TestFailingAsync(ServerTestCase):
+    BACKEND = 'sim:async=1,fail=1'
+
+    def test_failure(self):
+        response = self.server.request('method=append;ip=10.0.0.1')
+        self.assertEqual(response['code'], 1)
+        self.assertEqual(response['reason'], "Simulated failure Try `iptables -h' for more information.")
+
+
+class TestExpiry(ServerTestCase):
+    # Beyond the range of the timing wheel (2^26 seconds)
+    FAR = 3 * 365 * 86400
+
+    def prepare(self) -> None:
+        now = int(time.time())
+        path = os.path.join(self.workdir, 'expiry.txt')
+        with open(os.open(path, os.O_WRONLY | os.O_CREAT, 0o600), 'w') as file:
+            file.write(f"# ip rules deadline\n10.0.0.1 1 {now - 60}\n10.0.0.2 1 {now + self.FAR}\n")
+
+    def entries(self) -> List[str]:
+        with open(os.path.join(self.workdir, 'expiry.txt')) as file:
+            return [line.split()[0] for line in file if not line.startswith('#')]
+
+    def wait(self, ip: str) -> None:
+        deadline = time.monotonic() + TIMEOUT
+        while ip in self.entries() and time.monotonic() < deadline:
+            time.sleep(0.1)
+
+    def test_loaded(self):
+        self.wait('10.0.0.1')
+        self.assertEqual(self.entries(), ['10.0.0.2'])
+
+    def test_ttl(self):
+        self.assertEqual(self.server.request('method=append;ip=10.0.0.3;ttl=1')['code'], 0)
+        time.sleep(1.5)
+        self.wait('10.0.0.3')
+        self.assertEqual(self.entries(), ['10.0.0.2'])
+
+
+if __name__ == "__main__":
+    main()
@@ -13,7 +13,11 @@
 static void* _start_manager(void *arg);
 static void* _start_worker(void *arg);
 static tp_worker_t* _find_worker(tp_t *tp);
+static tp_worker_t* _spawn_worker(tp_t *tp);
+static void _lock(pthread_mutex_t *lock);
+static void _unlock(pthread_mutex_t *lock);
 static void _wait_for_condition(pthread_mutex_t *lock, pthread_cond_t *ready);
+static void _signal_condition(pthread_mutex_t *lock, pthread_cond_t *ready);
 static inline tp_job_t* _get_pending(tp_t *tp);
 static inline int _put_finished(tp_t *tp, tp_job_t *job);
 
@@ -30,27 +34,32 @@ static void* _start_manager(void *arg)
 
         log_debug("Threadpool manager was started");
 
-        self->state = TP_RUNNING;
         while (1) {
                 // Wait for job
-                while ((job = _get_pending(tp)) == NULL) {
-                        if (self->state == TP_STOPPED)
-                                goto stop_manager;
+                _lock(&self->job_lock);
+                while ((job = _get_pending(tp)) == NULL && self->state != TP_STOPPED)
                         _wait_for_condition(&self->job_lock, &self->job_ready);
-                }
+                _unlock(&self->job_lock);
+
+                if (self->state == TP_STOPPED)
+                        goto stop_manager;
 
                 // Wait for worker
-                while ((worker = _find_worker(tp)) == NULL) {
-                        if (self->state == TP_STOPPED)
-                                goto stop_manager;
+                _lock(&self->worker_lock);
+                while ((worker = _find_worker(tp)) == NULL && self->state != TP_STOPPED)
                         _wait_for_condition(&self->worker_lock, &self->worker_ready);
-                }
 
-                if (self->state == TP_STOPPED)
+                if (self->state == TP_STOPPED) {
+                        _unlock(&self->worker_lock);
                         goto stop_manager;
+                }
 
+                // Assigned under the worker_lock, so tp_resize() can not remove the worker in the meantime
+                _lock(&worker->lock);
                 worker->job = job;
                 pthread_cond_signal(&worker->ready);
+                _unlock(&worker->lock);
+                _unlock(&self->worker_lock);
         }
 
 stop_manager:
@@ -63,55 +72,116 @@ stop_manager:
 static void* _start_worker(void *arg)
 {
         tp_worker_t *self = (tp_worker_t*) arg;
+        tp_manager_t *manager = self->tp->manager;
+        bool retired;
 
         log_debug("Worker thread was started");
 
-        self->state = TP_RUNNING;
+        _signal_condition(&manager->worker_lock, &manager->worker_ready);
         while (1) {
-                _wait_for_condition(&self->lock, &self->ready);
-
-                if (self->state != TP_RUNNING) {
+                _lock(&self->lock);
+                while (self->job == NULL && self->state == TP_RUNNING)
+                        _wait_for_condition(&self->lock, &self->ready);
+                retired = self->retired;
+                _unlock(&self->lock);
+
+                // An assigned job is done even by a stopped worker
+                if (self->job == NULL) {
                         log_debug("Worker thread was stopped");
+                        if (retired) {
+                                pthread_detach(pthread_self());
+                                pthread_cond_destroy(&self->ready);
+                                pthread_mutex_destroy(&self->lock);
+                                free(self);
+                        }
                         pthread_exit(0);
                 }
 
-                if (self->job != NULL) {
-                    self->job->function(self->job->arg);
-                    _put_finished(self->tp, self->job);
-                    self->job = NULL;
-                    pthread_cond_signal(&self->tp->manager->worker_ready);
-                }
+                self->job->holds = 1;
+                self->job->function(self->job->arg);
+                tp_release(self->tp, self->job, false);
+
+                // Tell the manager that this worker is available again
+                _lock(&manager->worker_lock);
+                self->job = NULL;
+                pthread_cond_signal(&manager->worker_ready);
+                _unlock(&manager->worker_lock);
         }
 }
 
 static tp_worker_t* _find_worker(tp_t *tp)
 {
     for (int i=0; i<tp->size; ++i)
-        if (tp->workers[i].state == TP_RUNNING && tp->workers[i].job == NULL)
-            return &tp->workers[i];
+        if (tp->workers[i]->state == TP_RUNNING && tp->workers[i]->job == NULL)
+            return tp->workers[i];
 
     return NULL;
 }
 
-static void _wait_for_condition(pthread_mutex_t *lock, pthread_cond_t *ready)
+static tp_worker_t* _spawn_worker(tp_t *tp)
+{
+        tp_worker_t *worker;
+
+        worker = (tp_worker_t*) calloc (1, sizeof(*worker));
+        if (worker == NULL) {
+                log_error("Failed to calloc() memory for threadpool worker");
+                return NULL;
+        }
+
+        if (pthread_mutex_init(&worker->lock, NULL) != 0 || pthread_cond_init(&worker->ready, NULL) != 0) {
+                log_error("Failed to init worker lock / cond");
+                free(worker);
+                return NULL;
+        }
+
+        // Running before the thread starts, so a tp_resize() right after it can not be overwritten
+        worker->tp = tp;
+        worker->state = TP_RUNNING;
+        if (pthread_create(&worker->id, NULL, _start_worker, worker) != 0) {
+                log_error("Failed to create worker thread");
+                pthread_cond_destroy(&worker->ready);
+                pthread_mutex_destroy(&worker->lock);
+                free(worker);
+                return NULL;
+        }
+        return worker;
+}
+
+static void _lock(pthread_mutex_t *lock)
 {
         if (pthread_mutex_lock(lock) != 0) {
                 log_error("Failed lock mutex");
                 log_trace();
                 pthread_exit(0);
         }
-        if (pthread_cond_wait(ready, lock) != 0) {
-                log_error("Failed to wait for condition");
+}
+
+static void _unlock(pthread_mutex_t *lock)
+{
+        if (pthread_mutex_unlock(lock) != 0) {
+                log_error("Failed to unlock mutex");
                 log_trace();
                 pthread_exit(0);
         }
-        if (pthread_mutex_unlock(lock) != 0) {
-                log_error("Failed to unlock mutex");
+}
+
+// The lock has to be held by the caller and the predicate has to be checked in a loop
+static void _wait_for_condition(pthread_mutex_t *lock, pthread_cond_t *ready)
+{
+        if (pthread_cond_wait(ready, lock) != 0) {
+                log_error("Failed to wait for condition");
                 log_trace();
                 pthread_exit(0);
         }
 }
 
+static void _signal_condition(pthread_mutex_t *lock, pthread_cond_t *ready)
+{
+        _lock(lock);
+        pthread_cond_broadcast(ready);
+        _unlock(lock);
+}
+
 static inline tp_job_t* _get_pending(tp_t *tp)
 {
         return (tp_job_t*) queue_get(tp->jobs.pending);
@@ -147,15 +217,15 @@ tp_t* tp_create(int workers, int jobs)
         }
 
         tp->size = workers;
-        tp->workers = (tp_worker_t*) calloc (workers, sizeof(tp_worker_t));
-        if (tp->workers < 0) {
+        tp->workers = (tp_worker_t**) calloc (workers > 0 ? workers : 1, sizeof(*tp->workers));
+        if (tp->workers == NULL) {
                 log_error("Failed to calloc() memory for threadpool workers");
                 free(tp->manager);
                 free(tp);
                 return NULL;
         }
 
-        tp->jobs.pending = queue_create(jobs);
+        tp->jobs.pending = queue_create(jobs > 0 ? jobs : TP_QUEUE);
         if (tp->jobs.pending == NULL) {
                 log_error("Failed to create pending job queue for threadpool");
                 free(tp->workers);
@@ -164,8 +234,12 @@ tp_t* tp_create(int workers, int jobs)
                 return NULL;
         }
 
-        tp->jobs.finished = queue_create(jobs);
-        if (tp->jobs.pending == NULL) {
+        // Without jobs of its own the pool runs the jobs of the caller, as many as they put
+        if (jobs == 0)
+                queue_grow(tp->jobs.pending);
+
+        tp->jobs.finished = queue_create(jobs > 0 ? jobs : 1);
+        if (tp->jobs.finished == NULL) {
                 log_error("Failed to create finished job queue for threadpool");
                 free(tp->jobs.pending);
                 free(tp->workers);
@@ -175,7 +249,7 @@ tp_t* tp_create(int workers, int jobs)
         }
 
         job_array = (tp_job_t*) calloc (jobs, sizeof(*job_array));
-        if (job_array == NULL) {
+        if (job_array == NULL && jobs > 0) {
                 log_error("Failed to create jobs for threadpool");
                 free(tp->jobs.pending);
                 free(tp->jobs.finished);
@@ -186,6 +260,7 @@ tp_t* tp_create(int workers, int jobs)
         }
         for (int i=0; i<jobs; ++i)
                 _put_finished(tp, &job_array[i]);
+        tp->chunk = job_array;
 
         log_debug("Threadpool has been created");
         return tp;
@@ -219,29 +294,18 @@ int tp_start(tp_t *tp)
     
     // Init and start worker threads
     for (id=0; id<tp->size; ++id) {
-        worker = &tp->workers[id];
-
-        if (pthread_mutex_init(&worker->lock, NULL) != 0) {
-            log_error("Failed to init worker lock");
-            return -1;
-        }
-
-        if (pthread_cond_init(&worker->ready, NULL) != 0) {
-            log_error("Failed to init worker cond");
-            return -1;
-        }
-
-        worker->tp = tp;
-        worker->state = TP_NONE;
-        if (pthread_create(&worker->id, NULL, _start_worker, worker) != 0) {
-            log_error("Failed to create worker thread");
+        if ((worker = _spawn_worker(tp)) == NULL) {
+            tp->size = id;
             return -1;
         }
+        tp->workers[id] = worker;
     }
 
-    tp->manager->state = TP_NONE;
+    // Running before the thread starts, so a tp_stop() right after it can not be overwritten
+    tp->manager->state = TP_RUNNING;
     if (pthread_create(&tp->manager->id, NULL, _start_manager, tp) != 0) {
         log_error("Failed to create manager thread");
+        tp->manager->state = TP_NONE;
         return -1;
     }
 
@@ -252,26 +316,121 @@ int tp_start(tp_t *tp)
 int tp_put(tp_t *tp, tp_job_t *job) { 
         int rc = queue_put(tp->jobs.pending, job);
         if (rc == 0)
-                pthread_cond_signal(&tp->manager->job_ready);
+                _signal_condition(&tp->manager->job_lock, &tp->manager->job_ready);
         return rc;
 }
 tp_job_t* tp_get(tp_t *tp) { return (tp_job_t*) queue_get(tp->jobs.finished); }
+void tp_unget(tp_t *tp, tp_job_t *job) { _put_finished(tp, job); }
+tp_job_t* tp_wait(tp_t *tp) { return (tp_job_t*) queue_wait(tp->jobs.finished); }
+
+int tp_pending(tp_t *tp) { return queue_count(tp->jobs.pending); }
+
+// Racy snapshot of the workers which have a job, good enough for statistics
+int tp_busy(tp_t *tp)
+{
+        int busy = 0;
+
+        _lock(&tp->manager->worker_lock);
+        for (int i=0; i<tp->size; ++i)
+                if (__atomic_load_n(&tp->workers[i]->job, __ATOMIC_RELAXED) != NULL)
+                        busy++;
+        _unlock(&tp->manager->worker_lock);
+        return busy;
+}
 
+int tp_resize(tp_t *tp, int workers)
+{
+        tp_worker_t **grown, *worker;
+        int size = tp->size;
+
+        if (workers < 1)
+                return -1;
+
+        _lock(&tp->manager->worker_lock);
+        if (workers > tp->size) {
+                if ((grown = (tp_worker_t**) realloc (tp->workers, workers * sizeof(*grown))) == NULL) {
+                        _unlock(&tp->manager->worker_lock);
+                        log_error("Failed to realloc() memory for threadpool workers");
+                        return -1;
+                }
+                tp->workers = grown;
+                while (tp->size < workers && (worker = _spawn_worker(tp)) != NULL)
+                        tp->workers[tp->size++] = worker;
+        }
+
+        // The manager can not pick the removed workers, the busy ones stop after their job
+        while (tp->size > workers) {
+                worker = tp->workers[--tp->size];
+                _lock(&worker->lock);
+                worker->retired = true;
+                worker->state = TP_STOPPED;
+                pthread_cond_signal(&worker->ready);
+                _unlock(&worker->lock);
+        }
+        pthread_cond_broadcast(&tp->manager->worker_ready);
+        _unlock(&tp->manager->worker_lock);
+
+        log_debug("Threadpool resized from %d to %d workers", size, tp->size);
+        return tp->size == workers ? 0 : -1;
+}
+
+void tp_recycle(tp_t *tp, void (*recycle)(void *arg, tp_job_t *job), void *arg)
+{
+        tp->recycled = arg;
+        tp->recycle = recycle;
+}
+
+void tp_hold(tp_job_t *job)
+{
+        __atomic_add_fetch(&job->holds, 1, __ATOMIC_RELAXED);
+}
+
+void tp_release(tp_t *tp, tp_job_t *job, bool again)
+{
+        if (again)
+                job->again = true;
+        if (__atomic_sub_fetch(&job->holds, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+
+        if (!job->again) {
+                if (tp->recycle != NULL)
+                        tp->recycle(tp->recycled, job);
+                else
+                        _put_finished(tp, job);
+        } else {
+                job->again = false;
+                if (tp_put(tp, job) < 0)
+                        log_error("Failed to put back held job");
+        }
+}
+
+// Wake up the callers waiting for a free job
+void tp_close(tp_t *tp) { queue_close(tp->jobs.finished); }
+
+// The workers finish their assigned job before they stop
 void tp_stop(tp_t *tp)
 {
+    bool manager = tp->manager->state == TP_RUNNING;
+
     log_debug("Stopping threadpool");
+    tp_close(tp);
+
     // Stop workers
     for (int i=0; i<tp->size; ++i) {
-        tp->workers[i].state = TP_STOPPED;
-        pthread_cond_signal(&tp->workers[i].ready); // Stop waiting for job
+        tp->workers[i]->state = TP_STOPPED;
+        _signal_condition(&tp->workers[i]->lock, &tp->workers[i]->ready); // Stop waiting for job
     }
 
     // Stop manager
     tp->manager->state = TP_STOPPED;
-    pthread_cond_signal(&tp->manager->job_ready);       // Stop waiting for job
-    pthread_cond_signal(&tp->manager->worker_ready);    // Stop waiting for worker
+    _signal_condition(&tp->manager->job_lock, &tp->manager->job_ready);         // Stop waiting for job
+    _signal_condition(&tp->manager->worker_lock, &tp->manager->worker_ready);   // Stop waiting for worker
+
+    for (int i=0; i<tp->size; ++i)
+        pthread_join(tp->workers[i]->id, NULL);
+    if (manager)
+        pthread_join(tp->manager->id, NULL);
     log_debug("Threadpool has stopped");
-    sleep(1);
 }
 
 void tp_destroy(tp_t *tp)
@@ -279,7 +438,10 @@ void tp_destroy(tp_t *tp)
     log_debug("Destroying threadpool");
     queue_destroy(tp->jobs.pending);
     queue_destroy(tp->jobs.finished);
+    for (int i=0; i<tp->size; ++i)
+        free(tp->workers[i]);
     free(tp->workers);
+    free(tp->chunk);
     free(tp->manager);
     free(tp);
     log_debug("Threadpool has been destroyed");
@@ -4,11 +4,16 @@
 #include "queue.h"
 
 
+// Initial size of the pending queue of a pool without jobs, it grows on demand
+#define TP_QUEUE 64
+
 enum tp_state {TP_NONE, TP_RUNNING, TP_STOPPED};
 
 typedef struct tp_job {
         void (*function)(void *arg);
         void *arg;
+        int holds;              // The running function and the tp_hold() calls
+        bool again;             // Put back into the pending queue by the last holder
 } tp_job_t;
 
 typedef struct tp_jobs {
@@ -21,6 +26,7 @@ typedef struct tp_worker {
         struct tp *tp;
         struct tp_job *job;
         enum tp_state state; 
+        bool retired;           // Removed by tp_resize(), frees itself after its last job
         pthread_cond_t ready;
         pthread_mutex_t lock;
 } tp_worker_t;
@@ -38,7 +44,10 @@ typedef struct tp_manager {
 typedef struct tp {
         int size;
         struct tp_jobs jobs;
-        struct tp_worker *workers;
+        struct tp_job *chunk;           // The jobs of tp_create()
+        void (*recycle)(void *arg, struct tp_job *job);
+        void *recycled;                 // Argument of recycle()
+        struct tp_worker **workers;     // Guarded by the worker_lock of the manager
         struct tp_manager *manager;
 } tp_t;
 
@@ -48,6 +57,25 @@ void tp_destroy(tp_t *tp);
 
 int tp_start(tp_t *tp);
 void tp_stop(tp_t *tp);
+void tp_close(tp_t *tp);
 
 int tp_put(tp_t *tp, tp_job_t *job);
 tp_job_t* tp_get(tp_t *tp);
+tp_job_t* tp_wait(tp_t *tp);
+// Give back a job of tp_get() or tp_wait() which could not be put
+void tp_unget(tp_t *tp, tp_job_t *job);
+
+int tp_pending(tp_t *tp);
+int tp_busy(tp_t *tp);
+
+// Change the number of workers while running, the removed workers finish their job first
+int tp_resize(tp_t *tp, int workers);
+// Give the finished jobs to recycle() instead of the free jobs, eg. for the
+// jobs of the caller put with tp_put() (tp_create() with 0 jobs)
+void tp_recycle(tp_t *tp, void (*recycle)(void *arg, tp_job_t *job), void *arg);
+
+// A job can finish after its function returned (eg. waiting for a child
+// process without a worker): the function holds it, the completion releases
+// it from any thread, then the job runs again (again) or it is finished
+void tp_hold(tp_job_t *job);
+void tp_release(tp_t *tp, tp_job_t *job, bool again);
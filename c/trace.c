@@ -0,0 +1,174 @@
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "trace.h"
+
+
+// The sequence is odd while the record is written, so the dump can skip
+// the records which change under it instead of locking the writers
+typedef struct trace_slot {
+        uint64_t sequence;
+        trace_record_t record;
+} trace_slot_t;
+
+static struct {
+        int size;
+        unsigned long slow;
+        uint64_t next;
+        uint64_t ids;
+        int64_t offset;         // Wall clock minus monotonic clock
+        trace_slot_t *slots;
+} ring;
+
+// Duration of the stage closed by the stamp in microseconds (-1 if it was not reached)
+static long _duration(const trace_record_t *record, enum trace_stamp stamp)
+{
+        if (record->stamps[stamp] == 0 || record->stamps[stamp-1] == 0)
+                return -1;
+        return (record->stamps[stamp] - record->stamps[stamp-1]) / 1000;
+}
+
+static long _total(const trace_record_t *record)
+{
+        if (record->stamps[TRACE_CLOSED] == 0)
+                return -1;
+        return (record->stamps[TRACE_CLOSED] - record->stamps[TRACE_ACCEPTED]) / 1000;
+}
+
+static void _write(FILE *out, const trace_record_t *record)
+{
+        char timestamp[32];
+        struct tm tm;
+        uint64_t wall = record->stamps[TRACE_ACCEPTED] + ring.offset;
+        time_t seconds = wall / 1000000000;
+
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime_r(&seconds, &tm));
+        fprintf(out, "%lu %s.%03lu %s %s:%d %d %s", record->id, timestamp, (wall / 1000000) % 1000,
+                        record->method[0] ? record->method : "-", record->ip, record->port,
+                        record->code, record->result ? record->result : "-");
+        for (int i=TRACE_STARTED; i<=TRACE_SENT; ++i)
+                fprintf(out, " %ld", _duration(record, i));
+        fprintf(out, " %ld\n", _total(record));
+}
+
+
+int trace_setup(int size, unsigned long slow)
+{
+        struct timespec wall, mono;
+
+        log_debug("Creating request trace ring with %d records", size);
+
+        ring.slots = (trace_slot_t*) calloc (size, sizeof(*ring.slots));
+        if (ring.slots == NULL) {
+                log_error("Failed to calloc() trace ring");
+                return -1;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &wall);
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        ring.offset = (wall.tv_sec - mono.tv_sec) * 1000000000ll + (wall.tv_nsec - mono.tv_nsec);
+        ring.size = size;
+        ring.slow = slow;
+        return 0;
+}
+
+void trace_teardown()
+{
+        free(ring.slots);
+        ring.slots = NULL;
+        ring.size = 0;
+}
+
+uint64_t trace_id()
+{
+        return __atomic_add_fetch(&ring.ids, 1, __ATOMIC_RELAXED);
+}
+
+void trace_commit(const trace_record_t *record)
+{
+        trace_slot_t *slot;
+        uint64_t ticket;
+        long total;
+
+        if (ring.slots == NULL)
+                return;
+
+        ticket = __atomic_fetch_add(&ring.next, 1, __ATOMIC_RELAXED);
+        slot = &ring.slots[ticket % ring.size];
+
+        __atomic_store_n(&slot->sequence, 2 * ticket + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        slot->record = *record;
+        __atomic_store_n(&slot->sequence, 2 * ticket + 2, __ATOMIC_RELEASE);
+
+        total = _total(record);
+        if (ring.slow > 0 && total >= (long) ring.slow * 1000) {
+                log_warning("Slow request %lu: %s %s from %s:%d took %ldus (queue=%ld recv=%ld parse=%ld exec=%ld send=%ld)",
+                                record->id, record->method, record->result ? record->result : "-",
+                                record->ip, record->port, total,
+                                _duration(record, TRACE_STARTED),
+                                _duration(record, TRACE_RECEIVED),
+                                _duration(record, TRACE_PARSED),
+                                _duration(record, TRACE_EXECUTED),
+                                _duration(record, TRACE_SENT));
+        }
+}
+
+// Write the records from the oldest to the newest into a temporary file and
+// rename it, so the readers never see a partial dump
+int trace_dump(const char *path)
+{
+        char tmp[4096];
+        trace_record_t record;
+        trace_slot_t *slot;
+        uint64_t next, first, sequence;
+        int count = 0;
+        FILE *out;
+        int fd;
+
+        if (ring.slots == NULL)
+                return -1;
+
+        // A new file of the server next to the dump, never an existing path
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+        if ((fd = mkstemp(tmp)) < 0) {
+                log_error("Failed to create %s: %s", tmp, strerror(errno));
+                return -1;
+        }
+        if ((out = fdopen(fd, "w")) == NULL) {
+                log_error("Failed to open %s: %s", tmp, strerror(errno));
+                close(fd);
+                unlink(tmp);
+                return -1;
+        }
+
+        fprintf(out, "# id accepted method address code result queue_us recv_us parse_us exec_us send_us total_us\n");
+        next = __atomic_load_n(&ring.next, __ATOMIC_ACQUIRE);
+        first = next > ring.size ? next - ring.size : 0;
+        for (uint64_t ticket=first; ticket<next; ++ticket) {
+                slot = &ring.slots[ticket % ring.size];
+                sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+                if (sequence != 2 * ticket + 2)
+                        continue;
+                record = slot->record;
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+                        continue;
+                _write(out, &record);
+                count++;
+        }
+
+        if (fclose(out) != 0 || rename(tmp, path) < 0) {
+                log_error("Failed to write %s: %s", path, strerror(errno));
+                unlink(tmp);
+                return -1;
+        }
+
+        log_info("Dumped %d request(s) to %s", count, path);
+        return count;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+
+#define TRACE_METHOD_SIZE 16
+#define TRACE_IP_SIZE 40
+
+// Timestamps of a request, every stamp closes the stage which started at the previous one
+enum trace_stamp {
+        TRACE_ACCEPTED,
+        TRACE_STARTED,
+        TRACE_RECEIVED,
+        TRACE_PARSED,
+        TRACE_EXECUTED,
+        TRACE_SENT,
+        TRACE_CLOSED,
+        TRACE_STAMPS
+};
+
+typedef struct trace_record {
+        uint64_t id;
+        uint64_t stamps[TRACE_STAMPS];
+        char method[TRACE_METHOD_SIZE];
+        char ip[TRACE_IP_SIZE];
+        unsigned short port;
+        int code;
+        const char *result;     // Static string
+} trace_record_t;
+
+
+int trace_setup(int size, unsigned long slow);
+void trace_teardown();
+
+uint64_t trace_id();
+void trace_commit(const trace_record_t *record);
+int trace_dump(const char *path);
@@ -0,0 +1,179 @@
+#include <stdlib.h>
+
+#include "logging.h"
+#include "wheel.h"
+
+
+static inline void _list_init(wheel_timer_t *head) { head->next = head->prev = head; }
+static inline bool _list_empty(wheel_timer_t *head) { return head->next == head; }
+
+static inline void _list_add(wheel_timer_t *head, wheel_timer_t *timer)
+{
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+}
+
+static inline void _list_del(wheel_timer_t *timer)
+{
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->next = timer->prev = NULL;
+}
+
+static inline unsigned long _index(unsigned long ticks, int level)
+{
+        return (ticks >> (WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS)) & (WHEEL_LEVEL_SIZE - 1);
+}
+
+// Find the slot of the timer based on how far it is in the future
+static void _insert(wheel_t *wheel, wheel_timer_t *timer)
+{
+        unsigned long expires = timer->expires;
+        unsigned long delta = expires - wheel->now;
+        int level;
+
+        if ((long) delta < 0) {
+                _list_add(&wheel->root[wheel->now & (WHEEL_ROOT_SIZE - 1)], timer);
+                return;
+        }
+
+        if (delta < WHEEL_ROOT_SIZE) {
+                _list_add(&wheel->root[expires & (WHEEL_ROOT_SIZE - 1)], timer);
+                return;
+        }
+
+        for (level=0; level<WHEEL_LEVELS-2; ++level)
+                if (delta < 1UL << (WHEEL_ROOT_BITS + (level + 1) * WHEEL_LEVEL_BITS))
+                        break;
+
+        // Clamp the too distant timers to the end of the wheel
+        if (level == WHEEL_LEVELS-2 && delta >= 1UL << (WHEEL_ROOT_BITS + (level + 1) * WHEEL_LEVEL_BITS)) {
+                expires = wheel->now + (1UL << (WHEEL_ROOT_BITS + (level + 1) * WHEEL_LEVEL_BITS)) - 1;
+                timer->expires = expires;
+        }
+
+        _list_add(&wheel->levels[level][_index(expires, level)], timer);
+}
+
+// Move the timers of an upper level slot one level down
+static unsigned long _cascade(wheel_t *wheel, int level, unsigned long index)
+{
+        wheel_timer_t list, *timer;
+        wheel_timer_t *head = &wheel->levels[level][index];
+
+        if (_list_empty(head))
+                return index;
+
+        // Detach the whole slot first, because _insert() can put timers back to it
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        _list_init(head);
+
+        while (!_list_empty(&list)) {
+                timer = list.next;
+                _list_del(timer);
+                _insert(wheel, timer);
+        }
+        return index;
+}
+
+wheel_t* wheel_create(unsigned long tick)
+{
+        wheel_t *wheel;
+
+        wheel = (wheel_t*) calloc (1, sizeof(*wheel));
+        if (wheel == NULL) {
+                log_error("Failed to calloc() memory for timing wheel");
+                return NULL;
+        }
+
+        wheel->tick = tick;
+        for (int i=0; i<WHEEL_ROOT_SIZE; ++i)
+                _list_init(&wheel->root[i]);
+        for (int l=0; l<WHEEL_LEVELS-1; ++l)
+                for (int i=0; i<WHEEL_LEVEL_SIZE; ++i)
+                        _list_init(&wheel->levels[l][i]);
+
+        return wheel;
+}
+
+void wheel_destroy(wheel_t *wheel)
+{
+        free(wheel);
+}
+
+void wheel_init_timer(wheel_timer_t *timer, void *arg)
+{
+        timer->next = timer->prev = NULL;
+        timer->expires = 0;
+        timer->arg = arg;
+}
+
+bool wheel_pending(wheel_timer_t *timer)
+{
+        return timer->prev != NULL;
+}
+
+// Delay is in the same unit as the time passed to wheel_advance()
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned long delay)
+{
+        unsigned long ticks = (delay + wheel->tick - 1) / wheel->tick;
+
+        if (wheel_pending(timer))
+                wheel_del(wheel, timer);
+
+        timer->expires = wheel->now + (ticks ? ticks : 1);
+        _insert(wheel, timer);
+        wheel->pending++;
+}
+
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer)
+{
+        if (!wheel_pending(timer))
+                return;
+
+        _list_del(timer);
+        wheel->pending--;
+}
+
+// Run the wheel until the given time and return the expired timers in a
+// NULL terminated list linked through timer->next. The time is counted from
+// the creation of the wheel in the same unit as the tick.
+wheel_timer_t* wheel_advance(wheel_t *wheel, unsigned long now)
+{
+        unsigned long target = now / wheel->tick;
+        unsigned long index;
+        wheel_timer_t *expired = NULL;
+        wheel_timer_t *timer, *head;
+        int level;
+
+        while ((long)(target - wheel->now) >= 0) {
+                index = wheel->now & (WHEEL_ROOT_SIZE - 1);
+
+                // Refill the root from the upper levels once it has turned around
+                for (level=0; index == 0 && level<WHEEL_LEVELS-1; ++level)
+                        index = _cascade(wheel, level, _index(wheel->now, level));
+
+                head = &wheel->root[wheel->now & (WHEEL_ROOT_SIZE - 1)];
+                while (!_list_empty(head)) {
+                        timer = head->prev;
+                        _list_del(timer);
+                        wheel->pending--;
+                        timer->next = expired;
+                        expired = timer;
+                }
+
+                // Skip the empty rounds when nothing is pending
+                if (wheel->pending == 0) {
+                        wheel->now = target + 1;
+                        break;
+                }
+                wheel->now++;
+        }
+
+        return expired;
+}
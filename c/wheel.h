@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+
+
+// Hierarchical timing wheel: 256 slots in the first level and 3 levels of
+// 64 slots above it, so timers can be scheduled up to 2^26 ticks ahead.
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVELS 4
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+
+typedef struct wheel_timer {
+        struct wheel_timer *next;
+        struct wheel_timer *prev;
+        unsigned long expires;
+        void *arg;
+} wheel_timer_t;
+
+typedef struct wheel {
+        unsigned long now;
+        unsigned long tick;
+        unsigned long pending;
+        wheel_timer_t root[WHEEL_ROOT_SIZE];
+        wheel_timer_t levels[WHEEL_LEVELS-1][WHEEL_LEVEL_SIZE];
+} wheel_t;
+
+// The wheel does no locking, the callers have to serialize the access
+wheel_t* wheel_create(unsigned long tick);
+void wheel_destroy(wheel_t *wheel);
+
+void wheel_init_timer(wheel_timer_t *timer, void *arg);
+bool wheel_pending(wheel_timer_t *timer);
+
+void wheel_add(wheel_t *wheel, wheel_timer_t *timer, unsigned long delay);
+void wheel_del(wheel_t *wheel, wheel_timer_t *timer);
+wheel_timer_t* wheel_advance(wheel_t *wheel, unsigned long now);
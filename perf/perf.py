@@ -0,0 +1,401 @@
+"""
+End-to-end performance regression suite of the servers
+
+The servers run with a fake iptables on PATH (see fake-iptables), so no root is needed and the cost of the
+firewall is a fixed latency. Every workload profile runs against a freshly started server, the throughput and the
+latency percentiles are compared with the baseline of the server in baselines/<server>.json.
+"""
+import os
+import re
+import sys
+import json
+import time
+import random
+import shutil
+import signal
+import socket
+import asyncio
+import argparse
+import tempfile
+import subprocess
+from typing import Dict, List, Optional, Tuple
+
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+PERF = os.path.join(ROOT, 'perf')
+BASELINES = os.path.join(PERF, 'baselines')
+
+# Milliseconds of every fake iptables call
+LATENCY = 5
+
+# Allowed relative regression of the throughput and the latencies
+TOLERANCE = 0.3
+
+# Milliseconds the latencies may grow on top of the tolerance, a scheduling hiccup is not a regression
+SLACK = 5.0
+
+# Seconds to wait for a response (and for a server to start)
+TIMEOUT = 10
+
+# The reported metrics: whether more is better and the multiple of the tolerance they get. The tails of a few
+# hundred requests hang on a handful of them, they are let vary twice as much.
+METRICS = {
+    'throughput': (True, 1),
+    'p50': (False, 1),
+    'p90': (False, 2),
+    'p99': (False, 2),
+}
+
+# kind: 'burst' sends every request at once, 'rate' sends them at a fixed rate for duration seconds, 'closed' keeps
+# concurrency clients busy. slow clients connect and wait delay seconds before sending, their requests are not
+# measured. methods are weighted, 'invalid' is a request which the server rejects without calling iptables.
+PROFILES = {
+    'burst': {'kind': 'burst', 'requests': 500},
+    'steady': {'kind': 'rate', 'rate': 50, 'duration': 5},
+    'slow-client': {'kind': 'rate', 'rate': 25, 'duration': 10, 'slow': 16, 'delay': 1.0},
+    'mixed': {'kind': 'closed', 'concurrency': 16, 'requests': 1000,
+              'methods': {'append': 3, 'remove': 1, 'invalid': 1}},
+}
+
+
+class Server:
+    """
+    A server process on a free port, with the fake iptables first on its PATH
+    """
+    name = None
+
+    def __init__(self, workdir: str):
+        self.workdir = workdir
+        self.port = free_port()
+        self.process: Optional[subprocess.Popen] = None
+        self.log = os.path.join(workdir, f'{self.name}.log')
+
+    def command(self) -> List[str]:
+        raise NotImplementedError
+
+    def request(self, method: str, ip: str) -> bytes:
+        raise NotImplementedError
+
+    def code(self, response: bytes) -> Optional[int]:
+        raise NotImplementedError
+
+    def start(self, latency: int) -> None:
+        env = dict(os.environ)
+        env['PATH'] = os.path.join(self.workdir, 'bin') + os.pathsep + env.get('PATH', '')
+        env['FAKE_IPTABLES_LATENCY'] = str(latency)
+
+        with open(self.log, 'ab') as log:
+            self.process = subprocess.Popen(self.command(), stdout=log, stderr=subprocess.STDOUT, env=env,
+                                            cwd=self.workdir)
+
+        deadline = time.monotonic() + TIMEOUT
+        while time.monotonic() < deadline:
+            if self.process.poll() is not None:
+                break
+            try:
+                socket.create_connection(('127.0.0.1', self.port), timeout=1).close()
+                return
+            except OSError:
+                time.sleep(0.05)
+        self.stop()
+        raise RuntimeError(f"{self.name} server did not start, see {self.log}")
+
+    def stop(self) -> None:
+        if self.process is None or self.process.poll() is not None:
+            return
+        self.process.send_signal(signal.SIGINT)
+        try:
+            self.process.wait(TIMEOUT)
+        except subprocess.TimeoutExpired:
+            self.process.kill()
+            self.process.wait()
+
+
+class CServer(Server):
+    name = 'c'
+    binary = os.path.join(ROOT, 'c', 'server')
+
+    def command(self) -> List[str]:
+        return [self.binary, '-b', 'iptables', '-p', str(self.port), '-s', '0',
+                '-e', os.path.join(self.workdir, 'expiry.txt')]
+
+    def request(self, method: str, ip: str) -> bytes:
+        return f'method={method};ip={ip}'.encode()
+
+    def code(self, response: bytes) -> Optional[int]:
+        match = re.search(rb'(?:^|;)code=(-?\d+)', response)
+        return int(match.group(1)) if match else None
+
+
+class PythonServer(Server):
+    name = 'python'
+    options: List[str] = []
+
+    def command(self) -> List[str]:
+        return [sys.executable, os.path.join(ROOT, 'python', 'server.py'), '-p', str(self.port)] + self.options
+
+    def request(self, method: str, ip: str) -> bytes:
+        return json.dumps({'method': method, 'host': ip}).encode()
+
+    def code(self, response: bytes) -> Optional[int]:
+        try:
+            return json.loads(response)['code']
+        except (ValueError, KeyError):
+            return None
+
+
+class AsyncPythonServer(PythonServer):
+    name = 'python-asyncio'
+    options = ['--asyncio']
+
+
+SERVERS = {server.name: server for server in (CServer, PythonServer, AsyncPythonServer)}
+
+
+def free_port() -> int:
+    with socket.socket() as sock:
+        sock.bind(('127.0.0.1', 0))
+        return sock.getsockname()[1]
+
+
+def percentile(values: List[float], p: float) -> float:
+    """
+    Nearest-rank percentile of the sorted values
+    """
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, max(0, int(round(p / 100 * len(values) + 0.5)) - 1))]
+
+
+class Load:
+    """
+    Load generator of one profile: every request is a connection, like the clients of the servers do it
+    """
+
+    def __init__(self, server: Server, profile: dict):
+        self.server = server
+        self.profile = profile
+        self.methods = list(profile.get('methods', {'append': 1}).items())
+        self.latencies: List[float] = []
+        self.errors = 0
+        self.failed = 0
+        self.running = True
+
+    def pick(self) -> Tuple[str, str, bool]:
+        """
+        Returns the method, the address and whether the request should succeed. The addresses are random, so the
+        requests are not coalesced by the servers.
+        """
+        method = random.choices([m for m, _ in self.methods], weights=[w for _, w in self.methods])[0]
+        ip = f'10.{random.randrange(256)}.{random.randrange(256)}.{random.randrange(1, 255)}'
+        if method == 'invalid':
+            return 'append', ip + '.1', False
+        return method, ip, True
+
+    async def call(self, method: str, ip: str, delay: float = 0) -> Optional[int]:
+        reader, writer = await asyncio.open_connection('127.0.0.1', self.server.port)
+        try:
+            if delay:
+                await asyncio.sleep(delay)
+            writer.write(self.server.request(method, ip))
+            await writer.drain()
+            # Without keep-alive both servers close the connection after the response
+            return self.server.code(await reader.read())
+        finally:
+            writer.close()
+
+    async def one(self, start: Optional[float] = None) -> None:
+        """
+        One measured request, its latency counts from start (the time it was due) if given
+        """
+        method, ip, valid = self.pick()
+        start = time.monotonic() if start is None else start
+        try:
+            code = await asyncio.wait_for(self.call(method, ip), TIMEOUT)
+        except (OSError, asyncio.TimeoutError):
+            self.errors += 1
+            return
+        if code is None:
+            self.errors += 1
+            return
+        if (code == 0) != valid:
+            self.failed += 1
+        self.latencies.append((time.monotonic() - start) * 1000)
+
+    async def slow(self) -> None:
+        """
+        A client which keeps a connection idle before every request
+        """
+        while self.running:
+            method, ip, _ = self.pick()
+            try:
+                await asyncio.wait_for(self.call(method, ip, self.profile['delay']), TIMEOUT)
+            except (OSError, asyncio.TimeoutError):
+                await asyncio.sleep(0.1)
+
+    async def closed(self, count: int) -> None:
+        for _ in range(count):
+            await self.one()
+
+    async def run(self) -> dict:
+        profile = self.profile
+        slow = [asyncio.ensure_future(self.slow()) for _ in range(profile.get('slow', 0))]
+        if slow:
+            await asyncio.sleep(profile['delay'] / 2)
+
+        begin = time.monotonic()
+        if profile['kind'] == 'burst':
+            await asyncio.gather(*(self.one() for _ in range(profile['requests'])))
+        elif profile['kind'] == 'closed':
+            share, extra = divmod(profile['requests'], profile['concurrency'])
+            await asyncio.gather(*(self.closed(share + (i < extra)) for i in range(profile['concurrency'])))
+        else:
+            # Open loop: the latency counts from the time the request was due, a stalled server is not hidden
+            # by the requests which were not sent in the meantime
+            pending = []
+            count = int(profile['rate'] * profile['duration'])
+            for i in range(count):
+                due = begin + i / profile['rate']
+                await asyncio.sleep(max(0.0, due - time.monotonic()))
+                pending.append(asyncio.ensure_future(self.one(due)))
+            await asyncio.gather(*pending)
+        elapsed = time.monotonic() - begin
+
+        self.running = False
+        for task in slow:
+            task.cancel()
+        await asyncio.gather(*slow, return_exceptions=True)
+
+        latencies = sorted(self.latencies)
+        return {
+            'requests': len(latencies) + self.errors,
+            'errors': self.errors,
+            'failed': self.failed,
+            'throughput': round(len(latencies) / elapsed, 1),
+            'p50': round(percentile(latencies, 50), 2),
+            'p90': round(percentile(latencies, 90), 2),
+            'p99': round(percentile(latencies, 99), 2),
+        }
+
+
+def measure(cls, workdir: str, name: str, latency: int, runs: int) -> dict:
+    """
+    Run the profile runs times on fresh servers, the best value of every metric is kept: the noise of a shared box
+    only makes some of the runs slower, a regression makes all of them slower
+    """
+    results = []
+    for _ in range(runs):
+        server = cls(workdir)
+        server.start(latency)
+        try:
+            results.append(asyncio.run(Load(server, PROFILES[name]).run()))
+        finally:
+            server.stop()
+
+    merged = {key: min(result[key] for result in results) for key in results[0]}
+    merged['throughput'] = max(result['throughput'] for result in results)
+    merged['requests'] = max(result['requests'] for result in results)
+    return merged
+
+
+def compare(result: dict, baseline: dict, tolerance: float) -> List[str]:
+    """
+    Returns the regressions of the result
+    """
+    regressions = []
+    for metric, (higher, scale) in METRICS.items():
+        value, base, allowed = result[metric], baseline[metric], tolerance * scale
+        if higher and value < base * (1 - allowed):
+            regressions.append(f"{metric} {value} < {base} - {allowed:.0%}")
+        elif not higher and value > base * (1 + allowed) + SLACK:
+            regressions.append(f"{metric} {value} ms > {base} ms + {allowed:.0%}")
+
+    # A noisy one in a hundred is let through on top of the errors of the baseline
+    for metric in ('errors', 'failed'):
+        if result[metric] > baseline.get(metric, 0) * (1 + tolerance) + result['requests'] // 100:
+            regressions.append(f"{metric} {result[metric]} > {baseline.get(metric, 0)}")
+    return regressions
+
+
+def report(server: str, name: str, result: dict, baseline: Optional[dict], regressions: List[str]) -> None:
+    def delta(metric):
+        if baseline is None or not baseline.get(metric):
+            return ''
+        return f" ({(result[metric] - baseline[metric]) / baseline[metric]:+.0%})"
+
+    status = 'FAIL' if regressions else 'ok' if baseline is not None else 'new'
+    print(f"{server:15} {name:12} {result['throughput']:8.1f}/s{delta('throughput'):7}"
+          f"  p50 {result['p50']:8.2f}{delta('p50'):7}  p90 {result['p90']:8.2f}{delta('p90'):7}"
+          f"  p99 {result['p99']:8.2f}{delta('p99'):7}  errors {result['errors']}/{result['failed']}  {status}")
+    for regression in regressions:
+        print(f"{'':15} {'':12} regression: {regression}")
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('-s', '--server', action='append', choices=list(SERVERS),
+                        help="Server to measure, can be repeated (default: all)")
+    parser.add_argument('-p', '--profile', action='append', choices=list(PROFILES),
+                        help="Profile to run, can be repeated (default: all)")
+    parser.add_argument('-l', '--latency', type=int, default=LATENCY,
+                        help="Milliseconds of every fake iptables call (default: %(default)s)")
+    parser.add_argument('-r', '--runs', type=int, default=3,
+                        help="Runs of every profile, the best of them is compared (default: %(default)s)")
+    parser.add_argument('-t', '--tolerance', type=float, default=TOLERANCE,
+                        help="Allowed relative regression (default: %(default)s)")
+    parser.add_argument('-u', '--update', action='store_true',
+                        help="Store the results as the new baselines instead of comparing them")
+    args = parser.parse_args()
+
+    servers = args.server or list(SERVERS)
+    profiles = args.profile or list(PROFILES)
+    if 'c' in servers and not os.access(CServer.binary, os.X_OK):
+        print(f"{CServer.binary} is missing, build it with 'make -C c server'", file=sys.stderr)
+        return 2
+
+    failed = False
+    with tempfile.TemporaryDirectory(prefix='fwmgr-perf-') as workdir:
+        os.mkdir(os.path.join(workdir, 'bin'))
+        for name in ('iptables', 'iptables-restore'):
+            shutil.copy(os.path.join(PERF, 'fake-iptables'), os.path.join(workdir, 'bin', name))
+
+        for server in servers:
+            path = os.path.join(BASELINES, f'{server}.json')
+            baselines: Dict[str, dict] = {'latency': args.latency, 'profiles': {}}
+            if os.path.exists(path):
+                with open(path) as file:
+                    baselines = json.load(file)
+            if baselines['latency'] != args.latency and not args.update:
+                print(f"{path} was recorded with {baselines['latency']} ms fake iptables, not {args.latency} ms",
+                      file=sys.stderr)
+                return 2
+            baselines['latency'] = args.latency
+
+            for name in profiles:
+                try:
+                    result = measure(SERVERS[server], workdir, name, args.latency, args.runs)
+                except RuntimeError as error:
+                    with open(os.path.join(workdir, f'{server}.log'), 'rb') as log:
+                        sys.stderr.write(log.read()[-2000:].decode(errors='replace'))
+                    print(error, file=sys.stderr)
+                    return 2
+
+                baseline = None if args.update else baselines['profiles'].get(name)
+                regressions = compare(result, baseline, args.tolerance) if baseline is not None else []
+                report(server, name, result, baseline, regressions)
+                if regressions or (baseline is None and not args.update):
+                    failed = True
+                baselines['profiles'][name] = result
+
+            if args.update:
+                with open(path, 'w') as file:
+                    json.dump(baselines, file, indent=4, sort_keys=True)
+                    file.write('\n')
+
+    if failed:
+        print("Performance regressed (or a baseline is missing, record it with --update)", file=sys.stderr)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
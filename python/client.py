@@ -1,14 +1,28 @@
 import sys
 import json
+from threading import Thread
 from socket import socket
-from socket import AF_INET, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
+from socket import AF_INET, AF_UNIX, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR, SHUT_WR
 
 
 class Client:
-    def __init__(self, addr, port):
+    def __init__(self, addr, port=None):
+        """
+        :param addr: address of the server or path of its unix socket if port is None
+        :param port: port of the server
+        """
         self.addr = addr
         self.port = port
 
+    def connect(self):
+        if self.port is None:
+            sock = socket(AF_UNIX, SOCK_STREAM)
+            sock.connect(self.addr)
+        else:
+            sock = socket(AF_INET, SOCK_STREAM)
+            sock.connect((self.addr, self.port))
+        return sock
+
     def pack(self, payload):
         return bytes(json.dumps(payload), encoding='utf8')
 
@@ -18,33 +32,89 @@ class Client:
     def send(self, payload):
         request = self.pack(payload)
 
-        sock = socket(AF_INET, SOCK_STREAM)
-        sock.connect((self.addr, self.port))
+        sock = self.connect()
         sock.send(request)
         response = sock.recv(1024)
+        sock.close()
 
         return self.unpack(response)
 
+    def bulk(self, lines, callback=None):
+        """
+        Stream "<method> <host>" lines over one connection, the server applies them in large transactions.
+
+        :param lines: iterable of the lines (str or bytes)
+        :param callback: called with the failed lines ('line' key) and the progress ('progress' key)
+        :returns: the summary of the server
+        """
+        sock = self.connect()
+
+        # Send in the background, otherwise both sides could block on a full socket buffer
+        def stream():
+            sock.sendall(self.pack({'method': 'bulk'}) + b'\n')
+            for line in lines:
+                line = line if isinstance(line, bytes) else bytes(line, encoding='utf8')
+                sock.sendall(line if line.endswith(b'\n') else line + b'\n')
+            sock.shutdown(SHUT_WR)
+
+        sender = Thread(target=stream, daemon=True)
+        sender.start()
+
+        summary = None
+        with sock.makefile('rb') as reader:
+            for line in reader:
+                response = self.unpack(line)
+                if 'line' in response or 'progress' in response:
+                    if callback is not None:
+                        callback(response)
+                else:
+                    summary = response
+
+        sender.join()
+        sock.close()
+        return summary
+
 
 if __name__ == "__main__":
+    path = None
+    if len(sys.argv) > 2 and sys.argv[1] == '-u':
+        path = sys.argv[2]
+        del sys.argv[1:3]
+
     if len(sys.argv) < 3:
         sys.stderr.write("""
-%s <method> <host>
+%s [-u <socket>] <method> <host>
+%s [-u <socket>] bulk <file | ->
 
 Methods:
     - append
     - remove
+    - bulk: stream the "<method> <host>" lines of a file or stdin
 
 Hosts:
     - Any valid ip address
-""".lstrip() % sys.argv[0])
+""".lstrip() % (sys.argv[0], sys.argv[0]))
         sys.exit(1)
 
+    client = Client(path) if path else Client('localhost', 5555)
+
+    if sys.argv[1] == 'bulk':
+        def progress(response):
+            if 'line' in response:
+                print(f"Line {response['line']}: {response['msg']}")
+            else:
+                print(response['msg'], file=sys.stderr)
+
+        with (sys.stdin.buffer if sys.argv[2] == '-' else open(sys.argv[2], 'rb')) as lines:
+            response = client.bulk(lines, callback=progress)
+        print(response['msg'])
+        sys.exit(response['code'])
+
     payload = {
         'method': sys.argv[1],
         'host': sys.argv[2],
     }
 
-    response = Client('localhost', 5555).send(payload)
+    response = client.send(payload)
     print(response['msg'])
     sys.exit(response['code'])
@@ -1,17 +1,21 @@
 """
 Server application for modifying firewall rules with iptables
 """
+import os
 import re
 import sys
 import json
+import struct
+import asyncio
 import logging
+import argparse
 from subprocess import Popen, PIPE
 from threading import Thread
 from ipaddress import ip_address
 from collections import namedtuple
 import socket
-from socket import AF_INET, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR
-from typing import Tuple, Optional
+from socket import AF_INET, AF_UNIX, SOCK_STREAM, SOL_SOCKET, SO_REUSEADDR, SO_PEERCRED, SHUT_RDWR
+from typing import Tuple, Optional, List, Iterator
 
 
 # Error codes
@@ -20,6 +24,19 @@ INVALID_METHOD = 1
 INVALID_HOST = 2
 INVALID_JSON = 3
 EXECUTION_ERROR = 4
+PERMISSION_DENIED = 5
+
+# Rules applied in one iptables-restore transaction in bulk mode
+BULK_BATCH = 512
+
+# Concurrent iptables executions in asyncio mode
+EXECUTIONS = 8
+
+# Seconds to wait for the request (and for the lines of a bulk stream)
+TIMEOUT = 5
+
+# TCP port of the server
+PORT = 5555
 
 
 logger = logging.getLogger("fwmgr")
@@ -46,15 +63,17 @@ class Response:
     def __repr__(self):
         return f"{self.__class__.__name__}(code={self.code}, msg={self.msg})"
 
-    def __init__(self, code: int, msg: str):
+    def __init__(self, code: int, msg: str, **fields):
         """
         Response class to store and dump server response
 
         :param code: Error code
         :param msg: Message about what the error code means
+        :param fields: additional fields, eg: line and progress in bulk mode
         """
         self.code = code
         self.msg = msg
+        self.fields = fields
 
     def dump(self) -> bytes:
         """
@@ -63,12 +82,18 @@ class Response:
         data = json.dumps({
             'code': self.code,
             'msg': self.msg,
+            **self.fields,
         })
         return bytes(data, encoding='utf8')
 
 
 class Runner:
     METHODS = ['append', 'remove']
+    COMMANDS = {
+        'append': "iptables -A FORWARD -s {addr} -j ACCEPT",
+        'remove': "iptables -D FORWARD -s {addr} -j ACCEPT",
+    }
+    DONE = {'append': 'appended', 'remove': 'removed'}
 
     def __repr__(self):
         return f"{self.__class__.__name__}({self.data})"
@@ -81,6 +106,24 @@ class Runner:
         """
         self.data = data
 
+    def _restore(self, rules: str) -> Process:
+        """
+        Apply the rules in one transaction via iptables-restore
+
+        :param rules: input of iptables-restore
+        :returns: Proces named tuple with return_code, stdout and stderr
+        """
+        logger.info(f"Execute command: iptables-restore --noflush with %d rule(s)", rules.count('\n') - 2)
+
+        process = Popen(['iptables-restore', '--noflush'], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+        stdout, stderr = process.communicate(bytes(rules, encoding='utf8'))
+        return_code = process.poll()
+
+        if return_code != 0:
+            logger.warning(f"Return-code: %s; stdout: %s; stderr: %s", return_code, stdout, stderr)
+
+        return Process(return_code, stdout, stderr)
+
     def _run(self, cmd: str) -> Process:
         """
         Execute command via subprocess.Popen()
@@ -116,6 +159,58 @@ class Runner:
         except (ValidationError, ExecutionError) as error:
             return Response(error.code, error.msg)
 
+    def bulk(self) -> bool:
+        """
+        Return True if the client is going to stream rules in bulk mode
+        """
+        try:
+            method, _ = self.parse()
+        except ValidationError:
+            return False
+        return method == 'bulk'
+
+    @staticmethod
+    def split(msg: bytes) -> Tuple[bytes, bytes]:
+        """
+        Separate the request from the bulk stream which may follow it after a newline.
+        A message which is JSON as a whole (even a pretty-printed one) is only a request.
+        """
+        try:
+            json.loads(msg.decode('utf8'))
+            return msg, b''
+        except ValueError:
+            pass
+
+        request, _, rest = msg.partition(b'\n')
+        if Runner(request).bulk():
+            return request, rest
+        return msg, b''
+
+    def batch(self, rules: List[Tuple[str, str]]) -> List[Response]:
+        """
+        Apply validated (method, address) rules in as few iptables-restore transactions as possible.
+        A failed transaction applies none of the rules, so it is split until the failed rules are found.
+
+        :returns: with one Response object per rule
+        """
+        if not rules:
+            return []
+
+        if len(rules) == 1:
+            method, addr = rules[0]
+            try:
+                return [getattr(self, method)(addr)]
+            except ExecutionError as error:
+                return [Response(error.code, error.msg)]
+
+        lines = [f"{'-A' if method == 'append' else '-D'} FORWARD -s {addr} -j ACCEPT" for method, addr in rules]
+        process = self._restore("*filter\n" + "\n".join(lines) + "\nCOMMIT\n")
+        if process.return_code == 0:
+            return [Response(OK, f"Host {addr} has been successfully {self.DONE[method]}") for method, addr in rules]
+
+        half = len(rules) // 2
+        return self.batch(rules[:half]) + self.batch(rules[half:])
+
     def parse(self) -> tuple:
         """
         Parse data of the received from the client and return with the method and the host address.
@@ -144,35 +239,151 @@ class Runner:
         except Exception as exc:
             raise ValidationError(INVALID_HOST, f'Invalid host address "{addr}"')
 
-    def append(self, addr: str) -> Response:
+    def command(self, method: str, addr: str) -> str:
         """
-        Append an ACCEPTING iptables rule to the FORWARD chain for the specified host.
-        Returns with Response object
+        Return with the iptables command of the method
         """
-        cmd = f"iptables -A FORWARD -s {addr} -j ACCEPT"
-        process = self._run(cmd)
+        return self.COMMANDS[method].format(addr=addr)
 
+    def check(self, method: str, addr: str, process: Process) -> Response:
+        """
+        Return with the Response of the executed command, raises ExecutionError on unexpected errors
+        """
         if process.return_code == 0:
-            return Response(OK, f"Host {addr} has been successfully appended")
+            return Response(OK, f"Host {addr} has been successfully {self.DONE[method]}")
+
+        # Handle the errors
+        if method == 'remove' and re.search('does a matching rule exist', process.stderr.decode('utf8')):
+            return Response(EXECUTION_ERROR, "No matching rule presents")
 
         raise ExecutionError(EXECUTION_ERROR, "Unexpected error happened. Check server logs for further information")
 
+    def append(self, addr: str) -> Response:
+        """
+        Append an ACCEPTING iptables rule to the FORWARD chain for the specified host.
+        Returns with Response object
+        """
+        return self.check('append', addr, self._run(self.command('append', addr)))
+
     def remove(self, addr: str) -> Response:
         """
         Remove an iptables rule from the FORWARD chain for the specified host.
         Returns with Response obejct
         """
-        cmd = f"iptables -D FORWARD -s {addr} -j ACCEPT"
-        process = self._run(cmd)
+        return self.check('remove', addr, self._run(self.command('remove', addr)))
 
-        if process.return_code == 0:
-            return Response(OK, f"Host {addr} has been successfully removed")
 
-        # Handle the errors
-        if re.search('does a matching rule exist', process.stderr.decode('utf8')):
-            return Response(EXECUTION_ERROR, "No matching rule presents")
+class AsyncRunner(Runner):
+    def __init__(self, data: bytes, semaphore: asyncio.Semaphore):
+        """
+        Runner class for executing subprocesses from the event loop
 
-        raise ExecutionError(EXECUTION_ERROR, "Unexpected error happened. Check server logs for further information")
+        :param data: data read from the socket
+        :param semaphore: limits the concurrent executions
+        """
+        super().__init__(data)
+        self.semaphore = semaphore
+
+    async def _run_async(self, cmd: str) -> Process:
+        """
+        Execute command via asyncio.create_subprocess_exec() without blocking the event loop
+
+        :param cmd: command to execute
+        :returns: Proces named tuple with return_code, stdout and stderr
+        """
+        async with self.semaphore:
+            logger.info(f"Execute command: {cmd}")
+
+            process = await asyncio.create_subprocess_exec(*cmd.split(), stdout=PIPE, stderr=PIPE)
+            stdout, stderr = await process.communicate()
+            return_code = process.returncode
+
+        if return_code != 0:
+            logger.warning(f"Return-code: %s; stdout: %s; stderr: %s", return_code, stdout, stderr)
+
+        return Process(return_code, stdout, stderr)
+
+    async def execute_async(self) -> Response:
+        """
+        Same as execute() but the command runs without blocking the event loop
+        """
+        try:
+            method, addr = self.parse()
+            self.validate(method, addr)
+            return self.check(method, addr, await self._run_async(self.command(method, addr)))
+
+        except (ValidationError, ExecutionError) as error:
+            return Response(error.code, error.msg)
+
+    async def batch_async(self, rules: List[Tuple[str, str]]) -> List[Response]:
+        """
+        Same as batch() but in a worker thread, a transaction takes one of the executions
+        """
+        async with self.semaphore:
+            return await asyncio.to_thread(self.batch, rules)
+
+
+class Bulk:
+    def __init__(self):
+        """
+        State of a bulk stream independently of the IO: the lines are added one by one, the collected rules are
+        applied in transactions of BULK_BATCH rules by the caller
+        """
+        self.batch: List[Tuple[int, str, str]] = []
+        self.applied = 0
+        self.failed = 0
+        self.lines = 0
+
+    def add(self, runner: Runner, number: int, line: bytes) -> Optional[Response]:
+        """
+        Validate a "<method> <host>" line and collect its rule
+
+        :returns: with the Response of an invalid line
+        """
+        self.lines = number
+        fields = line.decode('utf8', errors='replace').split()
+        if not fields or fields[0].startswith('#'):
+            return None
+
+        method, addr = fields[0], fields[1] if len(fields) > 1 else None
+        try:
+            runner.validate(method, addr)
+        except ValidationError as error:
+            self.failed += 1
+            return Response(error.code, error.msg, line=number)
+
+        self.batch.append((number, method, addr))
+        return None
+
+    def full(self) -> bool:
+        return len(self.batch) >= BULK_BATCH
+
+    def rules(self) -> List[Tuple[str, str]]:
+        """
+        Return with the (method, address) rules of the pending transaction
+        """
+        return [(method, addr) for _, method, addr in self.batch]
+
+    def done(self, responses: List[Response]) -> List[Response]:
+        """
+        Account the results of the pending transaction
+
+        :returns: with the failed lines and the progress to send to the client
+        """
+        replies = []
+        for (number, _, _), response in zip(self.batch, responses):
+            if response.code != OK:
+                self.failed += 1
+                replies.append(Response(response.code, response.msg, line=number))
+            else:
+                self.applied += 1
+
+        self.batch = []
+        replies.append(Response(OK, f"{self.lines} line(s) processed", progress=self.lines))
+        return replies
+
+    def summary(self) -> Response:
+        return Response(EXECUTION_ERROR if self.failed else OK, f"{self.applied} rule(s) applied, {self.failed} failed")
 
 
 class Connection(Thread):
@@ -198,16 +409,21 @@ class Connection(Thread):
         """
         logger.debug("Connection received from %s:%s" % self.addr)
 
-        self.socket.settimeout(5)
+        self.socket.settimeout(TIMEOUT)
         try:
             msg = self.socket.recv(1024)
         except socket.timeout:
             logger.warning("Connection timedout to %s", self)
             return self.teardown()
 
+        msg, rest = Runner.split(msg)
         logger.debug("Request: %s", msg)
 
         runner = Runner(msg)
+        if runner.bulk():
+            self.bulk(runner, rest)
+            return self.teardown()
+
         response = runner.execute()
         msg = response.dump()
 
@@ -216,6 +432,64 @@ class Connection(Thread):
 
         self.teardown()
 
+    def lines(self, rest: bytes) -> Iterator[bytes]:
+        """
+        Yield the lines streamed by the client until it shuts down its side of the connection
+
+        :param rest: the beginning of the stream which was received with the request
+        """
+        buffer = rest
+        while True:
+            *lines, buffer = buffer.split(b'\n')
+            yield from lines
+
+            try:
+                data = self.socket.recv(65536)
+            except socket.timeout:
+                logger.warning("Bulk stream timedout from %s", self)
+                return
+            if not data:
+                break
+            buffer += data
+
+        # The last line does not need a newline
+        if buffer:
+            yield buffer
+
+    def reply(self, response: Response) -> None:
+        """
+        Send an intermediate response of the bulk mode, one per line
+        """
+        self.socket.sendall(response.dump() + b'\n')
+
+    def commit(self, runner: Runner, bulk: Bulk) -> None:
+        """
+        Apply the collected rules in one transaction, report the failed lines and the progress
+        """
+        for response in bulk.done(runner.batch(bulk.rules())):
+            self.reply(response)
+
+    def bulk(self, runner: Runner, rest: bytes) -> None:
+        """
+        Bulk mode: the client streams "<method> <host>" lines after the request, they are applied in transactions
+        of BULK_BATCH rules. The failed lines and the progress are sent back after every transaction, the summary
+        at the end of the stream.
+        """
+        bulk = Bulk()
+        for number, line in enumerate(self.lines(rest), start=1):
+            failure = bulk.add(runner, number, line)
+            if failure is not None:
+                self.reply(failure)
+            if bulk.full():
+                self.commit(runner, bulk)
+
+        if bulk.batch:
+            self.commit(runner, bulk)
+
+        summary = bulk.summary()
+        logger.info("Bulk from %s: %d line(s), %s", self, bulk.lines, summary.msg)
+        self.socket.sendall(summary.dump())
+
     def teardown(self):
         """
         Close the connection to the client
@@ -224,6 +498,119 @@ class Connection(Thread):
         self.socket.close()
 
 
+class AsyncConnection:
+    def __repr__(self):
+        return f"{self.__class__.__name__}({self.addr[0]}:{self.addr[1]})"
+
+    def __init__(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter, addr: Tuple[str, int],
+                 semaphore: asyncio.Semaphore):
+        """
+        Class for representing a connection to a client in the event loop
+
+        :param reader: stream to receive from the client
+        :param writer: stream to send to the client
+        :param addr: tuple like (ip, port)
+        :param semaphore: limits the concurrent executions
+        """
+        self.reader = reader
+        self.writer = writer
+        self.addr = addr
+        self.semaphore = semaphore
+
+    async def run(self) -> None:
+        """
+        Same as Connection.run() as a coroutine
+        """
+        logger.debug("Connection received from %s:%s" % self.addr)
+
+        try:
+            msg = await asyncio.wait_for(self.reader.read(1024), TIMEOUT)
+        except asyncio.TimeoutError:
+            logger.warning("Connection timedout to %s", self)
+            return await self.teardown()
+
+        msg, rest = Runner.split(msg)
+        logger.debug("Request: %s", msg)
+
+        runner = AsyncRunner(msg, self.semaphore)
+        if runner.bulk():
+            await self.bulk(runner, rest)
+            return await self.teardown()
+
+        response = await runner.execute_async()
+        msg = response.dump()
+
+        self.writer.write(msg)
+        await self.writer.drain()
+        logger.debug("Response: %s", msg)
+
+        await self.teardown()
+
+    async def lines(self, rest: bytes):
+        """
+        Same as Connection.lines() as an asynchronous generator
+        """
+        buffer = rest
+        while True:
+            *lines, buffer = buffer.split(b'\n')
+            for line in lines:
+                yield line
+
+            try:
+                data = await asyncio.wait_for(self.reader.read(65536), TIMEOUT)
+            except asyncio.TimeoutError:
+                logger.warning("Bulk stream timedout from %s", self)
+                return
+            if not data:
+                break
+            buffer += data
+
+        # The last line does not need a newline
+        if buffer:
+            yield buffer
+
+    async def reply(self, response: Response) -> None:
+        self.writer.write(response.dump() + b'\n')
+        await self.writer.drain()
+
+    async def commit(self, runner: AsyncRunner, bulk: Bulk) -> None:
+        for response in bulk.done(await runner.batch_async(bulk.rules())):
+            await self.reply(response)
+
+    async def bulk(self, runner: AsyncRunner, rest: bytes) -> None:
+        """
+        Same as Connection.bulk() as a coroutine
+        """
+        bulk = Bulk()
+        number = 0
+        async for line in self.lines(rest):
+            number += 1
+            failure = bulk.add(runner, number, line)
+            if failure is not None:
+                await self.reply(failure)
+            if bulk.full():
+                await self.commit(runner, bulk)
+
+        if bulk.batch:
+            await self.commit(runner, bulk)
+
+        summary = bulk.summary()
+        logger.info("Bulk from %s: %d line(s), %s", self, bulk.lines, summary.msg)
+        self.writer.write(summary.dump())
+        await self.writer.drain()
+
+    async def teardown(self) -> None:
+        """
+        Close the connection to the client
+        """
+        logger.debug("Connection closed to %s:%s" % self.addr)
+        self.writer.close()
+        try:
+            await self.writer.wait_closed()
+        except ConnectionError:
+            pass
+
+
 class Server:
     def __repr__(self):
         return f"{self.__class__.__name__}({self.host}:{self.port})"
@@ -238,6 +625,10 @@ class Server:
         self.host = host
         self.port = port
         self.socket: Optional[socket.socket] = None
+        self.server: Optional[asyncio.AbstractServer] = None
+        self.loop: Optional[asyncio.AbstractEventLoop] = None
+        self.semaphore: Optional[asyncio.Semaphore] = None
+        self.stopped = False
 
     def setup(self) -> None:
         """
@@ -263,9 +654,65 @@ class Server:
             except KeyboardInterrupt:
                 logger.info("Stop listening for new connection because of KeyboardInterrupt")
                 return
+            except OSError:
+                if not self.stopped:
+                    raise
+                logger.info("Stop listening for new connections")
+                return
 
-            conn = Connection(sock, addr)
-            conn.start()
+            self.handle(sock, addr)
+
+    def handle(self, sock: socket.socket, addr: Tuple[str, int]) -> None:
+        """
+        Start a threaded connection manager for the accepted client
+
+        :param sock: socket object of the accepted client
+        :param addr: tuple like (ip, port)
+        """
+        conn = Connection(sock, addr)
+        conn.start()
+
+    async def start(self) -> asyncio.AbstractServer:
+        """
+        Start serving the socket in the event loop
+        """
+        return await asyncio.start_server(self.handle_async, sock=self.socket)
+
+    async def serve(self, executions: int = EXECUTIONS) -> None:
+        """
+        Serve the connections as coroutines of one event loop instead of a thread for every client. At most
+        executions commands run at the same time, the other requests wait without holding a thread.
+        """
+        assert self.socket is not None, "Socket was not initialized"
+
+        self.loop = asyncio.get_running_loop()
+        self.semaphore = asyncio.Semaphore(executions)
+        self.server = await self.start()
+
+        logger.info("Listening for new connections (asyncio, %d executions)", executions)
+        async with self.server:
+            try:
+                await self.server.serve_forever()
+            except asyncio.CancelledError:
+                pass
+
+    def stop(self) -> None:
+        """
+        Stop serving, safe to call from any thread. In threaded mode the shutdown wakes up the blocked accept()
+        of listen(), so it returns before teardown() closes the socket.
+        """
+        if self.loop is not None and self.server is not None:
+            self.loop.call_soon_threadsafe(self.server.close)
+        elif self.socket is not None:
+            self.stopped = True
+            self.socket.shutdown(SHUT_RDWR)
+
+    async def handle_async(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        """
+        Serve the accepted client in asyncio mode
+        """
+        conn = AsyncConnection(reader, writer, writer.get_extra_info('peername'), self.semaphore)
+        await conn.run()
 
     def teardown(self) -> None:
         """
@@ -284,14 +731,143 @@ class Server:
         self.teardown()
 
 
+class UnixServer(Server):
+    CREDENTIALS = struct.Struct('3i')
+
+    def __repr__(self):
+        return f"{self.__class__.__name__}({self.path})"
+
+    def __init__(self, path: str, uids: Tuple[int, ...] = ()):
+        """
+        Server class for listening on a unix domain socket for local clients. The callers are authenticated with
+        SO_PEERCRED: root, the user of the server and the users listed in uids are accepted.
+
+        :param path: path of the socket file
+        :param uids: additional user ids which are allowed to connect
+        """
+        super().__init__(host=None, port=None)
+        self.path = path
+        self.uids = set(uids) | {0, os.geteuid()}
+
+    def setup(self) -> None:
+        """
+        Setup the socket
+        """
+        logger.info("Starting server on %s", self.path)
+        if os.path.exists(self.path):
+            os.unlink(self.path)
+        self.socket = socket.socket(AF_UNIX, SOCK_STREAM)
+        self.socket.bind(self.path)
+        os.chmod(self.path, 0o666)
+        self.socket.listen(1)
+        logger.info("Server has been started")
+
+    def allowed(self, uid: int) -> bool:
+        """
+        Return True if the user is allowed to modify the firewall rules
+        """
+        return uid in self.uids
+
+    def handle(self, sock: socket.socket, addr: str) -> None:
+        """
+        Authenticate the local client and start a threaded connection manager for it
+
+        :param sock: socket object of the accepted client
+        :param addr: address of the client (which is empty for unix sockets)
+        """
+        pid, uid = self.credentials(sock)
+
+        if not self.allowed(uid):
+            logger.warning("Rejected local connection from pid=%s uid=%s", pid, uid)
+            sock.send(Response(PERMISSION_DENIED, "Permission denied").dump())
+            sock.close()
+            return
+
+        conn = Connection(sock, ('local', pid))
+        conn.start()
+
+    def credentials(self, sock) -> Tuple[int, int]:
+        """
+        Return with the pid and the uid of the local client
+        """
+        pid, uid, gid = self.CREDENTIALS.unpack(sock.getsockopt(SOL_SOCKET, SO_PEERCRED, self.CREDENTIALS.size))
+        return pid, uid
+
+    async def start(self) -> asyncio.AbstractServer:
+        return await asyncio.start_unix_server(self.handle_async, sock=self.socket)
+
+    async def handle_async(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        """
+        Same as handle() in asyncio mode
+        """
+        pid, uid = self.credentials(writer.get_extra_info('socket'))
+
+        if not self.allowed(uid):
+            logger.warning("Rejected local connection from pid=%s uid=%s", pid, uid)
+            writer.write(Response(PERMISSION_DENIED, "Permission denied").dump())
+            await writer.drain()
+            writer.close()
+            return
+
+        conn = AsyncConnection(reader, writer, ('local', pid), self.semaphore)
+        await conn.run()
+
+    def teardown(self) -> None:
+        """
+        Close the socket of the server and remove the socket file
+        """
+        super().teardown()
+        os.unlink(self.path)
+
+
+async def serve(servers: List[Server], executions: int) -> None:
+    """
+    Serve every server in the same event loop
+    """
+    await asyncio.gather(*(server.serve(executions) for server in servers))
+
+
 if __name__ == "__main__":
-    logger.setLevel(logging.INFO)
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('-d', '--debug', action='store_true', help="Enable debug logging")
+    parser.add_argument('-p', '--port', type=int, default=PORT, help="TCP port to listen on (default: %(default)s)")
+    parser.add_argument('-u', '--unix', metavar='PATH', help="Listen on a unix domain socket too")
+    parser.add_argument('-a', '--asyncio', action='store_true',
+                        help="Serve the connections in an event loop instead of a thread per connection")
+    parser.add_argument('-e', '--executions', type=int, default=EXECUTIONS,
+                        help="Concurrent iptables executions in asyncio mode (default: %(default)s)")
+    args = parser.parse_args()
+
+    logger.setLevel(logging.DEBUG if args.debug else logging.INFO)
     handler = logging.StreamHandler(stream=sys.stdout)
     handler.setFormatter(logging.Formatter(fmt='%(asctime)s | %(threadName)10s | %(levelname)7s | %(message)s'))
     logger.addHandler(handler)
 
-    if len(sys.argv) == 2 and (sys.argv[1] == '-d' or sys.argv[1] == '--debug'):
-        logger.setLevel(logging.DEBUG)
+    if args.asyncio:
+        servers = [Server(host="localhost", port=args.port)]
+        if args.unix:
+            servers.append(UnixServer(args.unix))
 
-    server = Server(host="localhost", port=5555)
+        for server in servers:
+            server.setup()
+        try:
+            asyncio.run(serve(servers, args.executions))
+        except KeyboardInterrupt:
+            logger.info("Stop listening for new connection because of KeyboardInterrupt")
+        for server in servers:
+            server.teardown()
+        sys.exit(0)
+
+    if args.unix:
+        local = UnixServer(args.unix)
+        local.setup()
+        listener = Thread(target=local.listen, daemon=True)
+        listener.start()
+
+    server = Server(host="localhost", port=args.port)
     server.run()
+
+    if args.unix:
+        local.stop()
+        listener.join()
+        local.teardown()
@@ -1,9 +1,18 @@
+import os
+import sys
 import json
+import time
+import asyncio
+import tempfile
+import threading
+from threading import Thread
 from unittest import TestCase, main
 from unittest.mock import patch, Mock
-from server import Response, Runner, Process, Connection
+from server import Response, Runner, AsyncRunner, Process, Connection, UnixServer
 from server import ValidationError, ExecutionError
-from server import OK, INVALID_METHOD, INVALID_HOST, INVALID_JSON, EXECUTION_ERROR
+from server import OK, INVALID_METHOD, INVALID_HOST, INVALID_JSON, EXECUTION_ERROR, PERMISSION_DENIED, BULK_BATCH
+from server import EXECUTIONS
+from client import Client
 
 
 class TestReponse(TestCase):
@@ -20,6 +29,10 @@ class TestReponse(TestCase):
         resp = Response(0, "my-msg")
         self.assertEqual(resp.dump(), b'{"code": 0, "msg": "my-msg"}')
 
+    def test_dump_fields(self):
+        resp = Response(1, "my-msg", line=3)
+        self.assertEqual(resp.dump(), b'{"code": 1, "msg": "my-msg", "line": 3}')
+
 
 class MockRunner(Runner):
     cmd = None
@@ -42,6 +55,27 @@ class MockRunner(Runner):
         return self.process
 
 
+class BatchRunner(MockRunner):
+    """
+    Runner whose transactions and commands fail when they contain the bad address
+    """
+    bad = '9.9.9.9'
+
+    def __init__(self):
+        super().__init__()
+        self.transactions = []
+
+    def _restore(self, rules):
+        self.transactions.append(rules)
+        return Process(return_code=1 if self.bad in rules else 0, stdout=b'', stderr=b'')
+
+    def _run(self, cmd):
+        self.cmd = cmd
+        if self.bad in cmd:
+            return Process(return_code=1, stdout=b'', stderr=b'does a matching rule exist')
+        return Process(return_code=0, stdout=b'', stderr=b'')
+
+
 class TestRunner(TestCase):
     def test_methods(self):
         self.assertEqual(set(Runner.METHODS) - set(dir(Runner)), set())
@@ -157,6 +191,35 @@ class TestRunner(TestCase):
         self.assertEqual(response.msg, "No matching rule presents")
 
 
+    def test_bulk(self):
+        self.assertTrue(Runner(b'{"method": "bulk"}').bulk())
+        self.assertFalse(MockRunner().bulk())
+        self.assertFalse(Runner(b'').bulk())
+
+    def test_split(self):
+        pretty = bytes(json.dumps({'method': 'append', 'host': '1.2.3.4'}, indent=4), encoding='utf8')
+        self.assertEqual(Runner.split(pretty), (pretty, b''))
+        self.assertEqual(Runner.split(b'{"method": "bulk"}\nappend 1.2.3.4\n'), (b'{"method": "bulk"}', b'append 1.2.3.4\n'))
+        self.assertEqual(Runner.split(b'{"method": "append"}\nappend'), (b'{"method": "append"}\nappend', b''))
+
+    def test_batch_success(self):
+        runner = BatchRunner()
+        responses = runner.batch([('append', '1.2.3.4'), ('remove', '1.2.3.5')])
+        self.assertEqual([response.code for response in responses], [OK, OK])
+        self.assertEqual(runner.transactions, ["*filter\n"
+                                               "-A FORWARD -s 1.2.3.4 -j ACCEPT\n"
+                                               "-D FORWARD -s 1.2.3.5 -j ACCEPT\n"
+                                               "COMMIT\n"])
+
+    def test_batch_split(self):
+        runner = BatchRunner()
+        rules = [('append', f'10.0.0.{i}') for i in range(7)] + [('remove', '9.9.9.9')]
+        responses = runner.batch(rules)
+        self.assertEqual([response.code for response in responses], [OK] * 7 + [EXECUTION_ERROR])
+        self.assertEqual(responses[7].msg, "No matching rule presents")
+        self.assertEqual(runner.cmd, "iptables -D FORWARD -s 9.9.9.9 -j ACCEPT")
+
+
 class TestConnection(TestCase):
     def test_init_socket(self):
         socket = 'socket'
@@ -176,6 +239,219 @@ class TestConnection(TestCase):
         self.assertEqual(socket.send.call_args.args, (b'{"code": 0, "msg": "my-response"}',))
         self.assertEqual(socket.close.call_count, 1)
 
+    @patch('server.Runner.execute', autospec=True)
+    def test_run_pretty(self, execute):
+        socket = Mock()
+        socket.recv.return_value = bytes(json.dumps({'method': 'append', 'host': '1.2.3.4'}, indent=4), encoding='utf8')
+        execute.return_value = Response(code=0, msg="my-response")
+        Connection(socket, ('1.2.3.4', 5555)).run()
+        self.assertEqual(execute.call_args.args[0].data, socket.recv.return_value)
+        self.assertEqual(socket.send.call_args.args, (b'{"code": 0, "msg": "my-response"}',))
+
+
+class TestUnixServer(TestCase):
+    def setUp(self):
+        tmpdir = tempfile.TemporaryDirectory()
+        self.addCleanup(tmpdir.cleanup)
+        self.path = os.path.join(tmpdir.name, 'fwmgr.sock')
+
+    def test_repr(self):
+        self.assertEqual(repr(UnixServer('/my/path')), 'UnixServer(/my/path)')
+
+    def test_allowed(self):
+        server = UnixServer(self.path, uids=(1234,))
+        self.assertTrue(server.allowed(0))
+        self.assertTrue(server.allowed(os.geteuid()))
+        self.assertTrue(server.allowed(1234))
+        self.assertFalse(server.allowed(4321))
+
+    def serve(self, server):
+        server.setup()
+        thread = Thread(target=server.listen, daemon=True)
+        thread.start()
+
+        def stop():
+            server.stop()
+            thread.join()
+            server.teardown()
+        self.addCleanup(stop)
+
+    @patch('server.Runner.execute')
+    def test_request(self, execute):
+        execute.return_value = Response(code=OK, msg="my-response")
+        self.serve(UnixServer(self.path))
+        response = Client(self.path).send({'method': 'append', 'host': '1.2.3.4'})
+        self.assertEqual(response, {'code': OK, 'msg': 'my-response'})
+
+    @patch('server.Runner.execute')
+    def test_request_rejected(self, execute):
+        server = UnixServer(self.path)
+        server.allowed = lambda uid: False
+        self.serve(server)
+        response = Client(self.path).send({'method': 'append', 'host': '1.2.3.4'})
+        self.assertEqual(response['code'], PERMISSION_DENIED)
+        self.assertEqual(execute.call_count, 0)
+
+    def test_bulk(self):
+        runner = BatchRunner()
+        lines = [f"append 10.0.{i // 256}.{i % 256}" for i in range(BULK_BATCH + 1)]
+        lines += ["# comment", "", "remove 9.9.9.9", "invalid 1.2.3.4", "append"]
+        responses = []
+
+        with patch('server.Runner._restore', side_effect=runner._restore), \
+             patch('server.Runner._run', side_effect=runner._run):
+            self.serve(UnixServer(self.path))
+            summary = Client(self.path).bulk(lines, callback=responses.append)
+
+        failures = [response for response in responses if 'line' in response]
+        progress = [response['progress'] for response in responses if 'progress' in response]
+        self.assertEqual(summary, {'code': EXECUTION_ERROR, 'msg': f"{BULK_BATCH + 1} rule(s) applied, 3 failed"})
+        self.assertEqual(sorted(response['line'] for response in failures), [BULK_BATCH + 4, BULK_BATCH + 5, BULK_BATCH + 6])
+        self.assertEqual(progress, [BULK_BATCH, BULK_BATCH + 6])
+
+
+class TestAsyncRunner(TestCase):
+    # Commands which exit like iptables without touching the firewall
+    COMMANDS = {'append': 'true {addr}', 'remove': 'false {addr}'}
+
+    def execute(self, method, executions=1):
+        async def run():
+            runner = AsyncRunner(bytes(json.dumps({'method': method, 'host': '1.2.3.4'}), encoding='utf8'),
+                                 asyncio.Semaphore(executions))
+            return await runner.execute_async()
+        return asyncio.run(run())
+
+    @patch.object(Runner, 'COMMANDS', COMMANDS)
+    def test_execute_success(self):
+        response = self.execute('append')
+        self.assertEqual(response.code, OK)
+        self.assertEqual(response.msg, "Host 1.2.3.4 has been successfully appended")
+
+    @patch.object(Runner, 'COMMANDS', COMMANDS)
+    def test_execute_error(self):
+        response = self.execute('remove')
+        self.assertEqual(response.code, EXECUTION_ERROR)
+        self.assertRegex(response.msg, 'Unexpected error happened')
+
+    def test_execute_invalid(self):
+        response = self.execute('not-existing')
+        self.assertEqual(response.code, INVALID_METHOD)
+
+    @patch.object(Runner, 'COMMANDS', {'append': 'sleep 0.05'})
+    def test_executions_bounded(self):
+        async def run():
+            semaphore = asyncio.Semaphore(2)
+            data = bytes(json.dumps({'method': 'append', 'host': '1.2.3.4'}), encoding='utf8')
+            return await asyncio.gather(*(AsyncRunner(data, semaphore).execute_async() for _ in range(6)))
+
+        start = time.monotonic()
+        responses = asyncio.run(run())
+        self.assertGreaterEqual(time.monotonic() - start, 0.15)
+        self.assertEqual([response.code for response in responses], [OK] * 6)
+
+
+class TestAsyncUnixServer(TestUnixServer):
+    def serve(self, server):
+        server.setup()
+        thread = Thread(target=asyncio.run, args=(server.serve(),), daemon=True)
+        thread.start()
+
+        def stop():
+            server.stop()
+            thread.join()
+            server.teardown()
+        self.addCleanup(stop)
+
+    @patch('server.AsyncRunner.execute_async')
+    def test_request(self, execute):
+        execute.return_value = Response(code=OK, msg="my-response")
+        self.serve(UnixServer(self.path))
+        response = Client(self.path).send({'method': 'append', 'host': '1.2.3.4'})
+        self.assertEqual(response, {'code': OK, 'msg': 'my-response'})
+
+    @patch('server.AsyncRunner.execute_async')
+    def test_request_rejected(self, execute):
+        server = UnixServer(self.path)
+        server.allowed = lambda uid: False
+        self.serve(server)
+        response = Client(self.path).send({'method': 'append', 'host': '1.2.3.4'})
+        self.assertEqual(response['code'], PERMISSION_DENIED)
+        self.assertEqual(execute.call_count, 0)
+
+
+class TestLoad(TestCase):
+    """
+    The same burst of concurrent clients against the threaded and the asyncio mode
+    """
+    CLIENTS = 32
+    REQUESTS = 8
+
+    def setUp(self):
+        tmpdir = tempfile.TemporaryDirectory()
+        self.addCleanup(tmpdir.cleanup)
+        self.path = os.path.join(tmpdir.name, 'fwmgr.sock')
+
+    def burst(self):
+        """
+        Returns with the responses, the elapsed time and the peak number of threads besides the clients
+        """
+        baseline = threading.active_count()
+        responses, peak, running = [], [0], [True]
+
+        def sample():
+            while running[0]:
+                peak[0] = max(peak[0], threading.active_count())
+                time.sleep(0.001)
+
+        def client():
+            for i in range(self.REQUESTS):
+                responses.append(Client(self.path).send({'method': 'append', 'host': f'10.0.0.{i}'}))
+
+        sampler = Thread(target=sample)
+        sampler.start()
+        clients = [Thread(target=client) for _ in range(self.CLIENTS)]
+        start = time.monotonic()
+        for thread in clients:
+            thread.start()
+        for thread in clients:
+            thread.join()
+        elapsed = time.monotonic() - start
+        running[0] = False
+        sampler.join()
+
+        return responses, elapsed, peak[0] - baseline - self.CLIENTS - 1
+
+    @patch.object(Runner, 'COMMANDS', {'append': 'true {addr}'})
+    def test_threaded_vs_asyncio(self):
+        threaded = UnixServer(self.path)
+        threaded.setup()
+        listener = Thread(target=threaded.listen, daemon=True)
+        listener.start()
+        responses, threaded_elapsed, threaded_threads = self.burst()
+        threaded.stop()
+        listener.join()
+        threaded.teardown()
+        self.assertEqual([response['code'] for response in responses], [OK] * self.CLIENTS * self.REQUESTS)
+
+        server = UnixServer(self.path)
+        server.setup()
+        loop = Thread(target=asyncio.run, args=(server.serve(),), daemon=True)
+        loop.start()
+        responses, async_elapsed, async_threads = self.burst()
+        server.stop()
+        loop.join()
+        server.teardown()
+        self.assertEqual([response['code'] for response in responses], [OK] * self.CLIENTS * self.REQUESTS)
+
+        report = (f"{self.CLIENTS}x{self.REQUESTS} requests: "
+                  f"threaded {threaded_elapsed:.3f}s with {threaded_threads} thread(s) at peak, "
+                  f"asyncio {async_elapsed:.3f}s with {async_threads} thread(s) at peak")
+        print(f"\n{report}", file=sys.stderr)
+
+        # The event loop serves every connection on its own thread, only the waiters
+        # of the running commands (bounded by the executions) come and go
+        self.assertLessEqual(async_threads, 1 + EXECUTIONS, report)
+
 
 if __name__ == "__main__":
     main()